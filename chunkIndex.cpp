@@ -0,0 +1,553 @@
+/********************************************************************************************************
+ * Filename: chunkIndex.cpp
+ * Purpose: Persistent index of the content-defined chunks of the files being served (see chunkIndex.h)
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h> // mmap
+#include <dirent.h>
+#include <fcntl.h> // openat
+#include <stdio.h> // perror, snprintf, rename
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h> // pthread_atfork, pthread_sigmask
+#include <signal.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <chrono>
+#include "protocol.h" // encodeBigEndian
+#include "crc32c.h"
+#include "contentChunks.h"
+#include "chunkIndex.h"
+using namespace std;
+
+ChunkIndex &chunkIndex = *new ChunkIndex; // Off until open(), never destroyed: its build thread waits on it
+
+/********************************************************************************************************************************
+ * Function name:     writeAll
+ * Description:       Writes every byte given to a file
+ * Parameters:        int fd: The file
+                      const char *data, size_t length: The bytes
+ * Return Value:      true:  if they were all written
+                      false: otherwise, errno tells why
+********************************************************************************************************************************/
+static bool writeAll(int fd, const char *data, size_t length)
+{
+  while(length > 0)
+    {
+      ssize_t written = write(fd, data, length);
+      if(written < 0 && errno == EINTR)
+	continue;
+      if(written < 0)
+	return false;
+      data += written;
+      length -= written;
+    }
+  return true;
+}// end writeAll
+/********************************************************************************************************************************
+ * Function name:     indexHeader
+ * Description:       The header every index file starts with
+ * Parameters:        none
+ * Return Value:      string: its CHUNK_INDEX_HEADER bytes
+********************************************************************************************************************************/
+static string indexHeader()
+{
+  string header(CHUNK_INDEX_HEADER, '\0');
+  memcpy(&header[0], CHUNK_INDEX_MAGIC, 8);
+  encodeBigEndian(&header[8], CDC_AVG_SIZE, 4);
+  return header;
+}// end indexHeader
+/********************************************************************************************************************************
+ * Function name:     ChunkIndex
+ * Description:       Creates an index that is off
+ * Parameters:        none
+ * Return Value:      none
+********************************************************************************************************************************/
+ChunkIndex::ChunkIndex()
+  : fd(-1), rootFd(-1), builderPid(-1), mapped((char *)MAP_FAILED), mappedSize(0), scanned(0), liveBytes(0),
+    chunked(0), failed(0), downloads(0), fileBytes(0), wireBytes(0)
+{
+}
+/********************************************************************************************************************************
+ * Function name:     open
+ * Description:       Turns the index on, keeping it in a file (created if it isn't there). A record a stopped server left
+                      half written is cut off, an index made with other chunk sizes is started over. Meant to be called once
+                      before the first session.
+ * Parameters:        const char *path: The index file
+ * Return Value:      true:  if the index is on
+                      false: if the file can't be opened, or isn't an index
+********************************************************************************************************************************/
+bool ChunkIndex::open(const char *path)
+{
+  this->path = path;
+  lock_guard<mutex> guard(lock);
+  return load(true);
+}// end open
+/********************************************************************************************************************************
+ * Function name:     start
+ * Description:       Starts the thread that keeps the index current in this process: it walks the served tree right away
+                      and every CHUNK_INDEX_RESCAN seconds after that, and chunks the files downloads ask for meanwhile.
+                      Processes forked after this only read the index (fork() leaves the thread behind), the lock is taken
+                      around every fork() so a child never starts out with it held.
+ * Parameters:        int rootFd: The served tree (startDirFd)
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void ChunkIndex::start(int rootFd)
+{
+  if(!enabled())
+    return;
+  this->rootFd = rootFd;
+  builderPid = getpid();
+  pthread_atfork([]() { chunkIndex.lock.lock(); }, []() { chunkIndex.lock.unlock(); }, []() { chunkIndex.lock.unlock(); });
+  // The thread starts out with every signal blocked, so signals meant for the process (SIGCHLD for the fork model's
+  // supervisor) reach the thread that waits for them
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  thread(buildThread, this).detach();
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}// end start
+/********************************************************************************************************************************
+ * Function name:     lookup
+ * Description:       Finds the recipe of one version of a file. Records other processes appended since the last lookup are
+                      read first, and the index file is opened again if it was compacted (renamed over) meanwhile.
+ * Parameters:        const struct stat &info: stat of the file being downloaded
+                      string &recipe: Set to its chunks (see contentChunks.h)
+ * Return Value:      true:  if the version is indexed
+                      false: otherwise
+********************************************************************************************************************************/
+bool ChunkIndex::lookup(const struct stat &info, string &recipe)
+{
+  struct stat named, opened;
+
+  lock_guard<mutex> guard(lock);
+  if(!enabled())
+    return false;
+  if(stat(path.c_str(), &named) == 0 && fstat(fd, &opened) == 0
+     && (named.st_dev != opened.st_dev || named.st_ino != opened.st_ino))
+    load(builderPid == getpid());
+  refresh(false);
+  FileId id = { info.st_dev, info.st_ino };
+  auto entry = entries.find(id);
+  if(entry == entries.end() || !current(entry->second, info))
+    return false;
+  entry->second.seen = true; // a file outside the walked tree stays indexed while it is downloaded
+  const char *body = mapped + entry->second.offset + CHUNK_INDEX_RECORD;
+  recipe.assign(body + CHUNK_INDEX_BODY, entry->second.length - CHUNK_INDEX_RECORD - CHUNK_INDEX_BODY);
+  return true;
+}// end lookup
+/********************************************************************************************************************************
+ * Function name:     requested
+ * Description:       Queues a downloaded file that isn't indexed (or changed) to be chunked ahead of the next walk. Only the
+                      process running the build thread can, forked children leave it to the walk.
+ * Parameters:        const struct stat &info: stat of the file
+                      int fileFd: The open file, -1 with cached
+                      const CachedFilePtr &cached: The file's cached contents
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void ChunkIndex::requested(const struct stat &info, int fileFd, const CachedFilePtr &cached)
+{
+  if(builderPid != getpid() || info.st_size == 0)
+    return;
+  lock_guard<mutex> guard(lock);
+  if(builds.size() >= CHUNK_INDEX_QUEUE)
+    return;
+  for(size_t i = 0; i < builds.size(); i++)
+    if(builds[i].info.st_dev == info.st_dev && builds[i].info.st_ino == info.st_ino)
+      return;
+
+  Build job;
+  job.info = info;
+  job.fileFd = fileFd == -1 ? -1 : fcntl(fileFd, F_DUPFD_CLOEXEC, 0);
+  job.cached = cached;
+  if(fileFd != -1 && job.fileFd == -1)
+    return; // out of descriptors, the walk gets to it
+  builds.push_back(job);
+  queued.notify_one();
+}// end requested
+/********************************************************************************************************************************
+ * Function name:     sent
+ * Description:       Counts a "dget" once its chunks are queued
+ * Parameters:        off_t fileBytes: Size of the file
+                      off_t wireBytes: Bytes of it that had to be sent
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void ChunkIndex::sent(off_t fileBytes, off_t wireBytes)
+{
+  lock_guard<mutex> guard(lock);
+  downloads++;
+  this->fileBytes += fileBytes;
+  this->wireBytes += wireBytes;
+}// end sent
+/********************************************************************************************************************************
+ * Function name:     stats
+ * Description:       Describes the index counters for the "stats" command
+ * Parameters:        none
+ * Return Value:      string: the counters in text form
+********************************************************************************************************************************/
+string ChunkIndex::stats()
+{
+  char text[256];
+  lock_guard<mutex> guard(lock);
+
+  if(!enabled())
+    return "Chunk Index: off";
+  snprintf(text, sizeof(text), "Chunk Index: %zu files indexed, %llu chunked, %llu failed, %zu waiting, %llu dgets sent %llu of %llu bytes",
+	   entries.size(), chunked, failed, builds.size(), downloads, wireBytes, fileBytes);
+  return text;
+}// end stats
+/********************************************************************************************************************************
+ * Function name:     load
+ * Description:       (Re)opens the index file and reads all of its records, with the lock held. A new or empty file gets its
+                      header. With repair a damaged tail is cut off, otherwise reading just stops there.
+ * Parameters:        bool repair: This process may change the file
+ * Return Value:      true:  if the index is open
+                      false: if the file can't be opened or isn't an index (the index is off)
+********************************************************************************************************************************/
+bool ChunkIndex::load(bool repair)
+{
+  struct stat info;
+  char header[CHUNK_INDEX_HEADER];
+  string expected = indexHeader();
+
+  if(mapped != MAP_FAILED)
+    munmap(mapped, mappedSize);
+  mapped = (char *)MAP_FAILED;
+  mappedSize = 0;
+  if(fd != -1)
+    close(fd);
+  entries.clear();
+  liveBytes = 0;
+  scanned = CHUNK_INDEX_HEADER;
+
+  fd = ::open(path.c_str(), (repair ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY) | O_CLOEXEC, 0644);
+  if(fd == -1 || fstat(fd, &info) == -1)
+    {
+      perror(("Couldn't Open Chunk Index " + path).c_str());
+      if(fd != -1)
+	close(fd);
+      fd = -1;
+      return false;
+    }
+  bool valid = info.st_size >= CHUNK_INDEX_HEADER && pread(fd, header, sizeof(header), 0) == (ssize_t)sizeof(header);
+  if(valid && memcmp(header, expected.data(), 8) != 0)
+    {
+      cout << path << " Is Not A Chunk Index" << endl;
+      close(fd);
+      fd = -1;
+      return false;
+    }
+  if(!valid || memcmp(header, expected.data(), sizeof(header)) != 0) // new, torn, or cut with other chunk sizes
+    {
+      if(!repair || (info.st_size > 0 && ftruncate(fd, 0) == -1) || !writeAll(fd, expected.data(), expected.length()))
+	{
+	  perror(("Couldn't Start Chunk Index " + path).c_str());
+	  close(fd);
+	  fd = -1;
+	  return false;
+	}
+    }
+  refresh(repair);
+  return true;
+}// end load
+/********************************************************************************************************************************
+ * Function name:     refresh
+ * Description:       Maps what was appended to the index file since the last time and reads its records, with the lock held
+ * Parameters:        bool repair: Cut the file off at a damaged record (at open() only: later a record may be half written)
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void ChunkIndex::refresh(bool repair)
+{
+  struct stat info;
+
+  if(fstat(fd, &info) == -1 || (size_t)info.st_size <= mappedSize)
+    return;
+  if(mapped != MAP_FAILED)
+    munmap(mapped, mappedSize);
+  mappedSize = 0;
+  mapped = (char *)mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if(mapped == MAP_FAILED)
+    {
+      perror(("Couldn't Map Chunk Index " + path).c_str());
+      return; // tried again at the next lookup
+    }
+  mappedSize = info.st_size;
+
+  while(scanned + CHUNK_INDEX_RECORD <= mappedSize)
+    {
+      const char *record = mapped + scanned;
+      uint64_t length = decodeBigEndian(record + 4, 4);
+      const char *body = record + CHUNK_INDEX_RECORD;
+      if(length < CHUNK_INDEX_BODY || scanned + CHUNK_INDEX_RECORD + length > mappedSize
+	 || decodeBigEndian(record, 4) != crc32cUpdate(0, body, length)
+	 || (length - CHUNK_INDEX_BODY) != decodeBigEndian(body + 36, 4) * CHUNK_RECORD_SIZE)
+	{
+	  if(repair && ftruncate(fd, scanned) == 0)
+	    {
+	      cout << "Chunk Index " << path << ": " << mappedSize - scanned << " damaged bytes cut off" << endl;
+	      mappedSize = scanned; // the pages past it are never looked at
+	    }
+	  return;
+	}
+      FileId id = { (dev_t)decodeBigEndian(body, 8), (ino_t)decodeBigEndian(body + 8, 8) };
+      Entry &entry = entries[id];
+      if(entry.length != 0)
+	liveBytes -= entry.length;
+      entry.offset = scanned;
+      entry.length = CHUNK_INDEX_RECORD + length;
+      entry.seen = true;
+      liveBytes += entry.length;
+      scanned += entry.length;
+    }
+}// end refresh
+/********************************************************************************************************************************
+ * Function name:     current
+ * Description:       Tells whether a record is of the version of a file that is there now, with the lock held
+ * Parameters:        const Entry &entry: The newest record of the file
+                      const struct stat &info: stat of the file
+ * Return Value:      true:  if the size and mtime are the ones it was chunked with
+                      false: otherwise
+********************************************************************************************************************************/
+bool ChunkIndex::current(const Entry &entry, const struct stat &info) const
+{
+  const char *body = mapped + entry.offset + CHUNK_INDEX_RECORD;
+  return decodeBigEndian(body + 16, 8) == (uint64_t)info.st_size && decodeBigEndian(body + 24, 8) == (uint64_t)info.st_mtim.tv_sec
+    && decodeBigEndian(body + 32, 4) == (uint64_t)info.st_mtim.tv_nsec;
+}// end current
+/********************************************************************************************************************************
+ * Function name:     append
+ * Description:       Appends the record of a file just chunked with a single write() (O_APPEND), so no reader ever sees
+                      records interleaved, then reads it back into entries. Build thread only.
+ * Parameters:        const struct stat &info: stat of the file, as it was chunked
+                      const string &recipe: Its chunks
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void ChunkIndex::append(const struct stat &info, const string &recipe)
+{
+  string record(CHUNK_INDEX_RECORD + CHUNK_INDEX_BODY, '\0');
+  char *body = &record[CHUNK_INDEX_RECORD];
+
+  encodeBigEndian(body, info.st_dev, 8);
+  encodeBigEndian(body + 8, info.st_ino, 8);
+  encodeBigEndian(body + 16, info.st_size, 8);
+  encodeBigEndian(body + 24, info.st_mtim.tv_sec, 8);
+  encodeBigEndian(body + 32, info.st_mtim.tv_nsec, 4);
+  encodeBigEndian(body + 36, recipe.length() / CHUNK_RECORD_SIZE, 4);
+  record += recipe;
+  encodeBigEndian(&record[4], record.length() - CHUNK_INDEX_RECORD, 4);
+  encodeBigEndian(&record[0], crc32cUpdate(0, record.data() + CHUNK_INDEX_RECORD, record.length() - CHUNK_INDEX_RECORD), 4);
+
+  lock_guard<mutex> guard(lock);
+  if(!writeAll(fd, record.data(), record.length()))
+    {
+      perror(("Couldn't Write Chunk Index " + path).c_str());
+      failed++;
+      return;
+    }
+  chunked++;
+  refresh(false);
+}// end append
+/********************************************************************************************************************************
+ * Function name:     compact
+ * Description:       Rewrites the index file without the records nothing refers to any more once they take up more room
+                      than the live ones: the live records are copied to a temporary file in their order, which is renamed
+                      over the index. Other processes notice the rename at their next lookup. Build thread only.
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void ChunkIndex::compact()
+{
+  lock_guard<mutex> guard(lock);
+  size_t dead = scanned - CHUNK_INDEX_HEADER - liveBytes;
+  if(dead < CHUNK_INDEX_COMPACT || dead < liveBytes)
+    return;
+
+  string temp = path + "." + to_string((long long)getpid()) + ".tmp";
+  string header = indexHeader();
+  map<size_t, size_t> live; // offset -> length of every live record, in file order
+  for(auto entry = entries.begin(); entry != entries.end(); ++entry)
+    live[entry->second.offset] = entry->second.length;
+  int tempFd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  bool written = tempFd != -1 && writeAll(tempFd, header.data(), header.length());
+  for(auto record = live.begin(); written && record != live.end(); ++record)
+    written = writeAll(tempFd, mapped + record->first, record->second);
+  if(tempFd != -1 && close(tempFd) == -1)
+    written = false;
+  if(!written || rename(temp.c_str(), path.c_str()) == -1)
+    {
+      perror(("Couldn't Compact Chunk Index " + path).c_str());
+      unlink(temp.c_str());
+      return;
+    }
+  load(true);
+}// end compact
+/********************************************************************************************************************************
+ * Function name:     buildThread
+ * Description:       Keeps the index current for as long as the server runs: walks the served tree every
+                      CHUNK_INDEX_RESCAN seconds, forgets the files the walk no longer finds (and that weren't downloaded
+                      since), and chunks downloaded files in between
+ * Parameters:        ChunkIndex *index: The index to keep
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void ChunkIndex::buildThread(ChunkIndex *index)
+{
+  while(true)
+    {
+      int dirFd = openat(index->rootFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC); // not dup(): readdir() would move the offset of rootFd
+      if(dirFd != -1)
+	index->walk(dirFd, 0);
+      {
+	lock_guard<mutex> guard(index->lock);
+	for(auto entry = index->entries.begin(); entry != index->entries.end(); )
+	  if(!entry->second.seen)
+	    {
+	      index->liveBytes -= entry->second.length;
+	      entry = index->entries.erase(entry);
+	    }
+	  else
+	    {
+	      entry->second.seen = false;
+	      ++entry;
+	    }
+      }
+      index->compact();
+
+      auto next = chrono::steady_clock::now() + chrono::seconds(CHUNK_INDEX_RESCAN);
+      while(chrono::steady_clock::now() < next)
+	{
+	  {
+	    unique_lock<mutex> guard(index->lock);
+	    if(!index->queued.wait_until(guard, next, [index]() { return !index->builds.empty(); }))
+	      break;
+	  }
+	  index->runBuilds();
+	}
+    }
+}// end buildThread
+/********************************************************************************************************************************
+ * Function name:     walk
+ * Description:       Chunks every regular file of a directory tree that isn't indexed as it is now, downloaded files
+                      queued meanwhile are chunked first. Symbolic links aren't followed, the index file is left out.
+ * Parameters:        int dirFd: The directory, closed when done
+                      int depth: How deep it is, the walk stops at CHUNK_INDEX_DEPTH
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void ChunkIndex::walk(int dirFd, int depth)
+{
+  struct stat info, indexInfo;
+
+  DIR *directoryPtr = fdopendir(dirFd);
+  if(directoryPtr == NULL)
+    {
+      close(dirFd);
+      return;
+    }
+  bool haveIndex = stat(path.c_str(), &indexInfo) == 0;
+  struct dirent *dirEntry;
+  while((dirEntry = readdir(directoryPtr)) != NULL)
+    {
+      runBuilds();
+      if(strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0
+	 || fstatat(dirFd, dirEntry->d_name, &info, AT_SYMLINK_NOFOLLOW) == -1)
+	continue;
+      if(S_ISDIR(info.st_mode))
+	{
+	  int subdirFd = depth + 1 < CHUNK_INDEX_DEPTH ? openat(dirFd, dirEntry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+	  if(subdirFd != -1)
+	    walk(subdirFd, depth + 1);
+	  continue;
+	}
+      if(!S_ISREG(info.st_mode) || info.st_size == 0
+	 || (haveIndex && info.st_dev == indexInfo.st_dev && info.st_ino == indexInfo.st_ino))
+	continue;
+      {
+	lock_guard<mutex> guard(lock);
+	FileId id = { info.st_dev, info.st_ino };
+	auto entry = entries.find(id);
+	if(entry != entries.end() && current(entry->second, info))
+	  {
+	    entry->second.seen = true;
+	    continue;
+	  }
+      }
+      Build job;
+      job.fileFd = openat(dirFd, dirEntry->d_name, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+      if(job.fileFd == -1 || fstat(job.fileFd, &job.info) == -1)
+	{
+	  if(job.fileFd != -1)
+	    close(job.fileFd);
+	  continue;
+	}
+      index(job);
+      close(job.fileFd);
+    }
+  closedir(directoryPtr);
+}// end walk
+/********************************************************************************************************************************
+ * Function name:     runBuilds
+ * Description:       Chunks the downloaded files queued by requested(), oldest first
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void ChunkIndex::runBuilds()
+{
+  while(true)
+    {
+      Build job;
+      {
+	lock_guard<mutex> guard(lock);
+	if(builds.empty())
+	  return;
+	job = builds.front();
+	builds.pop_front();
+      }
+      index(job);
+      if(job.fileFd != -1)
+	close(job.fileFd);
+    }
+}// end runBuilds
+/********************************************************************************************************************************
+ * Function name:     index
+ * Description:       Chunks one file and appends its record, unless that version is indexed already. A record is only
+                      written if the file didn't change while it was read, and not for files with more than
+                      CHUNK_RECIPE_MAX chunks.
+ * Parameters:        const Build &job: The file
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void ChunkIndex::index(const Build &job)
+{
+  string recipe;
+  struct stat after;
+
+  {
+    lock_guard<mutex> guard(lock);
+    FileId id = { job.info.st_dev, job.info.st_ino };
+    auto entry = entries.find(id);
+    if(entry != entries.end() && current(entry->second, job.info))
+      {
+	entry->second.seen = true;
+	return;
+      }
+  }
+  bool read;
+  if(job.fileFd == -1)
+    read = job.cached && job.cached->size == job.info.st_size
+      && chunkBytes(job.cached->data.data(), job.cached->data.length(), true, recipe) == job.cached->data.length();
+  else
+    read = chunkFile(job.fileFd, job.info.st_size, recipe) && fstat(job.fileFd, &after) == 0 && after.st_size == job.info.st_size
+      && after.st_mtim.tv_sec == job.info.st_mtim.tv_sec && after.st_mtim.tv_nsec == job.info.st_mtim.tv_nsec;
+  if(!read || recipe.length() / CHUNK_RECORD_SIZE > CHUNK_RECIPE_MAX)
+    {
+      lock_guard<mutex> guard(lock);
+      failed++;
+      return;
+    }
+  append(job.info, recipe);
+}// end index
@@ -0,0 +1,114 @@
+/********************************************************************************************************
+ * Filename: chunkIndex.h
+ * Purpose: Persistent index of the content-defined chunks (see contentChunks.h) of every file the
+ *          server serves (-X), so "dget" can tell a client the recipe of a file without reading it
+ *          and send only the chunks the client doesn't hold, whichever files they came from.
+ * Programming Language Used: C++
+ * Format: -> The index file is a header followed by records, only ever appended to (and rewritten
+ *            without the dead records once they outweigh the live ones):
+ *
+ *                header: "DLCHUNK1" (8) | CDC_AVG_SIZE (4) | 0 (4)
+ *                record: CRC32C of the rest (4) | body length (4) | device (8) | inode (8) | size (8)
+ *                        | mtime seconds (8) | mtime nanoseconds (4) | chunk count (4) | recipe
+ *
+ *            all big endian. The newest record of a device and inode is the one that counts, and
+ *            only while the file still has that size and mtime.
+ *         -> The file is mapped into memory, a recipe is copied straight out of the mapping. Every
+ *            process of the server maps it and catches up with records appended by the others.
+ *********************************************************************************************************/
+#ifndef CHUNK_INDEX_H
+#define CHUNK_INDEX_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <string>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include "fileCache.h" // CachedFilePtr
+
+#define CHUNK_INDEX_MAGIC "DLCHUNK1"
+#define CHUNK_INDEX_HEADER 16 // magic + CDC_AVG_SIZE + reserved
+#define CHUNK_INDEX_RECORD 8 // CRC32C + body length, the body follows
+#define CHUNK_INDEX_BODY 40 // device + inode + size + mtime + chunk count, the recipe follows
+#define CHUNK_INDEX_RESCAN 60 // Seconds between walks of the served tree looking for new and changed files
+#define CHUNK_INDEX_COMPACT (1 << 20) // Dead record bytes the index file may hold before it is rewritten (if they outweigh the live ones)
+#define CHUNK_INDEX_QUEUE 64 // Downloaded files that may wait to be chunked, more are left to the next walk
+#define CHUNK_INDEX_DEPTH 64 // Directories deep the walk goes
+
+/*************************************************************************************************
+ * Class name:        ChunkIndex
+ * Description:       The index file mapped into memory and a table of where the newest record of
+                      each file is in it. A background thread of the process that start()s it walks
+                      the served tree every CHUNK_INDEX_RESCAN seconds and chunks every file that
+                      is new or changed, files downloaded before they are indexed are chunked first.
+                      Every member is safe to call from any thread.
+ *************************************************************************************************/
+class ChunkIndex
+{
+public:
+  ChunkIndex();
+
+  bool open(const char *path);
+  void start(int rootFd);
+  bool enabled() const { return fd != -1; }
+
+  bool lookup(const struct stat &info, std::string &recipe);
+  void requested(const struct stat &info, int fileFd, const CachedFilePtr &cached);
+  void sent(off_t fileBytes, off_t wireBytes);
+  std::string stats();
+
+private:
+  struct FileId
+  {
+    dev_t device;
+    ino_t inode;
+    bool operator==(const FileId &other) const { return device == other.device && inode == other.inode; }
+  };
+  struct FileIdHash
+  {
+    size_t operator()(const FileId &id) const { return std::hash<unsigned long long>()(id.inode * 31 + id.device); }
+  };
+  struct Entry
+  {
+    size_t offset; // of the record in the index file
+    size_t length; // of the record
+    bool seen; // found by the walk under way
+  };
+  struct Build
+  {
+    struct stat info;
+    int fileFd; // a descriptor of the file's own (-1 with cached)
+    CachedFilePtr cached;
+  };
+
+  bool load(bool repair);
+  void refresh(bool repair);
+  bool current(const Entry &entry, const struct stat &info) const;
+  void append(const struct stat &info, const std::string &recipe);
+  void compact();
+  static void buildThread(ChunkIndex *index);
+  void walk(int dirFd, int depth);
+  void runBuilds();
+  void index(const Build &job);
+
+  std::string path; // of the index file
+  int fd; // the index file, -1 while the index is off
+  int rootFd; // the served tree, -1 until start()
+  pid_t builderPid; // the process whose thread builds the index, forked children only read it
+  std::mutex lock; // guards everything below
+  std::condition_variable queued; // a file was requested
+  char *mapped; // the index file, MAP_FAILED when nothing is mapped
+  size_t mappedSize;
+  size_t scanned; // end of the records read into entries
+  std::unordered_map<FileId, Entry, FileIdHash> entries; // newest record of every file
+  size_t liveBytes; // bytes of the records in entries
+  std::deque<Build> builds; // downloaded files waiting to be chunked, oldest first
+  unsigned long long chunked, failed, downloads, fileBytes, wireBytes;
+};
+
+extern ChunkIndex &chunkIndex; // shared by every session of the process, never destroyed (like compressStore)
+
+#endif // CHUNK_INDEX_H
@@ -5,11 +5,37 @@
 /* Purpose:  client side program to test server 								*/
 /* Language: C++ 																*/
 /* Compiler version: clang 3.4.2  												*/
-/* Compile Command: clang++ -std=c++11 client.cpp 								*/
+/* Compile Command: clang++ -std=c++11 -pthread client.cpp -lz 				*/
 /* Execute Command: ./a.out <Hostname> Optional: <Port Number> 2 > errors.out  	*/
 /*                 Do 2 > errors.out if you would like 							*/
 /*                 to see meesages sent to server 								*/ 
-/* Protocol: All messages that are sent to the server will end with ':)' 		*/
+/* Protocol: All messages are sent as frames (see protocol.h), a header   */
+/*          with the type and length of the payload comes first         */
+/*          A download is announced with "READY <file size>", after the    */
+/*          client answers READY the file follows in one data frame       */
+/*          "RANGE <offset> [<length>]" instead of READY asks for part of */
+/*          the file only, used to resume from a <file>.part and to     */
+/*          fetch the pieces of a parallel download on their own        */
+/*          connections                                                  */
+/*          "mget" sends glob patterns, the server answers with the      */
+/*          names they match and then sends each file like "get"        */
+/*          "download-dir <dir>" answers "ARCHIVE <name>" and sends the */
+/*          tree as a tar archive in data frames, an empty frame ends it */
+/*          "multi" numbers its requests and sends them on streams, the */
+/*          server interleaves the files in chunks so small ones finish */
+/*          while a big one is still coming                              */
+/*          "compress <codecs>" picks a codec, whole files that compress  */
+/*          well then come as compressed blocks (see compression.h)      */
+/*          "checksum crc32c" is sent on every connection, each file or  */
+/*          range is then followed by its CRC32Cs (not a get on a        */
+/*          stream or a download-dir), a damaged chunk is fetched        */
+/*          again with RANGE                                             */
+/*          "sync <file>" sends the block signatures of the local copy, */
+/*          the server answers "SYNC <size>" and sends only what changed */
+/*          (see deltaSync.h), the copy is rebuilt in place              */
+/*          "have" sends the hashes of the content-defined chunks of    */
+/*          local files, "dget <file>" then gets the file's chunks and  */
+/*          only the bytes of those not held (see contentChunks.h)      */
 /*          																	*/
 /********************************************************************************/
 
@@ -23,18 +49,183 @@
 #include <string.h>
 #include <fstream>
 #include <iomanip>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h> // stat, mkdir, futimens
+#include <fcntl.h> // open, posix_fallocate
+#include <thread>
+#include <vector>
+#include <chrono> // throughput of parallel downloads
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <mutex>
+#include <condition_variable> // mget writer threads
+#include <sstream> // istringstream
+#include <fnmatch.h> // mget names
+#include <time.h> // strftime
+#include "protocol.h" // frame format shared with the server
+#include "tarArchive.h" // download-dir archives
+#include "compression.h" // compressed downloads
+#include "crc32c.h" // download checksums
+#include "deltaSync.h" // sync
+#include "contentChunks.h" // have, dget
 
-#define DEFAULT_PORT 49878 // Default port to connect to server
-#define MAX_MSG_SIZE 5000 // Max size of message 
+#define MAX_CONNECTIONS 64 // most connections one parallel download may open
+#define MGET_WRITERS 4 // threads writing the files of an mget to disk
+#define MGET_QUEUE 16 // files of an mget received but not written yet, the receiving waits when it is full
+#define MGET_BUFFER_MAX (1 << 20) // bigger mget files are written as they arrive instead of by the writers
+#define CHECKSUM_RETRIES 3 // times a damaged chunk is fetched again before the download is given up
+
+typedef std::vector<std::pair<long long, long long> > ByteRanges; // offset and length of damaged parts of a file
+
+bool verifyChecksums = false; // the server follows files and ranges with their CRC32Cs (see negotiateChecksums)
+
+/************************************************************************/
+/* Struct name: ChunkPlace                                           */
+/* Description: Where the bytes of a chunk held locally are            */
+/*************************************************************************/
+struct ChunkPlace
+{
+  size_t file; // index into chunkFiles
+  long long offset; // where the chunk starts in it
+  uint32_t length;
+};
+
+std::vector<std::string> chunkFiles; // local files whose chunks were offered with "have" or came with "dget"
+std::unordered_map<uint64_t, ChunkPlace> chunkPlaces; // hash -> where the chunk is, checked again before it is used
+std::unordered_set<uint64_t> serverHeld; // the chunks the server counts this connection as holding (see chunkHeld)
+
+/************************************************************************/
+/* Struct name: ChunkSums                                            */
+/* Description: CRC32Cs of the bytes of a file or range as they are   */
+/*              received, one per CHECKSUM_CHUNK_SIZE bytes             */
+/*************************************************************************/
+struct ChunkSums
+{
+  std::vector<uint32_t> crcs; // of the chunks complete so far
+  uint32_t current; // CRC of the chunk being received
+  uint64_t fill; // bytes of it received
+  uint64_t total; // bytes received in all
+  
+  ChunkSums() : current(0), fill(0), total(0) {}
+  
+  void add(const char *data, size_t length)
+  {
+    while(length > 0)
+      {
+	size_t take = std::min((uint64_t)length, CHECKSUM_CHUNK_SIZE - fill);
+	current = crc32cUpdate(current, data, take);
+	fill += take;
+	total += take;
+	data += take;
+	length -= take;
+	if(fill == CHECKSUM_CHUNK_SIZE)
+	  {
+	    crcs.push_back(current);
+	    current = 0;
+	    fill = 0;
+	  }
+      }
+  }
+};
+
+/************************************************************************/
+/* Class name: ChecksumBuf                                           */
+/* Description: Stream buffer that passes everything written to it   */
+/*              on to another one and adds it to a ChunkSums, so a     */
+/*              file is checksummed as it is written (decompressed)   */
+/*************************************************************************/
+class ChecksumBuf : public std::streambuf
+{
+public:
+  ChecksumBuf(std::streambuf *target, ChunkSums &sums) : target(target), sums(sums) {}
+  
+protected:
+  std::streamsize xsputn(const char *data, std::streamsize length)
+  {
+    sums.add(data, length);
+    return target != NULL ? target->sputn(data, length) : length;
+  }
+  int_type overflow(int_type c)
+  {
+    if(c == traits_type::eof())
+      return traits_type::not_eof(c);
+    char byte = traits_type::to_char_type(c);
+    return xsputn(&byte, 1) == 1 ? c : traits_type::eof();
+  }
+  
+private:
+  std::streambuf *target; // where the bytes go, NULL to drop them
+  ChunkSums &sums;
+};
 
 //Function Prototypes
 bool isNumeric(const std::string str);//Helper function to determine if string is numeric
-bool isEndOfMsg(const std::string str); // Helper function to determine if EOM sequence is in message
 void sendToServer(const int sockfd, const char* message); // Send message to server
-void recvFromServer(const int sockfd, char server_reply[], bool printMsg); // receive message from server
+void recvFromServer(FrameReader &reader, char server_reply[], bool printMsg); // receive message from server
 void displayMenu(); //display menu options
-void valInput(std::string input, const int sockfd, char server_reply[]); // validate input to server
+void valInput(std::string input, FrameReader &reader, char server_reply[], const struct sockaddr_in &servaddr); // validate input to server
+int connectToServer(const struct sockaddr_in &servaddr); // open another connection to the server
 std::string modifyInput(std::string input); // Helper function modify input to lowercase
+void recvFileChunked(FrameReader &reader, std::ofstream &outfile, long long fileSize, long long offset,
+		     ByteRanges &damaged); // receive a file straight to disk
+bool downloadFile(FrameReader &reader, const std::string &fileName, long long fileSize); // download or resume a file
+bool confirmOverwrite(const std::string &fileName); // ask before replacing a local file
+void parallelDownload(FrameReader &reader, char server_reply[], const struct sockaddr_in &servaddr,
+		      const std::string &fileName, int connections); // download a file over several connections
+void fetchSegment(const struct sockaddr_in &servaddr, std::string path, long long fileSize, int fd,
+		  long long offset, long long length); // one connection of a parallel download
+void recvFileRange(FrameReader &reader, int fd, long long offset, long long length,
+		   ByteRanges &damaged); // receive part of a file with pwrite
+void negotiateChecksums(FrameReader &reader); // ask for the CRC32Cs of every file and range
+bool recvChecksums(FrameReader &reader, const ChunkSums &sums, long long offset,
+		   ByteRanges &damaged); // check received bytes against the server's CRC32Cs
+bool repairRanges(FrameReader &reader, const std::string &path, long long fileSize, int fd,
+		  ByteRanges damaged); // fetch damaged chunks again
+void syncFile(FrameReader &reader, const std::string &fileName); // bring a local copy up to date
+void offerChunks(FrameReader &reader, const std::vector<std::string> &paths); // "have" the chunks of local files
+bool sendChunkHashes(FrameReader &reader, const std::string &hashes); // one "have" and its answer
+void dedupDownload(FrameReader &reader, const std::string &fileName); // download only the chunks not held
+bool readFully(int fd, char *buffer, size_t length, off_t offset); // pread() all of a range
+bool writeFully(int fd, const char *buffer, size_t length, off_t offset); // pwrite() all of a range
+void listPages(FrameReader &reader, char server_reply[], int pageSize); // page through the directory listing
+void statBatch(FrameReader &reader, const std::vector<std::string> &paths); // size/mtime/type of many paths at once
+bool readPathList(std::vector<std::string> &paths); // the paths given on the rest of the command line
+void pipelineDownload(FrameReader &reader, const std::vector<std::string> &files); // many files, requests sent back to back
+void multiDownload(FrameReader &reader, const std::vector<std::string> &requests); // many files on interleaved streams
+void sendOnStream(const int sockfd, uint32_t stream, const std::string &command); // a command whose answer comes on a stream
+void mgetDownload(FrameReader &reader, const std::vector<std::string> &patterns); // every file matching the patterns
+bool mgetNameWanted(const std::string &name, const std::vector<std::string> &patterns); // a name the server may answer with
+bool writeWholeFile(const std::string &fileName, const std::string &data); // write a file through <file>.part
+long long recvFileBody(FrameReader &reader, FrameEvent &event, std::ostream &out); // a file as it is or in compressed blocks
+
+/************************************************************************/
+/* Struct name: TarUnpacker                                          */
+/* Description: Where unpacking a download-dir archive is, the bytes  */
+/*              come in pieces of any size                              */
+/*************************************************************************/
+struct TarUnpacker
+{
+  char block[TAR_BLOCK_SIZE]; // header being received
+  size_t blockFill; // bytes of it received
+  TarEntry entry; // entry whose contents are being received
+  std::string pax; // pax extended header being received, or its records waiting for the next header
+  bool paxPending; // pax holds records for the next header
+  uint64_t contentsLeft; // bytes of entry's contents still to come
+  size_t paddingLeft; // zeros after them still to come
+  int fd; // entry's <file>.part (-1 if it is being skipped)
+  bool discard; // the user didn't want the archive, drop everything
+  bool finished; // the zero blocks at the end were seen
+  long long files, bytes; // files unpacked, bytes of them
+};
+
+void downloadDirectory(FrameReader &reader, const std::string &dirName); // a whole directory tree as one archive
+bool unpackTar(TarUnpacker &unpacker, const char *data, size_t length); // unpack the next bytes of an archive
+void startTarEntry(TarUnpacker &unpacker); // create the directory or file a header describes
+void finishTarEntry(TarUnpacker &unpacker); // close and rename a file once its contents are in
+bool safeArchivePath(const std::string &path); // no absolute paths and no ".." in an archive
 
 
 /************************************************************************/
@@ -51,7 +242,6 @@ int main(int argc, char **argv)
   struct sockaddr_in servaddr;  //pointer to server info
   struct hostent *hostEnt; //pointer to host 
   struct in_addr *IPaddr; //pointer to IP address
-  const char *byeMessage = "bye:)";
   
   
   //Valadating command line arguments 
@@ -93,22 +283,11 @@ int main(int argc, char **argv)
   
   IPaddr= (struct in_addr *)hostEnt->h_addr; //store IP address into IPaddr
   
-  if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) //create a socket
-    { 
-      perror("Error creating socket " ) ;
-      exit(-1);
-    } // end if 
-  
   //specify the address Family and  Ip Address
   servaddr.sin_family = AF_INET;
   servaddr.sin_addr= *IPaddr;
   
-  //connecting to server
-  if(connect(sockfd, (struct sockaddr *) &servaddr, sizeof(servaddr)) == -1 )
-    {  // error
-      perror("Error connecting to server ");
-      exit(-1);
-    }//end if   
+  sockfd = connectToServer(servaddr); //connecting to server
   
   
   char ipAddress[50] = {'\0'}; // Create char array for IP address to be stored
@@ -122,9 +301,11 @@ int main(int argc, char **argv)
   
   
   char server_reply[MAX_MSG_SIZE] = {'\0'}; // Declare buffer for message
+  FrameReader reader(sockfd); // Frames from the server are parsed through this for the whole session
   
   //recieving hello message from server
-  recvFromServer(sockfd, server_reply, 1);
+  recvFromServer(reader, server_reply, 1);
+  negotiateChecksums(reader);
   
   std::string command;
   displayMenu();
@@ -136,7 +317,7 @@ int main(int argc, char **argv)
       std::cout << "Command: " ;
       std::cin >> command;
       command=modifyInput(command);
-      valInput(command,sockfd, server_reply); //Check command being used
+      valInput(command,reader, server_reply, servaddr); //Check command being used
       
       if(command!= "bye") //If client wants to disconnect do not display menu
 	displayMenu();
@@ -174,28 +355,6 @@ bool isNumeric(const std::string str)
   return true; // if all characters are numbers 
 } //End isNumeric
 
-/************************************************************************/
-/* Function name: isEndOfMsg                                             */
-/* Description: Determine if string that was entered contains the end of */
-/*              message sequence defined in protocol                    */
-/* Parameters: const std::string str- String that was entered by user    */
-/* Return Value: True- If string entered contains end of message sequence*/
-/*               False- If string entered does not contain end of message */
-/*                      sequence      */
-/*************************************************************************/
-
-bool isEndOfMsg(const std::string str) 
-{
-  int i = 0;
-  while(i < str.length()) // Make sure no out of bounds errors occur
-    {
-      for(i=0; i <str.length(); i++) // Check for end of message sequence
-	if(str[i] == ':' && str[i+1] == ')')
-	  return true; // If whole message is received 
-    }//end while
-  return false; // End Of Message sequence is not in message 
-} //end isEndOfMsg
-
 /************************************************************************/
 /* Function name: sendToServer                                           */
 /* Description: Send messages to a connected Server                      */
@@ -208,8 +367,7 @@ void sendToServer(const int sockfd, const char* message)
 {
   std::string userMsg = message;
   
-  const char* serverMessage = (userMsg + ":)").c_str();
-  if(send(sockfd, serverMessage, strlen(serverMessage), 0)== -1) // Send message to server check for failure
+  if(!sendMessage(sockfd, userMsg.c_str(), userMsg.length())) // Send message to server check for failure
     {
       perror("Error sending message: " ) ;
       exit(-1);
@@ -220,40 +378,53 @@ void sendToServer(const int sockfd, const char* message)
 /************************************************************************/
 /* Function name: recvFromServer                                        */
 /* Description: receive messages from a connected Server                */
-/* Parameters: const int sockfd- socket file descriptor    */
-/*             char server_reply[] - char array message received */
+/* Parameters: FrameReader &reader- connection to the server   */
+/*             char server_reply[] - char array message received, only */
+/*                            the first MAX_MSG_SIZE - 1 bytes are kept */
 /*             bool printMsg- Determine if the message from server */
-/*                            should be printed(Dont print contents of */
-/*                            file downloaded */
+/*                            should be printed, long messages (like  */
+/*                            a directory listing) are printed in full */
 /* Return Value: Nothing */
 /*************************************************************************/
 
-void recvFromServer(const int sockfd, char server_reply[],bool printMsg)
+void recvFromServer(FrameReader &reader, char server_reply[],bool printMsg)
 {
+  FrameEvent event; // piece of the frame received
+  size_t stored = 0; // bytes copied into server_reply so far
+  int kind; // what readFrameEvent reported
   
   memset(server_reply, 0, MAX_MSG_SIZE ); // Resetting buffer to be empty to receive full message
   
-  if (recv(sockfd, server_reply,  MAX_MSG_SIZE, 0) == -1) // receive message check for failure
+  kind = readFrameEvent(reader, event); // receive message check for failure
+  if (kind != FRAME_BEGIN || event.header.type != FRAME_MSG)
     {
-      perror("Error receiving message: " ) ;
+      if(kind == FRAME_FAILED)
+	perror("Error receiving message: " ) ;
+      else
+	std::cout << "Server closed the connection or sent something unexpected" << std::endl;
       exit(-1);      
     }//end if 
-  else 
-    {// Check to make sure full message was received
-      while(!isEndOfMsg(server_reply))
-	{ //If message was not received recv again until message is fully received
-	  if (recv(sockfd, server_reply,  MAX_MSG_SIZE, 0) == -1) // receive message check for failure
-	    {
-	      perror("Error receiving message: " ) ;
-	      exit(-1);
-	    }//end if
-	}
-      // Since Message Successfully received, trim the end of message marker
-      server_reply[strlen(server_reply) -2] = '\0';
+  
+  if(printMsg)
+    std::cout<< "Message from server: \"";
+  // The frame length says where the message ends, keep going until the end of the frame
+  while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+    {
       if(printMsg)
-	std::cout<< "Message from server: \"" << server_reply << "\"" << std::endl;
-      
-    }//end else  
+	std::cout.write(event.data, event.length);
+      size_t room = MAX_MSG_SIZE - 1 - stored; // space left in server_reply
+      size_t toStore = event.length < room ? event.length : room;
+      memcpy(server_reply + stored, event.data, toStore);
+      stored += toStore;
+    }//end while
+  if(printMsg)
+    std::cout << "\"" << std::endl;
+  
+  if(kind != FRAME_END)
+    {
+      perror("Error receiving message: " ) ;
+      exit(-1);
+    }//end if
   
 }// end recvFromServer
 
@@ -277,7 +448,22 @@ void displayMenu()
   std::cout << "*\tCD <Directory Name>  - Changes Directory to directory specified"
             << std::setw(7) << "*" << std::endl;
   
+  std::cout << "*\tLS <N> - Prints the directory on server N names at a time" << std::setw(13) << "*" << std::endl;
   std::cout << "*\tDownload <fileName> - Download specified file" << std::setw(25) << "*" << std::endl;
+  std::cout << "*\tPDownload <fileName> <N> - Download over N connections" << std::setw(16) << "*" << std::endl;
+  std::cout << "*\tSync <fileName> - Update a local copy, sending only changes" << std::setw(11) << "*" << std::endl;
+  std::cout << "*\tHave <path>... | @<file> - Offer local files' chunks to dget" << std::setw(10) << "*" << std::endl;
+  std::cout << "*\tDget <fileName> - Download only chunks not held locally" << std::setw(15) << "*" << std::endl;
+  std::cout << "*\tStat-Batch <path>... | @<file> - Size, time & type of many files"
+            << std::setw(6) << "*" << std::endl;
+  std::cout << "*\tPipeline <fileName>... | @<file> - Download many files at once"
+            << std::setw(8) << "*" << std::endl;
+  std::cout << "*\tDownload-Dir <dirName> - Download a whole directory tree" << std::setw(14) << "*" << std::endl;
+  std::cout << "*\tMget <pattern>... | @<file> - Download all matching files" << std::setw(13) << "*" << std::endl;
+  std::cout << "*\tMulti <fileName>... | @<file> - Download many files side by side"
+            << std::setw(6) << "*" << std::endl;
+  std::cout << "*\tCompress <zlib|zstd|off> - Compress whole-file downloads" << std::setw(14) << "*" << std::endl;
+  std::cout << "*\tStats - Prints the server's cache counters" << std::setw(28) << "*" << std::endl;
   std::cout << "*\tBye - Disconnect from server" << std::setw(42) << "*" << std::endl
             <<  "*" <<  std::setw(77) <<   "*" << std::endl ;
   
@@ -288,26 +474,98 @@ void displayMenu()
 /* Function name: valInput                                        */
 /* Description: Validate user input to make sure command entered was   */
 /*              then send the command to the server and receive reply  */ 
-/* Parameters: const int sockfd- socket file descriptor    */
+/* Parameters: FrameReader &reader- connection to the server   */
 /*             char server_reply[] - char array message received */
 /*             string input- Input from user                           */
+/*             const sockaddr_in &servaddr- server address, for      */
+/*                            the extra connections of pdownload       */
 /* Return Value: Nothing */
 /*************************************************************************/
-void valInput(std::string input, const int sockfd, char server_reply[])
+void valInput(std::string input, FrameReader &reader, char server_reply[], const struct sockaddr_in &servaddr)
 { // Check command user enters
+  const int sockfd = reader.sockfd; // socket connected to the server
   
   if (input == "pwd")
     { 
       const char* pwd="pwd"; //message being sent to server
       sendToServer(sockfd, pwd);
-      recvFromServer(sockfd, server_reply,1); //receive the working directory 
+      recvFromServer(reader, server_reply,1); //receive the working directory 
     } //end if 
   
   else if (input == "dir")
     {
       const char* dir="dir"; // Message being sent to server
       sendToServer(sockfd, dir);
-      recvFromServer(sockfd, server_reply,1); //receive the listing of Directories
+      recvFromServer(reader, server_reply,1); //receive the listing of Directories
+    } // end else if
+  
+  else if (input == "ls")
+    {
+      std::string pageSize; // names per page
+      std::cin >> pageSize;
+      
+      if(!isNumeric(pageSize) || pageSize.length() > 4 || atoi(pageSize.c_str()) < 1)
+	{
+	  std::cout << "The page size must be a number between 1 and " << LIST_PAGE_MAX << std::endl;
+	  return;
+	}
+      listPages(reader, server_reply, atoi(pageSize.c_str()));
+    } // end else if
+  
+  else if (input == "stat-batch")
+    {
+      std::vector<std::string> paths;
+      if(readPathList(paths))
+	statBatch(reader, paths);
+    } // end else if
+  
+  else if (input == "pipeline")
+    {
+      std::vector<std::string> files;
+      if(readPathList(files))
+	pipelineDownload(reader, files);
+    } // end else if
+  
+  else if (input == "download-dir")
+    {
+      std::string dirName; // the rest of the line, spaces included
+      std::getline(std::cin, dirName);
+      dirName.erase(0, dirName.find_first_not_of(" \t"));
+      if(dirName.empty())
+	std::cout << "Usage: download-dir <dirName>" << std::endl;
+      else
+	downloadDirectory(reader, dirName);
+    } // end else if
+  
+  else if (input == "mget")
+    {
+      std::vector<std::string> patterns;
+      if(readPathList(patterns) && !patterns.empty())
+	mgetDownload(reader, patterns);
+    } // end else if
+  
+  else if (input == "multi")
+    {
+      std::vector<std::string> requests;
+      if(readPathList(requests))
+	multiDownload(reader, requests);
+    } // end else if
+  
+  else if (input == "compress")
+    {
+      std::string codecs; // e.g. zstd,zlib in order of preference, or off
+      std::cin >> codecs;
+      
+      if(modifyInput(codecs) == "off")
+	codecs = "none";
+      sendToServer(sockfd, ("compress " + codecs).c_str());
+      recvFromServer(reader, server_reply,1); // receive the codec the server picked
+    } // end else if
+  
+  else if (input == "stats")
+    {
+      sendToServer(sockfd, "stats");
+      recvFromServer(reader, server_reply,1); //receive the file cache counters
     } // end else if
   
   else if (input == "cd")
@@ -320,16 +578,15 @@ void valInput(std::string input, const int sockfd, char server_reply[])
       const char * newDir = dirName.c_str(); //convert dirName to C string to send to server
       
       sendToServer(sockfd, cd); //Sending the command first to server
-      recvFromServer(sockfd, server_reply,1); //Receiving which directory user wants to send to
+      recvFromServer(reader, server_reply,1); //Receiving which directory user wants to send to
       
       sendToServer(sockfd, newDir); // Sending the directory to change to
-      recvFromServer(sockfd, server_reply,1); //Receiving success or fail message
+      recvFromServer(reader, server_reply,1); //Receiving success or fail message
     } // end else if 
   
   else if (input == "download")
     {
       //messages to be sent to server 
-      const char* ready = "READY";
       const char* stop = "STOP";
       const char* download = "download";
       
@@ -337,79 +594,68 @@ void valInput(std::string input, const int sockfd, char server_reply[])
       std::cin >> fileName; //Getting file being requested to be downloaded
       
       sendToServer(sockfd, download); //Sending command 
-      recvFromServer(sockfd, server_reply,1); // receiving which file user wishes to downloaded
+      recvFromServer(reader, server_reply,1); // receiving which file user wishes to downloaded
       
       sendToServer(sockfd, fileName.c_str()); // sending file to be downloaded
-      recvFromServer(sockfd, server_reply,1);// receiving if file exists or not
+      recvFromServer(reader, server_reply,1);// receiving if file exists or not
       
       std::string response = server_reply; 
       
-      std::ifstream infile(fileName);       
-      if(response == "READY" )
+      if(response.compare(0, 6, "READY ") == 0 )
 	{//file exists on server 
 	  std::cout<< "File Exists on server!" << std::endl;
-      	  
-	  if(!infile.good())// While the file is not on the client
-	    {
-	      std::ofstream outfile(fileName);
-	      
-	      sendToServer(sockfd, ready); // Send ready message to begin download
-	      
-	      recvFromServer(sockfd, server_reply,0); // Receiving file
-	      
-	      
-	      const char *success = "File received  Successfully";
-	      sendToServer(sockfd, success);
-	      // Store the file read from server into a string
-	      // Write contents to file 
-	      std::string file = server_reply;
-	      outfile << file;
-	      
-	      std::cout << "File: \"" << fileName <<  "\" Downloaded!" << std::endl;
-	      outfile.close(); // close output file		
-	    }
+	  long long fileSize = atoll(response.c_str() + 6); // size announced after READY
 	  
-	  
-	  //end  if(!infile.good())
-	  else if(infile.good()==1) //check if file exists on local machine 
+	  if(confirmOverwrite(fileName))
 	    {
-	      //prompt user to overwrite file or not
-	      std::cout << "File Exists locally do you wish to overwrite file? (y/n)" << std::endl;
-	      std::cin >> response ;
-	      std::string lowResponse = modifyInput(response); // Make whatever user enters lowercase
-	      
-	      while(lowResponse != "y" && lowResponse != "n")
-		{ // validate user input
-		  std::cout << "Please enter (y/n) " << std::endl;
-		  std::cin >> lowResponse ;
-		}// end while
-	      
-	      if(lowResponse == "y")
-		{ 
-		  sendToServer(sockfd, ready);//send ready message to server
-		  recvFromServer(sockfd, server_reply,0); //receive file		  
-		  const char *success = "File received  Successfully";
-		  sendToServer(sockfd, success); // send success message		  
-		}// end if 
-	      else 
-		{ // Do not overwrite file
-		  sendToServer(sockfd, stop);
-		  recvFromServer(sockfd, server_reply,1);
-		}//end else 
-	      
-	      infile.close(); // close input file
-	      
-	    } // end if(input == "READY")
-	}
-      // end else if(infile.good() == 1) 
+	      if(downloadFile(reader, fileName, fileSize)) // resumes an earlier partial download
+		std::cout << "File: \"" << fileName <<  "\" Downloaded!" << std::endl;
+	    }
+	  else 
+	    { // Do not overwrite file
+	      sendToServer(sockfd, stop);
+	      recvFromServer(reader, server_reply,1);
+	    }//end else 
+	}
     }
   //end if ready message 
   // end if download command selected 
+  else if (input == "sync")
+    {
+      std::string fileName;
+      std::cin >> fileName; // the local copy has the same name
+      syncFile(reader, fileName);
+    } // end else if
+  else if (input == "have")
+    {
+      std::vector<std::string> paths;
+      if(readPathList(paths) && !paths.empty())
+	offerChunks(reader, paths);
+    } // end else if
+  else if (input == "dget")
+    {
+      std::string fileName;
+      std::cin >> fileName; // saved under the same name
+      dedupDownload(reader, fileName);
+    } // end else if
+  else if (input == "pdownload")
+    {
+      std::string fileName, connections; // file and how many connections to fetch it over
+      std::cin >> fileName >> connections;
+      
+      if(!isNumeric(connections) || connections.length() > 3 || atoi(connections.c_str()) < 1
+	 || atoi(connections.c_str()) > MAX_CONNECTIONS)
+	{
+	  std::cout << "The number of connections must be between 1 and " << MAX_CONNECTIONS << std::endl;
+	  return;
+	}
+      parallelDownload(reader, server_reply, servaddr, fileName, atoi(connections.c_str()));
+    } // end else if
   else if (input== "bye")
     { 
       const char* bye = "bye"  ; // bye message to be sent 
       sendToServer(sockfd, bye);
-      recvFromServer(sockfd, server_reply,1); // receive server disconnected message
+      recvFromServer(reader, server_reply,1); // receive server disconnected message
     } // end else if 
   else 
     {//invalid menu option 
@@ -418,19 +664,2090 @@ void valInput(std::string input, const int sockfd, char server_reply[])
 } // end valInput
 
 /************************************************************************/
-/* Function name: modifyInput                                        */
-/* Description: Changes whatever user input was to be all lowercase   */
-/* Parameters: string input-  The user input    */
-/* Return Value: string - the new string that will be users input all  */
-/*                        lowercase */
-/*************************************************************************/  
-std::string modifyInput(std::string input)
+/* Function name: listPages                                         */
+/* Description: Prints the server's directory one page at a time, each  */
+/*              page is asked for with "list <N> <cursor>" once the user */
+/*              wants it, so a huge directory can be stopped early and   */
+/*              no page is ever too big for server_reply                */
+/* Parameters: FrameReader &reader- connection to the server   */
+/*             char server_reply[] - char array message received */
+/*             int pageSize- most names per page                       */
+/* Return Value: Nothing */
+/*************************************************************************/
+void listPages(FrameReader &reader, char server_reply[], int pageSize)
 {
+  std::string cursor = "0"; // where the next page starts, from the "PAGE <cursor>" of the last one
+  std::string answer; // does the user want another page
   
-  std::string message;  
-  for(int i =0; i < input.length(); i++)
-    {//loop through string and make every character lowercase
-      message.push_back(std::tolower(input[i]));
-    } // end for 
-  return message ;  
-}
+  while(true)
+    {
+      std::string request = "list " + std::to_string(pageSize) + " " + cursor;
+      sendToServer(reader.sockfd, request.c_str());
+      recvFromServer(reader, server_reply, 0);
+      
+      std::string page = server_reply;
+      size_t lineEnd = page.find('\n');
+      if(page.compare(0, 5, "PAGE ") != 0 || lineEnd == std::string::npos)
+	{ // an error instead of a page
+	  std::cout << "Message from server: \"" << page << "\"" << std::endl;
+	  return;
+	}
+      cursor = page.substr(5, lineEnd - 5);
+      std::cout << page.substr(lineEnd + 1);
+      
+      if(cursor == "END")
+	{
+	  std::cout << "End of directory." << std::endl;
+	  return;
+	}
+      std::cout << "More? (y/n): ";
+      std::cin >> answer;
+      if(modifyInput(answer) != "y")
+	return;
+    }//end while
+}// end listPages
+
+/************************************************************************/
+/* Function name: readPathList                                      */
+/* Description: Reads the paths that follow a command on the same line, */
+/*              "@<file>" stands for every line of a local file          */
+/* Parameters: vector<string> &paths- filled with the paths          */
+/* Return Value: True- If the paths could be read                        */
+/*               False- If an @ file can't be opened                     */
+/*************************************************************************/
+bool readPathList(std::vector<std::string> &paths)
+{
+  std::string line, path; // the rest of the line holds the paths
+  std::getline(std::cin, line);
+  std::istringstream words(line);
+  
+  while(words >> path)
+    {
+      if(path[0] == '@') // @<file>: read the paths from a local file, one per line
+	{
+	  std::ifstream list(path.substr(1));
+	  if(!list)
+	    {
+	      perror(("Cannot open " + path.substr(1)).c_str());
+	      return false;
+	    }
+	  while(std::getline(list, line))
+	    if(!line.empty())
+	      paths.push_back(line);
+	}
+      else
+	paths.push_back(path);
+    }//end while
+  return true;
+}// end readPathList
+
+/************************************************************************/
+/* Function name: pipelineDownload                                  */
+/* Description: Downloads many files over this connection without a    */
+/*              round trip per file: a thread sends "get <file>" for   */
+/*              every file back to back while the answers, each file   */
+/*              as one data frame or a message saying why it couldn't  */
+/*              be sent, are read in the same order. Each file is       */
+/*              written to <file>.part and renamed once complete.     */
+/* Parameters: FrameReader &reader- connection to the server   */
+/*             const vector<string> &files- files to download        */
+/* Return Value: Nothing */
+/*************************************************************************/
+void pipelineDownload(FrameReader &reader, const std::vector<std::string> &files)
+{
+  std::vector<std::string> wanted; // files to ask for
+  struct stat localStat; // is the file already here
+  FrameEvent event; // piece of the reply received
+  int kind; // what readFrameEvent reported
+  
+  // Ask about existing files once for the whole batch, a prompt per file would stall the pipeline
+  size_t existing = 0;
+  for(size_t i = 0; i < files.size(); i++)
+    if(stat(files[i].c_str(), &localStat) == 0)
+      existing++;
+  bool overwrite = false;
+  if(existing > 0)
+    {
+      std::string answer;
+      std::cout << existing << " of the files already exist, overwrite them? (y/n): ";
+      std::cin >> answer;
+      overwrite = modifyInput(answer) == "y";
+    }
+  for(size_t i = 0; i < files.size(); i++)
+    if(overwrite || stat(files[i].c_str(), &localStat) == -1)
+      wanted.push_back(files[i]);
+  if(wanted.empty())
+    return;
+  
+  auto started = std::chrono::steady_clock::now();
+  std::thread requests([&reader, &wanted]()
+		       {
+			 for(size_t i = 0; i < wanted.size(); i++)
+			   sendToServer(reader.sockfd, ("get " + wanted[i]).c_str());
+		       });
+  
+  size_t received = 0; // files downloaded
+  long long bytes = 0; // bytes of them
+  std::vector<std::pair<std::string, ByteRanges> > repairs; // files with damaged chunks, fixed once all are in
+  std::vector<long long> repairSizes; // their sizes
+  for(size_t i = 0; i < wanted.size(); i++)
+    {
+      kind = readFrameEvent(reader, event);
+      if(kind != FRAME_BEGIN)
+	{
+	  perror("Error receiving file: " ) ;
+	  exit(-1);
+	}
+      if(event.header.type == FRAME_MSG) // the file couldn't be sent
+	{
+	  std::string message;
+	  while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+	    message.append(event.data, event.length);
+	  std::cout << wanted[i] << ": " << message << std::endl;
+	  continue;
+	}
+      
+      std::string partName = wanted[i] + ".part"; // bytes received so far
+      std::ofstream outfile(partName, std::ios::binary | std::ios::trunc);
+      if(!outfile)
+	{
+	  perror(("Error opening " + partName).c_str());
+	  exit(-1);
+	}
+      ChunkSums sums; // CRC32Cs of what is written
+      ChecksumBuf checksummed(outfile.rdbuf(), sums);
+      std::ostream out(&checksummed);
+      long long fileSize = recvFileBody(reader, event, out); // Written out chunk by chunk
+      outfile.close();
+      if(fileSize == -1)
+	exit(-1);
+      if(!out || !outfile)
+	{
+	  perror(("Error writing " + partName).c_str());
+	  exit(-1);
+	}
+      ByteRanges damaged;
+      if(verifyChecksums && !recvChecksums(reader, sums, 0, damaged))
+	exit(-1);
+      if(!damaged.empty())
+	{
+	  repairs.push_back(std::make_pair(wanted[i], damaged));
+	  repairSizes.push_back(fileSize);
+	}
+      bytes += fileSize;
+      if(rename(partName.c_str(), wanted[i].c_str()) == -1)
+	{
+	  perror(("Error renaming " + partName).c_str());
+	  exit(-1);
+	}
+      received++;
+    }//end for
+  requests.join();
+  for(size_t i = 0; i < repairs.size(); i++) // the renamed files are patched in place
+    {
+      int fd = open(repairs[i].first.c_str(), O_WRONLY | O_CLOEXEC);
+      if(fd == -1) // failed to be written, already reported
+	continue;
+      if(!repairRanges(reader, repairs[i].first, repairSizes[i], fd, repairs[i].second))
+	{
+	  std::cout << repairs[i].first << ": damaged, removed" << std::endl;
+	  unlink(repairs[i].first.c_str());
+	  received--;
+	}
+      close(fd);
+    }
+  
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  std::cout << "Downloaded " << received << " of " << wanted.size() << " files (" << bytes << " bytes) in "
+	    << std::fixed << std::setprecision(3) << seconds << " s" << std::endl;
+  std::cout.unsetf(std::ios::floatfield);
+}// end pipelineDownload
+
+/************************************************************************/
+/* Function name: writeWholeFile                                    */
+/* Description: Writes a file received in full to <file>.part, then   */
+/*              renames it, so a file is never seen half written       */
+/* Parameters: const string &fileName- the file to write            */
+/*             const string &data- its contents                       */
+/* Return Value: True- If the file was written                         */
+/*               False- otherwise, errno tells why                      */
+/*************************************************************************/
+bool writeWholeFile(const std::string &fileName, const std::string &data)
+{
+  std::string partName = fileName + ".part"; // bytes received so far
+  std::ofstream outfile(partName, std::ios::binary | std::ios::trunc);
+  if(!outfile)
+    return false;
+  outfile.write(data.data(), data.length());
+  outfile.close();
+  return outfile && rename(partName.c_str(), fileName.c_str()) == 0;
+}// end writeWholeFile
+
+/************************************************************************/
+/* Function name: mgetDownload                                      */
+/* Description: Downloads every file matching glob patterns (or the   */
+/*              names in @<file>) with one command. The server answers */
+/*              with the names the patterns match and sends the files */
+/*              back to back in that order, each as one data frame (or */
+/*              a message saying why it couldn't be sent). Small files */
+/*              are handed to MGET_WRITERS threads that write them     */
+/*              while the next ones arrive, big ones are written as    */
+/*              they come. Existing local files are asked about once. */
+/*              Names that no pattern matches or that would leave the */
+/*              current directory are reported and their files dropped.*/
+/* Parameters: FrameReader &reader- connection to the server   */
+/*             const vector<string> &patterns- patterns like *.log   */
+/* Return Value: Nothing */
+/*************************************************************************/
+void mgetDownload(FrameReader &reader, const std::vector<std::string> &patterns)
+{
+  struct stat localStat; // is the file already here
+  FrameEvent event; // piece of the reply received
+  int kind; // what readFrameEvent reported
+  std::string command = "mget "; // the patterns, one per line
+  
+  for(size_t i = 0; i < patterns.size(); i++)
+    command += (i ? "\n" : "") + patterns[i];
+  if(command.length() > MAX_MSG_SIZE - 1)
+    {
+      std::cout << "Too many patterns for one mget, split them up" << std::endl;
+      return;
+    }
+  auto started = std::chrono::steady_clock::now();
+  sendToServer(reader.sockfd, command.c_str());
+  
+  // "MGET <count>" and the names, or why the patterns couldn't be matched
+  std::string reply;
+  if(readFrameEvent(reader, event) != FRAME_BEGIN || event.header.type != FRAME_MSG)
+    {
+      perror("Error receiving message: " ) ;
+      exit(-1);
+    }
+  while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+    reply.append(event.data, event.length);
+  if(reply.compare(0, 5, "MGET ") != 0)
+    {
+      std::cout << reply << std::endl;
+      return;
+    }
+  std::vector<std::string> names;
+  std::istringstream lines(reply);
+  std::string line;
+  std::getline(lines, line);
+  while(std::getline(lines, line))
+    names.push_back(line);
+  
+  // The names become local paths, a server must not pick where files are written
+  std::vector<bool> wanted(names.size());
+  for(size_t i = 0; i < names.size(); i++)
+    if(!(wanted[i] = mgetNameWanted(names[i], patterns)))
+      std::cout << "Skipping \"" << names[i] << "\": not a name the patterns ask for" << std::endl;
+  
+  size_t existing = 0;
+  for(size_t i = 0; i < names.size(); i++)
+    if(wanted[i] && stat(names[i].c_str(), &localStat) == 0)
+      existing++;
+  bool overwrite = true;
+  if(existing > 0)
+    {
+      std::string answer;
+      std::cout << existing << " of the " << names.size() << " files already exist, overwrite them? (y/n): ";
+      std::cin >> answer;
+      overwrite = modifyInput(answer) == "y";
+    }
+  
+  // Writers take whole small files off the queue, the receiving waits while it is full
+  std::deque<std::pair<std::string, std::string> > queue; // name and contents
+  std::mutex lock; // guards queue, done and failed
+  std::condition_variable changed; // the queue changed or the receiving is done
+  bool done = false;
+  size_t failed = 0; // files that couldn't be written
+  std::vector<std::thread> writers;
+  for(int i = 0; i < MGET_WRITERS; i++)
+    writers.push_back(std::thread([&]()
+				  {
+				    std::unique_lock<std::mutex> guard(lock);
+				    while(true)
+				      {
+					changed.wait(guard, [&]() { return done || !queue.empty(); });
+					if(queue.empty())
+					  return;
+					std::pair<std::string, std::string> file;
+					file.swap(queue.front());
+					queue.pop_front();
+					changed.notify_all();
+					guard.unlock();
+					bool written = writeWholeFile(file.first, file.second);
+					if(!written)
+					  perror(("Error writing " + file.first).c_str());
+					guard.lock();
+					failed += !written;
+				      }
+				  }));
+  
+  size_t received = 0; // files downloaded
+  long long bytes = 0; // bytes of them
+  std::vector<std::pair<std::string, ByteRanges> > repairs; // files with damaged chunks, fixed once all are written
+  std::vector<long long> repairSizes; // their sizes
+  for(size_t i = 0; i < names.size(); i++)
+    {
+      kind = readFrameEvent(reader, event);
+      if(kind != FRAME_BEGIN)
+	{
+	  perror("Error receiving file: " ) ;
+	  exit(-1);
+	}
+      if(event.header.type == FRAME_MSG) // the file couldn't be sent
+	{
+	  std::string message;
+	  while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+	    message.append(event.data, event.length);
+	  std::cout << names[i] << ": " << message << std::endl;
+	  continue;
+	}
+      
+      // the local copy stays (or nothing is written for an unwanted name), the bytes are dropped
+      bool keep = !wanted[i] || (!overwrite && stat(names[i].c_str(), &localStat) == 0);
+      // a compressed file's size is only known once it is in, it is always written as it arrives
+      bool streamed = !keep && (event.header.length > MGET_BUFFER_MAX || (event.header.flags & FRAME_FLAG_COMPRESSED));
+      std::ostringstream contents;
+      std::ofstream outfile;
+      if(streamed)
+	{
+	  outfile.open(names[i] + ".part", std::ios::binary | std::ios::trunc);
+	  if(!outfile)
+	    perror(("Error opening " + names[i] + ".part").c_str());
+	}
+      ChunkSums sums; // CRC32Cs of what is received
+      ChecksumBuf checksummed(keep ? NULL : streamed ? (std::streambuf *)outfile.rdbuf() : contents.rdbuf(), sums);
+      std::ostream out(&checksummed);
+      long long fileSize = recvFileBody(reader, event, out);
+      if(fileSize == -1)
+	exit(-1);
+      ByteRanges damaged;
+      if(verifyChecksums && !recvChecksums(reader, sums, 0, damaged))
+	exit(-1);
+      if(keep)
+	continue;
+      if(!damaged.empty())
+	{
+	  repairs.push_back(std::make_pair(names[i], damaged));
+	  repairSizes.push_back(fileSize);
+	}
+      
+      received++;
+      bytes += fileSize;
+      if(streamed)
+	{
+	  outfile.close();
+	  if(!out || !outfile || rename((names[i] + ".part").c_str(), names[i].c_str()) == -1)
+	    {
+	      perror(("Error writing " + names[i]).c_str());
+	      received--;
+	    }
+	  continue;
+	}
+      std::unique_lock<std::mutex> guard(lock);
+      changed.wait(guard, [&]() { return queue.size() < MGET_QUEUE; });
+      queue.push_back(std::make_pair(names[i], contents.str()));
+      changed.notify_all();
+    }//end for
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    done = true;
+  }
+  changed.notify_all();
+  for(size_t i = 0; i < writers.size(); i++)
+    writers[i].join();
+  received -= failed;
+  for(size_t i = 0; i < repairs.size(); i++) // the written files are patched in place
+    {
+      int fd = open(repairs[i].first.c_str(), O_WRONLY | O_CLOEXEC);
+      if(fd == -1) // failed to be written, already reported
+	continue;
+      if(!repairRanges(reader, repairs[i].first, repairSizes[i], fd, repairs[i].second))
+	{
+	  std::cout << repairs[i].first << ": damaged, removed" << std::endl;
+	  unlink(repairs[i].first.c_str());
+	  received--;
+	}
+      close(fd);
+    }
+  
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  std::cout << "Downloaded " << received << " of " << names.size() << " files (" << bytes << " bytes) in "
+	    << std::fixed << std::setprecision(3) << seconds << " s" << std::endl;
+  std::cout.unsetf(std::ios::floatfield);
+}// end mgetDownload
+
+/************************************************************************/
+/* Function name: mgetNameWanted                                   */
+/* Description: Tells whether a name from the server's MGET reply may  */
+/*              be written: it has to stay in the current directory    */
+/*              and match one of the patterns sent, the way the server */
+/*              matches them                                          */
+/* Parameters: const string &name- the name from the reply            */
+/*             const vector<string> &patterns- the patterns sent       */
+/* Return Value: True- If the name is safe and asked for               */
+/*               False- otherwise                                      */
+/*************************************************************************/
+bool mgetNameWanted(const std::string &name, const std::vector<std::string> &patterns)
+{
+  if(!safeArchivePath(name))
+    return false;
+  for(size_t i = 0; i < patterns.size(); i++)
+    if(patterns[i] == name || fnmatch(patterns[i].c_str(), name.c_str(), FNM_PATHNAME | FNM_PERIOD) == 0)
+      return true;
+  return false;
+}// end mgetNameWanted
+
+/************************************************************************/
+/* Function name: downloadDirectory                                 */
+/* Description: Downloads a directory tree with one command. The       */
+/*              server walks it and streams it as a tar archive, which */
+/*              is unpacked as it arrives: nothing is kept in memory  */
+/*              and no .tar file is written. A local directory of the */
+/*              same name is asked about once.                         */
+/* Parameters: FrameReader &reader- connection to the server   */
+/*             const string &dirName- directory on the server        */
+/* Return Value: Nothing */
+/*************************************************************************/
+void downloadDirectory(FrameReader &reader, const std::string &dirName)
+{
+  struct stat localStat; // is the directory already here
+  FrameEvent event; // piece of the reply received
+  int kind; // what readFrameEvent reported
+  
+  auto started = std::chrono::steady_clock::now();
+  sendToServer(reader.sockfd, ("download-dir " + dirName).c_str());
+  
+  // "ARCHIVE <name>" or why the directory can't be sent
+  std::string reply;
+  if(readFrameEvent(reader, event) != FRAME_BEGIN || event.header.type != FRAME_MSG)
+    {
+      perror("Error receiving message: " ) ;
+      exit(-1);
+    }
+  while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+    reply.append(event.data, event.length);
+  if(reply.compare(0, 8, "ARCHIVE ") != 0)
+    {
+      std::cout << reply << std::endl;
+      return;
+    }
+  std::string root = reply.substr(8);
+  
+  TarUnpacker unpacker;
+  unpacker.blockFill = 0;
+  unpacker.paxPending = false;
+  unpacker.contentsLeft = unpacker.paddingLeft = 0;
+  unpacker.fd = -1;
+  unpacker.discard = false;
+  unpacker.finished = false;
+  unpacker.files = unpacker.bytes = 0;
+  if(stat(root.c_str(), &localStat) == 0)
+    {
+      std::string answer;
+      std::cout << root << " already exists, replace the files in it? (y/n): ";
+      std::cin >> answer;
+      unpacker.discard = modifyInput(answer) != "y";
+    }
+  
+  // Data frames until an empty one, together they are the archive
+  bool unpacked = true;
+  while(true)
+    {
+      kind = readFrameEvent(reader, event);
+      if(kind != FRAME_BEGIN || event.header.type != FRAME_DATA)
+	{
+	  perror("Error receiving archive: " ) ;
+	  exit(-1);
+	}
+      if(event.header.length == 0)
+	break;
+      while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+	if(unpacked && !unpackTar(unpacker, event.data, event.length))
+	  unpacked = false; // keep reading to the end of the archive, the connection stays usable
+      if(kind != FRAME_END)
+	{
+	  perror("Error receiving archive: " ) ;
+	  exit(-1);
+	}
+    }//end while
+  readFrameEvent(reader, event); // the end of the empty frame
+  if(unpacker.fd != -1)
+    close(unpacker.fd);
+  
+  if(unpacker.discard)
+    return;
+  if(!unpacked || !unpacker.finished)
+    std::cout << "The archive of " << root << " is damaged, it was only partly unpacked" << std::endl;
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  std::cout << "Unpacked " << unpacker.files << " files (" << unpacker.bytes << " bytes) into " << root << " in "
+	    << std::fixed << std::setprecision(3) << seconds << " s" << std::endl;
+  std::cout.unsetf(std::ios::floatfield);
+}// end downloadDirectory
+
+/************************************************************************/
+/* Function name: unpackTar                                         */
+/* Description: Unpacks the next bytes of an archive: headers are     */
+/*              collected a block at a time, file contents are written */
+/*              straight to the file as they come                      */
+/* Parameters: TarUnpacker &unpacker- the archive being unpacked     */
+/*             const char *data- the bytes                             */
+/*             size_t length- number of bytes at data                  */
+/* Return Value: True- If the bytes were used                          */
+/*               False- If a header is damaged (nothing more can be   */
+/*                      unpacked)                                      */
+/*************************************************************************/
+bool unpackTar(TarUnpacker &unpacker, const char *data, size_t length)
+{
+  while(length > 0)
+    {
+      if(unpacker.contentsLeft > 0) // contents of a file (or of a pax extended header)
+	{
+	  size_t piece = std::min((uint64_t)length, unpacker.contentsLeft);
+	  if(unpacker.entry.type == TAR_TYPE_PAX)
+	    unpacker.pax.append(data, piece);
+	  else if(unpacker.fd != -1 && write(unpacker.fd, data, piece) != (ssize_t)piece)
+	    {
+	      perror(("Error writing " + unpacker.entry.path).c_str());
+	      close(unpacker.fd);
+	      unlink((unpacker.entry.path + ".part").c_str());
+	      unpacker.fd = -1;
+	    }
+	  data += piece;
+	  length -= piece;
+	  unpacker.contentsLeft -= piece;
+	  if(unpacker.contentsLeft == 0)
+	    finishTarEntry(unpacker);
+	  continue;
+	}
+      if(unpacker.paddingLeft > 0)
+	{
+	  size_t piece = std::min(length, unpacker.paddingLeft);
+	  data += piece;
+	  length -= piece;
+	  unpacker.paddingLeft -= piece;
+	  continue;
+	}
+      
+      // A header block
+      size_t piece = std::min(length, TAR_BLOCK_SIZE - unpacker.blockFill);
+      memcpy(unpacker.block + unpacker.blockFill, data, piece);
+      data += piece;
+      length -= piece;
+      unpacker.blockFill += piece;
+      if(unpacker.blockFill < TAR_BLOCK_SIZE)
+	continue;
+      unpacker.blockFill = 0;
+      if(unpacker.finished)
+	continue; // the second zero block
+      
+      TarEntry entry;
+      if(!decodeTarHeader(unpacker.block, entry))
+	{
+	  char zeros[TAR_BLOCK_SIZE] = {0};
+	  if(memcmp(unpacker.block, zeros, TAR_BLOCK_SIZE) != 0)
+	    return false;
+	  unpacker.finished = true;
+	  continue;
+	}
+      if(entry.type == TAR_TYPE_PAX)
+	unpacker.pax.clear();
+      else if(unpacker.paxPending)
+	{
+	  applyPaxRecords(unpacker.pax, entry);
+	  unpacker.paxPending = false;
+	}
+      unpacker.entry = entry;
+      unpacker.contentsLeft = entry.type == TAR_TYPE_FILE || entry.type == TAR_TYPE_PAX ? entry.size : 0;
+      unpacker.paddingLeft = tarPadding(unpacker.contentsLeft);
+      startTarEntry(unpacker);
+      if(unpacker.contentsLeft == 0)
+	finishTarEntry(unpacker);
+    }//end while
+  return true;
+}// end unpackTar
+
+/************************************************************************/
+/* Function name: startTarEntry                                     */
+/* Description: Creates the directory a header describes, or opens   */
+/*              <file>.part for the contents of a file. Entries with  */
+/*              unsafe paths and other types are skipped.             */
+/* Parameters: TarUnpacker &unpacker- entry is the new header        */
+/* Return Value: Nothing */
+/*************************************************************************/
+void startTarEntry(TarUnpacker &unpacker)
+{
+  const TarEntry &entry = unpacker.entry;
+  
+  unpacker.fd = -1;
+  if(unpacker.discard || entry.type == TAR_TYPE_PAX)
+    return;
+  if(!safeArchivePath(entry.path))
+    {
+      std::cout << "Skipped " << entry.path << ": it would be written outside of the directory" << std::endl;
+      return;
+    }
+  if(entry.type == TAR_TYPE_DIR)
+    {
+      if(mkdir(entry.path.c_str(), (entry.mode & 0777) | 0700) == -1 && errno != EEXIST)
+	perror(("Error creating " + entry.path).c_str());
+    }
+  else if(entry.type == TAR_TYPE_FILE)
+    {
+      unpacker.fd = open((entry.path + ".part").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      if(unpacker.fd == -1)
+	perror(("Error opening " + entry.path + ".part").c_str());
+    }
+  else
+    std::cout << "Skipped " << entry.path << ": not a file or a directory" << std::endl;
+}// end startTarEntry
+
+/************************************************************************/
+/* Function name: finishTarEntry                                    */
+/* Description: Gives a file its mode and modification time and       */
+/*              renames it from <file>.part once its contents are in,  */
+/*              keeps the records of a pax header for the next entry   */
+/* Parameters: TarUnpacker &unpacker- entry is complete              */
+/* Return Value: Nothing */
+/*************************************************************************/
+void finishTarEntry(TarUnpacker &unpacker)
+{
+  const TarEntry &entry = unpacker.entry;
+  
+  if(entry.type == TAR_TYPE_PAX)
+    {
+      unpacker.paxPending = true;
+      return;
+    }
+  if(unpacker.fd == -1)
+    return;
+  
+  struct timespec times[2]; // access and modification time
+  times[0].tv_sec = times[1].tv_sec = entry.mtime;
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+  fchmod(unpacker.fd, entry.mode & 0777);
+  futimens(unpacker.fd, times);
+  close(unpacker.fd);
+  unpacker.fd = -1;
+  if(rename((entry.path + ".part").c_str(), entry.path.c_str()) == -1)
+    {
+      perror(("Error renaming " + entry.path + ".part").c_str());
+      return;
+    }
+  unpacker.files++;
+  unpacker.bytes += entry.size;
+}// end finishTarEntry
+
+/************************************************************************/
+/* Function name: safeArchivePath                                   */
+/* Description: Tells whether a path from an archive stays inside the */
+/*              directory it is unpacked in                            */
+/* Parameters: const string &path- the path of an entry               */
+/* Return Value: True- If it is relative and has no ".." part          */
+/*               False- otherwise                                      */
+/*************************************************************************/
+bool safeArchivePath(const std::string &path)
+{
+  if(path.empty() || path[0] == '/')
+    return false;
+  std::istringstream parts(path);
+  std::string part;
+  while(std::getline(parts, part, '/'))
+    if(part == "..")
+      return false;
+  return true;
+}// end safeArchivePath
+
+/************************************************************************/
+/* Function name: sendOnStream                                      */
+/* Description: Sends a command flagged FRAME_FLAG_STREAM, its answer  */
+/*              comes back in frames carrying the same stream id       */
+/* Parameters: const int sockfd- socket file descriptor  */
+/*             uint32_t stream- id of the stream, never 0             */
+/*             const string &command- the command ("get <file>", "dir") */
+/* Return Value: Nothing */
+/*************************************************************************/
+void sendOnStream(const int sockfd, uint32_t stream, const std::string &command)
+{
+  std::string payload(STREAM_ID_SIZE, '\0');
+  encodeBigEndian(&payload[0], stream, STREAM_ID_SIZE);
+  payload += command;
+  
+  if(!sendFrameHeader(sockfd, FRAME_MSG, FRAME_FLAG_STREAM, payload.length())
+     || !sendAll(sockfd, payload.data(), payload.length()))
+    {
+      perror("Error sending message: " ) ;
+      exit(-1);
+    }
+  std::cerr << "Message sent to server on stream " << stream << ": \"" << command << "\"" << std::endl;
+}//end sendOnStream
+
+/************************************************************************/
+/* Function name: multiDownload                                     */
+/* Description: Downloads many files over this connection at the same  */
+/*              time: each "get <file>" goes out on a stream of its own */
+/*              and the server sends the files in chunks taking turns, */
+/*              so a small file is done long before a big one sent     */
+/*              with it. At most MAX_STREAMS requests are in flight,   */
+/*              the next one goes out as soon as one is done. ":dir",  */
+/*              ":pwd" and ":stats" among the files run that command.  */
+/*              Each file is written to <file>.part and renamed once   */
+/*              complete.                                             */
+/* Parameters: FrameReader &reader- connection to the server   */
+/*             const vector<string> &requests- files and :commands  */
+/* Return Value: Nothing */
+/*************************************************************************/
+void multiDownload(FrameReader &reader, const std::vector<std::string> &requests)
+{
+  struct Stream
+  {
+    std::string name; // file asked for, or the command
+    bool isFile;
+    std::ofstream outfile; // the file's .part, opened on its first data frame
+    std::string message; // text of a message answer
+    long long bytes; // bytes of the file received
+  };
+  std::vector<std::string> wanted; // files and commands to ask for
+  std::map<uint32_t, Stream> streams; // requests in flight by stream id
+  struct stat localStat; // is the file already here
+  FrameEvent event; // piece of the reply received
+  int kind; // what readFrameEvent reported
+  
+  // Ask about existing files once for the whole batch, like pipeline
+  size_t existing = 0;
+  for(size_t i = 0; i < requests.size(); i++)
+    if(requests[i][0] != ':' && stat(requests[i].c_str(), &localStat) == 0)
+      existing++;
+  bool overwrite = false;
+  if(existing > 0)
+    {
+      std::string answer;
+      std::cout << existing << " of the files already exist, overwrite them? (y/n): ";
+      std::cin >> answer;
+      overwrite = modifyInput(answer) == "y";
+    }
+  for(size_t i = 0; i < requests.size(); i++)
+    if(requests[i][0] == ':' || overwrite || stat(requests[i].c_str(), &localStat) == -1)
+      wanted.push_back(requests[i]);
+  
+  auto started = std::chrono::steady_clock::now();
+  size_t next = 0; // next request to send
+  size_t received = 0, files = 0; // files downloaded, files asked for
+  long long bytes = 0; // bytes of them
+  while(next < wanted.size() || !streams.empty())
+    {
+      // Keep the window full
+      while(next < wanted.size() && streams.size() < MAX_STREAMS)
+	{
+	  uint32_t id = next + 1;
+	  Stream &stream = streams[id];
+	  stream.isFile = wanted[next][0] != ':';
+	  stream.name = stream.isFile ? wanted[next] : wanted[next].substr(1);
+	  stream.bytes = 0;
+	  files += stream.isFile;
+	  sendOnStream(reader.sockfd, id, stream.isFile ? "get " + stream.name : stream.name);
+	  next++;
+	}
+      
+      kind = readFrameEvent(reader, event);
+      if(kind != FRAME_BEGIN || !(event.header.flags & FRAME_FLAG_STREAM))
+	{
+	  perror("Error receiving file: " ) ;
+	  exit(-1);
+	}
+      bool isData = event.header.type == FRAME_DATA;
+      bool last = event.header.flags & FRAME_FLAG_END;
+      
+      // The payload starts with the stream id, it may come in more than one piece
+      char idBytes[STREAM_ID_SIZE];
+      size_t idLength = 0;
+      Stream *stream = NULL;
+      while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+	{
+	  const char *data = event.data;
+	  size_t length = event.length;
+	  while(idLength < STREAM_ID_SIZE && length > 0)
+	    {
+	      idBytes[idLength++] = *data++;
+	      length--;
+	    }
+	  if(idLength < STREAM_ID_SIZE)
+	    continue;
+	  if(stream == NULL)
+	    {
+	      auto found = streams.find(decodeBigEndian(idBytes, STREAM_ID_SIZE));
+	      if(found == streams.end())
+		{
+		  std::cout << "Frame received for an unknown stream" << std::endl;
+		  exit(-1);
+		}
+	      stream = &found->second;
+	      if(isData && !stream->outfile.is_open())
+		{
+		  stream->outfile.open(stream->name + ".part", std::ios::binary | std::ios::trunc);
+		  if(!stream->outfile)
+		    {
+		      perror(("Error opening " + stream->name + ".part").c_str());
+		      exit(-1);
+		    }
+		}
+	    }
+	  if(isData)
+	    {
+	      stream->outfile.write(data, length); // Write the chunk out right away
+	      stream->bytes += length;
+	    }
+	  else
+	    stream->message.append(data, length);
+	}
+      if(kind != FRAME_END || stream == NULL)
+	{
+	  perror("Error receiving file: " ) ;
+	  exit(-1);
+	}
+      if(!last)
+	continue;
+      
+      // The stream is done
+      if(stream->outfile.is_open())
+	{
+	  stream->outfile.close();
+	  std::string partName = stream->name + ".part";
+	  if(!stream->outfile || rename(partName.c_str(), stream->name.c_str()) == -1)
+	    {
+	      perror(("Error receiving " + stream->name).c_str());
+	      exit(-1);
+	    }
+	  received++;
+	  bytes += stream->bytes;
+	  std::cout << stream->name << ": " << stream->bytes << " bytes" << std::endl;
+	}
+      else if(stream->isFile) // the file couldn't be sent
+	std::cout << stream->name << ": " << stream->message << std::endl;
+      else
+	std::cout << stream->message << std::endl;
+      streams.erase(decodeBigEndian(idBytes, STREAM_ID_SIZE));
+    }//end while
+  
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  std::cout << "Downloaded " << received << " of " << files << " files (" << bytes << " bytes) in "
+	    << std::fixed << std::setprecision(3) << seconds << " s" << std::endl;
+  std::cout.unsetf(std::ios::floatfield);
+}// end multiDownload
+
+/************************************************************************/
+/* Function name: statBatch                                         */
+/* Description: Asks for the type, size, mtime and inode of every path */
+/*              in one round trip: "stat-batch" and the '\0' separated */
+/*              paths go out together, one data frame of StatRecords */
+/*              (see protocol.h) comes back                            */
+/* Parameters: FrameReader &reader- connection to the server   */
+/*             const vector<string> &paths- paths relative to the    */
+/*                            server's working directory            */
+/* Return Value: Nothing */
+/*************************************************************************/
+void statBatch(FrameReader &reader, const std::vector<std::string> &paths)
+{
+  static const char *typeNames[] = { "-", "file", "dir", "other" }; // by STAT_TYPE_*
+  std::string list; // the paths, each ended by '\0'
+  FrameEvent event; // piece of the reply received
+  int kind; // what readFrameEvent reported
+  
+  if(paths.empty() || paths.size() > STAT_BATCH_MAX)
+    {
+      std::cout << "Give between 1 and " << STAT_BATCH_MAX << " paths" << std::endl;
+      return;
+    }
+  for(size_t i = 0; i < paths.size(); i++)
+    list.append(paths[i].c_str(), paths[i].length() + 1);
+  if(list.length() > STAT_BATCH_BYTES)
+    {
+      std::cout << "The paths are longer than " << STAT_BATCH_BYTES << " bytes altogether" << std::endl;
+      return;
+    }
+  
+  sendToServer(reader.sockfd, "stat-batch");
+  if(!sendFrameHeader(reader.sockfd, FRAME_DATA, 0, list.length()) || !sendAll(reader.sockfd, list.data(), list.length()))
+    {
+      perror("Error sending message: " ) ;
+      exit(-1);
+    }
+  
+  kind = readFrameEvent(reader, event);
+  if(kind != FRAME_BEGIN)
+    {
+      perror("Error receiving message: " ) ;
+      exit(-1);
+    }
+  if(event.header.type == FRAME_MSG) // the server refused the batch
+    {
+      std::string message;
+      while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+	message.append(event.data, event.length);
+      std::cout << "Message from server: \"" << message << "\"" << std::endl;
+      return;
+    }
+  
+  std::string records; // every record of the reply
+  while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+    records.append(event.data, event.length);
+  if(kind != FRAME_END || records.length() != paths.size() * STAT_RECORD_SIZE)
+    {
+      std::cout << "Server sent a bad stat-batch reply" << std::endl;
+      exit(-1);
+    }
+  
+  for(size_t i = 0; i < paths.size(); i++)
+    {
+      StatRecord record = decodeStatRecord(records.data() + i * STAT_RECORD_SIZE);
+      if(record.error != 0)
+	{
+	  std::cout << paths[i] << ": " << strerror(record.error) << std::endl;
+	  continue;
+	}
+      char modified[32]; // mtime as text
+      time_t seconds = (time_t)record.mtimeSeconds;
+      strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+      std::cout << std::left << std::setw(6) << typeNames[record.type < 4 ? record.type : 3] << std::right
+		<< std::setw(14) << record.size << "  " << modified << "  " << std::setw(10) << record.inode
+		<< "  " << paths[i] << std::endl;
+    }//end for
+}// end statBatch
+
+/************************************************************************/
+/* Function name: modifyInput                                        */
+/* Description: Changes whatever user input was to be all lowercase   */
+/* Parameters: string input-  The user input    */
+/* Return Value: string - the new string that will be users input all  */
+/*                        lowercase */
+/*************************************************************************/  
+std::string modifyInput(std::string input)
+{
+  
+  std::string message;  
+  for(int i =0; i < input.length(); i++)
+    {//loop through string and make every character lowercase
+      message.push_back(std::tolower(input[i]));
+    } // end for 
+  return message ;  
+}
+
+/************************************************************************/
+/* Function name: connectToServer                                       */
+/* Description: Opens a connection to the server                        */
+/* Parameters: const sockaddr_in &servaddr- address of the server       */
+/* Return Value: int- the connected socket (exits on failure)           */
+/*************************************************************************/
+int connectToServer(const struct sockaddr_in &servaddr)
+{
+  int sockfd; //socket descriptor
+  
+  if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) //create a socket
+    { 
+      perror("Error creating socket " ) ;
+      exit(-1);
+    } // end if 
+  
+  //connecting to server
+  if(connect(sockfd, (const struct sockaddr *) &servaddr, sizeof(servaddr)) == -1 )
+    {  // error
+      perror("Error connecting to server ");
+      exit(-1);
+    }//end if   
+  return sockfd;
+} // end connectToServer
+
+/************************************************************************/
+/* Function name: confirmOverwrite                                      */
+/* Description: Asks the user before a local file is replaced           */
+/* Parameters: const std::string &fileName- file about to be downloaded */
+/* Return Value: True- if the file isn't there or may be replaced       */
+/*               False- if the user wants to keep it                    */
+/*************************************************************************/
+bool confirmOverwrite(const std::string &fileName)
+{
+  std::ifstream infile(fileName);
+  if(!infile.good()) // a file that isn't on the client yet is always downloaded
+    return true;
+  infile.close(); // done checking
+  
+  //prompt user to overwrite file or not
+  std::cout << "File Exists locally do you wish to overwrite file? (y/n)" << std::endl;
+  std::string response;
+  std::cin >> response ;
+  std::string lowResponse = modifyInput(response); // Make whatever user enters lowercase
+  
+  while(lowResponse != "y" && lowResponse != "n")
+    { // validate user input
+      std::cout << "Please enter (y/n) " << std::endl;
+      std::cin >> lowResponse ;
+    }// end while
+  return lowResponse == "y";
+} // end confirmOverwrite
+
+/************************************************************************/
+/* Function name: downloadFile                                          */
+/* Description: Answers the server's READY and receives the file into   */
+/*              <fileName>.part, renamed to fileName once complete. If  */
+/*              a .part is left from an interrupted download only the  */
+/*              bytes after it are asked for (RANGE) and appended.      */
+/* Parameters: FrameReader &reader- connection to the server            */
+/*             const std::string &fileName- file being downloaded       */
+/*             long long fileSize- size announced by the server         */
+/* Return Value: True- If the file was downloaded                       */
+/*               False- If it was damaged and couldn't be repaired      */
+/*************************************************************************/
+bool downloadFile(FrameReader &reader, const std::string &fileName, long long fileSize)
+{
+  std::string partName = fileName + ".part"; // bytes received so far
+  struct stat partStat; // size of an earlier partial download
+  long long offset = 0; // first byte to ask for
+  
+  // A .part bigger than the file can't be a piece of it, start over
+  if(stat(partName.c_str(), &partStat) == 0 && partStat.st_size <= fileSize)
+    offset = partStat.st_size;
+  
+  std::ofstream outfile(partName, std::ios::binary | (offset > 0 ? std::ios::app : std::ios::trunc));
+  if(!outfile)
+    {
+      perror(("Error opening " + partName).c_str());
+      exit(-1);
+    }
+  
+  if(offset > 0)
+    {
+      std::cout << "Resuming \"" << fileName << "\" at byte " << offset << std::endl;
+      sendToServer(reader.sockfd, ("RANGE " + std::to_string(offset)).c_str());
+    }
+  else
+    sendToServer(reader.sockfd, "READY"); // Send ready message to begin download
+  
+  ByteRanges damaged; // chunks whose CRC32C didn't match
+  recvFileChunked(reader, outfile, fileSize - offset, offset, damaged); // Receiving file straight to disk
+  outfile.close(); // close output file
+  
+  const char *success = "File received  Successfully";
+  sendToServer(reader.sockfd, success);
+  
+  if(!damaged.empty())
+    {
+      int fd = open(partName.c_str(), O_WRONLY | O_CLOEXEC);
+      bool repaired = fd != -1 && repairRanges(reader, fileName, fileSize, fd, damaged);
+      if(fd != -1)
+	close(fd);
+      if(!repaired) // a .part with damage in it must not be resumed from
+	{
+	  std::cout << "File: \"" << fileName << "\" is damaged, removed" << std::endl;
+	  unlink(partName.c_str());
+	  return false;
+	}
+    }
+  
+  if(rename(partName.c_str(), fileName.c_str()) == -1)
+    {
+      perror(("Error renaming " + partName).c_str());
+      exit(-1);
+    }
+  return true;
+} // end downloadFile
+
+/************************************************************************/
+/* Function name: parallelDownload                                      */
+/* Description: Splits a file into byte ranges and fetches them over    */
+/*              several connections at once, so one TCP stream's window */
+/*              doesn't limit a long distance download. This connection */
+/*              fetches the first range, every other range gets its own */
+/*              connection and thread. Each range is written straight   */
+/*              to its offset of <fileName>.part (allocated up front),  */
+/*              renamed to fileName once every range is in.             */
+/* Parameters: FrameReader &reader- connection to the server            */
+/*             char server_reply[] - char array message received       */
+/*             const sockaddr_in &servaddr- server address             */
+/*             const std::string &fileName- file to download            */
+/*             int connections- how many connections to use             */
+/* Return Value: Nothing */
+/*************************************************************************/
+void parallelDownload(FrameReader &reader, char server_reply[], const struct sockaddr_in &servaddr,
+		      const std::string &fileName, int connections)
+{
+  const int sockfd = reader.sockfd; // socket connected to the server
+  std::string path = fileName; // the file as the other connections have to ask for it
+  
+  // New connections start in the server's directory, not in the one this connection cd'ed to
+  if(fileName[0] != '/')
+    {
+      sendToServer(sockfd, "pwd");
+      recvFromServer(reader, server_reply, 0);
+      path = std::string(server_reply) + "/" + fileName;
+    }
+  
+  sendToServer(sockfd, "download"); //Sending command 
+  recvFromServer(reader, server_reply,1); // receiving which file user wishes to downloaded
+  sendToServer(sockfd, fileName.c_str()); // sending file to be downloaded
+  recvFromServer(reader, server_reply,1);// receiving if file exists or not
+  if(strncmp(server_reply, "READY ", 6) != 0)
+    return; // the server said why
+  long long fileSize = atoll(server_reply + 6); // size announced after READY
+  
+  std::string partName = fileName + ".part"; // bytes received so far
+  int fd = -1; // file the ranges are written into
+  if(confirmOverwrite(fileName) && (fd = open(partName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+    perror(("Error opening " + partName).c_str());
+  if(fd == -1) // Do not overwrite file
+    {
+      sendToServer(sockfd, "STOP");
+      recvFromServer(reader, server_reply,1);
+      return;
+    }
+  // Reserve the whole file up front, so the ranges land in place without fragmenting it
+  if(fileSize > 0 && posix_fallocate(fd, 0, fileSize) != 0 && ftruncate(fd, fileSize) == -1)
+    perror(("Error allocating " + partName).c_str());
+  
+  // Ranges smaller than a chunk aren't worth a connection
+  long long rangeSize = (fileSize + connections - 1) / connections;
+  if(rangeSize < CHUNK_SIZE)
+    rangeSize = CHUNK_SIZE;
+  int numRanges = fileSize == 0 ? 1 : (fileSize + rangeSize - 1) / rangeSize;
+  
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for(int i = 1; i < numRanges; i++)
+    {
+      long long offset = i * rangeSize;
+      workers.push_back(std::thread(fetchSegment, std::cref(servaddr), path, fileSize, fd, offset,
+				    std::min(rangeSize, fileSize - offset)));
+    }
+  
+  // The first range comes over this connection
+  long long firstLength = std::min(rangeSize, fileSize);
+  ByteRanges damaged; // chunks of the first range whose CRC32C didn't match
+  sendToServer(sockfd, ("RANGE 0 " + std::to_string(firstLength)).c_str());
+  recvFileRange(reader, fd, 0, firstLength, damaged);
+  sendToServer(sockfd, "File received  Successfully");
+  if(!repairRanges(reader, fileName, fileSize, fd, damaged))
+    {
+      std::cout << "Range at byte 0 is damaged" << std::endl;
+      exit(-1);
+    }
+  
+  for(size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  
+  if(close(fd) == -1 || rename(partName.c_str(), fileName.c_str()) == -1)
+    {
+      perror(("Error saving " + partName).c_str());
+      exit(-1);
+    }
+  std::cout << "File: \"" << fileName <<  "\" Downloaded! " << fileSize << " bytes over " << numRanges
+	    << " connection(s) in " << std::fixed << std::setprecision(3) << seconds << " s ("
+	    << std::setprecision(2) << (seconds > 0 ? fileSize / seconds / 1e6 : 0) << " MB/s)" << std::endl;
+  std::cout.unsetf(std::ios::floatfield);
+} // end parallelDownload
+
+/************************************************************************/
+/* Function name: fetchSegment                                          */
+/* Description: Runs one range of a parallel download on a connection   */
+/*              of its own: asks for the file by its full path, checks  */
+/*              it is the file the first connection was offered, takes  */
+/*              its range and says goodbye                              */
+/* Parameters: const sockaddr_in &servaddr- server address             */
+/*             std::string path- full path of the file on the server    */
+/*             long long fileSize- size the first connection was told   */
+/*             int fd- file the range is written into                   */
+/*             long long offset- first byte of the range                */
+/*             long long length- bytes in the range                     */
+/* Return Value: Nothing */
+/*************************************************************************/
+void fetchSegment(const struct sockaddr_in &servaddr, std::string path, long long fileSize, int fd,
+		  long long offset, long long length)
+{
+  char server_reply[MAX_MSG_SIZE] = {'\0'}; // buffer of this connection
+  int sockfd = connectToServer(servaddr);
+  FrameReader reader(sockfd);
+  
+  recvFromServer(reader, server_reply, 0); // hello message
+  if(verifyChecksums)
+    negotiateChecksums(reader);
+  sendToServer(sockfd, "download");
+  recvFromServer(reader, server_reply, 0); // file name prompt
+  sendToServer(sockfd, path.c_str());
+  recvFromServer(reader, server_reply, 0);
+  if(strncmp(server_reply, "READY ", 6) != 0 || atoll(server_reply + 6) != fileSize)
+    {
+      std::cout << "Range at byte " << offset << " failed, server answered: \"" << server_reply << "\"" << std::endl;
+      exit(-1);
+    }
+  
+  ByteRanges damaged; // chunks whose CRC32C didn't match
+  sendToServer(sockfd, ("RANGE " + std::to_string(offset) + " " + std::to_string(length)).c_str());
+  recvFileRange(reader, fd, offset, length, damaged);
+  sendToServer(sockfd, "File received  Successfully");
+  if(!repairRanges(reader, path, fileSize, fd, damaged))
+    {
+      std::cout << "Range at byte " << offset << " is damaged" << std::endl;
+      exit(-1);
+    }
+  
+  sendToServer(sockfd, "bye");
+  recvFromServer(reader, server_reply, 0);
+  close(sockfd);
+} // end fetchSegment
+
+/************************************************************************/
+/* Function name: recvFileRange                                         */
+/* Description: Receive a range of a file from the server and write     */
+/*              each chunk to its place in the file with pwrite(), so   */
+/*              several ranges can be written at once                   */
+/* Parameters: FrameReader &reader- connection to the server            */
+/*             int fd- open file the bytes go into                      */
+/*             long long offset- where the range starts in the file     */
+/*             long long length- number of bytes asked for              */
+/*             ByteRanges &damaged- filled with chunks whose CRC32C     */
+/*                                  didn't match                        */
+/* Return Value: Nothing */
+/*************************************************************************/
+void recvFileRange(FrameReader &reader, int fd, long long offset, long long length, ByteRanges &damaged)
+{
+  FrameEvent event; // piece of the data frame received
+  int kind; // what readFrameEvent reported
+  ChunkSums sums; // CRC32Cs of what is written
+  long long start = offset; // where the range begins
+  
+  kind = readFrameEvent(reader, event);
+  if(kind != FRAME_BEGIN || event.header.type != FRAME_DATA || event.header.length != (uint64_t)length)
+    {
+      if(kind == FRAME_FAILED)
+	perror("Error receiving file: " ) ;
+      else
+	std::cout << "Server did not send the range that was asked for" << std::endl;
+      exit(-1);
+    }//end if
+  
+  while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+    {
+      sums.add(event.data, event.length);
+      size_t written = 0; // of this chunk
+      while(written < event.length)
+	{
+	  ssize_t result = pwrite(fd, event.data + written, event.length - written, offset);
+	  if(result == -1)
+	    {
+	      perror("Error writing file: ");
+	      exit(-1);
+	    }//end if
+	  written += result;
+	  offset += result;
+	}//end while
+    }//end while
+  
+  if(kind != FRAME_END) // Server went away in the middle of the range
+    {
+      if(kind == FRAME_FAILED)
+	perror("Error receiving file: " ) ;
+      else
+	std::cout << "Connection closed with " << reader.parser.remaining() << " bytes of the range missing" << std::endl;
+      exit(-1);
+    }//end if
+  if(verifyChecksums && !recvChecksums(reader, sums, start, damaged))
+    exit(-1);
+} // end recvFileRange
+
+/************************************************************************/
+/* Function name: recvFileChunked                                       */
+/* Description: Receive a file of a known size from the server and      */
+/*              write each chunk to disk as soon as it arrives, so the  */
+/*              memory used does not grow with the size of the file     */
+/* Parameters: FrameReader &reader- connection to the server            */
+/*             std::ofstream &outfile- open file the bytes go into      */
+/*             long long fileSize- number of bytes announced by server  */
+/*             long long offset- where they start in the file           */
+/*             ByteRanges &damaged- filled with chunks whose CRC32C     */
+/*                                  didn't match                        */
+/* Return Value: Nothing */
+/*************************************************************************/
+void recvFileChunked(FrameReader &reader, std::ofstream &outfile, long long fileSize, long long offset,
+		     ByteRanges &damaged)
+{
+  FrameEvent event; // piece of the data frame received
+  int kind; // what readFrameEvent reported
+  
+  kind = readFrameEvent(reader, event);
+  if(kind != FRAME_BEGIN || event.header.type != FRAME_DATA
+     || (!(event.header.flags & FRAME_FLAG_COMPRESSED) && event.header.length != (uint64_t)fileSize))
+    {
+      if(kind == FRAME_FAILED)
+	perror("Error receiving file: " ) ;
+      else
+	std::cout << "Server did not send the file that was announced" << std::endl;
+      exit(-1);
+    }//end if
+  
+  ChunkSums sums; // CRC32Cs of what is written
+  ChecksumBuf checksummed(outfile.rdbuf(), sums);
+  std::ostream out(&checksummed);
+  long long received = recvFileBody(reader, event, out); // Written out chunk by chunk
+  if(received == -1)
+    exit(-1);
+  if(!out || !outfile)
+    {
+      perror("Error writing file: ");
+      exit(-1);
+    }//end if
+  if(received != fileSize)
+    {
+      std::cout << "Server sent " << received << " bytes instead of the " << fileSize << " announced" << std::endl;
+      exit(-1);
+    }//end if
+  if(verifyChecksums && !recvChecksums(reader, sums, offset, damaged))
+    exit(-1);
+} // end recvFileChunked
+
+/************************************************************************/
+/* Function name: negotiateChecksums                                    */
+/* Description: Asks the server to follow every file and range with its */
+/*              CRC32Cs, verifyChecksums tells whether it will          */
+/* Parameters: FrameReader &reader- connection to the server            */
+/* Return Value: Nothing */
+/*************************************************************************/
+void negotiateChecksums(FrameReader &reader)
+{
+  char server_reply[MAX_MSG_SIZE] = {'\0'}; // the server's answer
+  
+  sendToServer(reader.sockfd, "checksum crc32c");
+  recvFromServer(reader, server_reply, 0);
+  verifyChecksums = strcmp(server_reply, "CHECKSUM crc32c") == 0;
+} // end negotiateChecksums
+
+/************************************************************************/
+/* Function name: recvChecksums                                         */
+/* Description: Receives the FRAME_CHECKSUM frame that follows a file   */
+/*              or range and compares it with the CRC32Cs of the bytes  */
+/*              received. A chunk whose CRC differs is damaged; if the  */
+/*              CRCs can't be matched up at all everything is           */
+/* Parameters: FrameReader &reader- connection to the server            */
+/*             const ChunkSums &sums- CRC32Cs of the bytes received     */
+/*             long long offset- where the bytes start in the file      */
+/*             ByteRanges &damaged- the damaged chunks are added to it  */
+/* Return Value: True- If the frame was received (damaged or not)       */
+/*               False- If the connection failed (already reported)     */
+/*************************************************************************/
+bool recvChecksums(FrameReader &reader, const ChunkSums &sums, long long offset, ByteRanges &damaged)
+{
+  FrameEvent event; // piece of the frame received
+  int kind; // what readFrameEvent reported
+  std::string payload; // chunk size, whole CRC, chunk CRCs
+  
+  kind = readFrameEvent(reader, event);
+  if(kind != FRAME_BEGIN || event.header.type != FRAME_CHECKSUM || event.header.length > (1 << 24))
+    {
+      if(kind == FRAME_FAILED)
+	perror("Error receiving checksums: " ) ;
+      else
+	std::cout << "Server did not send the checksums of the file" << std::endl;
+      return false;
+    }//end if
+  while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+    payload.append(event.data, event.length);
+  if(kind != FRAME_END)
+    {
+      perror("Error receiving checksums: " ) ;
+      return false;
+    }//end if
+  
+  std::vector<uint32_t> received = sums.crcs; // the chunk CRCs of what came in, the last partial one too
+  if(sums.fill > 0)
+    received.push_back(sums.current);
+  uint32_t whole = 0;
+  for(size_t i = 0; i < received.size(); i++)
+    whole = crc32cCombine(whole, received[i], std::min((uint64_t)CHECKSUM_CHUNK_SIZE, sums.total - i * CHECKSUM_CHUNK_SIZE));
+  
+  if(payload.length() < 8 || decodeBigEndian(payload.data(), 4) != CHECKSUM_CHUNK_SIZE
+     || payload.length() != 8 + 4 * received.size())
+    {
+      damaged.push_back(std::make_pair(offset, (long long)sums.total));
+      return true;
+    }//end if
+  for(size_t i = 0; i < received.size(); i++)
+    if(decodeBigEndian(&payload[8 + 4 * i], 4) != received[i])
+      damaged.push_back(std::make_pair(offset + (long long)(i * CHECKSUM_CHUNK_SIZE),
+				       (long long)std::min((uint64_t)CHECKSUM_CHUNK_SIZE, sums.total - i * CHECKSUM_CHUNK_SIZE)));
+  if(damaged.empty() && decodeBigEndian(&payload[4], 4) != whole)
+    damaged.push_back(std::make_pair(offset, (long long)sums.total));
+  return true;
+} // end recvChecksums
+
+/************************************************************************/
+/* Function name: repairRanges                                          */
+/* Description: Fetches damaged parts of a file again with RANGE and    */
+/*              writes them over the bad bytes, up to CHECKSUM_RETRIES  */
+/*              times while they keep arriving damaged                  */
+/* Parameters: FrameReader &reader- connection to the server            */
+/*             const std::string &path- the file, as the server knows it*/
+/*             long long fileSize- its size, it must not have changed   */
+/*             int fd- the local copy                                   */
+/*             ByteRanges damaged- the parts to fetch again             */
+/* Return Value: True- If every part arrived intact (or none was bad)   */
+/*               False- otherwise                                       */
+/*************************************************************************/
+bool repairRanges(FrameReader &reader, const std::string &path, long long fileSize, int fd, ByteRanges damaged)
+{
+  char server_reply[MAX_MSG_SIZE] = {'\0'}; // the server's answers
+  
+  for(int attempt = 0; attempt < CHECKSUM_RETRIES && !damaged.empty(); attempt++)
+    {
+      ByteRanges still; // damaged again
+      for(size_t i = 0; i < damaged.size(); i++)
+	{
+	  std::cout << path << ": " << damaged[i].second << " bytes at byte " << damaged[i].first
+		    << " arrived damaged, fetching them again" << std::endl;
+	  sendToServer(reader.sockfd, "download");
+	  recvFromServer(reader, server_reply, 0); // file name prompt
+	  sendToServer(reader.sockfd, path.c_str());
+	  recvFromServer(reader, server_reply, 0);
+	  if(strncmp(server_reply, "READY ", 6) != 0 || atoll(server_reply + 6) != fileSize)
+	    {
+	      std::cout << path << " changed on the server: \"" << server_reply << "\"" << std::endl;
+	      if(strncmp(server_reply, "READY ", 6) == 0)
+		{
+		  sendToServer(reader.sockfd, "STOP");
+		  recvFromServer(reader, server_reply, 0);
+		}
+	      return false;
+	    }
+	  sendToServer(reader.sockfd, ("RANGE " + std::to_string(damaged[i].first) + " "
+				       + std::to_string(damaged[i].second)).c_str());
+	  recvFileRange(reader, fd, damaged[i].first, damaged[i].second, still);
+	  sendToServer(reader.sockfd, "File received  Successfully");
+	}
+      damaged.swap(still);
+    }
+  return damaged.empty();
+} // end repairRanges
+
+/************************************************************************/
+/* Function name: syncFile                                              */
+/* Description: Brings a local copy of a file up to date: the weak and  */
+/*              strong hash of each of its blocks go to the server,     */
+/*              which sends back the changed bytes and references to    */
+/*              the blocks it still has (see deltaSync.h). The copy is  */
+/*              rebuilt in place, blocks that didn't move aren't even   */
+/*              written. Without a local copy the whole file comes.     */
+/* Parameters: FrameReader &reader- connection to the server            */
+/*             const std::string &fileName- the file, same name on both */
+/* Return Value: Nothing */
+/*************************************************************************/
+void syncFile(FrameReader &reader, const std::string &fileName)
+{
+  char server_reply[MAX_MSG_SIZE] = {'\0'}; // the server's answer
+  FrameEvent event; // piece of the delta received
+  int kind; // what readFrameEvent reported
+  struct stat localStat; // the local copy
+  long long localSize = 0; // its size, 0 if there is none
+  
+  int fd = open(fileName.c_str(), O_RDWR | O_CLOEXEC);
+  if(fd == -1 && errno != ENOENT)
+    {
+      perror(("Error opening " + fileName).c_str());
+      return;
+    }
+  if(fd != -1)
+    {
+      if(fstat(fd, &localStat) == -1 || !S_ISREG(localStat.st_mode))
+	{
+	  std::cout << fileName << " is not a regular file" << std::endl;
+	  close(fd);
+	  return;
+	}
+      localSize = localStat.st_size;
+    }
+  
+  uint32_t blockSize = syncBlockSize(localSize); // power of two, SYNC_BLOCK_MIN at least
+  if(blockSize == 0)
+    {
+      std::cout << fileName << " is too big to be synced" << std::endl;
+      close(fd);
+      return;
+    }
+  std::string signatures(4, '\0'); // block size, then weak checksum and strong hash of each whole block
+  std::vector<char> block(blockSize); // one block of the copy
+  encodeBigEndian(&signatures[0], blockSize, 4);
+  signatures.reserve(4 + localSize / blockSize * SYNC_SIGNATURE_SIZE);
+  for(long long offset = 0; offset + blockSize <= localSize; offset += blockSize)
+    {
+      char signature[SYNC_SIGNATURE_SIZE];
+      RollingChecksum weak;
+      if(!readFully(fd, block.data(), blockSize, offset))
+	{
+	  perror(("Error reading " + fileName).c_str());
+	  close(fd);
+	  return;
+	}
+      weak.start(block.data(), blockSize);
+      encodeBigEndian(signature, weak.value(), 4);
+      encodeBigEndian(signature + 4, xxHash64(block.data(), blockSize), 8);
+      signatures.append(signature, sizeof(signature));
+    }//end for
+  
+  sendToServer(reader.sockfd, ("sync " + fileName).c_str());
+  if(!sendFrameHeader(reader.sockfd, FRAME_DATA, 0, signatures.length())
+     || !sendAll(reader.sockfd, signatures.data(), signatures.length()))
+    {
+      perror("Error sending message: " ) ;
+      exit(-1);
+    }
+  recvFromServer(reader, server_reply, 1); // SYNC <size>, or why the file can't be synced
+  if(strncmp(server_reply, "SYNC ", 5) != 0)
+    {
+      if(fd != -1)
+	close(fd);
+      return;
+    }
+  long long fileSize = atoll(server_reply + 5); // size of the file on the server
+  if(fd == -1 && (fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+    {
+      perror(("Error creating " + fileName).c_str());
+      exit(-1); // the delta is on its way and can't be skipped
+    }
+  
+  ChunkSums sums; // CRC32Cs of the rebuilt file
+  long long at = 0; // bytes of it rebuilt
+  long long literalBytes = 0, reusedBytes = 0, wireBytes = 0; // for output
+  bool last = false; // the frame flagged FRAME_FLAG_END was received
+  while(!last)
+    {
+      std::string delta; // operations of one segment
+      kind = readFrameEvent(reader, event);
+      if(kind != FRAME_BEGIN || event.header.type != FRAME_DATA || event.header.length > 2 * SYNC_SEGMENT_SIZE)
+	{
+	  if(kind == FRAME_FAILED)
+	    perror("Error receiving file: " ) ;
+	  else
+	    std::cout << "Server did not send the rest of the delta" << std::endl;
+	  exit(-1);
+	}//end if
+      last = event.header.flags & FRAME_FLAG_END;
+      while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+	delta.append(event.data, event.length);
+      if(kind != FRAME_END)
+	{
+	  if(kind == FRAME_FAILED)
+	    perror("Error receiving file: " ) ;
+	  else
+	    std::cout << "Connection closed with " << reader.parser.remaining() << " bytes of the delta missing" << std::endl;
+	  exit(-1);
+	}//end if
+      wireBytes += delta.length();
+      
+      size_t op = 0; // operation being applied
+      bool bad = false; // an operation doesn't fit the delta, the copy or the file
+      while(op < delta.length())
+	{
+	  bool isCopy = delta[op] == SYNC_OP_COPY;
+	  size_t header = isCopy ? 9 : 5;
+	  if((delta[op] != SYNC_OP_COPY && delta[op] != SYNC_OP_LITERAL) || op + header > delta.length())
+	    {
+	      bad = true;
+	      break;
+	    }
+	  uint64_t first = decodeBigEndian(&delta[op + 1], 4); // literal length, or first block of a copy
+	  uint64_t count = isCopy ? decodeBigEndian(&delta[op + 5], 4) : 0; // blocks of a copy
+	  op += header;
+	  if(!isCopy)
+	    {
+	      if(op + first > delta.length() || at + (long long)first > fileSize)
+		{
+		  bad = true;
+		  break;
+		}
+	      if(!writeFully(fd, &delta[op], first, at))
+		{
+		  perror(("Error writing " + fileName).c_str());
+		  exit(-1);
+		}
+	      sums.add(&delta[op], first);
+	      op += first;
+	      at += first;
+	      literalBytes += first;
+	      continue;
+	    }
+	  // A block is copied from where it is and rewritten in place, so it must not come from before at (those bytes
+	  // were written over already), the server never sends that
+	  if((long long)((first + count) * blockSize) > localSize || at + (long long)(count * blockSize) > fileSize
+	     || (long long)(first * blockSize) < at)
+	    {
+	      bad = true;
+	      break;
+	    }
+	  for(uint64_t i = first; i < first + count; i++, at += blockSize)
+	    {
+	      off_t from = i * blockSize; // never before at (checked above), so not written over yet
+	      if(from == at && !verifyChecksums) // already in place
+		continue;
+	      if(!readFully(fd, block.data(), blockSize, from) || (from != at && !writeFully(fd, block.data(), blockSize, at)))
+		{
+		  perror(("Error rebuilding " + fileName).c_str());
+		  exit(-1);
+		}
+	      sums.add(block.data(), blockSize);
+	    }//end for
+	  reusedBytes += count * blockSize;
+	}//end while
+      if(bad || (last && at != fileSize))
+	{
+	  std::cout << "Server sent a bad delta" << std::endl;
+	  exit(-1);
+	}//end if
+    }//end while
+  if(ftruncate(fd, fileSize) == -1)
+    {
+      perror(("Error truncating " + fileName).c_str());
+      exit(-1);
+    }
+  
+  ByteRanges damaged; // chunks whose CRC32C didn't match
+  if(verifyChecksums && !recvChecksums(reader, sums, 0, damaged))
+    exit(-1);
+  if(!repairRanges(reader, fileName, fileSize, fd, damaged))
+    {
+      std::cout << "File: \"" << fileName << "\" is damaged, removed" << std::endl;
+      unlink(fileName.c_str());
+      close(fd);
+      return;
+    }
+  close(fd);
+  std::cout << "File: \"" << fileName << "\" Synced! " << fileSize << " bytes, " << wireBytes << " bytes received ("
+	    << literalBytes << " new, " << reusedBytes << " reused)" << std::endl;
+} // end syncFile
+
+/************************************************************************/
+/* Function name: offerChunks                                           */
+/* Description: Cuts local files into content-defined chunks and tells */
+/*              the server the hashes of those it doesn't count as held */
+/*              yet with "have", CHUNK_HAVE_BYTES of hashes per "have". */
+/*              Where each chunk is is remembered, so a later "dget"   */
+/*              can copy it from there instead of receiving it.        */
+/* Parameters: FrameReader &reader- connection to the server            */
+/*             const vector<string> &paths- the local files             */
+/* Return Value: Nothing */
+/*************************************************************************/
+void offerChunks(FrameReader &reader, const std::vector<std::string> &paths)
+{
+  std::string hashes; // of chunks not offered yet
+  std::unordered_set<uint64_t> pending; // the same, to leave out repeats
+  long long files = 0, chunks = 0, offered = 0; // for output
+  
+  for(size_t i = 0; i < paths.size(); i++)
+    {
+      struct stat info; // of the file
+      std::string recipe; // its chunks
+      int fd = open(paths[i].c_str(), O_RDONLY | O_CLOEXEC);
+      if(fd == -1 || fstat(fd, &info) == -1 || !S_ISREG(info.st_mode) || !chunkFile(fd, info.st_size, recipe))
+	{
+	  if(fd == -1)
+	    perror(("Error opening " + paths[i]).c_str());
+	  else
+	    std::cout << "Skipped " << paths[i] << ": not a regular file, or it can't be read" << std::endl;
+	  if(fd != -1)
+	    close(fd);
+	  continue;
+	}
+      close(fd);
+      
+      files++;
+      chunkFiles.push_back(paths[i]);
+      long long offset = 0; // of the chunk in the file
+      for(size_t at = 0; at < recipe.length(); at += CHUNK_RECORD_SIZE)
+	{
+	  uint64_t hash = decodeBigEndian(&recipe[at], CHUNK_HASH_SIZE);
+	  uint32_t length = decodeBigEndian(&recipe[at + CHUNK_HASH_SIZE], 4);
+	  ChunkPlace place = { chunkFiles.size() - 1, offset, length };
+	  chunkPlaces[hash] = place; // the newest copy is the likeliest to be intact
+	  offset += length;
+	  chunks++;
+	  if(serverHeld.count(hash) != 0 || !pending.insert(hash).second)
+	    continue;
+	  hashes.append(recipe, at, CHUNK_HASH_SIZE);
+	  offered++;
+	  if(hashes.length() == CHUNK_HAVE_BYTES)
+	    {
+	      if(!sendChunkHashes(reader, hashes))
+		return;
+	      hashes.clear();
+	      pending.clear();
+	    }
+	}//end for
+    }//end for
+  if(!hashes.empty() && !sendChunkHashes(reader, hashes))
+    return;
+  std::cout << files << " files, " << chunks << " chunks, " << offered << " new to the server, which counts "
+	    << serverHeld.size() << " as held" << std::endl;
+} // end offerChunks
+
+/************************************************************************/
+/* Function name: sendChunkHashes                                       */
+/* Description: Sends one "have" with its hashes and counts them as     */
+/*              held the way the server does once it answers "HAVE"     */
+/* Parameters: FrameReader &reader- connection to the server            */
+/*             const std::string &hashes- 8 byte chunk hashes           */
+/* Return Value: True- If the server took them                          */
+/*               False- If it refused (its answer is printed)           */
+/*************************************************************************/
+bool sendChunkHashes(FrameReader &reader, const std::string &hashes)
+{
+  char server_reply[MAX_MSG_SIZE] = {'\0'}; // the server's answer
+  
+  sendToServer(reader.sockfd, "have");
+  if(!sendFrameHeader(reader.sockfd, FRAME_DATA, 0, hashes.length())
+     || !sendAll(reader.sockfd, hashes.data(), hashes.length()))
+    {
+      perror("Error sending message: " ) ;
+      exit(-1);
+    }
+  recvFromServer(reader, server_reply, 0); // HAVE <chunks held>
+  if(strncmp(server_reply, "HAVE ", 5) != 0)
+    {
+      std::cout << server_reply << std::endl;
+      return false;
+    }
+  for(size_t at = 0; at < hashes.length(); at += CHUNK_HASH_SIZE)
+    chunkHeld(serverHeld, decodeBigEndian(&hashes[at], CHUNK_HASH_SIZE));
+  if(atoll(server_reply + 5) != (long long)serverHeld.size())
+    std::cout << "The server counts " << server_reply + 5 << " chunks as held, not " << serverHeld.size() << std::endl;
+  return true;
+} // end sendChunkHashes
+
+/************************************************************************/
+/* Function name: dedupDownload                                         */
+/* Description: Downloads a file with "dget": the server sends the     */
+/*              file's chunks and then the bytes of those it doesn't    */
+/*              count as held, in file order. The file is put together  */
+/*              in <file>.part: the received bytes go where they       */
+/*              belong, the other chunks are copied from the local file */
+/*              they were seen in (or from earlier in the file) after   */
+/*              checking their hash. A chunk that isn't there any more, */
+/*              and any chunk whose CRC32C doesn't match, is fetched    */
+/*              again with RANGE.                                        */
+/* Parameters: FrameReader &reader- connection to the server            */
+/*             const std::string &fileName- the file, same name on both */
+/* Return Value: Nothing */
+/*************************************************************************/
+void dedupDownload(FrameReader &reader, const std::string &fileName)
+{
+  char server_reply[MAX_MSG_SIZE] = {'\0'}; // the server's answer
+  FrameEvent event; // piece of a frame received
+  int kind; // what readFrameEvent reported
+  std::string recipe; // the file's chunks
+  
+  sendToServer(reader.sockfd, ("dget " + fileName).c_str());
+  recvFromServer(reader, server_reply, 1); // CHUNKS <size> <count>, or why the file can't be sent
+  if(strncmp(server_reply, "CHUNKS ", 7) != 0)
+    return;
+  long long fileSize = 0, count = 0; // of the file on the server
+  std::istringstream(server_reply + 7) >> fileSize >> count;
+  
+  kind = readFrameEvent(reader, event);
+  if(kind != FRAME_BEGIN || event.header.type != FRAME_DATA || count < 0 || count > CHUNK_RECIPE_MAX
+     || event.header.length != (uint64_t)count * CHUNK_RECORD_SIZE)
+    {
+      if(kind == FRAME_FAILED)
+	perror("Error receiving file: " ) ;
+      else
+	std::cout << "Server did not send the chunks of the file" << std::endl;
+      exit(-1);
+    }//end if
+  while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+    recipe.append(event.data, event.length);
+  if(kind != FRAME_END)
+    {
+      perror("Error receiving file: " ) ;
+      exit(-1);
+    }//end if
+  
+  // Which chunks come over the wire, the server decides the same way
+  std::vector<bool> onWire(count); // per chunk
+  ByteRanges wire; // parts of the file that come over the wire, in file order
+  long long wireBytes = 0, offset = 0; // bytes the server sends, where the next chunk starts
+  for(long long i = 0; i < count; i++)
+    {
+      long long length = decodeBigEndian(&recipe[i * CHUNK_RECORD_SIZE + CHUNK_HASH_SIZE], 4);
+      onWire[i] = !chunkHeld(serverHeld, decodeBigEndian(&recipe[i * CHUNK_RECORD_SIZE], CHUNK_HASH_SIZE));
+      if(onWire[i] && !wire.empty() && wire.back().first + wire.back().second == offset)
+	wire.back().second += length;
+      else if(onWire[i])
+	wire.push_back(std::make_pair(offset, length));
+      wireBytes += onWire[i] ? length : 0;
+      offset += length;
+    }//end for
+  if(count == 0 && fileSize > 0) // not indexed yet, all of it comes
+    {
+      wire.push_back(std::make_pair(0LL, fileSize));
+      wireBytes = offset = fileSize;
+    }
+  if(offset != fileSize)
+    {
+      std::cout << "The chunks of " << fileName << " don't add up to its size" << std::endl;
+      exit(-1);
+    }//end if
+  
+  std::string partName = fileName + ".part"; // the file is put together here
+  int fd = open(partName.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd == -1)
+    {
+      perror(("Error creating " + partName).c_str());
+      exit(-1); // the bytes are on their way and can't be skipped
+    }
+  kind = readFrameEvent(reader, event);
+  if(kind != FRAME_BEGIN || event.header.type != FRAME_DATA || event.header.length != (uint64_t)wireBytes)
+    {
+      if(kind == FRAME_FAILED)
+	perror("Error receiving file: " ) ;
+      else
+	std::cout << "Server did not send the chunks that were announced" << std::endl;
+      exit(-1);
+    }//end if
+  size_t piece = 0; // part of wire being received
+  long long pieceDone = 0; // bytes of it received
+  while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+    for(size_t done = 0; done < event.length; )
+      {
+	if(pieceDone == wire[piece].second)
+	  {
+	    piece++;
+	    pieceDone = 0;
+	  }
+	size_t take = std::min((long long)(event.length - done), wire[piece].second - pieceDone);
+	if(!writeFully(fd, event.data + done, take, wire[piece].first + pieceDone))
+	  {
+	    perror(("Error writing " + partName).c_str());
+	    exit(-1);
+	  }
+	done += take;
+	pieceDone += take;
+      }//end for
+  if(kind != FRAME_END)
+    {
+      if(kind == FRAME_FAILED)
+	perror("Error receiving file: " ) ;
+      else
+	std::cout << "Connection closed with " << reader.parser.remaining() << " bytes of the file missing" << std::endl;
+      exit(-1);
+    }//end if
+  
+  // The chunks held locally, from earlier in the file or from where they were seen
+  std::unordered_map<uint64_t, long long> earlier; // hash -> where the chunk first is in this file
+  std::map<size_t, int> sources; // chunkFiles index -> the file open for reading (-1 if it can't be)
+  std::vector<char> buffer(CDC_MAX_SIZE); // one chunk
+  ByteRanges damaged; // chunks that weren't there or arrived damaged
+  long long localBytes = 0; // for output
+  offset = 0;
+  for(long long i = 0; i < count; i++)
+    {
+      uint64_t hash = decodeBigEndian(&recipe[i * CHUNK_RECORD_SIZE], CHUNK_HASH_SIZE);
+      long long length = decodeBigEndian(&recipe[i * CHUNK_RECORD_SIZE + CHUNK_HASH_SIZE], 4);
+      bool copied = onWire[i]; // the chunk is in place
+      auto first = earlier.find(hash);
+      auto place = chunkPlaces.find(hash);
+      if(!copied && length <= CDC_MAX_SIZE)
+	{
+	  int from = fd; // file the chunk is copied from
+	  long long fromOffset = first != earlier.end() ? first->second : 0;
+	  if(first == earlier.end() && place != chunkPlaces.end() && place->second.length == length)
+	    {
+	      if(sources.count(place->second.file) == 0)
+		sources[place->second.file] = open(chunkFiles[place->second.file].c_str(), O_RDONLY | O_CLOEXEC);
+	      from = sources[place->second.file];
+	      fromOffset = place->second.offset;
+	    }
+	  else if(first == earlier.end())
+	    from = -1; // the server counts it as held but it isn't here (any more)
+	  copied = from != -1 && readFully(from, buffer.data(), length, fromOffset) && xxHash64(buffer.data(), length) == hash;
+	  if(copied && !writeFully(fd, buffer.data(), length, offset))
+	    {
+	      perror(("Error writing " + partName).c_str());
+	      exit(-1);
+	    }
+	  localBytes += copied ? length : 0;
+	}//end if
+      if(!copied && !damaged.empty() && damaged.back().first + damaged.back().second == offset)
+	damaged.back().second += length;
+      else if(!copied)
+	damaged.push_back(std::make_pair(offset, length));
+      if(first == earlier.end())
+	earlier[hash] = offset;
+      offset += length;
+    }//end for
+  for(std::map<size_t, int>::iterator source = sources.begin(); source != sources.end(); ++source)
+    if(source->second != -1)
+      close(source->second);
+  if(ftruncate(fd, fileSize) == -1)
+    {
+      perror(("Error truncating " + partName).c_str());
+      exit(-1);
+    }
+  
+  if(verifyChecksums) // of the file as it was put together
+    {
+      ChunkSums sums;
+      buffer.resize(CDC_READ_SIZE);
+      for(long long at = 0; at < fileSize; at += CDC_READ_SIZE)
+	{
+	  size_t length = std::min((long long)CDC_READ_SIZE, fileSize - at);
+	  if(!readFully(fd, buffer.data(), length, at))
+	    {
+	      perror(("Error reading " + partName).c_str());
+	      exit(-1);
+	    }
+	  sums.add(buffer.data(), length);
+	}//end for
+      if(!recvChecksums(reader, sums, 0, damaged))
+	exit(-1);
+    }//end if
+  if(!repairRanges(reader, fileName, fileSize, fd, damaged))
+    {
+      std::cout << "File: \"" << fileName << "\" is damaged, removed" << std::endl;
+      unlink(partName.c_str());
+      close(fd);
+      return;
+    }
+  close(fd);
+  if(rename(partName.c_str(), fileName.c_str()) == -1)
+    {
+      perror(("Error renaming " + partName).c_str());
+      return;
+    }
+  
+  chunkFiles.push_back(fileName); // its chunks can be copied from it from now on
+  offset = 0;
+  for(long long i = 0; i < count; i++)
+    {
+      uint32_t length = decodeBigEndian(&recipe[i * CHUNK_RECORD_SIZE + CHUNK_HASH_SIZE], 4);
+      ChunkPlace place = { chunkFiles.size() - 1, offset, length };
+      chunkPlaces[decodeBigEndian(&recipe[i * CHUNK_RECORD_SIZE], CHUNK_HASH_SIZE)] = place;
+      offset += length;
+    }//end for
+  std::cout << "File: \"" << fileName << "\" Downloaded! " << fileSize << " bytes, " << wireBytes << " received, "
+	    << localBytes << " copied from local chunks" << std::endl;
+} // end dedupDownload
+
+/************************************************************************/
+/* Function name: readFully                                             */
+/* Description: Reads a range of a file, however many pread()s it takes*/
+/* Parameters: int fd- the file                                         */
+/*             char *buffer- filled with the range                      */
+/*             size_t length- bytes in the range                        */
+/*             off_t offset- where it starts                            */
+/* Return Value: True- If the whole range was read                      */
+/*               False- If the file ended first or couldn't be read     */
+/*************************************************************************/
+bool readFully(int fd, char *buffer, size_t length, off_t offset)
+{
+  size_t done = 0; // bytes read so far
+  while(done < length)
+    {
+      ssize_t result = pread(fd, buffer + done, length - done, offset + done);
+      if(result == -1 && errno == EINTR)
+	continue;
+      if(result <= 0)
+	return false;
+      done += result;
+    }//end while
+  return true;
+} // end readFully
+
+/************************************************************************/
+/* Function name: writeFully                                            */
+/* Description: Writes a range of a file, however many pwrite()s it     */
+/*              takes                                                   */
+/* Parameters: int fd- the file                                         */
+/*             const char *buffer- the bytes                            */
+/*             size_t length- how many                                  */
+/*             off_t offset- where they go                              */
+/* Return Value: True- If all of them were written                      */
+/*               False- otherwise                                       */
+/*************************************************************************/
+bool writeFully(int fd, const char *buffer, size_t length, off_t offset)
+{
+  size_t done = 0; // bytes written so far
+  while(done < length)
+    {
+      ssize_t result = pwrite(fd, buffer + done, length - done, offset + done);
+      if(result == -1 && errno == EINTR)
+	continue;
+      if(result <= 0)
+	return false;
+      done += result;
+    }//end while
+  return true;
+} // end writeFully
+
+/************************************************************************/
+/* Function name: recvFileBody                                          */
+/* Description: Receives the file whose first data frame just began,    */
+/*              either that one frame as it is or, when it is flagged   */
+/*              FRAME_FLAG_COMPRESSED, every compressed block up to the */
+/*              one flagged FRAME_FLAG_END, decompressed as they arrive */
+/* Parameters: FrameReader &reader- connection to the server            */
+/*             FrameEvent &event- the FRAME_BEGIN of the first frame    */
+/*             std::ostream &out- where the file's bytes go             */
+/* Return Value: Bytes of the file (decompressed), -1 if the connection */
+/*               failed or a block was damaged (already reported)       */
+/*************************************************************************/
+long long recvFileBody(FrameReader &reader, FrameEvent &event, std::ostream &out)
+{
+  int kind; // what readFrameEvent reported
+  long long received = 0; // bytes of the file so far
+  BlockDecoder decoder; // only used for compressed blocks
+  
+  while(true)
+    {
+      bool compressed = event.header.flags & FRAME_FLAG_COMPRESSED;
+      bool last = !compressed || (event.header.flags & FRAME_FLAG_END);
+      bool damaged = false;
+      
+      decoder.begin();
+      while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+	{
+	  if(!compressed)
+	    {
+	      out.write(event.data, event.length); // Write the chunk out right away
+	      received += event.length;
+	    }
+	  else if(!damaged && !decoder.feed(event.data, event.length, out))
+	    damaged = true;
+	}//end while
+      if(kind != FRAME_END) // Server went away in the middle of the file
+	{
+	  if(kind == FRAME_FAILED)
+	    perror("Error receiving file: " ) ;
+	  else
+	    std::cout << "Connection closed with " << reader.parser.remaining() << " bytes of the file missing" << std::endl;
+	  return -1;
+	}//end if
+      if(compressed)
+	{
+	  uint64_t blockSize = damaged ? (uint64_t)-1 : decoder.finish();
+	  if(blockSize == (uint64_t)-1)
+	    {
+	      std::cout << "Received a damaged compressed block" << std::endl;
+	      return -1;
+	    }//end if
+	  received += blockSize;
+	}//end if
+      if(last)
+	return received;
+      
+      kind = readFrameEvent(reader, event); // the next block
+      if(kind != FRAME_BEGIN || event.header.type != FRAME_DATA || !(event.header.flags & FRAME_FLAG_COMPRESSED))
+	{
+	  if(kind == FRAME_FAILED)
+	    perror("Error receiving file: " ) ;
+	  else
+	    std::cout << "Server did not send the rest of the compressed file" << std::endl;
+	  return -1;
+	}//end if
+    }//end while
+} // end recvFileBody
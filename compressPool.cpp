@@ -0,0 +1,187 @@
+/********************************************************************************************************
+ * Filename: compressPool.cpp
+ * Purpose: Worker threads compressing download blocks (see compressPool.h)
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+
+#include <sys/types.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "compression.h"
+#include "compressPool.h"
+using namespace std;
+
+// Workers start with the first compressed download. Never destroyed: the detached workers wait on its condition
+// variable until the process ends, and destroying it under them would hang exit() (a fork() child's included).
+CompressPool &compressPool = *new CompressPool;
+
+/********************************************************************************************************************************
+ * Function name:     readBlock
+ * Description:       Reads a block of a file (or of its cached contents)
+ * Parameters:        int fileFd: The file, -1 to use cached
+                      const CachedFilePtr &cached: The file's cached contents
+                      off_t offset, size_t length: The block
+                      vector<char> &buffer: Filled with the block
+ * Return Value:      true:  if the whole block was read
+                      false: if the file couldn't be read or shrank
+********************************************************************************************************************************/
+bool readBlock(int fileFd, const CachedFilePtr &cached, off_t offset, size_t length, vector<char> &buffer)
+{
+  buffer.resize(length);
+  if(fileFd == -1)
+    {
+      if(!cached || offset + (off_t)length > cached->size)
+	return false;
+      buffer.assign(cached->data.begin() + offset, cached->data.begin() + offset + length);
+      return true;
+    }
+  size_t done = 0;
+  while(done < length)
+    {
+      ssize_t bytesRead = pread(fileFd, &buffer[done], length - done, offset + done);
+      if(bytesRead < 0 && errno == EINTR)
+	continue;
+      if(bytesRead <= 0)
+	return false;
+      done += bytesRead;
+    }
+  return true;
+}// end readBlock
+/********************************************************************************************************************************
+ * Function name:     worthCompressing
+ * Description:       Judges whether a file is worth compressing by compressing samples from its start, middle and end.
+                      Already compressed files (archives, images, video) hardly shrink and are sent as they are.
+ * Parameters:        int codec: The codec it would be compressed with
+                      int fileFd: The file, -1 to use cached
+                      const CachedFilePtr &cached: The file's cached contents
+                      off_t fileSize: Size of the file
+ * Return Value:      true:  if the samples shrank enough
+                      false: otherwise, or if the file is too small to bother
+********************************************************************************************************************************/
+bool worthCompressing(int codec, int fileFd, const CachedFilePtr &cached, off_t fileSize)
+{
+  vector<char> sample, piece;
+  string packed;
+
+  if(fileSize < COMPRESS_MIN_SIZE)
+    return false;
+  off_t pieceSize = min(fileSize, (off_t)COMPRESS_SAMPLE_SIZE);
+  off_t offsets[3] = { 0, (fileSize - pieceSize) / 2, fileSize - pieceSize };
+  for(int i = 0; i < 3; i++)
+    {
+      if(i > 0 && offsets[i] < offsets[i - 1] + pieceSize) // small file, the samples would overlap
+	break;
+      if(!readBlock(fileFd, cached, offsets[i], pieceSize, piece))
+	return false;
+      sample.insert(sample.end(), piece.begin(), piece.end());
+    }
+  if(!compressBlock(codec, sample.data(), sample.size(), packed))
+    return false;
+  return packed.length() - COMPRESS_BLOCK_HEADER < sample.size() * COMPRESS_MAX_RATIO;
+}// end worthCompressing
+/********************************************************************************************************************************
+ * Function name:     CompressPool
+ * Description:       Creates a pool without workers, the first submit() starts them
+ * Parameters:        none
+ * Return Value:      none
+********************************************************************************************************************************/
+CompressPool::CompressPool()
+  : workers(0)
+{
+}
+/********************************************************************************************************************************
+ * Function name:     threads
+ * Description:       Tells how many blocks the pool compresses at once, a download keeps that many in flight
+ * Parameters:        none
+ * Return Value:      int: number of worker threads (one per core)
+********************************************************************************************************************************/
+int CompressPool::threads()
+{
+  int cores = thread::hardware_concurrency();
+  return cores > 0 ? cores : 1;
+}// end threads
+/********************************************************************************************************************************
+ * Function name:     submit
+ * Description:       Queues a block to be read and compressed by a worker. The file must stay open until the result
+                      is ready.
+ * Parameters:        int codec: CODEC_ZLIB or CODEC_ZSTD
+                      int fileFd: The file, -1 to use cached
+                      const CachedFilePtr &cached: The file's cached contents
+                      off_t offset, size_t length: The block, at most COMPRESS_BLOCK_SIZE bytes
+                      int wakeFd: eventfd written to once the block is ready, -1 for none
+ * Return Value:      future<string>: the frame payload (see compression.h), empty if the block couldn't be read or
+                                      compressed
+********************************************************************************************************************************/
+future<string> CompressPool::submit(int codec, int fileFd, const CachedFilePtr &cached, off_t offset, size_t length,
+				    int wakeFd)
+{
+  return run([codec, fileFd, cached, offset, length]()
+	     {
+	       static thread_local vector<char> block; // kept between jobs, so it is allocated once per worker
+	       string payload;
+	       if(!readBlock(fileFd, cached, offset, length, block) || !compressBlock(codec, block.data(), block.size(), payload))
+		 payload.clear();
+	       return payload;
+	     }, wakeFd);
+}// end submit
+/********************************************************************************************************************************
+ * Function name:     run
+ * Description:       Queues any job for a worker
+ * Parameters:        const function<string()> &work: The job, run on a worker thread
+                      int wakeFd: eventfd written to once the result is ready, -1 for none
+ * Return Value:      future<string>: what the job returns
+********************************************************************************************************************************/
+future<string> CompressPool::run(const function<string()> &work, int wakeFd)
+{
+  Job job;
+  job.task = packaged_task<string()>(work);
+  job.wakeFd = wakeFd;
+  future<string> result = job.task.get_future();
+  lock_guard<mutex> guard(lock);
+
+  if(workers == 0)
+    start();
+  jobs.push_back(move(job));
+  queued.notify_one();
+  return result;
+}// end run
+/********************************************************************************************************************************
+ * Function name:     start
+ * Description:       Starts the worker threads (the lock must be held)
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void CompressPool::start()
+{
+  for(workers = 0; workers < threads(); workers++)
+    thread(workerThread, this).detach();
+}// end start
+/********************************************************************************************************************************
+ * Function name:     workerThread
+ * Description:       Runs queued jobs for as long as the server runs, waking the event loop a job names once it is done
+ * Parameters:        CompressPool *pool: The pool the worker belongs to
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void CompressPool::workerThread(CompressPool *pool)
+{
+  while(true)
+    {
+      Job job;
+      {
+	unique_lock<mutex> guard(pool->lock);
+	pool->queued.wait(guard, [pool]() { return !pool->jobs.empty(); });
+	job = move(pool->jobs.front());
+	pool->jobs.pop_front();
+      }
+      job.task();
+      if(job.wakeFd != -1) // the future is ready by now, the loop waiting for it may look
+	{
+	  uint64_t one = 1;
+	  while(write(job.wakeFd, &one, sizeof(one)) == -1 && errno == EINTR)
+	    ;
+	}
+    }
+}// end workerThread
@@ -0,0 +1,68 @@
+/********************************************************************************************************
+ * Filename: compressPool.h
+ * Purpose: Worker threads that compress downloads a block at a time for every connection of the
+ *          server process (see compression.h for the format). The blocks of one big file are
+ *          compressed on several cores at once while the blocks before them are being sent.
+ *          Download checksums are computed on the same workers. A job can be given an eventfd that is
+ *          written to once its result is ready, so an event loop never has to wait on the future.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+#ifndef COMPRESS_POOL_H
+#define COMPRESS_POOL_H
+
+#include <sys/types.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <future>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include "fileCache.h" // CachedFilePtr
+
+#define COMPRESS_MIN_SIZE 1024 // smaller files go out as they are, the frames would cost more than they save
+#define COMPRESS_SAMPLE_SIZE 16384 // bytes compressed from the start, middle and end of a file to judge it
+#define COMPRESS_MAX_RATIO 0.9 // a sample that doesn't shrink below this is already compressed (or random)
+
+bool readBlock(int fileFd, const CachedFilePtr &cached, off_t offset, size_t length, std::vector<char> &buffer);
+bool worthCompressing(int codec, int fileFd, const CachedFilePtr &cached, off_t fileSize);
+
+/*************************************************************************************************
+ * Class name:        CompressPool
+ * Description:       A queue of jobs (blocks to compress, ranges to checksum) and one worker thread
+                      per core taking them off it. The workers are started by the first submit(), so each process of the
+                      fork() model starts its own. Every member is safe to call from any thread.
+ *************************************************************************************************/
+class CompressPool
+{
+public:
+  CompressPool();
+
+  int threads();
+  std::future<std::string> submit(int codec, int fileFd, const CachedFilePtr &cached, off_t offset, size_t length,
+			   int wakeFd = -1);
+  std::future<std::string> run(const std::function<std::string()> &work, int wakeFd = -1);
+
+private:
+  /*************************************************************************************************
+   * Struct name:       Job
+   * Description:       A queued job and who to tell once it is done
+   *************************************************************************************************/
+  struct Job
+  {
+    std::packaged_task<std::string()> task;
+    int wakeFd; // eventfd to add 1 to once the result is ready, -1 for none
+  };
+
+  void start();
+  static void workerThread(CompressPool *pool);
+
+  std::mutex lock; // guards everything below
+  std::condition_variable queued; // a job was added
+  std::deque<Job> jobs;
+  int workers; // started so far, 0 until the first submit()
+};
+
+extern CompressPool &compressPool; // shared by every session of the process, never destroyed (see compressPool.cpp)
+
+#endif // COMPRESS_POOL_H
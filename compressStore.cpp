@@ -0,0 +1,313 @@
+/********************************************************************************************************
+ * Filename: compressStore.cpp
+ * Purpose: Compressed variants of hot files kept in a directory (see compressStore.h)
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h> // openat
+#include <stdio.h> // perror, snprintf, renameat
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include "protocol.h" // encodeFrameHeader
+#include "compression.h"
+#include "compressPool.h" // readBlock
+#include "compressStore.h"
+using namespace std;
+
+CompressStore &compressStore = *new CompressStore; // Off until open(), never destroyed: its build thread waits on it
+
+/********************************************************************************************************************************
+ * Function name:     writeAll
+ * Description:       Writes every byte given to a file
+ * Parameters:        int fd: The file
+                      const char *data, size_t length: The bytes
+ * Return Value:      true:  if they were all written
+                      false: otherwise, errno tells why
+********************************************************************************************************************************/
+static bool writeAll(int fd, const char *data, size_t length)
+{
+  while(length > 0)
+    {
+      ssize_t written = write(fd, data, length);
+      if(written < 0 && errno == EINTR)
+	continue;
+      if(written < 0)
+	return false;
+      data += written;
+      length -= written;
+    }
+  return true;
+}// end writeAll
+/********************************************************************************************************************************
+ * Function name:     CompressStore
+ * Description:       Creates a store that is off
+ * Parameters:        none
+ * Return Value:      none
+********************************************************************************************************************************/
+CompressStore::CompressStore()
+  : dirFd(-1), building(false), served(0), built(0), failed(0)
+{
+}
+/********************************************************************************************************************************
+ * Function name:     open
+ * Description:       Turns the store on, keeping variants in a directory (created if it isn't there). Variants a stopped
+                      server left half written are removed. Meant to be called once before the first session.
+ * Parameters:        const char *path: The store directory
+ * Return Value:      true:  if the store is on
+                      false: if the directory can't be created or opened
+********************************************************************************************************************************/
+bool CompressStore::open(const char *path)
+{
+  if(mkdir(path, 0755) == -1 && errno != EEXIST)
+    {
+      perror(("Couldn't Create " + string(path)).c_str());
+      return false;
+    }
+  int fd = ::open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd == -1)
+    {
+      perror(("Couldn't Open " + string(path)).c_str());
+      return false;
+    }
+
+  int listFd = dup(fd); // closedir() closes it, readdir() moves its offset
+  DIR *directoryPtr = listFd == -1 ? NULL : fdopendir(listFd);
+  if(directoryPtr != NULL)
+    {
+      struct dirent *entry;
+      while((entry = readdir(directoryPtr)) != NULL)
+	if(strncmp(entry->d_name, COMPRESS_STORE_PREFIX, strlen(COMPRESS_STORE_PREFIX)) == 0)
+	  unlinkat(fd, entry->d_name, 0);
+      closedir(directoryPtr);
+    }
+  else if(listFd != -1)
+    close(listFd);
+  dirFd = fd;
+  return true;
+}// end open
+/********************************************************************************************************************************
+ * Function name:     lookup
+ * Description:       Opens the variant of one version of a file for a codec, if it was built
+ * Parameters:        const struct stat &info: stat of the file being downloaded
+                      int codec: The codec the session uses
+                      off_t &size: Set to the size of the variant
+ * Return Value:      int: the open variant, to be sent as it is (the caller closes it), -1 if there is none
+********************************************************************************************************************************/
+int CompressStore::lookup(const struct stat &info, int codec, off_t &size)
+{
+  struct stat variant;
+
+  int fd = openat(dirFd, variantName(variantOf(info, codec)).c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd == -1)
+    return -1;
+  if(fstat(fd, &variant) == -1 || variant.st_size == 0)
+    {
+      close(fd);
+      return -1;
+    }
+  size = variant.st_size;
+  lock_guard<mutex> guard(lock);
+  served++;
+  return fd;
+}// end lookup
+/********************************************************************************************************************************
+ * Function name:     requested
+ * Description:       Counts a compressed download of a file that has no variant yet. The download that makes it hot
+                      queues its build, the build thread reads the file through a descriptor of its own.
+ * Parameters:        const struct stat &info: stat of the file
+                      int codec: The codec the session uses
+                      int fileFd: The open file, -1 with cached
+                      const CachedFilePtr &cached: The file's cached contents
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void CompressStore::requested(const struct stat &info, int codec, int fileFd, const CachedFilePtr &cached)
+{
+  VariantId id = variantOf(info, codec);
+  lock_guard<mutex> guard(lock);
+
+  if(counts.size() >= COMPRESS_STORE_TRACKED && counts.find(id) == counts.end())
+    counts.clear(); // only files that keep being downloaded get hot again
+  int &count = counts[id];
+  if(count == -1 || ++count < COMPRESS_STORE_HOT)
+    return;
+
+  Build job;
+  job.id = id;
+  job.fileFd = fileFd == -1 ? -1 : fcntl(fileFd, F_DUPFD_CLOEXEC, 0);
+  job.cached = cached;
+  if(fileFd != -1 && job.fileFd == -1)
+    return; // out of descriptors, the next download tries again
+  count = -1;
+  builds.push_back(job);
+  queued.notify_one();
+  if(!building)
+    {
+      building = true;
+      thread(buildThread, this).detach();
+    }
+}// end requested
+/********************************************************************************************************************************
+ * Function name:     stats
+ * Description:       Describes the store counters for the "stats" command
+ * Parameters:        none
+ * Return Value:      string: the counters in text form
+********************************************************************************************************************************/
+string CompressStore::stats()
+{
+  char text[256];
+  lock_guard<mutex> guard(lock);
+
+  if(!enabled())
+    return "Compress Store: off";
+  snprintf(text, sizeof(text), "Compress Store: %llu downloads served from variants, %llu variants built, %llu failed, %zu waiting",
+	   served, built, failed, builds.size());
+  return text;
+}// end stats
+/********************************************************************************************************************************
+ * Function name:     variantOf
+ * Description:       Identifies the variant of one version of a file for a codec
+ * Parameters:        const struct stat &info: stat of the file
+                      int codec: The codec
+ * Return Value:      VariantId: the variant
+********************************************************************************************************************************/
+CompressStore::VariantId CompressStore::variantOf(const struct stat &info, int codec)
+{
+  VariantId id = { info.st_dev, info.st_ino, info.st_mtim, info.st_size, codec };
+  return id;
+}// end variantOf
+/********************************************************************************************************************************
+ * Function name:     variantName
+ * Description:       Name of a variant in the store directory: "<device>-<inode>-<mtime>-<size>.<codec>", the first two
+                      fields name the file so dropOldVariants() can find its other versions
+ * Parameters:        const VariantId &id: The variant
+ * Return Value:      string: its file name
+********************************************************************************************************************************/
+string CompressStore::variantName(const VariantId &id)
+{
+  char name[128];
+  snprintf(name, sizeof(name), "%llx-%llx-%llx.%09ld-%llx.%s", (unsigned long long)id.device, (unsigned long long)id.inode,
+	   (unsigned long long)id.mtime.tv_sec, (long)id.mtime.tv_nsec, (unsigned long long)id.size, codecName(id.codec));
+  return name;
+}// end variantName
+/********************************************************************************************************************************
+ * Function name:     buildThread
+ * Description:       Writes the queued variants one at a time for as long as the server runs
+ * Parameters:        CompressStore *store: The store the variants go in
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void CompressStore::buildThread(CompressStore *store)
+{
+  while(true)
+    {
+      Build job;
+      {
+	unique_lock<mutex> guard(store->lock);
+	store->queued.wait(guard, [store]() { return !store->builds.empty(); });
+	job = store->builds.front();
+	store->builds.pop_front();
+      }
+
+      bool done = store->build(job);
+      if(job.fileFd != -1)
+	close(job.fileFd);
+      if(done)
+	store->dropOldVariants(job.id);
+
+      lock_guard<mutex> guard(store->lock);
+      store->counts.erase(job.id); // a variant that goes missing is counted (and built) again
+      if(done)
+	store->built++;
+      else
+	store->failed++;
+    }
+}// end buildThread
+/********************************************************************************************************************************
+ * Function name:     build
+ * Description:       Writes a variant: the frames a compressed download of the file sends, one COMPRESS_BLOCK_SIZE block
+                      per frame. It is written under a temporary name and renamed into place once complete, and dropped if
+                      the file changed while it was read.
+ * Parameters:        const Build &job: The variant and the file
+ * Return Value:      true:  if the variant is in place
+                      false: otherwise
+********************************************************************************************************************************/
+bool CompressStore::build(const Build &job)
+{
+  string name = variantName(job.id);
+  string temp = COMPRESS_STORE_PREFIX + to_string((long long)getpid()) + "-" + name;
+  vector<char> block;
+  string payload;
+  char header[FRAME_HEADER_SIZE];
+  struct stat info;
+
+  int fd = openat(dirFd, temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd == -1)
+    {
+      perror(("Couldn't Create Variant " + temp).c_str());
+      return false;
+    }
+  bool written = true;
+  for(off_t offset = 0; written && offset < job.id.size; offset += COMPRESS_BLOCK_SIZE)
+    {
+      size_t length = min(job.id.size - offset, (off_t)COMPRESS_BLOCK_SIZE);
+      bool last = offset + (off_t)length == job.id.size;
+      written = readBlock(job.fileFd, job.cached, offset, length, block)
+	&& compressBlock(job.id.codec, block.data(), block.size(), payload);
+      if(!written)
+	break;
+      encodeFrameHeader(header, FRAME_DATA, FRAME_FLAG_COMPRESSED | (last ? FRAME_FLAG_END : 0), payload.length());
+      written = writeAll(fd, header, sizeof(header)) && writeAll(fd, payload.data(), payload.length());
+      if(!written)
+	perror(("Couldn't Write Variant " + temp).c_str());
+    }
+  if(close(fd) == -1)
+    written = false;
+  // the file may have been rewritten in place while it was read (renaming a new version over it is fine)
+  if(written && job.fileFd != -1)
+    written = fstat(job.fileFd, &info) == 0 && info.st_size == job.id.size
+      && info.st_mtim.tv_sec == job.id.mtime.tv_sec && info.st_mtim.tv_nsec == job.id.mtime.tv_nsec;
+  if(!written || renameat(dirFd, temp.c_str(), dirFd, name.c_str()) == -1)
+    {
+      unlinkat(dirFd, temp.c_str(), 0);
+      return false;
+    }
+  return true;
+}// end build
+/********************************************************************************************************************************
+ * Function name:     dropOldVariants
+ * Description:       Removes the variants of every other version of a file once a new one is built, so a file that keeps
+                      changing doesn't fill the store
+ * Parameters:        const VariantId &id: The variant just built
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void CompressStore::dropOldVariants(const VariantId &id)
+{
+  char prefix[64];
+  string name = variantName(id);
+  string suffix = string(".") + codecName(id.codec);
+
+  snprintf(prefix, sizeof(prefix), "%llx-%llx-", (unsigned long long)id.device, (unsigned long long)id.inode);
+  int listFd = openat(dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *directoryPtr = listFd == -1 ? NULL : fdopendir(listFd);
+  if(directoryPtr == NULL)
+    {
+      if(listFd != -1)
+	close(listFd);
+      return;
+    }
+  struct dirent *entry;
+  while((entry = readdir(directoryPtr)) != NULL)
+    {
+      string other = entry->d_name;
+      if(other != name && other.compare(0, strlen(prefix), prefix) == 0 && other.length() > suffix.length()
+	 && other.compare(other.length() - suffix.length(), suffix.length(), suffix) == 0)
+	unlinkat(dirFd, entry->d_name, 0);
+    }
+  closedir(directoryPtr);
+}// end dropOldVariants
@@ -0,0 +1,93 @@
+/********************************************************************************************************
+ * Filename: compressStore.h
+ * Purpose: Compressed variants of frequently downloaded files, kept in a directory (-S) so a hot file
+ *          is compressed once instead of on every download. A variant file holds exactly the frames
+ *          a compressed download sends (see compression.h), so it goes to the socket with the copy
+ *          mode like any other file: sendfile() of the compressed bytes, nothing is compressed again.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+#ifndef COMPRESS_STORE_H
+#define COMPRESS_STORE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <string>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include "fileCache.h" // CachedFilePtr
+
+#define COMPRESS_STORE_HOT 3 // compressed downloads of one version of a file before a variant of it is built
+#define COMPRESS_STORE_TRACKED 4096 // versions whose downloads are counted at most, the counts start over when full
+#define COMPRESS_STORE_PREFIX ".tmp-" // variants being written, left over ones are removed by open()
+
+/*************************************************************************************************
+ * Class name:        CompressStore
+ * Description:       Counts the compressed downloads of every version of a file (device, inode,
+                      mtime and size) and once one gets COMPRESS_STORE_HOT of them hands it to a
+                      background thread that writes its variant for that codec. Variants are named
+                      after the version, so a changed file is never served an old one, and the old
+                      variants of a file are removed when a new one is built. The directory may be
+                      shared by several server processes, variants appear with rename().
+                      Every member is safe to call from any thread.
+ *************************************************************************************************/
+class CompressStore
+{
+public:
+  CompressStore();
+
+  bool open(const char *path);
+  bool enabled() const { return dirFd != -1; }
+
+  int lookup(const struct stat &info, int codec, off_t &size);
+  void requested(const struct stat &info, int codec, int fileFd, const CachedFilePtr &cached);
+  std::string stats();
+
+private:
+  struct VariantId
+  {
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    off_t size;
+    int codec;
+    bool operator==(const VariantId &other) const
+    {
+      return device == other.device && inode == other.inode && mtime.tv_sec == other.mtime.tv_sec
+	&& mtime.tv_nsec == other.mtime.tv_nsec && size == other.size && codec == other.codec;
+    }
+  };
+  struct VariantIdHash
+  {
+    size_t operator()(const VariantId &id) const
+    {
+      return std::hash<unsigned long long>()((id.inode * 31 + id.device) * 31 + id.mtime.tv_nsec + id.codec);
+    }
+  };
+  struct Build
+  {
+    VariantId id;
+    int fileFd; // a descriptor of the file's own (-1 with cached)
+    CachedFilePtr cached;
+  };
+
+  static VariantId variantOf(const struct stat &info, int codec);
+  static std::string variantName(const VariantId &id);
+  static void buildThread(CompressStore *store);
+  bool build(const Build &job);
+  void dropOldVariants(const VariantId &id);
+
+  int dirFd; // the store directory, -1 while the store is off
+  std::mutex lock; // guards everything below
+  std::condition_variable queued; // a build was added
+  std::deque<Build> builds; // variants waiting to be written, oldest first
+  bool building; // the build thread is running (started by the first build, so it works after fork())
+  std::unordered_map<VariantId, int, VariantIdHash> counts; // compressed downloads so far, -1 once the build is queued
+  unsigned long long served, built, failed;
+};
+
+extern CompressStore &compressStore; // shared by every session of the process, never destroyed (like compressPool)
+
+#endif // COMPRESS_STORE_H
@@ -0,0 +1,279 @@
+/********************************************************************************************************
+ * Filename: compression.h
+ * Purpose: Codecs a download can be compressed with, shared by the server that compresses and the
+ *          client that decompresses. zlib is always there, zstd only when built with -DHAVE_ZSTD
+ *          (and -lzstd).
+ * Programming Language Used: C++
+ * Format: -> A compressed file is sent as FRAME_DATA frames flagged FRAME_FLAG_COMPRESSED, one per
+ *            COMPRESS_BLOCK_SIZE bytes of the file, the last one also flagged FRAME_FLAG_END.
+ *         -> Each frame is one block compressed on its own, so blocks can be compressed on
+ *            several cores at once:
+ *
+ *                +-----------+---------------------------+--------------------------+
+ *                | codec (1) | raw length (4, big end)   | compressed bytes         |
+ *                +-----------+---------------------------+--------------------------+
+ *********************************************************************************************************/
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <ostream>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "protocol.h" // encodeBigEndian
+
+// Codecs
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
+#define CODEC_ZSTD 2
+
+#define COMPRESS_BLOCK_SIZE (1 << 20) // Bytes of the file compressed into one frame
+#define COMPRESS_BLOCK_HEADER 5 // codec + raw length
+#define COMPRESS_ZLIB_LEVEL 1 // fast enough to keep a WAN link busy, text still shrinks several times
+#define COMPRESS_ZSTD_LEVEL 3
+
+/*************************************************************************************************
+ * Function name:     parseCodec
+ * Description:       Finds a codec by name
+ * Parameters:        const std::string &name: "zlib", "zstd" or "none"
+ * Return Value:      int: CODEC_*, -1 for a name that is unknown or not built in
+ *************************************************************************************************/
+inline int parseCodec(const std::string &name)
+{
+  if(name == "none")
+    return CODEC_NONE;
+  if(name == "zlib")
+    return CODEC_ZLIB;
+#ifdef HAVE_ZSTD
+  if(name == "zstd")
+    return CODEC_ZSTD;
+#endif
+  return -1;
+}// end parseCodec
+
+/*************************************************************************************************
+ * Function name:     codecName
+ * Description:       Name of a codec, for the protocol and for output
+ * Parameters:        int codec: CODEC_*
+ * Return Value:      const char*: its name
+ *************************************************************************************************/
+inline const char* codecName(int codec)
+{
+  switch(codec)
+    {
+    case CODEC_ZLIB:
+      return "zlib";
+    case CODEC_ZSTD:
+      return "zstd";
+    }
+  return "none";
+}// end codecName
+
+/*************************************************************************************************
+ * Function name:     compressBlock
+ * Description:       Compresses one block into the frame payload format above
+ * Parameters:        int codec: CODEC_ZLIB or CODEC_ZSTD
+                      const char *data, size_t length: The block, at most COMPRESS_BLOCK_SIZE bytes
+                      std::string &out: Set to the payload
+ * Return Value:      true if the block was compressed, false if the codec failed
+ *************************************************************************************************/
+inline bool compressBlock(int codec, const char *data, size_t length, std::string &out)
+{
+  size_t bound = codec == CODEC_ZLIB ? compressBound(length) : 0;
+#ifdef HAVE_ZSTD
+  if(codec == CODEC_ZSTD)
+    bound = ZSTD_compressBound(length);
+#endif
+  if(bound == 0)
+    return false;
+
+  out.resize(COMPRESS_BLOCK_HEADER + bound);
+  out[0] = (char)codec;
+  encodeBigEndian(&out[1], length, 4);
+  size_t packed = bound;
+  if(codec == CODEC_ZLIB)
+    {
+      uLongf zlibLength = bound;
+      if(compress2((Bytef *)&out[COMPRESS_BLOCK_HEADER], &zlibLength, (const Bytef *)data, length, COMPRESS_ZLIB_LEVEL) != Z_OK)
+	return false;
+      packed = zlibLength;
+    }
+#ifdef HAVE_ZSTD
+  else
+    {
+      packed = ZSTD_compress(&out[COMPRESS_BLOCK_HEADER], bound, data, length, COMPRESS_ZSTD_LEVEL);
+      if(ZSTD_isError(packed))
+	return false;
+    }
+#endif
+  out.resize(COMPRESS_BLOCK_HEADER + packed);
+  return true;
+}// end compressBlock
+
+/*************************************************************************************************
+ * Class name:        BlockDecoder
+ * Description:       Decompresses the blocks of a compressed file as their bytes arrive, the
+                      output is written out piece by piece and never held whole
+ *************************************************************************************************/
+class BlockDecoder
+{
+public:
+  BlockDecoder() : headerFill(0), codec(CODEC_NONE), produced(0), rawLength(0), done(false), zlibOpen(false)
+  {
+#ifdef HAVE_ZSTD
+    zstd = NULL;
+#endif
+  }
+  ~BlockDecoder()
+  {
+    if(zlibOpen)
+      inflateEnd(&zlib);
+#ifdef HAVE_ZSTD
+    if(zstd != NULL)
+      ZSTD_freeDStream(zstd);
+#endif
+  }
+
+  /*************************************************************************************************
+   * Function name:     begin
+   * Description:       Gets ready for the payload of the next block frame
+   * Parameters:        none
+   * Return Value:      void(none)
+   *************************************************************************************************/
+  void begin()
+  {
+    headerFill = 0;
+    produced = 0;
+    done = false;
+  }
+
+  /*************************************************************************************************
+   * Function name:     feed
+   * Description:       Decompresses the next bytes of a block frame's payload
+   * Parameters:        const char *data, size_t length: The bytes received
+                      std::ostream &out: Where the decompressed bytes go
+   * Return Value:      true if they were decompressed, false if the block is damaged
+   *************************************************************************************************/
+  bool feed(const char *data, size_t length, std::ostream &out)
+  {
+    while(headerFill < COMPRESS_BLOCK_HEADER && length > 0) // codec and raw length first
+      {
+	header[headerFill++] = *data++;
+	length--;
+	if(headerFill == COMPRESS_BLOCK_HEADER && !start())
+	  return false;
+      }
+    char buffer[CHUNK_SIZE];
+    bool full = false; // the last call filled buffer, the codec may hold more output
+    while(!done && (length > 0 || full))
+      {
+	size_t used, made;
+	if(codec == CODEC_ZLIB)
+	  {
+	    zlib.next_in = (Bytef *)data;
+	    zlib.avail_in = length;
+	    zlib.next_out = (Bytef *)buffer;
+	    zlib.avail_out = sizeof(buffer);
+	    int result = inflate(&zlib, Z_NO_FLUSH);
+	    if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) // Z_BUF_ERROR: nothing to do yet
+	      return false;
+	    done = result == Z_STREAM_END;
+	    used = length - zlib.avail_in;
+	    made = sizeof(buffer) - zlib.avail_out;
+	  }
+#ifdef HAVE_ZSTD
+	else if(codec == CODEC_ZSTD)
+	  {
+	    ZSTD_inBuffer in = { data, length, 0 };
+	    ZSTD_outBuffer outBuffer = { buffer, sizeof(buffer), 0 };
+	    size_t result = ZSTD_decompressStream(zstd, &outBuffer, &in);
+	    if(ZSTD_isError(result))
+	      return false;
+	    done = result == 0;
+	    used = in.pos;
+	    made = outBuffer.pos;
+	  }
+#endif
+	else
+	  return false;
+	out.write(buffer, made);
+	produced += made;
+	data += used;
+	length -= used;
+	full = made == sizeof(buffer);
+	if(used == 0 && made == 0)
+	  {
+	    if(length > 0) // stuck, the bytes don't belong to the block
+	      return false;
+	    break;
+	  }
+      }
+    return length == 0 && produced <= rawLength;
+  }
+
+  /*************************************************************************************************
+   * Function name:     finish
+   * Description:       Checks a block once its whole frame was fed
+   * Parameters:        none
+   * Return Value:      uint64_t: bytes the block decompressed to, -1 (as unsigned) if it is incomplete
+   *************************************************************************************************/
+  uint64_t finish()
+  {
+    if(headerFill < COMPRESS_BLOCK_HEADER || produced != rawLength || (rawLength > 0 && !done))
+      return (uint64_t)-1;
+    return produced;
+  }
+
+private:
+  /*************************************************************************************************
+   * Function name:     start
+   * Description:       Sets up the codec a block header names
+   * Parameters:        none
+   * Return Value:      true if the codec is known and was set up
+   *************************************************************************************************/
+  bool start()
+  {
+    codec = (uint8_t)header[0];
+    rawLength = decodeBigEndian(header + 1, 4);
+    if(rawLength == 0)
+      {
+	done = true;
+	return true;
+      }
+    if(codec == CODEC_ZLIB)
+      {
+	if(zlibOpen)
+	  return inflateReset(&zlib) == Z_OK;
+	memset(&zlib, 0, sizeof(zlib));
+	zlibOpen = inflateInit(&zlib) == Z_OK;
+	return zlibOpen;
+      }
+#ifdef HAVE_ZSTD
+    if(codec == CODEC_ZSTD)
+      {
+	if(zstd == NULL)
+	  zstd = ZSTD_createDStream();
+	return zstd != NULL && !ZSTD_isError(ZSTD_initDStream(zstd));
+      }
+#endif
+    return false;
+  }
+
+  char header[COMPRESS_BLOCK_HEADER]; // codec and raw length of the block
+  size_t headerFill; // bytes of header received
+  int codec; // CODEC_* of the block
+  uint64_t produced; // bytes the block decompressed to so far
+  uint64_t rawLength; // bytes it should decompress to
+  bool done; // the codec saw the end of the block
+  z_stream zlib;
+  bool zlibOpen; // zlib was initialized
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zstd;
+#endif
+};
+
+#endif // COMPRESSION_H
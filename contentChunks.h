@@ -0,0 +1,206 @@
+/********************************************************************************************************
+ * Filename: contentChunks.h
+ * Purpose: Content-defined chunks (FastCDC) of files, shared by the server that indexes the files it
+ *          serves (see chunkIndex.h) and the client that tells it which chunks it already holds.
+ *          A chunk ends where a rolling hash of the last bytes hits a pattern, not at a fixed offset,
+ *          so bytes inserted into or removed from a file only change the chunks around them and the
+ *          same region of two different files (versions of a build artifact) cuts into the same
+ *          chunks.
+ * Programming Language Used: C++
+ * Format: -> A file's recipe is its chunks in order, each CHUNK_RECORD_SIZE bytes big endian:
+ *
+ *                +-----------------------+-------------+
+ *                | xxHash64 of chunk (8) | length (4)  |
+ *                +-----------------------+-------------+
+ *
+ *         -> "have" is followed by a FRAME_DATA frame of 8 byte chunk hashes the client holds.
+ *         -> "dget <file>" is answered with "CHUNKS <file size> <chunk count>", a FRAME_DATA frame
+ *            with the recipe, then one FRAME_DATA frame with the bytes of every chunk the client
+ *            doesn't hold, in file order. A chunk is held if its hash was sent with "have" or came
+ *            in an earlier dget (or earlier in the same file). A file that isn't indexed yet has no
+ *            recipe (0 chunks) and all of its bytes come in the second frame.
+ *********************************************************************************************************/
+#ifndef CONTENT_CHUNKS_H
+#define CONTENT_CHUNKS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h> // pread
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include "protocol.h" // encodeBigEndian
+#include "deltaSync.h" // xxHash64
+
+#define CDC_MIN_SIZE (4 << 10) // No chunk is cut before this many bytes (but the last one)
+#define CDC_AVG_SIZE (16 << 10) // Chunks are this big on average
+#define CDC_MAX_SIZE (64 << 10) // A chunk is cut here whatever the bytes
+#define CDC_MASK_SMALL (((1ULL << 16) - 1) << 48) // cut pattern before CDC_AVG_SIZE bytes, 2 bits harder to hit
+#define CDC_MASK_LARGE (((1ULL << 12) - 1) << 52) // and after it, 2 bits easier (normalized chunking)
+#define CDC_READ_SIZE (4 << 20) // Bytes of a file read at a time while it is cut into chunks
+
+#define CHUNK_RECORD_SIZE 12 // hash + length of one chunk in a recipe
+#define CHUNK_HASH_SIZE 8
+#define CHUNK_RECIPE_MAX (1 << 22) // Most chunks in a recipe (a 64 GB file on average), bigger files aren't indexed
+#define CHUNK_HAVE_BYTES (8 << 20) // Longest hash list of one "have"
+#define CHUNK_HELD_MAX (1 << 21) // Most hashes "have" may leave a session holding
+
+/*************************************************************************************************
+ * Function name:     cdcGear
+ * Description:       The table of random 64 bit values the rolling hash adds up, one per byte
+                      value. Made from a fixed seed, so the client and the server cut alike.
+ * Parameters:        none
+ * Return Value:      const uint64_t*: the 256 values
+ *************************************************************************************************/
+inline const uint64_t* cdcGear()
+{
+  struct Table
+  {
+    uint64_t values[256];
+    Table()
+    {
+      uint64_t state = 0x2545F4914F6CDD1DULL; // splitmix64
+      for(int i = 0; i < 256; i++)
+	{
+	  uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+	  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	  values[i] = z ^ (z >> 31);
+	}
+    }
+  };
+  static const Table table;
+  return table.values;
+}// end cdcGear
+
+/*************************************************************************************************
+ * Function name:     cdcCut
+ * Description:       Finds where the chunk starting at data ends (FastCDC): the gear hash of the
+                      bytes after the first CDC_MIN_SIZE is checked against CDC_MASK_SMALL up to
+                      CDC_AVG_SIZE and against CDC_MASK_LARGE after it, so chunk sizes bunch up
+                      around the average
+ * Parameters:        const char *data, size_t length: The bytes from the start of the chunk on
+ * Return Value:      size_t: length of the chunk
+ *************************************************************************************************/
+inline size_t cdcCut(const char *data, size_t length)
+{
+  const uint64_t *gear = cdcGear();
+  if(length <= CDC_MIN_SIZE)
+    return length;
+  size_t normal = length < CDC_AVG_SIZE ? length : CDC_AVG_SIZE;
+  size_t end = length < CDC_MAX_SIZE ? length : CDC_MAX_SIZE;
+  uint64_t hash = 0;
+  size_t i = CDC_MIN_SIZE;
+  for(; i < normal; i++)
+    {
+      hash = (hash << 1) + gear[(uint8_t)data[i]];
+      if(!(hash & CDC_MASK_SMALL))
+	return i;
+    }
+  for(; i < end; i++)
+    {
+      hash = (hash << 1) + gear[(uint8_t)data[i]];
+      if(!(hash & CDC_MASK_LARGE))
+	return i;
+    }
+  return end;
+}// end cdcCut
+
+/*************************************************************************************************
+ * Function name:     appendChunkRecord
+ * Description:       Adds one chunk to a recipe
+ * Parameters:        std::string &recipe: The recipe so far
+                      uint64_t hash: xxHash64 of the chunk
+                      uint32_t length: Its length
+ * Return Value:      void(none)
+ *************************************************************************************************/
+inline void appendChunkRecord(std::string &recipe, uint64_t hash, uint32_t length)
+{
+  char record[CHUNK_RECORD_SIZE];
+  encodeBigEndian(record, hash, 8);
+  encodeBigEndian(record + 8, length, 4);
+  recipe.append(record, sizeof(record));
+}// end appendChunkRecord
+
+/*************************************************************************************************
+ * Function name:     chunkBytes
+ * Description:       Cuts bytes into chunks and adds them to a recipe. Unless the bytes run to the
+                      end of the file, the chunks stop CDC_MAX_SIZE short of their end (a chunk that
+                      ends there might go on), the caller passes the rest again with more bytes.
+ * Parameters:        const char *data, size_t length: The bytes, from the start of a chunk on
+                      bool atEnd: They run to the end of the file
+                      std::string &recipe: The chunks are added to it
+ * Return Value:      size_t: bytes cut into chunks
+ *************************************************************************************************/
+inline size_t chunkBytes(const char *data, size_t length, bool atEnd, std::string &recipe)
+{
+  size_t done = 0;
+  while(done < length && (atEnd || length - done >= CDC_MAX_SIZE))
+    {
+      size_t chunk = cdcCut(data + done, length - done);
+      appendChunkRecord(recipe, xxHash64(data + done, chunk), chunk);
+      done += chunk;
+    }
+  return done;
+}// end chunkBytes
+
+/*************************************************************************************************
+ * Function name:     chunkFile
+ * Description:       Cuts an open file into chunks, CDC_READ_SIZE bytes read at a time (pread, so
+                      a file that shrinks meanwhile is an error and not a SIGBUS like with mmap)
+ * Parameters:        int fd: The file
+                      uint64_t size: Its size, it must not change
+                      std::string &recipe: Set to its chunks
+ * Return Value:      true if the whole file was read, false otherwise (errno tells why, 0 if it shrank)
+ *************************************************************************************************/
+inline bool chunkFile(int fd, uint64_t size, std::string &recipe)
+{
+  std::vector<char> buffer(CDC_READ_SIZE);
+  size_t fill = 0; // bytes in buffer not cut yet
+  uint64_t offset = 0; // of the end of the bytes read
+
+  recipe.clear();
+  while(offset < size || fill > 0)
+    {
+      while(fill < buffer.size() && offset < size)
+	{
+	  ssize_t bytesRead = pread(fd, &buffer[fill], buffer.size() - fill, offset);
+	  if(bytesRead < 0 && errno == EINTR)
+	    continue;
+	  if(bytesRead <= 0)
+	    {
+	      if(bytesRead == 0)
+		errno = 0;
+	      return false;
+	    }
+	  fill += bytesRead;
+	  offset += bytesRead;
+	}
+      size_t done = chunkBytes(buffer.data(), fill, offset == size, recipe);
+      memmove(&buffer[0], &buffer[done], fill - done);
+      fill -= done;
+    }
+  return true;
+}// end chunkFile
+
+/*************************************************************************************************
+ * Function name:     chunkHeld
+ * Description:       Tells whether the client holds a chunk and counts it as held from then on.
+                      The server and the client both keep the client's chunks with it, so they
+                      agree on which chunks of a file are sent without telling each other.
+ * Parameters:        std::unordered_set<uint64_t> &held: Hashes of the chunks the client holds,
+                                                        at most CHUNK_HELD_MAX
+                      uint64_t hash: xxHash64 of the chunk
+ * Return Value:      true if the chunk was held already, false otherwise
+ *************************************************************************************************/
+inline bool chunkHeld(std::unordered_set<uint64_t> &held, uint64_t hash)
+{
+  if(held.count(hash) != 0)
+    return true;
+  if(held.size() < CHUNK_HELD_MAX)
+    held.insert(hash);
+  return false;
+}// end chunkHeld
+
+#endif // CONTENT_CHUNKS_H
@@ -0,0 +1,173 @@
+/********************************************************************************************************
+ * Filename: crc32c.h
+ * Purpose: CRC32C (Castagnoli) checksums of downloads, shared by the server that sends them and the
+ *          client that checks the bytes it received against them. On x86 CPUs with SSE4.2 the crc32
+ *          instruction does 8 bytes at a time (several GB/s per core, far more than a 10 Gbps link
+ *          carries), elsewhere a slicing-by-8 table does.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h> // _mm_crc32_u64
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // Castagnoli polynomial, bit reversed
+
+/*************************************************************************************************
+ * Function name:     crc32cTable
+ * Description:       Slicing-by-8 tables for the software CRC, built on first use
+ * Parameters:        none
+ * Return Value:      const uint32_t (*)[256]: 8 tables of 256 entries
+ *************************************************************************************************/
+inline const uint32_t (*crc32cTable())[256]
+{
+  struct Tables
+  {
+    uint32_t entries[8][256];
+    Tables()
+    {
+      for(uint32_t i = 0; i < 256; i++)
+	{
+	  uint32_t crc = i;
+	  for(int bit = 0; bit < 8; bit++)
+	    crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+	  entries[0][i] = crc;
+	}
+      for(uint32_t i = 0; i < 256; i++)
+	for(int k = 1; k < 8; k++)
+	  entries[k][i] = (entries[k - 1][i] >> 8) ^ entries[0][entries[k - 1][i] & 0xff];
+    }
+  };
+  static const Tables tables;
+  return tables.entries;
+}// end crc32cTable
+
+/*************************************************************************************************
+ * Function name:     crc32cSoftware
+ * Description:       Runs the CRC register over some bytes with the tables
+ * Parameters:        uint32_t crc: The register (not the finished CRC)
+                      const unsigned char *data, size_t length: The bytes
+ * Return Value:      uint32_t: the register after them
+ *************************************************************************************************/
+inline uint32_t crc32cSoftware(uint32_t crc, const unsigned char *data, size_t length)
+{
+  const uint32_t (*table)[256] = crc32cTable();
+
+  for(; length >= 8; data += 8, length -= 8)
+    {
+      uint32_t low, high;
+      memcpy(&low, data, 4);
+      memcpy(&high, data + 4, 4);
+      low ^= crc; // little endian, like the x86 instruction
+      crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24]
+	^ table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^ table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+    }
+  for(; length > 0; data++, length--)
+    crc = (crc >> 8) ^ table[0][(crc ^ *data) & 0xff];
+  return crc;
+}// end crc32cSoftware
+
+#if defined(__x86_64__)
+/*************************************************************************************************
+ * Function name:     crc32cHardware
+ * Description:       Runs the CRC register over some bytes with the SSE4.2 crc32 instruction
+ * Parameters:        uint32_t crc: The register (not the finished CRC)
+                      const unsigned char *data, size_t length: The bytes
+ * Return Value:      uint32_t: the register after them
+ *************************************************************************************************/
+__attribute__((target("sse4.2"))) inline uint32_t crc32cHardware(uint32_t crc, const unsigned char *data, size_t length)
+{
+  uint64_t crc64 = crc;
+
+  for(; length >= 8; data += 8, length -= 8)
+    {
+      uint64_t word;
+      memcpy(&word, data, 8);
+      crc64 = _mm_crc32_u64(crc64, word);
+    }
+  crc = (uint32_t)crc64;
+  for(; length > 0; data++, length--)
+    crc = _mm_crc32_u8(crc, *data);
+  return crc;
+}// end crc32cHardware
+#endif
+
+/*************************************************************************************************
+ * Function name:     crc32cUpdate
+ * Description:       Adds bytes to a CRC32C, crc32cUpdate(0, ...) starts a new one
+ * Parameters:        uint32_t crc: The CRC of the bytes before these
+                      const void *data, size_t length: The bytes
+ * Return Value:      uint32_t: the CRC of all the bytes
+ *************************************************************************************************/
+inline uint32_t crc32cUpdate(uint32_t crc, const void *data, size_t length)
+{
+#if defined(__x86_64__)
+  static const bool hardware = __builtin_cpu_supports("sse4.2");
+  if(hardware)
+    return ~crc32cHardware(~crc, (const unsigned char *)data, length);
+#endif
+  return ~crc32cSoftware(~crc, (const unsigned char *)data, length);
+}// end crc32cUpdate
+
+/*************************************************************************************************
+ * Function name:     crc32cShift
+ * Description:       Multiplies a vector by a 32x32 GF(2) matrix (a helper of crc32cCombine)
+ * Parameters:        const uint32_t matrix[]: 32 columns
+                      uint32_t vector: The vector
+ * Return Value:      uint32_t: the product
+ *************************************************************************************************/
+inline uint32_t crc32cShift(const uint32_t matrix[], uint32_t vector)
+{
+  uint32_t sum = 0;
+  for(int i = 0; vector != 0; i++, vector >>= 1)
+    if(vector & 1)
+      sum ^= matrix[i];
+  return sum;
+}// end crc32cShift
+
+/*************************************************************************************************
+ * Function name:     crc32cCombine
+ * Description:       CRC of two pieces of bytes one after the other from the CRCs of the pieces, so
+                      pieces checksummed on different threads give the CRC of the whole file (the
+                      zeros operator of zlib's crc32_combine, with the Castagnoli polynomial)
+ * Parameters:        uint32_t first: CRC of the first piece
+                      uint32_t second: CRC of the second piece
+                      uint64_t secondLength: Bytes in the second piece
+ * Return Value:      uint32_t: CRC of both pieces
+ *************************************************************************************************/
+inline uint32_t crc32cCombine(uint32_t first, uint32_t second, uint64_t secondLength)
+{
+  uint32_t even[32], odd[32], square[32];
+
+  if(secondLength == 0)
+    return first;
+  odd[0] = CRC32C_POLY; // the operator for one zero bit
+  for(int i = 1; i < 32; i++)
+    odd[i] = 1u << (i - 1);
+  for(int i = 0; i < 32; i++) // two zero bits
+    even[i] = crc32cShift(odd, odd[i]);
+  for(int i = 0; i < 32; i++) // four zero bits
+    odd[i] = crc32cShift(even, even[i]);
+
+  uint32_t *current = odd, *next = even; // squared before use, so the first one applied is a byte of zeros
+  while(secondLength != 0)
+    {
+      for(int i = 0; i < 32; i++)
+	square[i] = crc32cShift(current, current[i]);
+      memcpy(next, square, sizeof(square));
+      if(secondLength & 1)
+	first = crc32cShift(next, first);
+      secondLength >>= 1;
+      uint32_t *swap = current;
+      current = next;
+      next = swap;
+    }
+  return first ^ second;
+}// end crc32cCombine
+
+#endif // CRC32C_H
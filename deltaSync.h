@@ -0,0 +1,321 @@
+/********************************************************************************************************
+ * Filename: deltaSync.h
+ * Purpose: Delta transfer of a file the client already has an older copy of ("sync"), shared by the
+ *          client that describes its copy and rebuilds it and the server that matches it against
+ *          the current file. Works like rsync: the client cuts its copy into blocks and sends a weak
+ *          rolling checksum and a strong hash of each, the server slides a window over its file and
+ *          sends a reference wherever a window matches a block and the bytes themselves elsewhere.
+ * Programming Language Used: C++
+ * Format: -> The signatures the client sends in one FRAME_DATA frame: the block size, then for every
+ *            whole block of its copy the weak checksum and the strong hash (xxHash64), big endian:
+ *
+ *                +----------------+---------------------------------------------------------+
+ *                | block size (4) | weak (4) strong (8) | weak (4) strong (8) | ...          |
+ *                +----------------+---------------------------------------------------------+
+ *
+ *         -> The delta comes back in FRAME_DATA frames, one per SYNC_SEGMENT_SIZE bytes of the file
+ *            (the last one flagged FRAME_FLAG_END), each a list of whole operations:
+ *
+ *                SYNC_OP_LITERAL | length (4)      | the bytes
+ *                SYNC_OP_COPY    | first block (4) | block count (4)
+ *
+ *         -> The client rebuilds its copy in place: a block is only referenced where it isn't
+ *            written over before it is read (its offset is at or after where it goes), so a block
+ *            referenced at its own offset, the whole unchanged start of an appended file, is
+ *            neither sent nor written. The client rejects a delta that copies from before where
+ *            the block goes as bad.
+ *********************************************************************************************************/
+#ifndef DELTA_SYNC_H
+#define DELTA_SYNC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "protocol.h" // encodeBigEndian, decodeBigEndian
+
+#define SYNC_BLOCK_MIN 1024 // Smallest block size, also used for files of up to SYNC_BLOCK_MIN^2 bytes
+#define SYNC_BLOCK_MAX (1 << 20) // Biggest block size, SYNC_SEGMENT_SIZE must be a multiple of it
+#define SYNC_SIGNATURE_SIZE 12 // weak checksum + strong hash of one block
+#define SYNC_SIGNATURES_MAX (16 << 20) // Longest signature frame, enough for ~1.4 TB at the biggest block size
+#define SYNC_SEGMENT_SIZE (8 << 20) // Bytes of the file matched by one compress pool job and sent as one frame
+
+// Delta operations
+#define SYNC_OP_LITERAL 0
+#define SYNC_OP_COPY    1
+
+#define SYNC_NO_BLOCK 0xffffffff // no block matches
+#define SYNC_TAG_BITS 20 // bits of a weak checksum the tag table is indexed by
+
+/*************************************************************************************************
+ * Function name:     xxHash64
+ * Description:       The xxHash64 hash (seed 0), the strong hash of a block: fast and with good
+                      enough collisions for a 64 bit hash, the whole file is checked with its CRC32Cs
+                      anyway when checksums were negotiated
+ * Parameters:        const char *data, size_t length: The bytes
+ * Return Value:      uint64_t: their hash
+ *************************************************************************************************/
+inline uint64_t xxHash64(const char *data, size_t length)
+{
+  static const uint64_t prime1 = 11400714785074694791ULL, prime2 = 14029467366897019727ULL,
+    prime3 = 1609587929392839161ULL, prime4 = 9650029242287828579ULL, prime5 = 2870177450012600261ULL;
+  struct Helpers
+  {
+    static uint64_t rotate(uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); }
+    static uint64_t read64(const char *p) { uint64_t value; memcpy(&value, p, 8); return value; } // little endian hosts
+    static uint32_t read32(const char *p) { uint32_t value; memcpy(&value, p, 4); return value; }
+    static uint64_t round(uint64_t acc, uint64_t input) { return rotate(acc + input * prime2, 31) * prime1; }
+    static uint64_t merge(uint64_t hash, uint64_t acc) { return (hash ^ round(0, acc)) * prime1 + prime4; }
+  };
+  const char *end = data + length;
+  uint64_t hash;
+
+  if(length >= 32)
+    {
+      uint64_t v1 = prime1 + prime2, v2 = prime2, v3 = 0, v4 = -prime1;
+      for(; data + 32 <= end; data += 32)
+	{
+	  v1 = Helpers::round(v1, Helpers::read64(data));
+	  v2 = Helpers::round(v2, Helpers::read64(data + 8));
+	  v3 = Helpers::round(v3, Helpers::read64(data + 16));
+	  v4 = Helpers::round(v4, Helpers::read64(data + 24));
+	}
+      hash = Helpers::rotate(v1, 1) + Helpers::rotate(v2, 7) + Helpers::rotate(v3, 12) + Helpers::rotate(v4, 18);
+      hash = Helpers::merge(Helpers::merge(Helpers::merge(Helpers::merge(hash, v1), v2), v3), v4);
+    }
+  else
+    hash = prime5;
+  hash += length;
+  for(; data + 8 <= end; data += 8)
+    hash = Helpers::rotate(hash ^ Helpers::round(0, Helpers::read64(data)), 27) * prime1 + prime4;
+  if(data + 4 <= end)
+    {
+      hash = Helpers::rotate(hash ^ (Helpers::read32(data) * prime1), 23) * prime2 + prime3;
+      data += 4;
+    }
+  for(; data < end; data++)
+    hash = Helpers::rotate(hash ^ ((uint8_t)*data * prime5), 11) * prime1;
+  hash ^= hash >> 33;
+  hash *= prime2;
+  hash ^= hash >> 29;
+  hash *= prime3;
+  hash ^= hash >> 32;
+  return hash;
+}// end xxHash64
+
+/*************************************************************************************************
+ * Struct name:       RollingChecksum
+ * Description:       The weak checksum of a window of bytes (rsync's): two sums that are updated in
+                      constant time when the window moves on by one byte
+ *************************************************************************************************/
+struct RollingChecksum
+{
+  uint32_t a; // sum of the bytes
+  uint32_t b; // sum of the bytes weighted by their distance from the end of the window
+  uint32_t length; // bytes in the window
+
+  void start(const char *data, size_t windowLength)
+  {
+    a = b = 0;
+    length = windowLength;
+    for(size_t i = 0; i < windowLength; i++)
+      {
+	a += (uint8_t)data[i];
+	b += (windowLength - i) * (uint8_t)data[i];
+      }
+  }
+  void roll(uint8_t out, uint8_t in) // the window drops out and takes in
+  {
+    a += in - out;
+    b += a - length * out;
+  }
+  uint32_t value() const { return (a & 0xffff) | (b << 16); }
+};
+
+/*************************************************************************************************
+ * Function name:     syncBlockSize
+ * Description:       Picks the block size for a copy of a given size: about its square root (fewer
+                      signatures against finer matches), a power of two between SYNC_BLOCK_MIN and
+                      SYNC_BLOCK_MAX, and big enough for the signatures to fit in SYNC_SIGNATURES_MAX
+ * Parameters:        uint64_t fileSize: Bytes of the copy
+ * Return Value:      uint32_t: the block size, 0 if the copy is too big to be synced
+ *************************************************************************************************/
+inline uint32_t syncBlockSize(uint64_t fileSize)
+{
+  uint64_t size = SYNC_BLOCK_MIN;
+  while(size < SYNC_BLOCK_MAX && (size * size < fileSize || 4 + fileSize / size * SYNC_SIGNATURE_SIZE > SYNC_SIGNATURES_MAX))
+    size *= 2;
+  return 4 + fileSize / size * SYNC_SIGNATURE_SIZE > SYNC_SIGNATURES_MAX ? 0 : size;
+}// end syncBlockSize
+
+/*************************************************************************************************
+ * Function name:     encodeSyncOp
+ * Description:       Appends the header of a delta operation (a literal's bytes follow it)
+ * Parameters:        std::string &delta: The operations so far
+                      uint8_t op: SYNC_OP_LITERAL or SYNC_OP_COPY
+                      uint32_t first: Literal length, or first block of a copy
+                      uint32_t count: Blocks of a copy (not written for a literal)
+ * Return Value:      void(none)
+ *************************************************************************************************/
+inline void encodeSyncOp(std::string &delta, uint8_t op, uint32_t first, uint32_t count)
+{
+  char header[9];
+  header[0] = (char)op;
+  encodeBigEndian(header + 1, first, 4);
+  encodeBigEndian(header + 5, count, 4);
+  delta.append(header, op == SYNC_OP_COPY ? 9 : 5);
+}// end encodeSyncOp
+
+/*************************************************************************************************
+ * Class name:        SyncIndex
+ * Description:       The signatures of the client's copy, looked up by weak checksum. A table of
+                      2^SYNC_TAG_BITS bits (128 KB, fits the L2 cache) tells at once whether any block
+                      could have a weak checksum, so a window that matches nothing (most of them)
+                      costs one bit test.
+ *************************************************************************************************/
+class SyncIndex
+{
+public:
+  /*************************************************************************************************
+   * Function name:     parse
+   * Description:       Reads the signature frame the client sent
+   * Parameters:        const std::string &signatures: The frame's payload
+   * Return Value:      true if it is well formed, false otherwise
+   *************************************************************************************************/
+  bool parse(const std::string &signatures)
+  {
+    if(signatures.length() < 4 || (signatures.length() - 4) % SYNC_SIGNATURE_SIZE != 0)
+      return false;
+    blockSize = decodeBigEndian(signatures.data(), 4);
+    if(blockSize < SYNC_BLOCK_MIN || blockSize > SYNC_BLOCK_MAX || (blockSize & (blockSize - 1)) != 0)
+      return false;
+
+    size_t count = (signatures.length() - 4) / SYNC_SIGNATURE_SIZE;
+    strong.resize(count);
+    next.assign(count, SYNC_NO_BLOCK);
+    tags.assign((1 << SYNC_TAG_BITS) / 64, 0);
+    first.reserve(count);
+    for(size_t i = count; i-- > 0; ) // chained in reverse so every chain is in block order
+      {
+	const char *signature = signatures.data() + 4 + i * SYNC_SIGNATURE_SIZE;
+	uint32_t weak = decodeBigEndian(signature, 4);
+	strong[i] = decodeBigEndian(signature + 4, 8);
+	auto head = first.find(weak);
+	if(head != first.end())
+	  next[i] = head->second;
+	first[weak] = i;
+	tags[tag(weak) / 64] |= 1ULL << (tag(weak) % 64);
+      }
+    return true;
+  }
+
+  uint32_t size() const { return blockSize; }
+  size_t blocks() const { return strong.size(); }
+
+  /*************************************************************************************************
+   * Function name:     find
+   * Description:       Looks for a block with the bytes of a window that can be referenced at the
+                      window's position in place, the first at or after that position (one right at
+                      it isn't even written)
+   * Parameters:        uint32_t weak: Weak checksum of the window
+                      const char *window: Its blockSize bytes, hashed only if a weak checksum matches
+                      uint64_t position: Where the window starts in the file
+   * Return Value:      uint32_t: the block, SYNC_NO_BLOCK if there is none
+   *************************************************************************************************/
+  uint32_t find(uint32_t weak, const char *window, uint64_t position) const
+  {
+    if(!(tags[tag(weak) / 64] & (1ULL << (tag(weak) % 64))))
+      return SYNC_NO_BLOCK;
+    auto head = first.find(weak);
+    if(head == first.end())
+      return SYNC_NO_BLOCK;
+    bool hashed = false;
+    uint64_t hash = 0;
+    for(uint32_t block = head->second; block != SYNC_NO_BLOCK; block = next[block])
+      {
+	if((uint64_t)block * blockSize < position) // already written over by then
+	  continue;
+	if(!hashed)
+	  {
+	    hash = xxHash64(window, blockSize);
+	    hashed = true;
+	  }
+	if(strong[block] == hash)
+	  return block;
+      }
+    return SYNC_NO_BLOCK;
+  }
+
+  /*************************************************************************************************
+   * Function name:     delta
+   * Description:       Matches one segment of the file against the blocks and encodes it as delta
+                      operations. A match never reaches past the segment, so segments are matched on
+                      their own (on several cores at once); a block straddling a segment boundary is
+                      sent as literal bytes instead, which costs nothing for blocks at their old
+                      offsets since SYNC_SEGMENT_SIZE is a multiple of every block size.
+   * Parameters:        const char *data, size_t length: The segment's bytes
+                      uint64_t offset: Where it starts in the file
+   * Return Value:      std::string: the operations
+   *************************************************************************************************/
+  std::string delta(const char *data, size_t length, uint64_t offset) const
+  {
+    std::string ops;
+    size_t literal = 0; // first byte not sent or referenced yet
+    size_t at = 0; // start of the window
+    uint32_t copyFirst = SYNC_NO_BLOCK, copyCount = 0; // copy being extended block by block
+    RollingChecksum weak;
+
+    if(!strong.empty() && length >= blockSize)
+      weak.start(data, blockSize);
+    while(!strong.empty() && at + blockSize <= length)
+      {
+	uint32_t block = find(weak.value(), data + at, offset + at);
+	if(block == SYNC_NO_BLOCK)
+	  {
+	    if(at + blockSize < length)
+	      weak.roll(data[at], data[at + blockSize]);
+	    at++;
+	    continue;
+	  }
+	if(literal < at || block != copyFirst + copyCount) // a new copy
+	  {
+	    flushCopy(ops, copyFirst, copyCount);
+	    flushLiteral(ops, data + literal, at - literal);
+	    copyFirst = block;
+	    copyCount = 0;
+	  }
+	copyCount++;
+	at += blockSize;
+	literal = at;
+	if(at + blockSize <= length)
+	  weak.start(data + at, blockSize);
+      }
+    flushCopy(ops, copyFirst, copyCount);
+    flushLiteral(ops, data + literal, length - literal);
+    return ops;
+  }
+
+private:
+  static uint32_t tag(uint32_t weak) { return (weak ^ (weak >> SYNC_TAG_BITS)) & ((1 << SYNC_TAG_BITS) - 1); }
+  static void flushCopy(std::string &ops, uint32_t first, uint32_t count)
+  {
+    if(count > 0)
+      encodeSyncOp(ops, SYNC_OP_COPY, first, count);
+  }
+  static void flushLiteral(std::string &ops, const char *data, size_t length)
+  {
+    if(length == 0)
+      return;
+    encodeSyncOp(ops, SYNC_OP_LITERAL, length, 0);
+    ops.append(data, length);
+  }
+
+  uint32_t blockSize;
+  std::vector<uint64_t> strong; // strong hash of every block
+  std::vector<uint32_t> next; // next block with the same weak checksum, SYNC_NO_BLOCK at the end of a chain
+  std::unordered_map<uint32_t, uint32_t> first; // weak checksum -> first block with it
+  std::vector<uint64_t> tags; // bit per tag(), set if some block's weak checksum has it
+};
+
+#endif // DELTA_SYNC_H
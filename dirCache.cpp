@@ -0,0 +1,337 @@
+/********************************************************************************************************
+ * Filename: dirCache.cpp
+ * Purpose: Directory listings shared by all connections and kept current with inotify (see dirCache.h).
+ *          A listing is never rescanned once read: every event names one entry of one directory, and
+ *          that entry alone is stat()ed again and added to or dropped from the directory's names.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <fcntl.h> // openat
+#include <stdio.h> // perror, snprintf
+#include <errno.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include "protocol.h" // encodeFrameHeader
+#include "dirCache.h"
+using namespace std;
+
+// Changes to a directory's names that are reported, IN_IGNORED (watch gone) is always reported
+#define DIR_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+DirCache dirCache; // Off until start()
+
+/********************************************************************************************************************************
+ * Function name:     readDirectory
+ * Description:       Reads the names in a directory and which of them are regular files, an entry that can't be stat()ed
+                      is left out
+ * Parameters:        int dirFd: The directory (an O_PATH descriptor will do)
+                      DirNames &names: Filled with the names
+ * Return Value:      true:  if the directory could be read
+                      false: otherwise, errno tells why
+********************************************************************************************************************************/
+bool readDirectory(int dirFd, DirNames &names)
+{
+  struct dirent *dirStrPtr;    // pointer to directory structure
+  DIR *directoryPtr;           // directory pointer
+  struct stat statStr;         // stat structure
+
+  /* Open Directory (a descriptor of its own, readdir() moves its offset) */
+  int listFd = openat(dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (listFd == -1 || (directoryPtr = fdopendir(listFd)) == NULL)   {
+    int error = errno;
+    perror("Cannot open current directory: ");
+    if (listFd != -1)
+      close(listFd);
+    errno = error;
+    return false;
+  }   /* end if */
+
+  /* set errno to 0 so can check to see if the system call sets it for an error */
+  errno = 0;
+
+  /* While there are still contents in the directory to read */
+  while ((dirStrPtr = readdir(directoryPtr)) != NULL)   {
+    /* Get the status of the current entry, relative to the directory being listed */
+    if (fstatat(listFd, dirStrPtr->d_name, &statStr, 0) == -1)  {
+      string errmsg = "Error stat(" + string(dirStrPtr->d_name) + "): ";
+      perror(errmsg.c_str());
+      errno = 0;
+      continue;
+    }  // end if stat
+
+    names[dirStrPtr->d_name] = S_ISREG(statStr.st_mode);
+
+    // reset errno to 0
+    errno = 0;
+  }   /* end while */
+
+  /* Check for an error */
+  /* If there is an error, NULL will be returned and errno will be set */
+  if ((dirStrPtr == NULL) && (errno != 0))  {
+    perror("Error reading directory entry: ");
+  }  // end if error
+
+  closedir(directoryPtr); // closes listFd too
+  return true;
+}// end readDirectory
+/********************************************************************************************************************************
+ * Function name:     formatListing
+ * Description:       Turns directory names into the FRAME_MSG frame the "dir" command sends, regular files are marked
+                      with **
+ * Parameters:        const DirNames &names: The names to list
+ * Return Value:      CachedFilePtr: the frame (header and text), sent like cached file contents
+********************************************************************************************************************************/
+CachedFilePtr formatListing(const DirNames &names)
+{
+  static const string title = "\nFiles are  Marked With ** \n\n";
+  size_t length = title.length();
+  for(auto name = names.begin(); name != names.end(); ++name)
+    length += name->first.length() + (name->second ? 5 : 1);
+
+  shared_ptr<CachedFile> frame = make_shared<CachedFile>();
+  frame->data.reserve(FRAME_HEADER_SIZE + length);
+  frame->data.resize(FRAME_HEADER_SIZE);
+  encodeFrameHeader(&frame->data[0], FRAME_MSG, 0, length);
+  frame->data += title;
+  for(auto name = names.begin(); name != names.end(); ++name)
+    {
+      frame->data += name->first; // Add to the directory list
+      frame->data += name->second ? "  **\n" : "\n"; // append ** if its a file
+    }
+  frame->size = frame->data.length();
+  return frame;
+}// end formatListing
+/********************************************************************************************************************************
+ * Function name:     DirCache
+ * Description:       Creates an empty cache that is off
+ * Parameters:        none
+ * Return Value:      none
+********************************************************************************************************************************/
+DirCache::DirCache()
+  : inotifyFd(-1), hits(0), misses(0), updates(0)
+{
+}
+/********************************************************************************************************************************
+ * Function name:     start
+ * Description:       Turns the cache on: creates the inotify instance and the thread reading its events. Meant to be
+                      called once before the first session.
+ * Parameters:        none
+ * Return Value:      true:  if the cache is on
+                      false: if inotify is not available (listings are read for every "dir" instead)
+********************************************************************************************************************************/
+bool DirCache::start()
+{
+  int fd = inotify_init1(IN_CLOEXEC);
+  if(fd == -1)
+    {
+      perror("Couldn't Start inotify, Directory Listings Won't Be Cached");
+      return false;
+    }
+  inotifyFd = fd;
+  thread(watchThread, this).detach();
+  return true;
+}// end start
+/********************************************************************************************************************************
+ * Function name:     lookup
+ * Description:       Finds the listing of a directory. The first time a directory is listed a watch is put on it and it
+                      is read without holding the lock; events that arrive meanwhile are applied once it is read.
+ * Parameters:        int dirFd: The directory to list
+ * Return Value:      CachedFilePtr: the listing frame, NULL if the caller has to read the directory itself (it can't be
+                                     watched or read, or another thread is still reading it)
+********************************************************************************************************************************/
+CachedFilePtr DirCache::lookup(int dirFd)
+{
+  struct stat info;
+  char watchPath[64]; // /proc/self/fd/<n>, inotify only watches paths
+
+  if(fstat(dirFd, &info) == -1)
+    return CachedFilePtr();
+  DirId id = { info.st_dev, info.st_ino };
+  ListingPtr listing;
+  {
+    lock_guard<mutex> guard(lock);
+
+    auto entry = entries.find(id);
+    if(info.st_nlink == 0) // removed, but still open (by the cache too, so no IN_IGNORED until it is dropped)
+      {
+	if(entry != entries.end() && !entry->second->reading)
+	  remove(entry->second, true);
+	return CachedFilePtr();
+      }
+    if(entry != entries.end() && !entry->second->reading)
+      {
+	hits++;
+	lru.splice(lru.begin(), lru, entry->second->age); // now the most recently listed
+	if(!entry->second->frame) // changed since it was last sent
+	  entry->second->frame = formatListing(entry->second->names);
+	return entry->second->frame;
+      }
+    misses++;
+    if(entry != entries.end())
+      return CachedFilePtr();
+
+    int pathFd = openat(dirFd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(pathFd == -1)
+      return CachedFilePtr();
+    snprintf(watchPath, sizeof(watchPath), "/proc/self/fd/%d", pathFd);
+    int watch = inotify_add_watch(inotifyFd, watchPath, DIR_WATCH_EVENTS);
+    if(watch == -1) // out of watches (fs.inotify.max_user_watches) or no /proc
+      {
+	close(pathFd);
+	return CachedFilePtr();
+      }
+
+    while(entries.size() >= DIR_CACHE_ENTRIES)
+      remove(entries.find(lru.back())->second, true);
+    listing = make_shared<Listing>();
+    listing->id = id;
+    listing->dirFd = pathFd;
+    listing->watch = watch;
+    listing->reading = true;
+    lru.push_front(id);
+    listing->age = lru.begin();
+    entries[id] = listing;
+    watches[watch] = listing;
+  }
+
+  DirNames names;
+  bool wasRead = readDirectory(listing->dirFd, names);
+
+  lock_guard<mutex> guard(lock);
+  auto entry = entries.find(id);
+  if(entry == entries.end() || entry->second != listing) // dropped while it was read (deleted, overflow)
+    return wasRead ? formatListing(names) : CachedFilePtr();
+  if(!wasRead)
+    {
+      remove(listing, true);
+      return CachedFilePtr();
+    }
+  listing->names.swap(names);
+  for(auto name = listing->changed.begin(); name != listing->changed.end(); ++name)
+    recheck(*listing, *name);
+  listing->changed.clear();
+  listing->reading = false;
+  listing->frame = formatListing(listing->names);
+  return listing->frame;
+}// end lookup
+/********************************************************************************************************************************
+ * Function name:     stats
+ * Description:       Describes the cache counters for the "stats" command
+ * Parameters:        none
+ * Return Value:      string: the counters in text form
+********************************************************************************************************************************/
+string DirCache::stats()
+{
+  char text[256];
+  lock_guard<mutex> guard(lock);
+
+  if(!enabled())
+    return "Dir Cache: off";
+  snprintf(text, sizeof(text), "Dir Cache: %llu hits, %llu misses, %llu entries updated, %zu directories watched",
+	   hits, misses, updates, entries.size());
+  return text;
+}// end stats
+/********************************************************************************************************************************
+ * Function name:     watchThread
+ * Description:       Reads inotify events for as long as the server runs and hands them to handleEvents()
+ * Parameters:        DirCache *cache: The cache the events are for
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void DirCache::watchThread(DirCache *cache)
+{
+  alignas(struct inotify_event) char events[65536];
+
+  while(true)
+    {
+      ssize_t length = read(cache->inotifyFd, events, sizeof(events));
+      if(length < 0)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  perror("Reading inotify Events Failed ! ");
+	  return;
+	}
+      cache->handleEvents(events, length);
+    }
+}// end watchThread
+/********************************************************************************************************************************
+ * Function name:     handleEvents
+ * Description:       Applies a batch of inotify events: the entry each event names is looked at again, a directory whose
+                      watch is gone (deleted, unmounted) is dropped, and everything is dropped when the kernel lost events
+ * Parameters:        const char *events: The events read from the inotify descriptor
+                      ssize_t length: Number of bytes at events
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void DirCache::handleEvents(const char *events, ssize_t length)
+{
+  lock_guard<mutex> guard(lock);
+
+  for(ssize_t at = 0; at < length; )
+    {
+      const struct inotify_event *event = (const struct inotify_event *)(events + at);
+      at += sizeof(struct inotify_event) + event->len;
+
+      if(event->mask & IN_Q_OVERFLOW) // events were lost, no listing can be trusted
+	{
+	  while(!lru.empty())
+	    remove(entries.find(lru.back())->second, true);
+	  continue;
+	}
+      auto watch = watches.find(event->wd);
+      if(watch == watches.end()) // a directory already dropped
+	continue;
+      ListingPtr listing = watch->second;
+      if(event->mask & IN_IGNORED)
+	{
+	  remove(listing, false);
+	  continue;
+	}
+      if(event->len == 0)
+	continue;
+
+      updates++;
+      if(listing->reading)
+	listing->changed.insert(event->name);
+      else
+	recheck(*listing, event->name);
+    }
+}// end handleEvents
+/********************************************************************************************************************************
+ * Function name:     recheck
+ * Description:       Brings one name of a listing up to date (the lock must be held): it is added or updated if it is
+                      there now, dropped otherwise
+ * Parameters:        Listing &listing: The directory the name is in
+                      const string &name: The name an event was about
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void DirCache::recheck(Listing &listing, const string &name)
+{
+  struct stat info;
+
+  if(fstatat(listing.dirFd, name.c_str(), &info, 0) == 0)
+    listing.names[name] = S_ISREG(info.st_mode);
+  else
+    listing.names.erase(name);
+  listing.frame.reset();
+}// end recheck
+/********************************************************************************************************************************
+ * Function name:     remove
+ * Description:       Drops a listing (the lock must be held), clients being sent its frame keep it
+ * Parameters:        ListingPtr listing: The listing to drop
+                      bool removeWatch: also remove its inotify watch (false when the kernel already did)
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void DirCache::remove(ListingPtr listing, bool removeWatch)
+{
+  if(removeWatch)
+    inotify_rm_watch(inotifyFd, listing->watch);
+  close(listing->dirFd);
+  watches.erase(listing->watch);
+  lru.erase(listing->age);
+  entries.erase(listing->id);
+}// end remove
@@ -0,0 +1,88 @@
+/********************************************************************************************************
+ * Filename: dirCache.h
+ * Purpose: Directory listings kept ready to send and shared by every connection of the server
+ *          process. A directory is read once, after that inotify reports each name created, deleted
+ *          or renamed in it and only that name is looked at again, so a listing of a big directory
+ *          costs one fstat() instead of a readdir() and a stat() per entry.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string>
+#include <map>
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include "fileCache.h" // CachedFilePtr
+
+#define DIR_CACHE_ENTRIES 128 // directories (inotify watches) kept at most, least recently listed dropped first
+
+typedef std::map<std::string, bool> DirNames; // name -> true for regular files, sorted for the listing
+
+bool readDirectory(int dirFd, DirNames &names);
+CachedFilePtr formatListing(const DirNames &names);
+
+/*************************************************************************************************
+ * Class name:        DirCache
+ * Description:       LRU cache of directory listings keyed by device and inode, each held as a
+                      complete FRAME_MSG frame so every client is sent the same bytes. A thread of
+                      its own reads the inotify events and patches the names of the directories
+                      they are about, the frame is rebuilt from the names on the next listing.
+                      Every member is safe to call from any thread.
+ *************************************************************************************************/
+class DirCache
+{
+public:
+  DirCache();
+
+  bool start();
+  bool enabled() const { return inotifyFd != -1; }
+
+  CachedFilePtr lookup(int dirFd);
+  std::string stats();
+
+private:
+  struct DirId
+  {
+    dev_t device;
+    ino_t inode;
+    bool operator==(const DirId &other) const { return device == other.device && inode == other.inode; }
+  };
+  struct DirIdHash
+  {
+    size_t operator()(const DirId &id) const { return std::hash<unsigned long long>()(id.inode * 31 + id.device); }
+  };
+  struct Listing
+  {
+    DirId id;
+    int dirFd; // O_PATH descriptor of the directory, names from events are stat()ed relative to it
+    int watch; // inotify watch descriptor
+    DirNames names;
+    CachedFilePtr frame; // names as sent, NULL until rebuilt after a change
+    bool reading; // the first readDirectory() is still running without the lock
+    std::set<std::string> changed; // names events reported while reading, looked at again after it
+    std::list<DirId>::iterator age; // place in lru
+  };
+  typedef std::shared_ptr<Listing> ListingPtr;
+
+  static void watchThread(DirCache *cache);
+  void handleEvents(const char *events, ssize_t length);
+  void recheck(Listing &listing, const std::string &name);
+  void remove(ListingPtr listing, bool removeWatch);
+
+  int inotifyFd; // -1 while the cache is off
+  std::mutex lock; // guards everything below
+  std::unordered_map<DirId, ListingPtr, DirIdHash> entries;
+  std::unordered_map<int, ListingPtr> watches; // the same listings by watch descriptor
+  std::list<DirId> lru; // most recently listed first
+  unsigned long long hits, misses, updates;
+};
+
+extern DirCache dirCache; // shared by every session of the process
+
+#endif // DIR_CACHE_H
@@ -0,0 +1,380 @@
+/********************************************************************************************************
+ * Filename: eventLoop.cpp
+ * Purpose: Event driven server models (see eventLoop.h). Each thread runs its own epoll instance and
+ *          owns the connections it accepts until they are closed.
+ *          -m epoll:   one listening socket registered in every loop with EPOLLEXCLUSIVE, so a new
+ *                      connection wakes one thread only
+ *          -m reactor: every loop has its own SO_REUSEPORT listening socket and is pinned to a core,
+ *                      the kernel spreads new connections across the sockets so accepts never share
+ *                      a queue or a lock
+ *          Sessions waiting for the compress pool (a compressed block, a sync segment, checksums) don't
+ *          hold up their loop: the pool writes to the loop's eventfd when a job is done and the loop
+ *          runs them again.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h> // setrlimit
+#include <linux/filter.h> // reuseport steering program
+#include <pthread.h> // pthread_setaffinity_np
+#include <sched.h> // cpu_set_t
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <stdio.h> // perror
+#include <errno.h>
+#include <unistd.h>
+#include <iostream>
+#include <string.h> // strerror
+#include <thread>
+#include <vector>
+#include <unordered_set>
+#include "session.h"
+#include "logger.h"
+#include "eventLoop.h"
+using namespace std;
+
+struct EventLoop
+{
+  int id; // number of the thread running the loop
+  int epollFd; // epoll instance watching the listening socket and every connection of this loop
+  int listeningSock; // shared by all loops (-m epoll) or owned by this loop (-m reactor)
+  int cpu; // core the thread is pinned to, -1 for none
+  long connections; // connections currently owned by this loop
+  int wakeFd; // eventfd the compress pool writes to when a job of one of the loop's sessions is done
+  unordered_set<Session*> poolWaiters; // sessions stopped until the compress pool is done with a job of theirs
+};
+
+void initEventLoop(EventLoop &loop, int id, int listeningSock, uint32_t listenEvents);
+void startEventLoops(vector<EventLoop> &loops);
+void steerByCpu(vector<EventLoop> &loops);
+void makeNonBlocking(int sockfd);
+void eventLoopThread(EventLoop *loop);
+void acceptConnections(EventLoop &loop);
+void runSession(EventLoop &loop, Session *session);
+void runPoolWaiters(EventLoop &loop);
+void closeSession(EventLoop &loop, Session *session);
+
+/********************************************************************************************************************************
+ * Function name:     runEventLoops
+ * Description:       Serves clients with numThreads event loops, the calling thread runs the first one. Never returns.
+ * Parameters:        int listeningSock: The listening socket from connectToClient()
+                      int numThreads: How many event loops (threads) to run
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void runEventLoops(int listeningSock, int numThreads)
+{
+  makeNonBlocking(listeningSock);
+  raiseFileLimit();
+
+  vector<EventLoop> loops(numThreads);
+  for(int i = 0; i < numThreads; i++)
+    initEventLoop(loops[i], i, listeningSock, EPOLLIN | EPOLLEXCLUSIVE);
+
+  cout << "Serving With " << numThreads << " Event Loop Thread(s)" << endl;
+  startEventLoops(loops);
+}// end runEventLoops
+/********************************************************************************************************************************
+ * Function name:     runReactor
+ * Description:       Serves clients with one event loop per listening socket, each loop on its own thread pinned to its
+                      own core (loop i on core i, as long as core i may be used). Never returns.
+ * Parameters:        vector<int> &listeningSocks: Listening sockets bound to the same address with SO_REUSEPORT
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void runReactor(vector<int> &listeningSocks)
+{
+  cpu_set_t allowed; // cores this process may run on
+  int numThreads = listeningSocks.size();
+
+  raiseFileLimit();
+  CPU_ZERO(&allowed);
+  if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    perror("sched_getaffinity");
+
+  vector<EventLoop> loops(numThreads);
+  for(int i = 0; i < numThreads; i++)
+    {
+      makeNonBlocking(listeningSocks[i]);
+      // Nothing else waits on this socket, so there is no herd to keep from waking
+      initEventLoop(loops[i], i, listeningSocks[i], EPOLLIN);
+      if(i < CPU_SETSIZE && CPU_ISSET(i, &allowed))
+	loops[i].cpu = i;
+    }
+  steerByCpu(loops);
+
+  cout << "Serving With " << numThreads << " Reactor Thread(s), One Listening Socket Each" << endl;
+  startEventLoops(loops);
+}// end runReactor
+/********************************************************************************************************************************
+ * Function name:     initEventLoop
+ * Description:       Creates the epoll instance of a loop and registers its listening socket and its compress pool eventfd
+ * Parameters:        EventLoop &loop: The loop to set up
+                      int id: Number of the loop
+                      int listeningSock: Listening socket the loop accepts from
+                      uint32_t listenEvents: epoll events to watch the listening socket for
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void initEventLoop(EventLoop &loop, int id, int listeningSock, uint32_t listenEvents)
+{
+  loop.id = id;
+  loop.listeningSock = listeningSock;
+  loop.cpu = -1;
+  loop.connections = 0;
+  if((loop.epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+      perror("epoll_create1");
+      exit(EXIT_FAILURE);
+    }
+  if((loop.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    {
+      perror("eventfd");
+      exit(EXIT_FAILURE);
+    }
+
+  // The listening socket is the only entry with a NULL pointer
+  struct epoll_event event;
+  event.events = listenEvents;
+  event.data.ptr = NULL;
+  if(epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, listeningSock, &event) == -1)
+    {
+      perror("epoll_ctl: listening socket");
+      exit(EXIT_FAILURE);
+    }
+  // The eventfd is the only entry pointing at the loop, level triggered so a wake is never lost
+  event.events = EPOLLIN;
+  event.data.ptr = &loop;
+  if(epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, loop.wakeFd, &event) == -1)
+    {
+      perror("epoll_ctl: eventfd");
+      exit(EXIT_FAILURE);
+    }
+}// end initEventLoop
+/********************************************************************************************************************************
+ * Function name:     startEventLoops
+ * Description:       Runs every loop on its own thread, the calling thread runs the first one. Never returns.
+ * Parameters:        vector<EventLoop> &loops: The loops to run
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void startEventLoops(vector<EventLoop> &loops)
+{
+  vector<thread> threads;
+  for(size_t i = 1; i < loops.size(); i++)
+    threads.push_back(thread(eventLoopThread, &loops[i]));
+  eventLoopThread(&loops[0]);
+}// end startEventLoops
+/********************************************************************************************************************************
+ * Function name:     steerByCpu
+ * Description:       When loop i runs on core i for every loop, attaches a classic BPF program to the SO_REUSEPORT group
+                      that hands each new connection to the socket of the core that received it, so the connection is
+                      served where its packets are already being processed. Otherwise the kernel's hash is kept.
+ * Parameters:        vector<EventLoop> &loops: The reactor loops, in the order their sockets joined the group
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void steerByCpu(vector<EventLoop> &loops)
+{
+  for(size_t i = 0; i < loops.size(); i++)
+    if(loops[i].cpu != (int)i)
+      return;
+
+  // socket index = cpu % number of sockets
+  struct sock_filter code[] =
+    {
+      { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },
+      { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)loops.size() },
+      { BPF_RET | BPF_A, 0, 0, 0 }
+    };
+  struct sock_fprog program;
+  program.len = sizeof(code) / sizeof(code[0]);
+  program.filter = code;
+
+  // Attaching to one socket sets the program for the whole group
+  if(setsockopt(loops[0].listeningSock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == -1)
+    perror("Couldn't Steer Connections By CPU (kernel hash used instead)");
+}// end steerByCpu
+/********************************************************************************************************************************
+ * Function name:     makeNonBlocking
+ * Description:       Makes a listening socket non-blocking, accept() has to return EAGAIN once the backlog is empty
+ * Parameters:        int sockfd: The listening socket
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void makeNonBlocking(int sockfd)
+{
+  if(fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+      perror("Couldn't Make Listening Socket Non-Blocking");
+      exit(EXIT_FAILURE);
+    }
+}// end makeNonBlocking
+/********************************************************************************************************************************
+ * Function name:     eventLoopThread
+ * Description:       Waits for socket events and advances the sessions they belong to. Sockets are edge triggered, so a
+                      session is only run again once its socket changed state (or the compress pool finished a job of its),
+                      and it runs until it would block.
+ * Parameters:        EventLoop *loop: The loop to run
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void eventLoopThread(EventLoop *loop)
+{
+  struct epoll_event events[MAX_EVENTS];
+
+  if(loop->cpu != -1)
+    {
+      cpu_set_t core;
+      CPU_ZERO(&core);
+      CPU_SET(loop->cpu, &core);
+      int error = pthread_setaffinity_np(pthread_self(), sizeof(core), &core);
+      if(error != 0)
+	{
+	  cerr << "Couldn't Pin Thread " << loop->id << " To Core " << loop->cpu << ": " << strerror(error) << endl;
+	  loop->cpu = -1;
+	}
+    }
+
+  while(true)
+    {
+      int numEvents = epoll_wait(loop->epollFd, events, MAX_EVENTS, -1);
+      if(numEvents == -1)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  perror("epoll_wait");
+	  exit(EXIT_FAILURE);
+	}
+
+      bool poolWoke = false;
+      for(int i = 0; i < numEvents; i++)
+	{
+	  if(events[i].data.ptr == NULL) // New connections are waiting
+	    {
+	      acceptConnections(*loop);
+	      continue;
+	    }
+	  if(events[i].data.ptr == loop) // The compress pool finished jobs, see below
+	    {
+	      poolWoke = true;
+	      continue;
+	    }
+
+	  Session *session = (Session *)events[i].data.ptr;
+	  // Errors and hang ups are found by the next recv()/send(), so they count as readable/writable
+	  if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+	    session->setReadable();
+	  if(events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+	    session->setWritable();
+	  runSession(*loop, session);
+	}
+      // Only once every socket event of the batch is handled: a waiter this closes (and deletes) may have an event of
+      // its own further on in the batch
+      if(poolWoke)
+	runPoolWaiters(*loop);
+    }
+}// end eventLoopThread
+/********************************************************************************************************************************
+ * Function name:     acceptConnections
+ * Description:       Accepts every pending connection and starts a session for each, the new socket is watched for both
+                      directions once so its interest never has to be changed
+ * Parameters:        EventLoop &loop: The loop that will own the connections
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void acceptConnections(EventLoop &loop)
+{
+  while(true)
+    {
+      struct sockaddr_in address;
+      socklen_t addrlen = sizeof(address);
+      int client_socket = accept4(loop.listeningSock, (struct sockaddr *)&address, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if(client_socket == -1)
+	{
+	  if(errno == EINTR || errno == ECONNABORTED)
+	    continue;
+	  if(errno != EAGAIN && errno != EWOULDBLOCK) // Out of descriptors, the connection stays in the backlog
+	    LOG(LOG_ERROR, "accept: %m");
+	  return;
+	}
+
+      Session *session = new Session(client_socket, getIpAddress(address));
+      struct epoll_event event;
+      event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      event.data.ptr = session;
+      if(epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, client_socket, &event) == -1)
+	{
+	  LOG(LOG_ERROR, "epoll_ctl: client socket: %m");
+	  delete session;
+	  continue;
+	}
+      loop.connections++;
+
+      session->setPoolWake(loop.wakeFd);
+      // Send the hello message right away
+      runSession(loop, session);
+    }
+}// end acceptConnections
+/********************************************************************************************************************************
+ * Function name:     runSession
+ * Description:       Runs a session until it would block, closes it if it is finished and remembers it if it stopped for
+                      the compress pool
+ * Parameters:        EventLoop &loop: The loop that owns the connection
+                      Session *session: The session
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void runSession(EventLoop &loop, Session *session)
+{
+  if(session->run() == SESSION_CLOSE)
+    closeSession(loop, session);
+  else if(session->waitingForPool())
+    loop.poolWaiters.insert(session);
+}// end runSession
+/********************************************************************************************************************************
+ * Function name:     runPoolWaiters
+ * Description:       Runs every session that was waiting for the compress pool, those whose job is still not done wait again.
+                      Called between epoll_wait() batches only, sessions it closes are deleted.
+ * Parameters:        EventLoop &loop: The loop woken by the pool
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void runPoolWaiters(EventLoop &loop)
+{
+  uint64_t jobsDone;
+  if(read(loop.wakeFd, &jobsDone, sizeof(jobsDone)) == -1) // resets the count, so the eventfd stops being readable
+    return;
+
+  unordered_set<Session*> waiters;
+  waiters.swap(loop.poolWaiters);
+  for(Session *session : waiters)
+    runSession(loop, session);
+}// end runPoolWaiters
+/********************************************************************************************************************************
+ * Function name:     closeSession
+ * Description:       Stops watching a finished connection and deletes its session (which closes the socket)
+ * Parameters:        EventLoop &loop: The loop that owns the connection
+                      Session *session: The finished session
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void closeSession(EventLoop &loop, Session *session)
+{
+  epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, session->socket(), NULL);
+  loop.poolWaiters.erase(session);
+  delete session;
+  loop.connections--;
+}// end closeSession
+/********************************************************************************************************************************
+ * Function name:     raiseFileLimit
+ * Description:       Raises the open file limit to the hard limit, every connection needs a descriptor (two while a
+                      download is in progress)
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void raiseFileLimit()
+{
+  struct rlimit limit;
+
+  if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+      limit.rlim_cur = limit.rlim_max;
+      if(setrlimit(RLIMIT_NOFILE, &limit) == -1)
+	perror("Couldn't Raise Open File Limit");
+    }
+  cout << "Open File Limit: " << limit.rlim_cur << endl;
+}// end raiseFileLimit
@@ -0,0 +1,19 @@
+/********************************************************************************************************
+ * Filename: eventLoop.h
+ * Purpose: Event driven server models: non-blocking sockets watched with edge triggered epoll, every
+ *          connection is a Session (session.h) advanced whenever its socket is ready, so one thread
+ *          holds as many idle clients as there are file descriptors
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <vector>
+
+#define MAX_EVENTS 256 // epoll events handled per epoll_wait()
+
+void runEventLoops(int listeningSock, int numThreads);
+void runReactor(std::vector<int> &listeningSocks);
+void raiseFileLimit();
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,166 @@
+/********************************************************************************************************
+ * Filename: fileCache.cpp
+ * Purpose: In-memory cache of file contents shared by all connections (see fileCache.h). A file
+ *          changed on disk gets a new mtime or size, so its stale contents are never served: the
+ *          next lookup finds the mismatch, drops the old entry and reads the new version.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h> // snprintf
+#include <errno.h>
+#include <unistd.h>
+#include <string>
+#include "fileCache.h"
+using namespace std;
+
+FileCache fileCache; // Sized with -C, off until setCapacity()
+
+/********************************************************************************************************************************
+ * Function name:     FileCache
+ * Description:       Creates an empty cache that is off (capacity 0)
+ * Parameters:        none
+ * Return Value:      none
+********************************************************************************************************************************/
+FileCache::FileCache()
+  : capacity(0), used(0), hits(0), misses(0), invalidations(0), evictions(0)
+{
+}
+/********************************************************************************************************************************
+ * Function name:     setCapacity
+ * Description:       Sets the byte budget of the cache, 0 turns it off. Meant to be called once before the first session.
+ * Parameters:        size_t bytes: Most bytes of file contents to keep
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void FileCache::setCapacity(size_t bytes)
+{
+  lock_guard<mutex> guard(lock);
+  capacity = bytes;
+}// end setCapacity
+/********************************************************************************************************************************
+ * Function name:     lookup
+ * Description:       Finds the cached contents of a file, only if they are of the version described by info. An entry of an
+                      older version is dropped on the spot.
+ * Parameters:        const struct stat &info: stat() of the file being downloaded
+ * Return Value:      CachedFilePtr: the contents, NULL on a miss
+********************************************************************************************************************************/
+CachedFilePtr FileCache::lookup(const struct stat &info)
+{
+  FileId id = { info.st_dev, info.st_ino };
+  lock_guard<mutex> guard(lock);
+
+  auto entry = entries.find(id);
+  if(entry != entries.end() && !sameVersion(*entry->second.file, info))
+    {
+      remove(entry); // the file changed since it was cached
+      invalidations++;
+      entry = entries.end();
+    }
+  if(entry == entries.end())
+    {
+      misses++;
+      return CachedFilePtr();
+    }
+
+  hits++;
+  lru.splice(lru.begin(), lru, entry->second.age); // now the most recently used
+  return entry->second.file;
+}// end lookup
+/********************************************************************************************************************************
+ * Function name:     load
+ * Description:       Reads a whole file into the cache after a miss, making room by dropping the least recently used files.
+                      Files that don't fit() (bigger than 1/CACHE_ENTRY_SHARE of the cache) aren't cached. The file is read
+                      without holding the lock, if it changed while it was read nothing is cached. Event loops call this from
+                      the compress pool, it reads the whole file.
+ * Parameters:        int fileFd: The open file (its offset is not used)
+                      const struct stat &info: fstat() of fileFd
+ * Return Value:      CachedFilePtr: the contents, NULL if the file wasn't cached
+********************************************************************************************************************************/
+CachedFilePtr FileCache::load(int fileFd, const struct stat &info)
+{
+  if(!fits(info))
+    return CachedFilePtr();
+
+  shared_ptr<CachedFile> file = make_shared<CachedFile>();
+  file->data.resize(info.st_size);
+  file->device = info.st_dev;
+  file->inode = info.st_ino;
+  file->mtime = info.st_mtim;
+  file->size = info.st_size;
+
+  off_t done = 0;
+  while(done < info.st_size)
+    {
+      ssize_t bytesRead = pread(fileFd, &file->data[done], info.st_size - done, done);
+      if(bytesRead < 0 && errno == EINTR)
+	continue;
+      if(bytesRead <= 0) // unreadable, or shrank after stat()
+	return CachedFilePtr();
+      done += bytesRead;
+    }
+  struct stat after;
+  if(fstat(fileFd, &after) == -1 || !sameVersion(*file, after)) // written to while it was read
+    return CachedFilePtr();
+
+  FileId id = { info.st_dev, info.st_ino };
+  lock_guard<mutex> guard(lock);
+
+  auto entry = entries.find(id);
+  if(entry != entries.end()) // another connection cached it first
+    remove(entry);
+  while(used + file->size > capacity && !lru.empty())
+    {
+      remove(entries.find(lru.back()));
+      evictions++;
+    }
+  lru.push_front(id);
+  Entry &added = entries[id];
+  added.file = file;
+  added.age = lru.begin();
+  used += file->size;
+  return file;
+}// end load
+/********************************************************************************************************************************
+ * Function name:     stats
+ * Description:       Describes the cache counters for the "stats" command
+ * Parameters:        none
+ * Return Value:      string: the counters in text form
+********************************************************************************************************************************/
+string FileCache::stats()
+{
+  char text[256];
+  lock_guard<mutex> guard(lock);
+
+  if(capacity == 0)
+    return "File Cache: off";
+  unsigned long long lookups = hits + misses;
+  snprintf(text, sizeof(text), "File Cache: %llu hits, %llu misses (%.1f%% hit rate), %llu invalidated, %llu evicted, "
+	   "%zu files / %.1f MB of %.1f MB", hits, misses, lookups ? 100.0 * hits / lookups : 0.0, invalidations, evictions,
+	   entries.size(), used / 1048576.0, capacity / 1048576.0);
+  return text;
+}// end stats
+/********************************************************************************************************************************
+ * Function name:     sameVersion
+ * Description:       Tells whether cached contents were read from the version of the file described by info
+ * Parameters:        const CachedFile &file: The cached contents
+                      const struct stat &info: stat() of the file now
+ * Return Value:      true:  if the mtime and size are unchanged
+                      false: otherwise
+********************************************************************************************************************************/
+bool FileCache::sameVersion(const CachedFile &file, const struct stat &info)
+{
+  return file.size == info.st_size && file.mtime.tv_sec == info.st_mtim.tv_sec && file.mtime.tv_nsec == info.st_mtim.tv_nsec;
+}// end sameVersion
+/********************************************************************************************************************************
+ * Function name:     remove
+ * Description:       Drops an entry (the lock must be held), downloads still using its contents keep them
+ * Parameters:        entry: The entry to drop
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void FileCache::remove(unordered_map<FileId, Entry, FileIdHash>::iterator entry)
+{
+  used -= entry->second.file->size;
+  lru.erase(entry->second.age);
+  entries.erase(entry);
+}// end remove
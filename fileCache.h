@@ -0,0 +1,89 @@
+/********************************************************************************************************
+ * Filename: fileCache.h
+ * Purpose: Contents of frequently downloaded files kept in memory and shared by every connection of
+ *          the server process, so a popular file is opened and read once instead of once per
+ *          download. Bounded by a byte budget, least recently used files are dropped first.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <stddef.h>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+
+#define DEFAULT_CACHE_MB 64 // cache size of the threaded server models unless -C says otherwise
+#define CACHE_ENTRY_SHARE 16 // one file may take at most 1/16 of the cache, bigger ones go out with sendfile
+
+/*************************************************************************************************
+ * Struct name:       CachedFile
+ * Description:       The contents of one version of a file, never changed once cached. A download
+                      holds on to it until it is sent, even if the cache drops it in the meantime.
+ *************************************************************************************************/
+struct CachedFile
+{
+  std::string data; // the whole file
+  dev_t device; // which file
+  ino_t inode;
+  struct timespec mtime; // which version of it
+  off_t size;
+};
+
+typedef std::shared_ptr<const CachedFile> CachedFilePtr;
+
+/*************************************************************************************************
+ * Class name:        FileCache
+ * Description:       LRU cache of CachedFiles keyed by device and inode, an entry is only handed
+                      out while the file's mtime and size are still the ones it was read with.
+                      Every member is safe to call from any thread.
+ *************************************************************************************************/
+class FileCache
+{
+public:
+  FileCache();
+
+  void setCapacity(size_t bytes);
+  bool enabled() const { return capacity != 0; }
+  bool fits(const struct stat &info) const { return S_ISREG(info.st_mode) && (size_t)info.st_size <= capacity / CACHE_ENTRY_SHARE; }
+
+  CachedFilePtr lookup(const struct stat &info);
+  CachedFilePtr load(int fileFd, const struct stat &info);
+  std::string stats();
+
+private:
+  struct FileId
+  {
+    dev_t device;
+    ino_t inode;
+    bool operator==(const FileId &other) const { return device == other.device && inode == other.inode; }
+  };
+  struct FileIdHash
+  {
+    size_t operator()(const FileId &id) const { return std::hash<unsigned long long>()(id.inode * 31 + id.device); }
+  };
+  struct Entry
+  {
+    CachedFilePtr file;
+    std::list<FileId>::iterator age; // place in lru
+  };
+
+  static bool sameVersion(const CachedFile &file, const struct stat &info);
+  void remove(std::unordered_map<FileId, Entry, FileIdHash>::iterator entry);
+
+  std::mutex lock; // guards everything below
+  std::unordered_map<FileId, Entry, FileIdHash> entries;
+  std::list<FileId> lru; // most recently used first
+  size_t capacity; // byte budget, 0 when the cache is off
+  size_t used; // bytes of file contents cached
+  unsigned long long hits, misses, invalidations, evictions;
+};
+
+extern FileCache fileCache; // shared by every session of the process
+
+#endif // FILE_CACHE_H
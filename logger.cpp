@@ -0,0 +1,418 @@
+/********************************************************************************************************
+ * Filename: logger.cpp
+ * Purpose: The server log (see logger.h). Every thread that logs gets a ring of records the first time,
+ *          the writer thread goes around all rings, formats what they hold and writes it out.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+
+#include <sys/types.h>
+#include <stdio.h> // snprintf
+#include <stdlib.h> // atexit
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h> // pthread_atfork, pthread_sigmask
+#include <signal.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <new> // placement new
+#include <thread>
+#include <chrono>
+#include "logger.h"
+using namespace std;
+
+static_assert(sizeof(LogRecord) == LOG_RECORD_SIZE, "LogRecord must be LOG_RECORD_SIZE bytes");
+static_assert((LOG_RING_RECORDS & (LOG_RING_RECORDS - 1)) == 0, "LOG_RING_RECORDS must be a power of two");
+
+int logLevel = LOG_INFO; // Selected with -L
+unsigned logRate = LOG_DEFAULT_RATE; // Selected with -R
+
+static const char *levelNames[] = { "off", "error", "warn", "info", "debug" };
+
+/*************************************************************************************************
+ * Struct name:       LogRing
+ * Description:       Records of one thread, a single producer single consumer queue: the thread
+                      only moves head, the writer only moves tail
+ *************************************************************************************************/
+struct LogRing
+{
+  LogRecord records[LOG_RING_RECORDS];
+  std::atomic<uint64_t> head; // records filled so far
+  char headLine[64]; // keeps head and tail off each other's cache line
+  std::atomic<uint64_t> tail; // records written so far
+  char tailLine[64];
+  std::atomic<unsigned long long> logged, dropped; // lines handed to the writer, lines dropped while the ring was full
+};
+
+/*************************************************************************************************
+ * Struct name:       LogRings
+ * Description:       Every ring of the process. Never destroyed, the writer thread may still be
+                      at it while exit() runs the destructors.
+ *************************************************************************************************/
+struct LogRings
+{
+  mutex lock; // guards rings and writerPid
+  vector<LogRing*> rings; // one per thread that logged, kept when the thread ends
+  pid_t writerPid = 0; // process the writer thread runs in, fork() leaves it behind
+  mutex draining; // held by whoever reads the rings, there must only be one reader
+  mutex sleeping; // with wake, what the writer sleeps on while the rings are empty
+  condition_variable wake; // notified by a thread whose ring is half full
+  std::atomic<unsigned long long> suppressed; // lines dropped by rate limits
+};
+static LogRings &logRings = *new LogRings;
+static thread_local LogRing *threadRing = NULL;
+
+LogRing* addRing();
+void startWriter();
+void writerThread();
+bool drainRings(string &batch);
+void formatRecord(const LogRecord &record, string &line);
+void writeAll(const char *data, size_t length);
+void flushLog();
+
+/********************************************************************************************************************************
+ * Function name:     logClaim
+ * Description:       The next free record of the calling thread's ring, its ring is made the first time
+ * Parameters:        none
+ * Return Value:      LogRecord*: the record to fill and logCommit(), NULL if the ring is full (the line is dropped)
+********************************************************************************************************************************/
+LogRecord* logClaim()
+{
+  LogRing *ring = threadRing != NULL ? threadRing : addRing();
+  uint64_t head = ring->head.load(memory_order_relaxed);
+
+  if(head - ring->tail.load(memory_order_acquire) == LOG_RING_RECORDS)
+    {
+      ring->dropped.fetch_add(1, memory_order_relaxed);
+      return NULL;
+    }
+  return &ring->records[head & (LOG_RING_RECORDS - 1)];
+}// end logClaim
+/********************************************************************************************************************************
+ * Function name:     logCommit
+ * Description:       Hands the record logClaim() gave to the writer
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void logCommit()
+{
+  LogRing *ring = threadRing;
+  uint64_t head = ring->head.load(memory_order_relaxed) + 1;
+
+  ring->logged.fetch_add(1, memory_order_relaxed);
+  ring->head.store(head, memory_order_release);
+  // A burst doesn't wait for the writer to wake up on its own
+  if(head - ring->tail.load(memory_order_relaxed) == LOG_RING_RECORDS / 2)
+    logRings.wake.notify_one();
+}// end logCommit
+/********************************************************************************************************************************
+ * Function name:     logSuppress
+ * Description:       Counts a line a rate limit dropped
+ * Parameters:        LogSite &site: The LOG() statement that dropped it
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void logSuppress(LogSite &site)
+{
+  site.suppressed.fetch_add(1, memory_order_relaxed);
+  logRings.suppressed.fetch_add(1, memory_order_relaxed);
+}// end logSuppress
+/********************************************************************************************************************************
+ * Function name:     addRing
+ * Description:       Makes the calling thread's ring and starts the writer thread if this process doesn't have one yet. The
+                      first time it also makes sure a forked child starts out without its parent's rings and that records
+                      still in the rings at exit() are written.
+ * Parameters:        none
+ * Return Value:      LogRing*: the ring
+********************************************************************************************************************************/
+LogRing* addRing()
+{
+  static bool registered = false;
+  LogRing *ring = new LogRing();
+  lock_guard<mutex> guard(logRings.lock);
+
+  if(!registered)
+    {
+      registered = true;
+      pthread_atfork([]() { logRings.lock.lock(); logRings.draining.lock(); logRings.sleeping.lock(); },
+		     []() { logRings.sleeping.unlock(); logRings.draining.unlock(); logRings.lock.unlock(); },
+		     []() { // the parent's writer writes the parent's records
+		       logRings.rings.clear();
+		       logRings.writerPid = 0;
+		       threadRing = NULL;
+		       new (&logRings.wake) condition_variable; // may still count the parent's writer as waiting
+		       logRings.sleeping.unlock();
+		       logRings.draining.unlock();
+		       logRings.lock.unlock();
+		     });
+      atexit(flushLog);
+    }
+  logRings.rings.push_back(ring);
+  threadRing = ring;
+  if(logRings.writerPid != getpid())
+    startWriter();
+  return ring;
+}// end addRing
+/********************************************************************************************************************************
+ * Function name:     startWriter
+ * Description:       Starts the writer thread of this process (the lock must be held)
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void startWriter()
+{
+  logRings.writerPid = getpid();
+  // The thread starts out with every signal blocked, signals meant for the process go to the thread that waits for them
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  thread(writerThread).detach();
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}// end startWriter
+/********************************************************************************************************************************
+ * Function name:     writerThread
+ * Description:       Writes the records of every ring to stdout for as long as the process runs, sleeping LOG_IDLE_MS
+                      whenever all rings are empty (less if a ring fills up to half)
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void writerThread()
+{
+  string batch;
+
+  while(true)
+    {
+      bool more;
+      {
+	lock_guard<mutex> guard(logRings.draining);
+	more = drainRings(batch);
+	writeAll(batch.data(), batch.length());
+      }
+      batch.clear();
+      if(!more)
+	{
+	  unique_lock<mutex> guard(logRings.sleeping);
+	  logRings.wake.wait_for(guard, chrono::milliseconds(LOG_IDLE_MS));
+	}
+    }
+}// end writerThread
+/********************************************************************************************************************************
+ * Function name:     drainRings
+ * Description:       Formats the records of every ring into a batch, up to LOG_BATCH_BYTES of lines (draining must be held)
+ * Parameters:        string &batch: The lines are added to it
+ * Return Value:      true if the batch filled up before the rings ran empty, false otherwise
+********************************************************************************************************************************/
+bool drainRings(string &batch)
+{
+  vector<LogRing*> rings;
+  {
+    lock_guard<mutex> guard(logRings.lock);
+    rings = logRings.rings;
+  }
+
+  for(LogRing *ring : rings)
+    {
+      uint64_t tail = ring->tail.load(memory_order_relaxed);
+      uint64_t head = ring->head.load(memory_order_acquire);
+      for(; tail != head; tail++)
+	{
+	  if(batch.length() >= LOG_BATCH_BYTES)
+	    {
+	      ring->tail.store(tail, memory_order_release);
+	      return true;
+	    }
+	  formatRecord(ring->records[tail & (LOG_RING_RECORDS - 1)], batch);
+	}
+      ring->tail.store(tail, memory_order_release);
+    }
+  return false;
+}// end drainRings
+/********************************************************************************************************************************
+ * Function name:     formatRecord
+ * Description:       Turns a record into its line: the time and level, then the format with every conversion replaced by its
+                      argument, each conversion formatted on its own by snprintf() with the integers widened to long long
+ * Parameters:        const LogRecord &record: The record
+                      string &line: The line is added to it, with a newline
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void formatRecord(const LogRecord &record, string &line)
+{
+  static time_t cachedSecond = -1; // localtime_r() once a second, only the writer formats
+  static char cachedTime[32];
+  char text[LOG_RECORD_SIZE];
+  time_t second = record.nanos / 1000000000;
+
+  if(second != cachedSecond)
+    {
+      struct tm local;
+      localtime_r(&second, &local);
+      strftime(cachedTime, sizeof(cachedTime), "%Y-%m-%d %H:%M:%S", &local);
+      cachedSecond = second;
+    }
+  snprintf(text, sizeof(text), "%s.%03u %-5s ", cachedTime, (unsigned)(record.nanos / 1000000 % 1000), levelNames[record.level]);
+  line += text;
+
+  const char *data = record.data;
+  int arg = 0;
+  for(const char *at = record.format; *at != '\0'; at++)
+    {
+      if(*at != '%')
+	{
+	  line += *at;
+	  continue;
+	}
+      // "%" flags width .precision length conversion
+      const char *start = at++;
+      while(*at != '\0' && strchr("-+ #0123456789.", *at) != NULL)
+	at++;
+      string spec(start, at - start);
+      while(*at != '\0' && strchr("hljztLq", *at) != NULL) // the width of the argument was kept in its type
+	at++;
+      char conversion = *at;
+      if(conversion == '\0')
+	break;
+      if(conversion == '%')
+	{
+	  line += '%';
+	  continue;
+	}
+      if(conversion == 'm')
+	{
+	  line += strerror(record.savedErrno);
+	  continue;
+	}
+      if(arg >= record.argCount)
+	{
+	  line += "<missing>";
+	  continue;
+	}
+
+      uint64_t number = 0;
+      int type = record.types[arg++];
+      if(type != LOG_ARG_STRING)
+	{
+	  memcpy(&number, data, sizeof(number));
+	  data += sizeof(number);
+	}
+      if(type == LOG_ARG_STRING)
+	{
+	  snprintf(text, sizeof(text), conversion == 's' ? (spec + "s").c_str() : "%s", data);
+	  data += strlen(data) + 1;
+	}
+      else if(type == LOG_ARG_DOUBLE)
+	{
+	  double real;
+	  memcpy(&real, &number, sizeof(real));
+	  snprintf(text, sizeof(text), (spec + (strchr("fFeEgGaA", conversion) ? conversion : 'g')).c_str(), real);
+	}
+      else if(conversion == 'c')
+	snprintf(text, sizeof(text), (spec + "c").c_str(), (int)number);
+      else if(conversion == 'p' || type == LOG_ARG_POINTER)
+	snprintf(text, sizeof(text), "%p", (void*)(uintptr_t)number);
+      else if(strchr("di", conversion) != NULL)
+	snprintf(text, sizeof(text), (spec + "lld").c_str(), (long long)number);
+      else if(strchr("uxXo", conversion) != NULL)
+	snprintf(text, sizeof(text), (spec + "ll" + conversion).c_str(), (unsigned long long)number);
+      else
+	snprintf(text, sizeof(text), "%llu", (unsigned long long)number);
+      line += text;
+    }
+  if(record.suppressed != 0)
+    {
+      snprintf(text, sizeof(text), " (%u more like it dropped by the rate limit)", record.suppressed);
+      line += text;
+    }
+  line += '\n';
+}// end formatRecord
+/********************************************************************************************************************************
+ * Function name:     writeAll
+ * Description:       Writes bytes to stdout, however many write() calls it takes
+ * Parameters:        const char *data, size_t length: The bytes
+ * Return Value:      void(none), bytes stdout won't take are lost
+********************************************************************************************************************************/
+void writeAll(const char *data, size_t length)
+{
+  while(length > 0)
+    {
+      ssize_t result = write(STDOUT_FILENO, data, length);
+      if(result < 0 && errno == EINTR)
+	continue;
+      if(result <= 0)
+	return;
+      data += result;
+      length -= result;
+    }
+}// end writeAll
+/********************************************************************************************************************************
+ * Function name:     flushLog
+ * Description:       Writes the records still in the rings, at exit(): waits for the batch the writer thread is on, then
+                      drains the rings itself
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void flushLog()
+{
+  lock_guard<mutex> guard(logRings.draining);
+  string batch;
+  bool more;
+
+  do
+    {
+      more = drainRings(batch);
+      writeAll(batch.data(), batch.length());
+      batch.clear();
+    }
+  while(more);
+}// end flushLog
+/********************************************************************************************************************************
+ * Function name:     parseLogLevel
+ * Description:       Sets the log level from its command line name
+ * Parameters:        const char *name: "off", "error", "warn", "info" or "debug"
+ * Return Value:      true:  if the name is a known level
+                      false: otherwise (level left unchanged)
+********************************************************************************************************************************/
+bool parseLogLevel(const char *name)
+{
+  for(int level = LOG_OFF; level <= LOG_DEBUG; level++)
+    if(strcmp(name, levelNames[level]) == 0)
+      {
+	logLevel = level;
+	return true;
+      }
+  return false;
+}// end parseLogLevel
+/********************************************************************************************************************************
+ * Function name:     logLevelName
+ * Description:       Name of a log level, for output
+ * Parameters:        int level: The level
+ * Return Value:      const char*: its name
+********************************************************************************************************************************/
+const char* logLevelName(int level)
+{
+  return levelNames[level];
+}// end logLevelName
+/********************************************************************************************************************************
+ * Function name:     logStats
+ * Description:       Describes the log counters of this process for the "stats" command
+ * Parameters:        none
+ * Return Value:      string: the description
+********************************************************************************************************************************/
+string logStats()
+{
+  char text[192];
+  unsigned long long logged = 0, dropped = 0, waiting = 0;
+  lock_guard<mutex> guard(logRings.lock);
+
+  for(LogRing *ring : logRings.rings)
+    {
+      logged += ring->logged.load(memory_order_relaxed);
+      dropped += ring->dropped.load(memory_order_relaxed);
+      waiting += ring->head.load(memory_order_relaxed) - ring->tail.load(memory_order_relaxed);
+    }
+  snprintf(text, sizeof(text), "Log: %s, %u lines a second per statement, %llu lines logged, %llu dropped (ring full), "
+	   "%llu dropped (rate), %llu waiting", levelNames[logLevel], logRate, logged, dropped,
+	   logRings.suppressed.load(memory_order_relaxed), waiting);
+  return text;
+}// end logStats
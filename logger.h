@@ -0,0 +1,221 @@
+/********************************************************************************************************
+ * Filename: logger.h
+ * Purpose: What the server says about its clients while it serves them (connections, messages, files
+ *          sent, failures). A thread that logs doesn't format anything: it copies the time, the
+ *          format string's address and the arguments into a fixed-size record of a ring only it
+ *          writes to and only the background writer thread of the process reads (no lock, no system
+ *          call). The writer formats the records of every ring and writes them to stdout many lines
+ *          per write(), so no session ever waits for the console.
+ *          -> Lines above the level picked with -L cost one comparison: LOG() doesn't even evaluate
+ *             their arguments.
+ *          -> Every LOG() statement logs at most -R lines a second, the lines it drops are counted
+ *             and the next line it logs says how many there were.
+ *          -> A line logged while its thread's ring is full is dropped (and counted), the logging
+ *             thread never waits for the writer.
+ * Programming Language Used: C++
+ * Format: -> The format is a printf() format and must be a string literal (its address is what the
+ *            record keeps). Strings are copied into the record, cut short if they don't fit, %m is
+ *            the errno of the LOG() call.
+ *********************************************************************************************************/
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <type_traits>
+
+// Levels, each includes the ones before it
+#define LOG_OFF   0
+#define LOG_ERROR 1 // a connection or a download failed
+#define LOG_WARN  2 // a client asked for something that can't be done
+#define LOG_INFO  3 // connections, files sent (default)
+#define LOG_DEBUG 4 // every message
+
+#define LOG_RECORD_SIZE 512 // Bytes of a record, arguments that don't fit are cut short
+#define LOG_RING_RECORDS 512 // Records of a thread that may wait for the writer (a power of two)
+#define LOG_MAX_ARGS 8
+#define LOG_BATCH_BYTES (64 << 10) // Most bytes of lines written at once
+#define LOG_IDLE_MS 10 // How long the writer sleeps once every ring is empty
+#define LOG_DEFAULT_RATE 1000 // Lines a LOG() statement may log a second unless -R says otherwise
+
+// What a record argument is
+#define LOG_ARG_INT     0 // any signed integer, as 8 bytes
+#define LOG_ARG_UINT    1 // any unsigned integer, as 8 bytes
+#define LOG_ARG_DOUBLE  2
+#define LOG_ARG_STRING  3 // the bytes and a '\0'
+#define LOG_ARG_POINTER 4
+
+extern int logLevel; // Selected with -L, lines of higher levels aren't logged
+extern unsigned logRate; // Selected with -R, lines a second per LOG() statement (0: no limit)
+
+/*************************************************************************************************
+ * Struct name:       LogRecord
+ * Description:       One line as the thread that logged it left it for the writer
+ *************************************************************************************************/
+struct LogRecord
+{
+  uint64_t nanos; // CLOCK_REALTIME when it was logged
+  const char *format;
+  uint32_t suppressed; // lines of the same LOG() the rate limit dropped just before it
+  int32_t savedErrno; // for %m
+  uint8_t level;
+  uint8_t argCount;
+  uint8_t types[LOG_MAX_ARGS]; // LOG_ARG_* of each argument
+  uint16_t used; // bytes of data the arguments take
+  char data[LOG_RECORD_SIZE - 40]; // the arguments, one after the other
+};
+
+/*************************************************************************************************
+ * Struct name:       LogSite
+ * Description:       Rate limit of one LOG() statement, shared by every thread that runs it.
+                      Lines are counted per second, racing threads may let a few more through.
+ *************************************************************************************************/
+struct LogSite
+{
+  std::atomic<uint32_t> second; // of the monotonic clock, the lines are counted for
+  std::atomic<uint32_t> lines; // logged (or tried to) in that second
+  std::atomic<uint32_t> suppressed; // dropped since the last line logged
+};
+
+#define LOG(level, ...) do { if((level) <= logLevel)					\
+      {											\
+	static LogSite logSite;								\
+	if(false)									\
+	  logCheckFormat(__VA_ARGS__);							\
+	if(logAllow(logSite))								\
+	  logRecord(logSite, level, __VA_ARGS__);					\
+      } } while(0)
+
+LogRecord* logClaim();
+void logCommit();
+void logSuppress(LogSite &site);
+bool parseLogLevel(const char *name);
+const char* logLevelName(int level);
+std::string logStats();
+
+/*************************************************************************************************
+ * Function name:     logCheckFormat
+ * Description:       Never called, lets the compiler check a LOG() format against its arguments
+ * Parameters:        const char *format, ...: The format and its arguments
+ * Return Value:      void(none)
+ *************************************************************************************************/
+inline void logCheckFormat(const char *, ...) __attribute__((format(printf, 1, 2)));
+inline void logCheckFormat(const char *, ...)
+{
+}// end logCheckFormat
+
+/*************************************************************************************************
+ * Function name:     logAllow
+ * Description:       Applies the rate limit of a LOG() statement
+ * Parameters:        LogSite &site: The statement's limit
+ * Return Value:      true if the line may be logged, false if it is dropped
+ *************************************************************************************************/
+inline bool logAllow(LogSite &site)
+{
+  if(logRate == 0)
+    return true;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  if(site.second.load(std::memory_order_relaxed) != (uint32_t)now.tv_sec)
+    {
+      site.second.store(now.tv_sec, std::memory_order_relaxed);
+      site.lines.store(0, std::memory_order_relaxed);
+    }
+  if(site.lines.fetch_add(1, std::memory_order_relaxed) >= logRate)
+    {
+      logSuppress(site);
+      return false;
+    }
+  return true;
+}// end logAllow
+
+/*************************************************************************************************
+ * Function name:     logArg
+ * Description:       Copies one argument of a line into its record, the overloads tell the kinds
+                      apart (integers of every size are widened to 8 bytes)
+ * Parameters:        LogRecord &record: The record, the argument goes after the ones before it
+                      value: The argument
+ * Return Value:      void(none)
+ *************************************************************************************************/
+template<typename T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type logArg(LogRecord &record, T value)
+{
+  uint64_t wide = std::is_signed<T>::value ? (uint64_t)(int64_t)value : (uint64_t)value;
+  record.types[record.argCount++] = std::is_signed<T>::value ? LOG_ARG_INT : LOG_ARG_UINT;
+  memcpy(record.data + record.used, &wide, sizeof(wide));
+  record.used += sizeof(wide);
+}
+inline void logArg(LogRecord &record, double value)
+{
+  record.types[record.argCount++] = LOG_ARG_DOUBLE;
+  memcpy(record.data + record.used, &value, sizeof(value));
+  record.used += sizeof(value);
+}
+inline void logArg(LogRecord &record, const char *value)
+{
+  // whatever the arguments after it need is kept free, the string gets the rest
+  size_t room = sizeof(record.data) - record.used - 1 - (LOG_MAX_ARGS - record.argCount - 1) * sizeof(uint64_t);
+  size_t length = value == NULL ? 0 : strnlen(value, room);
+  record.types[record.argCount++] = LOG_ARG_STRING;
+  memcpy(record.data + record.used, value, length);
+  record.data[record.used + length] = '\0';
+  record.used += length + 1;
+}
+inline void logArg(LogRecord &record, const void *value)
+{
+  uint64_t wide = (uintptr_t)value;
+  record.types[record.argCount++] = LOG_ARG_POINTER;
+  memcpy(record.data + record.used, &wide, sizeof(wide));
+  record.used += sizeof(wide);
+}// end logArg
+
+inline void logArgs(LogRecord &)
+{
+}
+template<typename T, typename... Rest>
+inline void logArgs(LogRecord &record, T value, Rest... rest)
+{
+  logArg(record, value);
+  logArgs(record, rest...);
+}
+
+/*************************************************************************************************
+ * Function name:     logRecord
+ * Description:       Fills the next record of the calling thread's ring with a line and hands it to
+                      the writer. Called through LOG(), which checks the level and rate first. The
+                      lines the rate limit dropped before it are only taken off the statement's count
+                      once the line has a record, a line dropped by a full ring leaves them to the next.
+ * Parameters:        LogSite &site: The LOG() statement
+                      int level: LOG_ERROR, LOG_WARN, LOG_INFO or LOG_DEBUG
+                      const char *format, args...: printf() format of the line (no newline) and its arguments
+ * Return Value:      void(none)
+ *************************************************************************************************/
+template<typename... Args>
+void logRecord(LogSite &site, int level, const char *format, Args... args)
+{
+  static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "Too many arguments for one log line");
+  int savedErrno = errno;
+  LogRecord *record = logClaim();
+  if(record == NULL) // the ring is full
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  record->nanos = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  record->format = format;
+  record->suppressed = site.suppressed.load(std::memory_order_relaxed) == 0 ? 0 :
+    site.suppressed.exchange(0, std::memory_order_relaxed);
+  record->savedErrno = savedErrno;
+  record->level = level;
+  record->argCount = 0;
+  record->used = 0;
+  logArgs(*record, args...);
+  logCommit();
+  errno = savedErrno;
+}// end logRecord
+
+#endif // LOGGER_H
@@ -0,0 +1,364 @@
+/********************************************************************************************************
+ * Filename: metrics.cpp
+ * Purpose: Server metrics (see metrics.h): the shards, the latency histograms and the thread that
+ *          answers scrapes on the metrics port with all shards added up.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h> // shared shards
+#include <sys/time.h> // timeval
+#include <netinet/in.h>
+#include <arpa/inet.h> // htonl
+#include <pthread.h> // pthread_atfork, pthread_sigmask
+#include <signal.h>
+#include <stdio.h> // perror, snprintf
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include "metrics.h"
+using namespace std;
+
+thread_local MetricsShard *threadShard = NULL;
+
+static MetricsShard *shards = NULL; // numShards of them, shared with every process forked after initMetrics()
+static int numShards = 0;
+static atomic<int> nextShard(0); // next shard claimMetricsShard() hands out
+static int metricsSock = -1; // listening socket of the metrics port, -1 for none
+
+static const char *commandNames[COMMAND_KINDS] = { "pwd", "cd", "dir", "list", "download", "get", "mget", "download-dir", "sync",
+						   "have", "dget", "stat-batch", "compress", "checksum", "stats", "bye", "other" };
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+void metricsThread();
+void answerScrape(int sock);
+int latencyBucket(uint64_t micros);
+uint64_t bucketEnd(int bucket);
+
+/********************************************************************************************************************************
+ * Function name:     initMetrics
+ * Description:       Maps the shards, zeroed, where forked processes share them. Must be called before anything is counted
+                      and before the fork model forks its workers.
+ * Parameters:        int count: How many shards (worker processes or METRICS_THREAD_SHARDS)
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void initMetrics(int count)
+{
+  void *mapped = mmap(NULL, sizeof(MetricsShard) * count, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(mapped == MAP_FAILED)
+    {
+      perror("Couldn't Map The Metrics");
+      exit(EXIT_FAILURE);
+    }
+  shards = (MetricsShard*)mapped;
+  numShards = count;
+}// end initMetrics
+/********************************************************************************************************************************
+ * Function name:     claimMetricsShard
+ * Description:       Gives the calling thread the next unused shard, or the last one once they have all been given out
+                      (its counters are still right, only no longer uncontended)
+ * Parameters:        none
+ * Return Value:      MetricsShard*: the thread's shard
+********************************************************************************************************************************/
+MetricsShard* claimMetricsShard()
+{
+  int index = nextShard.fetch_add(1, memory_order_relaxed);
+  threadShard = &shards[index < numShards ? index : numShards - 1];
+  return threadShard;
+}// end claimMetricsShard
+/********************************************************************************************************************************
+ * Function name:     bindMetricsShard
+ * Description:       Makes a fork model worker count in the shard of its slot, which its predecessors in the slot counted in
+                      too, so the counters never go back. Sessions a predecessor didn't get to end are ended here.
+ * Parameters:        int index: The worker's slot
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void bindMetricsShard(int index)
+{
+  MetricsShard &shard = shards[index];
+  shard.closed.store(shard.connections.load());
+  shard.outputDone.store(shard.outputQueued.load());
+  threadShard = &shard;
+}// end bindMetricsShard
+/********************************************************************************************************************************
+ * Function name:     metricsShardAt
+ * Description:       One of the shards, for the fork model's per-worker stats
+ * Parameters:        int index: The shard
+ * Return Value:      MetricsShard&: the shard
+********************************************************************************************************************************/
+MetricsShard& metricsShardAt(int index)
+{
+  return shards[index];
+}// end metricsShardAt
+/********************************************************************************************************************************
+ * Function name:     shardCommands
+ * Description:       Adds up the commands of every kind a shard counted
+ * Parameters:        const MetricsShard &shard: The shard
+ * Return Value:      unsigned long long: the commands
+********************************************************************************************************************************/
+unsigned long long shardCommands(const MetricsShard &shard)
+{
+  unsigned long long total = 0;
+  for(int kind = 0; kind < COMMAND_KINDS; kind++)
+    total += shard.commands[kind].load(memory_order_relaxed);
+  return total;
+}// end shardCommands
+/********************************************************************************************************************************
+ * Function name:     commandKind
+ * Description:       Tells which kind of command a message is, for counting and timing
+ * Parameters:        const string &command: The message (without a stream id)
+ * Return Value:      int: COMMAND_*
+********************************************************************************************************************************/
+int commandKind(const string &command)
+{
+  string word = command.substr(0, command.find(' '));
+  for(int kind = 0; kind < COMMAND_OTHER; kind++)
+    if(word == commandNames[kind])
+      return kind;
+  return COMMAND_OTHER;
+}// end commandKind
+/********************************************************************************************************************************
+ * Function name:     recordLatency
+ * Description:       Adds the latency of a command that was just answered to its kind's histogram
+ * Parameters:        int kind: COMMAND_*
+                      uint64_t startMicros: metricsClock() when the command came
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void recordLatency(int kind, uint64_t startMicros)
+{
+  uint64_t micros = metricsClock() - startMicros;
+  LatencyHistogram &histogram = metrics().latency[kind];
+
+  countMetric(histogram.count);
+  countMetric(histogram.sumMicros, micros);
+  countMetric(histogram.buckets[latencyBucket(micros)]);
+}// end recordLatency
+/********************************************************************************************************************************
+ * Function name:     latencyBucket
+ * Description:       The histogram bucket of a latency
+ * Parameters:        uint64_t micros: The latency
+ * Return Value:      int: the bucket
+********************************************************************************************************************************/
+int latencyBucket(uint64_t micros)
+{
+  if(micros < 2 * LATENCY_SUB_BUCKETS)
+    return micros;
+  int top = 63 - __builtin_clzll(micros); // highest bit set
+  if(top >= LATENCY_MAX_BITS)
+    return LATENCY_BUCKETS - 1;
+  return (top - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS + (int)(micros >> (top - LATENCY_SUB_BITS)) - LATENCY_SUB_BUCKETS;
+}// end latencyBucket
+/********************************************************************************************************************************
+ * Function name:     bucketEnd
+ * Description:       The first latency past a histogram bucket, what a quantile that falls in the bucket is reported as
+ * Parameters:        int bucket: The bucket
+ * Return Value:      uint64_t: microseconds
+********************************************************************************************************************************/
+uint64_t bucketEnd(int bucket)
+{
+  if(bucket < 2 * LATENCY_SUB_BUCKETS)
+    return bucket + 1;
+  int top = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+  return (uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS + 1) << (top - LATENCY_SUB_BITS);
+}// end bucketEnd
+/********************************************************************************************************************************
+ * Function name:     startMetricsServer
+ * Description:       Listens on the metrics port of the loopback address and starts the thread that answers scrapes. In the
+                      fork model the supervisor answers them, forked workers close their copy of the socket.
+ * Parameters:        int port: The port
+ * Return Value:      true:  if the port is listening
+                      false: if it couldn't be bound (said why)
+********************************************************************************************************************************/
+bool startMetricsServer(int port)
+{
+  struct sockaddr_in address;
+  int enable = 1;
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  if((metricsSock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    {
+      perror("Couldn't Create The Metrics Socket");
+      return false;
+    }
+  setsockopt(metricsSock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  if(bind(metricsSock, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(metricsSock, SOMAXCONN) < 0)
+    {
+      perror("Couldn't Listen On The Metrics Port");
+      close(metricsSock);
+      metricsSock = -1;
+      return false;
+    }
+
+  pthread_atfork(NULL, NULL, []() { close(metricsSock); metricsSock = -1; });
+  // The thread starts out with every signal blocked, signals meant for the process go to the thread that waits for them
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  thread(metricsThread).detach();
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return true;
+}// end startMetricsServer
+/********************************************************************************************************************************
+ * Function name:     metricsThread
+ * Description:       Answers the scrapes of the metrics port one at a time for as long as the server runs
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void metricsThread()
+{
+  while(true)
+    {
+      int sock = accept4(metricsSock, NULL, NULL, SOCK_CLOEXEC);
+      if(sock < 0)
+	{
+	  if(errno != EINTR && errno != ECONNABORTED)
+	    {
+	      perror("accept: metrics port");
+	      sleep(1); // out of descriptors, say, try again in a while
+	    }
+	  continue;
+	}
+      // A scraper that stops talking mustn't hold up the next one
+      struct timeval timeout = { METRICS_SCRAPE_TIMEOUT, 0 };
+      setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      answerScrape(sock);
+      close(sock);
+    }
+}// end metricsThread
+/********************************************************************************************************************************
+ * Function name:     answerScrape
+ * Description:       Reads an HTTP request and answers GET /metrics (or GET /) with metricsText(), anything else with 404
+ * Parameters:        int sock: The scraper's connection
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void answerScrape(int sock)
+{
+  char request[4096];
+  size_t received = 0;
+
+  // Only the request line is looked at, but the headers are read so closing doesn't reset the connection
+  while(received < sizeof(request) - 1)
+    {
+      ssize_t result = recv(sock, request + received, sizeof(request) - 1 - received, 0);
+      if(result < 0 && errno == EINTR)
+	continue;
+      if(result <= 0)
+	return;
+      received += result;
+      request[received] = '\0';
+      if(strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+	break;
+    }
+  request[received] = '\0';
+
+  string body, status;
+  if(strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0)
+    {
+      status = "200 OK";
+      body = metricsText();
+    }
+  else
+    {
+      status = "404 Not Found";
+      body = "Only GET /metrics is served here\n";
+    }
+  string answer = "HTTP/1.0 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+    + to_string(body.length()) + "\r\nConnection: close\r\n\r\n" + body;
+
+  for(size_t sent = 0; sent < answer.length(); )
+    {
+      ssize_t result = send(sock, answer.data() + sent, answer.length() - sent, MSG_NOSIGNAL);
+      if(result < 0 && errno == EINTR)
+	continue;
+      if(result <= 0)
+	return;
+      sent += result;
+    }
+}// end answerScrape
+/********************************************************************************************************************************
+ * Function name:     metricsText
+ * Description:       Adds up every shard and writes the totals in the Prometheus text format: counters, gauges and a
+                      summary per command kind with the quantiles of its latency histogram
+ * Parameters:        none
+ * Return Value:      string: the metrics
+********************************************************************************************************************************/
+string metricsText()
+{
+  unsigned long long connections = 0, closed = 0, bytesSent = 0, outputQueued = 0, outputDone = 0;
+  unsigned long long commands[COMMAND_KINDS] = { 0 }, counts[COMMAND_KINDS] = { 0 }, sums[COMMAND_KINDS] = { 0 };
+  vector<unsigned long long> buckets(COMMAND_KINDS * LATENCY_BUCKETS, 0);
+  char line[256];
+
+  for(int i = 0; i < numShards; i++)
+    {
+      const MetricsShard &shard = shards[i];
+      connections += shard.connections.load(memory_order_relaxed);
+      closed += shard.closed.load(memory_order_relaxed);
+      bytesSent += shard.bytesSent.load(memory_order_relaxed);
+      outputQueued += shard.outputQueued.load(memory_order_relaxed);
+      outputDone += shard.outputDone.load(memory_order_relaxed);
+      for(int kind = 0; kind < COMMAND_KINDS; kind++)
+	{
+	  const LatencyHistogram &histogram = shard.latency[kind];
+	  commands[kind] += shard.commands[kind].load(memory_order_relaxed);
+	  if(histogram.count.load(memory_order_relaxed) == 0)
+	    continue;
+	  counts[kind] += histogram.count.load(memory_order_relaxed);
+	  sums[kind] += histogram.sumMicros.load(memory_order_relaxed);
+	  for(int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+	    buckets[kind * LATENCY_BUCKETS + bucket] += histogram.buckets[bucket].load(memory_order_relaxed);
+	}
+    }
+
+  string text;
+  text += "# HELP dlserver_connections_total Client connections accepted.\n# TYPE dlserver_connections_total counter\n";
+  text += "dlserver_connections_total " + to_string(connections) + "\n";
+  text += "# HELP dlserver_connections_active Client connections being served.\n# TYPE dlserver_connections_active gauge\n";
+  text += "dlserver_connections_active " + to_string(connections > closed ? connections - closed : 0) + "\n";
+  text += "# HELP dlserver_sent_bytes_total Bytes sent to clients.\n# TYPE dlserver_sent_bytes_total counter\n";
+  text += "dlserver_sent_bytes_total " + to_string(bytesSent) + "\n";
+  text += "# HELP dlserver_output_queue_items Replies queued and not fully sent yet, all connections together.\n"
+    "# TYPE dlserver_output_queue_items gauge\n";
+  text += "dlserver_output_queue_items " + to_string(outputQueued > outputDone ? outputQueued - outputDone : 0) + "\n";
+
+  text += "# HELP dlserver_commands_total Commands received.\n# TYPE dlserver_commands_total counter\n";
+  for(int kind = 0; kind < COMMAND_KINDS; kind++)
+    {
+      snprintf(line, sizeof(line), "dlserver_commands_total{command=\"%s\"} %llu\n", commandNames[kind], commands[kind]);
+      text += line;
+    }
+
+  text += "# HELP dlserver_command_latency_seconds Time from a command to the end of its answer.\n"
+    "# TYPE dlserver_command_latency_seconds summary\n";
+  for(int kind = 0; kind < COMMAND_KINDS; kind++)
+    {
+      if(counts[kind] == 0)
+	continue;
+      const unsigned long long *histogram = &buckets[kind * LATENCY_BUCKETS];
+      for(double quantile : quantiles)
+	{
+	  // the first bucket the quantile's rank falls in (counts read while they move may add up to a little less)
+	  unsigned long long rank = (unsigned long long)(quantile * counts[kind] + 0.999999), seen = 0;
+	  int bucket = 0;
+	  while(bucket < LATENCY_BUCKETS - 1 && (seen += histogram[bucket]) < rank)
+	    bucket++;
+	  snprintf(line, sizeof(line), "dlserver_command_latency_seconds{command=\"%s\",quantile=\"%g\"} %.6f\n",
+		   commandNames[kind], quantile, bucketEnd(bucket) / 1e6);
+	  text += line;
+	}
+      snprintf(line, sizeof(line), "dlserver_command_latency_seconds_sum{command=\"%s\"} %.6f\n"
+	       "dlserver_command_latency_seconds_count{command=\"%s\"} %llu\n",
+	       commandNames[kind], sums[kind] / 1e6, commandNames[kind], counts[kind]);
+      text += line;
+    }
+  return text;
+}// end metricsText
@@ -0,0 +1,130 @@
+/********************************************************************************************************
+ * Filename: metrics.h
+ * Purpose: Counters and per-command latency histograms of the server, exposed in the Prometheus text
+ *          format on a port of their own (-M, bound to the loopback address). Every thread counts in a
+ *          shard of its own, with relaxed atomic adds no other thread contends for, and the shards
+ *          are only added up when they are scraped. The shards live in memory shared across fork(),
+ *          so a worker of the fork model (see workerPool.h) counts where its supervisor can read it.
+ * Programming Language Used: C++
+ * Format: -> A latency histogram is HDR style: microseconds below 2 * LATENCY_SUB_BUCKETS each have
+ *            a bucket, above that every power of two is split into LATENCY_SUB_BUCKETS buckets, so a
+ *            latency is known to within 1 / LATENCY_SUB_BUCKETS of itself from 1 us up to hours.
+ *         -> A command's latency runs from its message to the moment the session has sent all of its
+ *            answer and waits for the next command (for "download" that includes the READY exchange),
+ *            commands sent back to back without waiting are all done when the last one is.
+ *********************************************************************************************************/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+
+#define METRICS_THREAD_SHARDS 64 // Shards of the threaded models, threads beyond it share the last one
+#define METRICS_SCRAPE_TIMEOUT 5 // Seconds a scraper may take to send its request and read the answer
+
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS) // Buckets per power of two
+#define LATENCY_MAX_BITS 36 // Latencies from 2^36 us (19 hours) on share the last bucket
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+// Kinds of commands counted and timed apart
+#define COMMAND_PWD          0
+#define COMMAND_CD           1
+#define COMMAND_DIR          2
+#define COMMAND_LIST         3
+#define COMMAND_DOWNLOAD     4
+#define COMMAND_GET          5
+#define COMMAND_MGET         6
+#define COMMAND_DOWNLOAD_DIR 7
+#define COMMAND_SYNC         8
+#define COMMAND_HAVE         9
+#define COMMAND_DGET         10
+#define COMMAND_STAT_BATCH   11
+#define COMMAND_COMPRESS     12
+#define COMMAND_CHECKSUM     13
+#define COMMAND_STATS        14
+#define COMMAND_BYE          15
+#define COMMAND_OTHER        16 // unknown commands
+#define COMMAND_KINDS        17
+
+typedef std::atomic<unsigned long long> MetricCounter;
+
+/*************************************************************************************************
+ * Struct name:       LatencyHistogram
+ * Description:       How long the commands of one kind took
+ *************************************************************************************************/
+struct LatencyHistogram
+{
+  MetricCounter count; // commands timed
+  MetricCounter sumMicros; // their latencies added up
+  MetricCounter buckets[LATENCY_BUCKETS];
+};
+
+/*************************************************************************************************
+ * Struct name:       MetricsShard
+ * Description:       What the sessions of one thread (one fork model worker) did. The gauges are
+                      a pair of counters, what was added and what was taken away.
+ *************************************************************************************************/
+struct MetricsShard
+{
+  MetricCounter connections; // sessions started
+  MetricCounter closed; // sessions ended
+  MetricCounter commands[COMMAND_KINDS]; // commands received, by kind
+  MetricCounter bytesSent; // bytes written to client sockets
+  MetricCounter outputQueued; // replies put on output queues
+  MetricCounter outputDone; // replies sent (or dropped with their session)
+  LatencyHistogram latency[COMMAND_KINDS];
+};
+
+extern thread_local MetricsShard *threadShard; // the calling thread's shard, NULL until it counts something
+
+void initMetrics(int numShards);
+MetricsShard* claimMetricsShard();
+void bindMetricsShard(int index);
+MetricsShard& metricsShardAt(int index);
+unsigned long long shardCommands(const MetricsShard &shard);
+bool startMetricsServer(int port);
+int commandKind(const std::string &command);
+void recordLatency(int kind, uint64_t startMicros);
+std::string metricsText();
+
+/*************************************************************************************************
+ * Function name:     metrics
+ * Description:       The calling thread's shard, claimed the first time it counts something
+ * Parameters:        none
+ * Return Value:      MetricsShard&: the shard
+ *************************************************************************************************/
+inline MetricsShard& metrics()
+{
+  MetricsShard *shard = threadShard;
+  return shard != NULL ? *shard : *claimMetricsShard();
+}// end metrics
+
+/*************************************************************************************************
+ * Function name:     countMetric
+ * Description:       Adds to a counter of the calling thread's shard, no ordering with anything else
+ * Parameters:        MetricCounter &counter: The counter
+                      unsigned long long amount: What to add
+ * Return Value:      void(none)
+ *************************************************************************************************/
+inline void countMetric(MetricCounter &counter, unsigned long long amount = 1)
+{
+  counter.fetch_add(amount, std::memory_order_relaxed);
+}// end countMetric
+
+/*************************************************************************************************
+ * Function name:     metricsClock
+ * Description:       Microseconds of the monotonic clock, the start of what recordLatency() times
+ * Parameters:        none
+ * Return Value:      uint64_t: the time
+ *************************************************************************************************/
+inline uint64_t metricsClock()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}// end metricsClock
+
+#endif // METRICS_H
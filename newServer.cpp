@@ -5,22 +5,61 @@
  * Purpose: This is a server side of a download server application
  * Programming Language Used: C++
  * Compiler Used: clang++ 3.4.2 
- * Compiler command: clang++ -std=c++11 newServer.cpp
+ * Compiler command: clang++ -std=c++11 -pthread newServer.cpp session.cpp eventLoop.cpp uringLoop.cpp workerPool.cpp fileCache.cpp
+                   dirCache.cpp compressPool.cpp compressStore.cpp chunkIndex.cpp metrics.cpp logger.cpp -lz (add -DHAVE_ZSTD ... -lzstd for zstd)
  * Execution command: ./a.out for default port Number or
                       ./a.out <PORTNUMBER> for user specified port Number
                       use ./a.out <PORTNUMBER>  2 > (fileName) To see the debug messages saved in a file
- * Protocol: ->  All Messages between client and server must be terminated by ':)' Character sequence.
-             ->  if the above condition fails then  program exits, 
-	         ->  Possible Message/Command from client "bye:)"
+                      ./a.out -c <sendfile|splice|buffered> <PORTNUMBER> to pick how downloads copy file bytes
+                      ./a.out -w <WORKERS> <PORTNUMBER> to size the pool of pre-forked worker processes
+                      ./a.out -m epoll -t <THREADS> <PORTNUMBER> to serve clients from event loop threads
+                      ./a.out -m reactor <PORTNUMBER> for one pinned event loop + listening socket per core
+                      ./a.out -m uring -t <THREADS> <PORTNUMBER> to do all socket and file I/O through io_uring
+                      ./a.out -m epoll -C <MEGABYTES> <PORTNUMBER> to size the file cache shared by all clients
+                      ./a.out -S <DIRECTORY> <PORTNUMBER> to keep compressed variants of hot files there
+                      ./a.out -X <INDEX FILE> <PORTNUMBER> to index the chunks of the served files there for dget
+                      ./a.out -M <METRICS PORT> <PORTNUMBER> to serve Prometheus metrics on 127.0.0.1:<METRICS PORT>
+                      ./a.out -L <off|error|warn|info|debug> <PORTNUMBER> to pick what is logged (debug: every message)
+                      ./a.out -R <LINES> <PORTNUMBER> to log at most that many lines a second per log statement (0: no limit)
+ * Protocol: ->  All Messages between client and server are sent as frames (see protocol.h): a type,
+                 flags, and a 64 bit payload length followed by the payload, nothing is ever terminated.
+             ->  if a frame can't be received then  program exits, 
+             ->  A download is announced with "READY <file size>", once the client answers "READY"
+                 the file follows as a single FRAME_DATA frame
+             ->  Answering "RANGE <offset> [<length>]" instead sends only that part of the file (to the
+                 end of the file if no length is given), so an interrupted download can be resumed
+             ->  "get <file name>" is a whole download in one request: the file follows as a FRAME_DATA
+                 frame right away (or a message says why it can't), no READY exchange and no ack, so
+                 a client may send many of them back to back and read the answers in order
+             ->  "sync <file name>" is followed at once by a FRAME_DATA frame of block signatures of the
+                 client's copy, answered with "SYNC <file size>" and the delta that rebuilds the file
+                 from that copy in FRAME_DATA frames, the last one flagged FRAME_FLAG_END (see deltaSync.h)
+             ->  "have" is followed at once by a FRAME_DATA frame of hashes of chunks the client holds and
+                 answered with "HAVE <chunks held>", "dget <file name>" answers "CHUNKS <file size> <count>",
+                 the file's chunks in a FRAME_DATA frame and the bytes of those the client doesn't hold in
+                 another one (see contentChunks.h)
+             ->  "mget <pattern>" (patterns separated by newlines) answers "MGET <count>" and the names of
+                 the matching files, one per line, then sends each of them as "get" would
+             ->  "download-dir <dir>" answers "ARCHIVE <name>" and then sends the tree as a tar archive
+                 (see tarArchive.h) in FRAME_DATA frames, an empty FRAME_DATA frame ends it
+             ->  "list <page size> [<cursor>]" answers with one page of the directory listing,
+                 "PAGE <next cursor>" (or "PAGE END") followed by a line per name
+             ->  "stat-batch" is followed at once by a FRAME_DATA frame of '\0' separated paths and
+                 answered with one FRAME_DATA frame of StatRecords (see protocol.h)
+             ->  A "get", "dir", "list", "pwd" or "stats" sent with FRAME_FLAG_STREAM and a stream id is
+                 answered on that stream, "get" files in chunks taking turns with the other streams'
+             ->  "compress <codec>[,<codec>...]" answers "COMPRESS <codec>" (or "COMPRESS none"), whole files
+                 that compress well then come as compressed blocks (see compression.h)
+             ->  "checksum crc32c" answers "CHECKSUM crc32c" (or "CHECKSUM none"), every file and range
+                 is then followed by a FRAME_CHECKSUM frame of its CRC32Cs (see protocol.h)
+	         ->  Possible Message/Command from client "bye"
  *
  *********************************************************************************************************/
 
 #include <stdlib.h>
 #include <ctype.h>
 #include <sys/types.h>
-#include <sys/stat.h>
 #include <sys/socket.h> // for socket
-#include <dirent.h>
 #include <netinet/in.h>
 #include <stdio.h> // perror
 #include <errno.h>
@@ -30,23 +69,29 @@
 #include <iostream> 
 #include <string.h>
 #include <string> // For String
-#include <fstream> // For file check
-#include<sys/wait.h> // for wait
+#include <vector>
+#include <signal.h> // signal
+#include "protocol.h" // frame format shared with the client
+#include "session.h" // per-connection state machine
+#include "eventLoop.h" // epoll server model
+#include "uringLoop.h" // io_uring server model
+#include "workerPool.h" // pre-forked worker processes
+#include "dirCache.h" // directory listings shared by all clients
+#include "compressStore.h" // compressed variants of hot files
+#include "chunkIndex.h" // chunks of the served files, for dget
+#include "metrics.h" // counters and latency histograms, for -M
+#include "logger.h" // for -L
 using namespace std;
 
-#define DEFAULT_PORT 49878
-#define MAX_MSG_SIZE 5000
+// Ways of serving clients, selected with -m
+#define MODEL_FORK  0 // a pool of pre-forked processes serving one connection each at a time, blocking sockets
+#define MODEL_EPOLL 1 // a few threads with edge triggered epoll, non-blocking sockets
+#define MODEL_REACTOR 2 // one pinned epoll thread per core, each with its own SO_REUSEPORT listening socket
+#define MODEL_URING 3 // a few threads with an io_uring each, falls back to MODEL_EPOLL without io_uring
+
 void usageClause(const char *argv[]);
 bool isNumeric(const string str);
-void checkReply( char* clientReply, const int connectedSock, const int listeningSock,  string ipAddress);
-bool hasEndOfMsg (const string str);
-void connectToClient(int &sockfd, int &client_socket, sockaddr_in  &address);
-string getIpAddress(sockaddr_in &address);
-void sendToClient(const int sockfd, const char* messsage, bool printToScreen);
-void recvFromClient(const int sockfd, char clientReply[]);
-bool doesFileExist(const char *file);
-void sendDirListing(int connectedSock);
-void runServer(int &sockfd, int &client_socket, sockaddr_in  &address, char clientReply[]);
+void connectToClient(int &sockfd, int &client_socket, sockaddr_in  &address, bool reusePort = false);
 
 /********************************************************************************************************************************
  * Function name:     main
@@ -67,23 +112,114 @@ int main(int argc, char const  *argv[])
   address.sin_family = AF_INET; // Specify the Address Family
   address.sin_addr.s_addr = INADDR_ANY; //Specify The IP Addresses
 
+  int serverModel = MODEL_FORK; // Selected with -m
+  int numThreads = 0; // Selected with -t, event loop threads for -m epoll/reactor/uring (0: the model's default)
+  int numWorkers = DEFAULT_WORKERS; // Selected with -w, worker processes for -m fork
+  int cacheMegabytes = -1; // Selected with -C, file cache size (-1: the model's default)
+  int metricsPort = 0; // Selected with -M, 0 for no metrics port
+  int option; // Option letter returned by getopt
+  // Parse the optional flags first, whatever is left over is the port number
+  while((option = getopt(argc, (char * const *)argv, "c:m:t:w:C:S:X:M:L:R:")) != -1)
+    {
+      switch(option)
+	{
+	case 'm': // How clients are served
+	  if(string(optarg) == "fork")
+	    serverModel = MODEL_FORK;
+	  else if(string(optarg) == "epoll")
+	    serverModel = MODEL_EPOLL;
+	  else if(string(optarg) == "reactor")
+	    serverModel = MODEL_REACTOR;
+	  else if(string(optarg) == "uring")
+	    serverModel = MODEL_URING;
+	  else
+	    {
+	      cout << "Unknown server model: " << optarg << endl;
+	      usageClause(argv);
+	    }
+	  break;
+	case 't': // Number of event loop threads
+	  if(!isNumeric(optarg) || (numThreads = atoi(optarg)) < 1)
+	    {
+	      cout << "Number of threads must be a positive number" << endl;
+	      usageClause(argv);
+	    }
+	  break;
+	case 'w': // Number of worker processes
+	  if(!isNumeric(optarg) || (numWorkers = atoi(optarg)) < 1 || numWorkers > MAX_WORKERS)
+	    {
+	      cout << "Number of workers must be between 1 and " << MAX_WORKERS << endl;
+	      usageClause(argv);
+	    }
+	  break;
+	case 'c': // How file bytes are copied to the socket during a download
+	  if(!parseCopyMode(optarg))
+	    {
+	      cout << "Unknown copy mode: " << optarg << endl;
+	      usageClause(argv);
+	    }
+	  break;
+	case 'C': // Size of the file cache
+	  if(!isNumeric(optarg) || strlen(optarg) > 6)
+	    {
+	      cout << "The file cache size must be a number of megabytes" << endl;
+	      usageClause(argv);
+	    }
+	  cacheMegabytes = atoi(optarg);
+	  break;
+	case 'S': // Directory for compressed variants of hot files
+	  if(!compressStore.open(optarg))
+	    usageClause(argv);
+	  break;
+	case 'X': // File the chunk index of the served files is kept in
+	  if(!chunkIndex.open(optarg))
+	    usageClause(argv);
+	  break;
+	case 'M': // Port the metrics are scraped on
+	  if(!isNumeric(optarg) || (metricsPort = atoi(optarg)) <= 1024 || metricsPort >= 65535)
+	    {
+	      cout << "The metrics port must be between 1024 and 65535" << endl;
+	      usageClause(argv);
+	    }
+	  break;
+	case 'L': // What is logged
+	  if(!parseLogLevel(optarg))
+	    {
+	      cout << "Unknown log level: " << optarg << endl;
+	      usageClause(argv);
+	    }
+	  break;
+	case 'R': // Rate limit of every log statement
+	  if(!isNumeric(optarg) || strlen(optarg) > 9)
+	    {
+	      cout << "The log rate must be a number of lines a second" << endl;
+	      usageClause(argv);
+	    }
+	  logRate = atoi(optarg);
+	  break;
+	default: // Unknown flag
+	  usageClause(argv);
+	}
+    }
+  int numArgs = argc - optind; // Arguments left once the flags are removed
+  
   // Few Arguments passed
-  if(argc < 2)
+  if(numArgs < 1)
     {
       // Assign Default Port
       address.sin_port = htons( DEFAULT_PORT ); 
     }
   // Too many arguments passed 
-  else if(argc > 2)
+  else if(numArgs > 1)
     {
       usageClause(argv);
     }
   // right amount of arguments passed
-  else if (argc == 2)
+  else if (numArgs == 1)
     { 
       
       // Check if port number entered is Numeric
-      if(!isNumeric(argv[1]))
+      if(!isNumeric(argv[optind]))
 	{
 	  cout << "Optional Port Number Must be all Numeric !" << endl;
 	  usageClause(argv);	  
@@ -91,7 +227,7 @@ int main(int argc, char const  *argv[])
       else 
 	{
 	  // Convert the command line argument to a number 
-	  string input = argv[1];
+	  string input = argv[optind];
 	  // Convert the string to a number
 	  int optionalPort = atoi(input.c_str());
 	  // Check if the port number entered is between the range 
@@ -105,157 +241,67 @@ int main(int argc, char const  *argv[])
     }
   
   
-  char clientReply[MAX_MSG_SIZE] = {'\0'}; // To Store reply message from the client  
-  connectToClient(sockfd, client_socket,  address);
+  cout << "File Copy Mode: " << copyModeName(copyMode) << endl;
   
-  int addrlen = sizeof(address);
-  int numChild = 0;	
-  // Infinite loop
-  while(true)
+  // Every worker process would fill a cache of its own, only threads can share one
+  if(serverModel == MODEL_FORK)
     {
-      // Accept incoming connections form client
-      if ((client_socket = accept(sockfd, (struct sockaddr *)&address, (socklen_t*)&addrlen))<0) 
-	{ 
-	  perror("accept"); 
-	  exit(EXIT_FAILURE); 
-	}    
-      int rv = fork(); // Fork()
-      switch(rv)
-	{
-	case -1: // fork() error
-	  {
-	    perror("Fork() Failed !");
-	    exit(-1);
-	  }
-	case 0: //Child
-	  {
-	    runServer(sockfd,client_socket,address, clientReply);
-	  }
-	default: // Parent
-	  {
-	    numChild++; // Keep Track of the number of child processes.
-	  }
-	}// end switch
-      
-    }// end while
+      if(cacheMegabytes > 0)
+	cout << "The fork model can't share a file cache between clients, -C ignored" << endl;
+      cacheMegabytes = 0;
+    }
+  fileCache.setCapacity((size_t)(cacheMegabytes == -1 ? DEFAULT_CACHE_MB : cacheMegabytes) * 1048576);
+  cout << fileCache.stats() << endl;
+  // Directory listings too, inotify keeps them current
+  if(serverModel != MODEL_FORK)
+    dirCache.start();
+  cout << dirCache.stats() << endl;
+  cout << compressStore.stats() << endl;
+  cout << chunkIndex.stats() << endl;
+  cout << "Log Level: " << logLevelName(logLevel);
+  if(logRate != 0)
+    cout << ", at most " << logRate << " lines a second per statement";
+  cout << endl;
   
-  for(int i =0; i < numChild; i++)
+  // A client that disconnects in the middle of a download must not kill the server (sendfile/splice raise SIGPIPE)
+  signal(SIGPIPE, SIG_IGN);
+  // Every worker process (every thread of the other models) counts in a shard of its own
+  initMetrics(serverModel == MODEL_FORK ? numWorkers : METRICS_THREAD_SHARDS);
+  if(metricsPort != 0)
     {
-      int stat;
-      pid_t  childPid; //To store wait return value: wait() returns process id of terminated child (if there is one)
-      childPid = wait(&stat); // using wait() to suspend Parent process until its child terminates
-      if(childPid == -1) // No child to wait for :(
-	{
-          perror("Error in Wait!");
-          continue;
-        }
-      // Output information about the status of the child process terminated
-      if(WIFEXITED(stat))// WIFEXITED(stat) will return true if the child terminates
-        {
-          // WEXITSTATUS(stat) will return the exit status of the child
-          cout << "Child: " << childPid << " is terminated: Return Status: " << WEXITSTATUS(stat) << endl;
-        }
-      else
-        cout << "Child: " << childPid << " is terminated, return status is unknown. "  << endl;
-      
-      
-      numChild--;
-      
+      if(!startMetricsServer(metricsPort))
+	exit(EXIT_FAILURE);
+      cout << "Metrics: http://127.0.0.1:" << metricsPort << "/metrics" << endl;
     }
-  close(sockfd); // Close the listening socket
-  
-  
-}// end main()
-void runServer(int &sockfd, int &client_socket, sockaddr_in  &address, char clientReply[])
-{
-  const char *hello = "Hello Client. "; // Servers  Hello Message For the Client 
-  // Get the Ip Address of the connected Socket 
-  string ipAddress = getIpAddress(address);  
-  // Send Hello Message to Client
-  sendToClient(client_socket, hello, true);
-  // Receive Message (Command) From Client
-  recvFromClient(client_socket,clientReply);
-  // convert to string for == comparison 
-  string clientMessage(clientReply);
+  initSessions();
+  chunkIndex.start(startDirFd); // walks the tree the sessions start in
   
-  while(clientMessage != "bye")
-    {       
-      // Check if the client wants to exit and end the connection.
-      checkReply(clientReply, client_socket,sockfd,  ipAddress);
-      // Receive Message (Command) From Client
-      recvFromClient(client_socket,clientReply);	  
+  if(serverModel == MODEL_REACTOR)
+    {
+      // One listening socket per thread, all bound to the same port, one thread per core by default
+      if(numThreads == 0)
+	numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+      vector<int> listeningSocks(numThreads);
+      for(int i = 0; i < numThreads; i++)
+	connectToClient(listeningSocks[i], client_socket, address, true);
+      runReactor(listeningSocks);
     }
   
-}
-/**********************************************************************************************
- * Function name:     sendToClient
- * Description:       Send Message To Client, Handle Errors Appropriately
- * Parameters:        const int sockfd: Socket Descriptor of connected Socket
-                      const char* message: A message to be sent to the client
-		      * Return Value:       void (none)
-		      *********************************************************************************************/
-void sendToClient(const int sockfd, const char* message, bool printToScreen)
-{
-  string userMsg = message; // store the message that will be outputted to the screen
-  // remove the end of message marker (for user output)  
-  const char* clientMsg = (userMsg + ":)").c_str();// store the message that will be sent to the client 
+  connectToClient(sockfd, client_socket,  address);
   
-  if(send(sockfd, clientMsg, strlen(clientMsg), 0 ) < 0 ) // For char
+  if(serverModel == MODEL_URING && !runUringLoops(sockfd, numThreads == 0 ? 1 : numThreads))
     {
-      perror("Sending Failed ! ");
-      exit(-1);
+      cout << "io_uring Is Not Available, Serving With epoll Instead" << endl;
+      serverModel = MODEL_EPOLL;
     }
+  if(serverModel == MODEL_EPOLL)
+    runEventLoops(sockfd, numThreads == 0 ? 1 : numThreads);
   else
-    if(printToScreen)
-      cout << "Message Sent: \"" <<  userMsg << "\"" << endl;
-  
-} 
-/**********************************************************************************************
- * Function name:     recvFromClient
- * Description:       Receive Message From Client, Handle Errors Appropriately
- * Parameters:        const int sockfd: Socket Descriptor of connected Socket
-                      char clientReply: A char array to store the message received from client
-		      * Return Value:      void (none)
- *********************************************************************************************/
-void recvFromClient(const int sockfd, char clientReply[])
-{
+    runWorkerPool(sockfd, numWorkers);
   
-  memset(clientReply, 0 , MAX_MSG_SIZE);
-  if(recv(sockfd, clientReply, MAX_MSG_SIZE, 0) < 0) // Error In Receive
-    {
-      perror("Recieving Failed ! ");
-      exit(-1);
-    }
-  else// recv success
-    {
-      while(!hasEndOfMsg(clientReply))// Check if the message from the client has (end of message character) 
-	{
-	  if(recv(sockfd, clientReply, MAX_MSG_SIZE, 0) < 0) // Error In Receive
-	    {
-	      perror("Recieving Failed ! ");
-	      exit(-1);
-	    }	
-	}// end while
-      
-      // Since this gets executed when the client send a complete message (a message with end of file character)
-      // Remove the end of message character for every receive here (instead of later checking for if("pwd:)" 
-	  // just check if(pwd)
-      clientReply[strlen(clientReply) -2] = '\0'; 
-	  cout << "\nMessage from The Client : \"" << clientReply << "\"" << endl;
-    }
-  /*
-    piazza
-     else
-     {
-     // Inform The User the Connection Has Ended
-     cout << "Failed Client Message: " << clientReply << endl;
-     cout << "Message Not Fully Received From Client." << endl;	 
-	  exit(-1);
-	  }
-  */  
+  close(sockfd); // Close the listening socket
   
-}// end revcFromClient
-
+}// end main()
 /********************************************************************************
  * Function name:     usageClause
  * Description:       Output the usage Clause for the user
@@ -266,7 +312,23 @@ void usageClause(const char *argv[])
 {
   
   cout << "PORT NUMBER Must be between the range 1024 and 65535 " << endl;
-  cout << "\nUsage: " << argv[0] << " <PORT NUMBER > \n" << endl;
+  cout << "\nUsage: " << argv[0] << " [-c sendfile|splice|buffered] [-m fork|epoll|reactor|uring] [-t threads] [-w workers] [-C megabytes] [-S directory] [-X file]"
+       << " [-M port] [-L level] [-R lines] <PORT NUMBER > \n" << endl;
+  cout << "  -c  How downloads copy file bytes to the socket (default sendfile)" << endl;
+  cout << "  -m  fork: pre-forked worker processes, one client each at a time (default), epoll: event loop threads," << endl;
+  cout << "      reactor: one pinned event loop per core, each with its own listening socket," << endl;
+  cout << "      uring: io_uring threads doing all socket and file I/O (epoll if io_uring is unavailable)" << endl;
+  cout << "  -t  Number of event loop threads (default 1 for epoll/uring, one per core for reactor)" << endl;
+  cout << "  -w  Number of worker processes for fork, clients served at once (default " << DEFAULT_WORKERS << ")" << endl;
+  cout << "  -C  Megabytes of file contents cached for all clients, 0 for none (default " << DEFAULT_CACHE_MB
+       << ", not used by fork)" << endl;
+  cout << "  -S  Directory compressed variants of hot files are kept in, built after " << COMPRESS_STORE_HOT
+       << " compressed downloads (default none)" << endl;
+  cout << "  -X  File the content-defined chunks of the served files are indexed in for dget, rescanned every "
+       << CHUNK_INDEX_RESCAN << " seconds (default none)" << endl;
+  cout << "  -M  Port of 127.0.0.1 that serves the metrics in the Prometheus text format at /metrics (default none)" << endl;
+  cout << "  -L  What is logged: off, error, warn, info or debug, which shows every message (default info)" << endl;
+  cout << "  -R  Lines a second each log statement may log, 0 for no limit (default " << LOG_DEFAULT_RATE << ")\n" << endl;
   exit (-1);
 }//end usageClause()
 /*******************************************************************************************************
@@ -285,216 +347,18 @@ bool isNumeric(const string str)
   
   return true; // else return true
 }// end isNumeric
-/********************************************************************************************************************************
- * Function name:     hasEndOfMsg
- * Description:       Checks if a string of characters contains the end of indicator specified in the protocol, in this case ":)"
- * Parameters:        const string str: A string that is going to be checked for a sequence of specified characters
- * Return Value:      true:  if the string contains the character sequence of ":" followed by ")" which is ":)"
-                      false: if the string fails to satisfy the above condition
-
-********************************************************************************************************************************/
-bool hasEndOfMsg(const string str)
-{
-  
-  int i = 0;
-  while(i < str.length()) // Not To Go Out Of Bounds while checking for i and i+1
-    {
-      // loop Through each character in the string
-      for(i =0; i <str.length(); i++)
-	if(str[i] == ':' && str[i+1] == ')')// If there is a :) sequence of characters
-	  return true;
-    }
-
-  return false;
-}// end hasEndOfMsg
-/********************************************************************************************************************************
- * Function name:     checkReply
- * Description:       Checks the client reply  (message/command) for the download protocol, and runs commands apprpriately 
- * Parameters:        const char* clientReply: The message recieved form the client 
-                      const int connectedSock: The socket descriptor for the connected socket (The Client Socket)
-                      const char* ipAddress: The Ip Address of the connected socket 
-* Return Value:     void(none)
-********************************************************************************************************************************/
-void checkReply( char* clientReply, const int connectedSock, const int listeningSock,  string ipAddress)
-{
-
-  int messageSize = strlen(clientReply);
-  // Good Bye Message For The Client
-  const char *goodByeMessage = "Good Bye Client.";
-  // Convert Message from client to string, useful Later  to use == comparison
-  string clientMessage(clientReply);
-  
-  if(clientMessage == "bye")
-    {
-      // Send A Good Bye Message      
-      sendToClient(connectedSock, goodByeMessage, true);
-      // Close Connection
-      if(close(connectedSock) == -1)
-	{
-	  perror("Error Closing Connected Socket: ");
-	}     
-      // Inform The User the Connection Has Ended
-      cout << "Connection With: " << ipAddress << " Has Ended !" << endl;
-      
-      exit(-1);
-    }
-  else if(clientMessage == "pwd")
-    {
-      
-      // Allocate a Buffer to store the current working directory name 
-      char directory[MAX_MSG_SIZE];
-      
-      // Get the Current Working Directory by the getcwd() function call also check for errors
-      if((getcwd(directory , sizeof(directory) ) == NULL ) )
-	{
-	  perror("Couldn't Get Current Working Directory");
-	}
-      // Convert to directory string
-      string strDirectory = directory;
-      // Send the working Directory to the Client 
-      sendToClient(connectedSock, strDirectory.c_str(), true);
-      
-    }
-  else if(clientMessage == "cd") // Change Directory
-    {
-      
-      const char *reqDirMsg = "Enter the New Directory: "; 
-      // memset(clientReply, 0 , sizeof clientReply);
-      char newDirectory[MAX_MSG_SIZE]; // for new directory
-      
-      // Prompt the client For the directory name(to change to)
-      sendToClient(connectedSock, reqDirMsg, true);
-      // Read the new directory to change to
-      recvFromClient(connectedSock, newDirectory);
-      
-      // If directory changing fails
-      if(chdir(newDirectory) == -1)
-	{
-	  // An error message from the server to the client
-	  char errorMsg[MAX_MSG_SIZE] = "Couldn't change to specified directory: ";
-	  // Append the error specified by the system call 
-	  const char* errorMessage  = strcat(errorMsg, strerror(errno));
-	  perror("Couldn't Change to New Directory");
-	  // send a combined  error message to client
-	  sendToClient(connectedSock,errorMessage,true); 
-	}// end if
-      else
-	{
-	  string successMsg = "Directory has Successfully Changed to: ";
-	  successMsg+=newDirectory;
-	  sendToClient(connectedSock, successMsg.c_str(),true);
-      
-	}// end else
-      
-      
-    }// end else if
-  else if (clientMessage == "download")
-    {
-      struct stat val; // statStr;	
-      ifstream ins;
-      char fileName[MAX_MSG_SIZE];
-      char responce[MAX_MSG_SIZE];
-      const char *prompt = "Enter the File Name: "; // Ask Client For The File Name
-      const char *readyMessage = "READY"; // A ready Message if file was found
-     
-      // Prompt the client for the file name 
-      sendToClient(connectedSock, prompt, true);
-      // Receive File Name From Server;
-      recvFromClient(connectedSock, fileName);
-      
-	  stat(fileName, &val);	
-	  string strFileName = fileName;
-	  
-		
-	  if(doesFileExist(strFileName.c_str()) == true)// If the File Exists 
-	    {
-	      ///if(!S_ISDIR(val.st_mode)) // If the fileName  is not a directory
-	      if ((val.st_mode & S_IFMT) == S_IFREG)
-		{
-			  // Send Ready message For Client 
-		  sendToClient(connectedSock, readyMessage, true);
-		  // receive "Ready" Or " Stop from client
-		  recvFromClient(connectedSock, responce);
-		  // convert clients response for string comparison
-		  string strResponce = responce;
-		  cout << "Client : " << responce << endl;
-		  
-		  if(strResponce == "READY")
-		    {	      
-		      //string file1 = "data.txt";
-		      ins.open(strFileName.c_str());	      
-		      // Var to store file, initially Empty
-		      string file = "";
-		      // Var to store line read from a file
-		      string line  ="";
-		      
-		      while(!ins.eof())
-			{
-			  // Get the first line from the file and store it inside line
-			  getline(ins,line);
-			  // Add the line to the file 
-			  file+=line;
-			  // Append a new line to the file after each line is read
-			  file +="\n";
-			} // once file completely read
-		      
-		      // Send File to Client
-		      sendToClient(connectedSock, file.c_str(), false);
-		      // Receive message? did client get complete file?
-		      recvFromClient(connectedSock, responce);	      
-		    }
-		  else if(strResponce == "STOP") // Client Doesn't Want File To Be Downloaded Anymore
-		    {
-		      const char *stop = "Download Canceled.";
-		      sendToClient(connectedSock, stop, true);
-		    }
-		  
-		  //Close File 
-		  ins.close();
-		}
-	      
-	      else
-		{  
-		  string strErrorMsg = "Download Failed: " + strFileName + " is a directory not a file! ";		  
-		  // send a combined  error message to client
-		  sendToClient(connectedSock, strErrorMsg.c_str(), true);
-		}
-	    }//if(!S_ISDIR(val.st_mode))
-	  else
-	    {  
-	      // An error message from the server to the client
-	      char errorMsg[MAX_MSG_SIZE] = "Download failed: "; 
-	      // Append the error specified by the system call
-	      const char* errorMessage  = strcat(errorMsg, strerror(errno));
-	      // send a combined  error message to client
-	      sendToClient(connectedSock, errorMessage, true);
-	    }
-    }
-  else if(clientMessage == "dir")
-    {
-      // Send Directory Listing to client (error handled inside function)
-      sendDirListing(connectedSock);
-    }
-  /*
-    else
-    {
-    cout << "Invalid Entry For the Server " << endl;
-    close (connectedSock);
-    exit(-1);
-    }
-  */
-  
-}// end checkReply
 /********************************************************************************************************************************
  * Function name:     connectToClient
  * Description:       Establishes a connection to a client using the system calls socket, bind, listen, and accept. Will display an error message if  
+                      With reusePort several sockets can listen on the same port and the kernel spreads connections over them
  * Parameters:        const char* clientReply: The message received form the client
                       int &connectedSock: The socket descriptor for the connected socket (The Client Socket)
                       const char* ipAddress: The Ip Address of the connected socket
+                      bool reusePort: set SO_REUSEPORT before binding (for -m reactor)
 		      * Return Value:     void(none)
 
 		      ********************************************************************************************************************************/
-void connectToClient(int &sockfd, int &client_socket, sockaddr_in  &address)
+void connectToClient(int &sockfd, int &client_socket, sockaddr_in  &address, bool reusePort)
 {
   int addrlen = sizeof(address);
   
@@ -504,6 +368,13 @@ void connectToClient(int &sockfd, int &client_socket, sockaddr_in  &address)
       perror("socket failed"); 
       exit(EXIT_FAILURE); 
     } 
+  int enable = 1;
+  // Every socket in the group must set SO_REUSEPORT before bind()
+  if (reusePort && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+    {
+      perror("SO_REUSEPORT failed");
+      exit(EXIT_FAILURE);
+    }
   // attaching socket to the DEFAULT_PORT
   if (bind(sockfd, (struct sockaddr *)&address, sizeof(address))<0) 
     { 
@@ -526,112 +397,3 @@ void connectToClient(int &sockfd, int &client_socket, sockaddr_in  &address)
   */
   
 }
-/*************************************************************************************************************************************
- * Function name:     getIpAddress
- * Description:       Converts the IPv4 and IPv6 addresses from binary to text form
- * Parameters:        struct sockaddr_in &address: A sockaddr_in structure used to store the addresses for the internet address family 
- * Return Value:      void(none)
-
- ************************************************************************************************************************************/
-
-string getIpAddress(sockaddr_in &address)
-{
-  
-  // To store the IP address of the client 
-  char ipAddress[50];
-
-  ///  Get the ip Address of the Client  
-  if(inet_ntop(AF_INET,&(&address)->sin_addr, ipAddress, sizeof ipAddress ) == NULL )
-    {
-      perror("Couldnt Get Clients IP Address !");
-    }
-  // Output The Ip address the server is connected to (Clients ip)
-  cout << "\nConnected To: " << ipAddress << endl;
-  
-  // Convert the Ip Address to a string 
-  string strIpAddress = ipAddress;
-
-  return strIpAddress;
-  
-}
-
-/******************************************************************************************************************* \
- ******************
- * Function name:     doesFileExist
- * Description:       Checks if a file exists or not
- * Parameters:        none
- * Return Value:      bool : (True if file exists, false if not)
-
-*******************************************************************************************************************\
-*****************/
-bool doesFileExist(const char *file)
-{
-  ifstream ins;
-  ins.open(file);
-  return ins.good();
-}
-
-void sendDirListing(int connectedSock)
-{
-
-  struct dirent *dirStrPtr;    // pointer to directory structure
-  DIR *directoryPtr;           // current directory pointer
-  char *dirname=(char *)calloc(80, sizeof(char));    // allocate memory and set it to 0s
-  char *filename=(char *)calloc(256, sizeof(char));  // allocate memory and set it to 0s
-  char *errmsg=(char *)calloc(256, sizeof(char));    // allocate memory and set it to 0s
-  struct stat statStr;         // stat structure
-  string header = "\nFiles are  Marked With ** \n\n";
-  string dirList = header;
-  /* Use current directory */
-  strcpy(dirname, ".");
-  
-  /* Open Directory */
-  if ((directoryPtr = opendir(dirname)) == NULL)   {
-    perror("Cannot open current directory: ");
-    exit(2);
-  }   /* end if */
-  
-
-  /* set errno to 0 so can check to see if the system call sets it for an error */
-  errno = 0;
-
-  /* While there are still contents in the directory to read */
-  while ((dirStrPtr = readdir(directoryPtr)) != NULL)   {
-    /* Get the status of the current entry */
-    sprintf(filename, "%s/%s", dirname, dirStrPtr->d_name);
-    if (stat(filename, &statStr) == -1)  {
-      sprintf(errmsg, "Error stat(%s): ", filename);
-      perror(errmsg);
-      continue;
-    }  // end if stat
-
-    /* Save entry name; mark files with an * */
-    if ((statStr.st_mode & S_IFMT) == S_IFREG)
-      {
-	dirList += dirStrPtr->d_name; // Add to the directory list
-	dirList += "  **"; // append ** if its a file
-	dirList += "\n"; // Append New Line
-      }
-    else
-      {
-	
-	dirList += dirStrPtr->d_name;// Add to the directory list
-	dirList += "\n";// Append New Line
-      }
-    
-    // reset errno to 0
-    errno = 0;
-  }   /* end while */
-  
-  /* Check for an error */
-  /* If there is an error, NULL will be returned and errno will be set */
-  if ((dirStrPtr == NULL) && (errno != 0))  {
-    perror("Error reading directory entry: ");
-  }  // end if error
-
-  //  dirList += ":)"; // Append End of message char
-  sendToClient(connectedSock, dirList.c_str(), false); // Send  the list to client
-  
-  closedir(directoryPtr);
-
-}
@@ -0,0 +1,448 @@
+/********************************************************************************************************
+ * Filename: protocol.h
+ * Purpose: Wire format shared by the client (client.cpp) and the server (newServer.cpp)
+ * Programming Language Used: C++
+ * Protocol: -> Every message between client and server is a frame:
+ *
+ *                +----------+-----------+----------------------------+---------------------+
+ *                | type (1) | flags (1) | payload length (8, big end) | payload (length)    |
+ *                +----------+-----------+----------------------------+---------------------+
+ *
+ *           -> FRAME_MSG frames carry text messages/commands, FRAME_DATA frames carry raw file bytes
+ *              (and the binary path list and StatRecords of stat-batch, the signatures and delta of
+ *              sync, the chunk hashes of have and the chunk list of dget).
+ *           -> The payload is never scanned, so any byte value (":)" included) can be sent.
+ *           -> With FRAME_FLAG_STREAM the payload starts with a stream id, so replies to several
+ *              requests can be in flight on one connection at once, their frames interleaved.
+ *              FRAME_FLAG_END marks the last frame of a stream.
+ *           -> After "compress" a whole file can come as FRAME_DATA frames flagged
+ *              FRAME_FLAG_COMPRESSED, one compressed block each, the last one also flagged
+ *              FRAME_FLAG_END (see compression.h).
+ *           -> After "checksum crc32c" the file or range of a download, a get, an mget file, a sync
+ *              and a dget is followed by a FRAME_CHECKSUM frame: the chunk size, the CRC32C of all
+ *              the bytes sent (of the whole file for sync and dget) and one CRC32C per chunk (see
+ *              crc32c.h), each 4 bytes big endian. A get sent on a stream and the archive of a
+ *              download-dir have none.
+ *
+ *                +----------------+---------------+-------------------------------------+
+ *                | chunk size (4) | whole CRC (4) | CRC of each chunk (4 each)          |
+ *                +----------------+---------------+-------------------------------------+
+ *           -> FrameParser consumes bytes as they arrive and reports each frame piece by piece,
+ *              every received byte is looked at once no matter how the stream is split by recv().
+ *********************************************************************************************************/
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h> // struct iovec
+#include <string>
+
+#define DEFAULT_PORT 49878 // Port used when none is given on the command line
+#define MAX_MSG_SIZE 5000 // Max size of a command sent to the server
+#define LIST_PAGE_MAX 1000 // Most names in one page of "list", a page never exceeds MAX_MSG_SIZE - 1 bytes either
+#define CHUNK_SIZE 65536 // Size of each piece of a file read or written at a time
+
+#define FRAME_HEADER_SIZE 10 // type + flags + 64 bit payload length
+
+#define STAT_BATCH_MAX 65536 // Most paths in one stat-batch request
+#define MGET_MAX_FILES 100000 // Most files one mget may match
+#define STAT_BATCH_BYTES (1 << 20) // Longest path list of one stat-batch request
+#define STAT_RECORD_SIZE 30 // error + type + size + mtime seconds + mtime nanoseconds + inode
+
+// File types in a StatRecord
+#define STAT_TYPE_NONE  0 // the path couldn't be stat()ed, see error
+#define STAT_TYPE_FILE  1 // regular file
+#define STAT_TYPE_DIR   2 // directory
+#define STAT_TYPE_OTHER 3 // fifo, socket, device
+
+// Frame types
+#define FRAME_MSG  1 // A text message or command
+#define FRAME_DATA 2 // Raw file bytes
+#define FRAME_CHECKSUM 3 // CRC32Cs of the file bytes just sent
+
+// Frame flags
+#define FRAME_FLAG_STREAM     0x01 // The payload starts with a STREAM_ID_SIZE byte stream id (network byte order)
+#define FRAME_FLAG_END        0x02 // Last frame of its stream, or of a compressed file
+#define FRAME_FLAG_COMPRESSED 0x04 // FRAME_DATA holding one compressed block of a file (see compression.h)
+
+#define CHECKSUM_CHUNK_SIZE (1 << 20) // Bytes covered by each chunk CRC of a FRAME_CHECKSUM frame
+
+#define STREAM_ID_SIZE 4 // Bytes of a stream id, 0 is never used
+#define MAX_STREAMS 64 // Most downloads one connection may have in flight on streams
+
+// Events reported by FrameParser::next() and readFrameEvent()
+#define FRAME_INVALID  -3 // The frame received was not the kind expected
+#define FRAME_FAILED   -2 // recv() failed, errno tells why
+#define FRAME_CLOSED   -1 // The other side closed the connection
+#define FRAME_NEED_MORE 0 // Every byte given was consumed, more are needed
+#define FRAME_BEGIN     1 // A frame header is complete, event.header describes the frame
+#define FRAME_PAYLOAD   2 // event.data/event.length is the next piece of the payload
+#define FRAME_END       3 // The payload of the current frame is complete
+
+struct FrameHeader
+{
+  uint8_t type; // FRAME_MSG, FRAME_DATA, FRAME_CHECKSUM
+  uint8_t flags; // FRAME_FLAG_*, 0 outside of streams
+  uint64_t length; // Number of payload bytes following the header
+};
+
+struct FrameEvent
+{
+  FrameHeader header; // The frame the event belongs to
+  const char *data; // FRAME_PAYLOAD only: points into the bytes given to the parser
+  size_t length; // FRAME_PAYLOAD only: number of payload bytes at data
+};
+
+/*************************************************************************************************
+ * Function name:     encodeFrameHeader
+ * Description:       Writes a frame header in wire format (length in network byte order)
+ * Parameters:        char out[]: FRAME_HEADER_SIZE bytes to fill
+                      uint8_t type, uint8_t flags, uint64_t length: The header fields
+ * Return Value:      void(none)
+ *************************************************************************************************/
+inline void encodeFrameHeader(char out[], uint8_t type, uint8_t flags, uint64_t length)
+{
+  out[0] = (char)type;
+  out[1] = (char)flags;
+  for(int i = 0; i < 8; i++)
+    out[2 + i] = (char)(length >> (56 - 8 * i));
+}// end encodeFrameHeader
+
+/*************************************************************************************************
+ * Function name:     decodeFrameHeader
+ * Description:       Reads a frame header from wire format
+ * Parameters:        const char in[]: FRAME_HEADER_SIZE bytes received
+ * Return Value:      FrameHeader: The header fields
+ *************************************************************************************************/
+inline FrameHeader decodeFrameHeader(const char in[])
+{
+  FrameHeader header;
+  header.type = (uint8_t)in[0];
+  header.flags = (uint8_t)in[1];
+  header.length = 0;
+  for(int i = 0; i < 8; i++)
+    header.length = (header.length << 8) | (uint8_t)in[2 + i];
+  return header;
+}// end decodeFrameHeader
+
+/*************************************************************************************************
+ * Struct name:       StatRecord
+ * Description:       What stat-batch reports for one path, sent as STAT_RECORD_SIZE bytes with
+                      every number in network byte order, one record per path in request order
+ *************************************************************************************************/
+struct StatRecord
+{
+  uint8_t error; // errno of the failed statx(), 0 if the rest is valid
+  uint8_t type; // STAT_TYPE_*
+  uint64_t size; // bytes
+  int64_t mtimeSeconds; // last modification, seconds since the epoch
+  uint32_t mtimeNanoseconds;
+  uint64_t inode;
+};
+
+/*************************************************************************************************
+ * Function name:     encodeBigEndian
+ * Description:       Writes the low bytes of a number, most significant byte first
+ * Parameters:        char out[]: bytes bytes to fill
+                      uint64_t value: The number
+                      int bytes: How many bytes to write (8 at most)
+ * Return Value:      void(none)
+ *************************************************************************************************/
+inline void encodeBigEndian(char out[], uint64_t value, int bytes)
+{
+  for(int i = 0; i < bytes; i++)
+    out[i] = (char)(value >> (8 * (bytes - 1 - i)));
+}// end encodeBigEndian
+
+/*************************************************************************************************
+ * Function name:     decodeBigEndian
+ * Description:       Reads a number written by encodeBigEndian
+ * Parameters:        const char in[]: The bytes
+                      int bytes: How many bytes to read (8 at most)
+ * Return Value:      uint64_t: The number
+ *************************************************************************************************/
+inline uint64_t decodeBigEndian(const char in[], int bytes)
+{
+  uint64_t value = 0;
+  for(int i = 0; i < bytes; i++)
+    value = (value << 8) | (uint8_t)in[i];
+  return value;
+}// end decodeBigEndian
+
+/*************************************************************************************************
+ * Function name:     encodeStatRecord
+ * Description:       Writes a StatRecord in wire format
+ * Parameters:        char out[]: STAT_RECORD_SIZE bytes to fill
+                      const StatRecord &record: The record
+ * Return Value:      void(none)
+ *************************************************************************************************/
+inline void encodeStatRecord(char out[], const StatRecord &record)
+{
+  out[0] = (char)record.error;
+  out[1] = (char)record.type;
+  encodeBigEndian(out + 2, record.size, 8);
+  encodeBigEndian(out + 10, (uint64_t)record.mtimeSeconds, 8);
+  encodeBigEndian(out + 18, record.mtimeNanoseconds, 4);
+  encodeBigEndian(out + 22, record.inode, 8);
+}// end encodeStatRecord
+
+/*************************************************************************************************
+ * Function name:     decodeStatRecord
+ * Description:       Reads a StatRecord from wire format
+ * Parameters:        const char in[]: STAT_RECORD_SIZE bytes received
+ * Return Value:      StatRecord: The record
+ *************************************************************************************************/
+inline StatRecord decodeStatRecord(const char in[])
+{
+  StatRecord record;
+  record.error = (uint8_t)in[0];
+  record.type = (uint8_t)in[1];
+  record.size = decodeBigEndian(in + 2, 8);
+  record.mtimeSeconds = (int64_t)decodeBigEndian(in + 10, 8);
+  record.mtimeNanoseconds = (uint32_t)decodeBigEndian(in + 18, 4);
+  record.inode = decodeBigEndian(in + 22, 8);
+  return record;
+}// end decodeStatRecord
+
+/*************************************************************************************************
+ * Class name:        FrameParser
+ * Description:       Incremental frame parser. Bytes are handed over as they are received and
+                      next() reports the frame they belong to without copying or rescanning the
+                      payload, only the 10 header bytes are ever buffered.
+ *************************************************************************************************/
+class FrameParser
+{
+public:
+  FrameParser() : state(STATE_HEADER), headerFill(0), payloadLeft(0)
+  {
+    current.type = 0;
+    current.flags = 0;
+    current.length = 0;
+  }
+
+  /*************************************************************************************************
+   * Function name:     next
+   * Description:       Consumes bytes from data and reports the next event
+   * Parameters:        const char *&data: Received bytes, advanced past the bytes consumed
+                        size_t &length: Number of bytes at data, reduced by the bytes consumed
+                        FrameEvent &event: Filled in for FRAME_BEGIN, FRAME_PAYLOAD and FRAME_END
+   * Return Value:      FRAME_NEED_MORE, FRAME_BEGIN, FRAME_PAYLOAD or FRAME_END
+   *************************************************************************************************/
+  int next(const char *&data, size_t &length, FrameEvent &event)
+  {
+    event.header = current;
+    event.data = NULL;
+    event.length = 0;
+
+    switch(state)
+      {
+      case STATE_HEADER:
+        {
+          size_t take = FRAME_HEADER_SIZE - headerFill;
+          if(take > length)
+            take = length;
+          memcpy(headerBytes + headerFill, data, take);
+          headerFill += take;
+          data += take;
+          length -= take;
+          if(headerFill < FRAME_HEADER_SIZE)
+            return FRAME_NEED_MORE;
+
+          current = decodeFrameHeader(headerBytes);
+          headerFill = 0;
+          payloadLeft = current.length;
+          state = payloadLeft > 0 ? STATE_PAYLOAD : STATE_END;
+          event.header = current;
+          return FRAME_BEGIN;
+        }
+      case STATE_PAYLOAD:
+        {
+          if(length == 0)
+            return FRAME_NEED_MORE;
+          size_t take = payloadLeft < length ? (size_t)payloadLeft : length;
+          event.data = data;
+          event.length = take;
+          data += take;
+          length -= take;
+          payloadLeft -= take;
+          if(payloadLeft == 0)
+            state = STATE_END;
+          return FRAME_PAYLOAD;
+        }
+      default: // STATE_END
+        state = STATE_HEADER;
+        return FRAME_END;
+      }
+  }// end next
+
+  // Number of payload bytes of the current frame not seen yet
+  uint64_t remaining() const { return payloadLeft; }
+
+private:
+  enum { STATE_HEADER, STATE_PAYLOAD, STATE_END };
+  int state;
+  char headerBytes[FRAME_HEADER_SIZE]; // header bytes collected so far
+  size_t headerFill; // how many of headerBytes are filled
+  uint64_t payloadLeft; // payload bytes of the current frame still to come
+  FrameHeader current; // header of the frame being parsed
+};
+
+/*************************************************************************************************
+ * Struct name:       FrameReader
+ * Description:       A blocking socket paired with a receive buffer and a FrameParser, bytes
+                      received past the end of one frame stay buffered for the next one
+ *************************************************************************************************/
+struct FrameReader
+{
+  int sockfd; // connected socket the frames come from
+  char buffer[CHUNK_SIZE]; // last chunk received
+  const char *data; // first unparsed byte in buffer
+  size_t length; // number of unparsed bytes at data
+  FrameParser parser;
+
+  explicit FrameReader(int fd) : sockfd(fd), data(buffer), length(0) {}
+};
+
+/*************************************************************************************************
+ * Function name:     readFrameEvent
+ * Description:       Reports the next frame event, receiving from the socket only when every
+                      buffered byte has been parsed
+ * Parameters:        FrameReader &reader: The connection to read from
+                      FrameEvent &event: Filled in with the event
+ * Return Value:      FRAME_BEGIN, FRAME_PAYLOAD, FRAME_END, FRAME_CLOSED or FRAME_FAILED
+ *************************************************************************************************/
+inline int readFrameEvent(FrameReader &reader, FrameEvent &event)
+{
+  while(true)
+    {
+      int kind = reader.parser.next(reader.data, reader.length, event);
+      if(kind != FRAME_NEED_MORE)
+        return kind;
+
+      ssize_t received = recv(reader.sockfd, reader.buffer, sizeof(reader.buffer), 0);
+      if(received < 0)
+        {
+          if(errno == EINTR)
+            continue;
+          return FRAME_FAILED;
+        }
+      if(received == 0)
+        return FRAME_CLOSED;
+      reader.data = reader.buffer;
+      reader.length = received;
+    }
+}// end readFrameEvent
+
+/*************************************************************************************************
+ * Function name:     recvMessage
+ * Description:       Receives one whole FRAME_MSG frame
+ * Parameters:        FrameReader &reader: The connection to read from
+                      std::string &message: Filled with the text of the message
+                      size_t maxLength: Longest message accepted
+ * Return Value:      FRAME_END:     if a message was received
+                      FRAME_CLOSED:  if the other side closed the connection
+                      FRAME_FAILED:  if recv() failed (errno set)
+                      FRAME_INVALID: if the frame was not a message that fits in maxLength
+ *************************************************************************************************/
+inline int recvMessage(FrameReader &reader, std::string &message, size_t maxLength)
+{
+  FrameEvent event;
+  int kind;
+
+  message.clear();
+  if((kind = readFrameEvent(reader, event)) != FRAME_BEGIN)
+    return kind;
+  if(event.header.type != FRAME_MSG || event.header.length > maxLength)
+    return FRAME_INVALID;
+
+  while((kind = readFrameEvent(reader, event)) == FRAME_PAYLOAD)
+    message.append(event.data, event.length);
+  return kind;
+}// end recvMessage
+
+/*************************************************************************************************
+ * Function name:     sendAll
+ * Description:       Sends a whole buffer, send() may accept fewer bytes than asked for so keep
+                      sending until every byte has been written
+ * Parameters:        const int sockfd: Socket Descriptor of connected Socket
+                      const char* buffer: The bytes to be sent
+                      size_t length: The number of bytes in the buffer
+ * Return Value:      true if every byte was sent, false on error (errno set)
+ *************************************************************************************************/
+inline bool sendAll(const int sockfd, const char* buffer, size_t length)
+{
+  size_t totalSent = 0; // number of bytes that made it to the socket so far
+
+  while(totalSent < length)
+    {
+      ssize_t sent = send(sockfd, buffer + totalSent, length - totalSent, MSG_NOSIGNAL);
+      if(sent < 0)
+        {
+          if(errno == EINTR) // Interrupted by a signal, just try again
+            continue;
+          return false;
+        }
+      totalSent += sent;
+    }
+  return true;
+}// end sendAll
+
+/*************************************************************************************************
+ * Function name:     sendFrameHeader
+ * Description:       Sends just the header of a frame, the payload is sent separately by the
+                      caller (used to stream file bytes after a FRAME_DATA header)
+ * Parameters:        const int sockfd: Socket Descriptor of connected Socket
+                      uint8_t type, uint8_t flags, uint64_t length: The header fields
+ * Return Value:      true if the header was sent, false on error (errno set)
+ *************************************************************************************************/
+inline bool sendFrameHeader(const int sockfd, uint8_t type, uint8_t flags, uint64_t length)
+{
+  char header[FRAME_HEADER_SIZE];
+  encodeFrameHeader(header, type, flags, length);
+  return sendAll(sockfd, header, sizeof(header));
+}// end sendFrameHeader
+
+/*************************************************************************************************
+ * Function name:     sendMessage
+ * Description:       Sends a whole FRAME_MSG frame, header and text go out in one sendmsg()
+ * Parameters:        const int sockfd: Socket Descriptor of connected Socket
+                      const char* message: The bytes of the message
+                      size_t length: Number of bytes in the message
+ * Return Value:      true if the frame was sent, false on error (errno set)
+ *************************************************************************************************/
+inline bool sendMessage(const int sockfd, const char* message, size_t length)
+{
+  char header[FRAME_HEADER_SIZE];
+  encodeFrameHeader(header, FRAME_MSG, 0, length);
+
+  struct iovec parts[2];
+  parts[0].iov_base = header;
+  parts[0].iov_len = sizeof(header);
+  parts[1].iov_base = (void *)message;
+  parts[1].iov_len = length;
+
+  struct msghdr frame;
+  memset(&frame, 0, sizeof(frame));
+  frame.msg_iov = parts;
+  frame.msg_iovlen = 2;
+
+  ssize_t sent;
+  do
+    sent = sendmsg(sockfd, &frame, MSG_NOSIGNAL);
+  while(sent < 0 && errno == EINTR);
+  if(sent < 0)
+    return false;
+
+  // sendmsg() may take only part of the frame, finish the rest with sendAll
+  if((size_t)sent < sizeof(header))
+    return sendAll(sockfd, header + sent, sizeof(header) - sent) && sendAll(sockfd, message, length);
+  sent -= sizeof(header);
+  return sendAll(sockfd, message + sent, length - sent);
+}// end sendMessage
+
+#endif // PROTOCOL_H
@@ -0,0 +1,2278 @@
+/********************************************************************************************************
+ * Filename: session.cpp
+ * Purpose: Per-connection state machine of the download server (see session.h). Handles the
+ *          pwd, cd, dir, list, stat-batch, download, get, sync, mget, download-dir, compress, checksum and bye
+ *          commands for one client without
+ *          ever blocking on anything but the socket it was given.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+
+#include <stdlib.h>
+#include <ctype.h> // isdigit
+#include <limits.h> // PATH_MAX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h> // sendfile
+#include <dirent.h> // getdents64
+#include <fcntl.h> // open, splice
+#include <stdio.h> // perror
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h> // inet_ntop
+#include <iostream>
+#include <string.h>
+#include <string>
+#include <algorithm> // count
+#include <fnmatch.h> // mget patterns
+#include "session.h"
+#include "dirCache.h" // cached directory listings
+#include "compression.h"
+#include "compressPool.h" // blocks of compressed downloads
+#include "compressStore.h" // compressed variants of hot files
+#include "crc32c.h" // download checksums
+#include "contentChunks.h" // dget
+#include "chunkIndex.h" // chunks of the served files
+#include "workerPool.h" // stats of the fork model's workers
+#include "logger.h"
+using namespace std;
+
+// What the output helpers tell flush()
+#define FLUSH_DONE        0 // everything given was sent
+#define FLUSH_BLOCKED     1 // the socket is full, try again once it is writable
+#define FLUSH_ERROR       2 // the connection is broken
+#define FLUSH_UNSUPPORTED 3 // the copy mode can't be used for this file, try the next one
+
+int copyMode = COPY_SENDFILE; // Selected with -c, sendfile unless told otherwise
+int startDirFd = -1; // Directory the server started in, opened once by initSessions()
+string startDir; // Path of startDirFd, for pwd
+
+/********************************************************************************************************************************
+ * Function name:     Session
+ * Description:       Starts a session for a newly accepted client, the working directory starts out as the server's
+                      (shared startDirFd, so an idle session holds no descriptor but its socket)
+ * Parameters:        int sockfd: Socket Descriptor of connected Socket (blocking or non-blocking)
+                      const string &ipAddress: The Ip Address of the connected socket
+ * Return Value:      none
+********************************************************************************************************************************/
+Session::Session(int sockfd, const string &ipAddress)
+  : sockfd(sockfd), ipAddress(ipAddress), state(STATE_COMMAND), closing(false), readBlocked(false),
+    writeBlocked(false), asyncOpen(false), poolWakeFd(-1), poolWaiting(false), dirFd(-1), cwd(startDir), downloadFd(-1), downloadSize(0), downloadAtOnce(false), downloadDedup(false),
+    replyStream(0),
+    archiveFiles(0), archiveBytes(0), codec(CODEC_NONE), checksums(false), inputStart(0), inputEnd(0), messageFlags(0), messageTooLong(false),
+    chunkStart(0), chunkEnd(0), pipeFill(0)
+{
+  pipeFds[0] = pipeFds[1] = -1;
+  compressing.fileFd = -1;
+  checksumming.pending = false;
+  checksumming.fileFd = -1;
+  syncing.fileFd = -1;
+  countMetric(metrics().connections);
+
+  // Servers  Hello Message For the Client
+  queueMessage("Hello Client. ", true);
+}
+/********************************************************************************************************************************
+ * Function name:     ~Session
+ * Description:       Closes the connection and every file still held for it
+ * Parameters:        none
+ * Return Value:      none
+********************************************************************************************************************************/
+Session::~Session()
+{
+  for(size_t i = 0; i < output.size(); i++)
+    if(output[i].fileFd != -1 && output[i].ownsFile)
+      close(output[i].fileFd);
+  for(size_t i = 0; i < streams.size(); i++)
+    if(streams[i].fileFd != -1)
+      close(streams[i].fileFd);
+  for(size_t i = 0; i < archiveDirs.size(); i++)
+    close(archiveDirs[i].dirFd);
+  if(loading.valid())
+    loading.wait(); // a worker may still be reading downloadFd
+  for(size_t i = 0; i < compressing.blocks.size(); i++)
+    compressing.blocks[i].wait(); // a worker may still be reading the file
+  if(compressing.fileFd != -1)
+    close(compressing.fileFd);
+  for(size_t i = 0; i < checksumming.parts.size(); i++)
+    checksumming.parts[i].wait();
+  if(checksumming.fileFd != -1)
+    close(checksumming.fileFd);
+  for(size_t i = 0; i < syncing.segments.size(); i++)
+    syncing.segments[i].wait();
+  if(syncing.fileFd != -1)
+    close(syncing.fileFd);
+  if(downloadFd != -1)
+    close(downloadFd);
+  if(dirFd != -1)
+    close(dirFd);
+  closePipe();
+  countMetric(metrics().outputDone, output.size());
+  countMetric(metrics().closed);
+
+  // Close Connection
+  if(close(sockfd) == -1)
+    {
+      LOG(LOG_ERROR, "Error Closing Connected Socket: %m");
+    }
+  // Inform The User the Connection Has Ended
+  LOG(LOG_INFO, "Connection With: %s Has Ended !", ipAddress.c_str());
+}
+/********************************************************************************************************************************
+ * Function name:     run
+ * Description:       Sends queued replies and handles received commands until the socket would block or the connection
+                      is finished. A reply is always sent completely before the next command is looked at, so a client
+                      can't make the server buffer more than one reply. Downloads on streams are sent a chunk at a time
+                      instead, with new commands looked at between chunks. With a blocking socket this only returns once
+                      the connection is finished. After setPoolWake() it also returns while the next piece of an answer
+                      is still with the compress pool (waitingForPool()).
+ * Parameters:        none
+ * Return Value:      SESSION_WAIT:  call again once the socket is readable/writable (or the compress pool woke the driver)
+                      SESSION_CLOSE: the connection is finished, delete the session
+********************************************************************************************************************************/
+int Session::run()
+{
+  while(true)
+    {
+      // Send whatever is queued before looking at the next command
+      if(!output.empty())
+	{
+	  int result = flush();
+	  if(result == FLUSH_BLOCKED)
+	    return SESSION_WAIT;
+	  if(result == FLUSH_ERROR)
+	    return SESSION_CLOSE;
+	}
+      if(closing)
+	return SESSION_CLOSE;
+      // Handle a command that is already buffered
+      if(processInput())
+	continue;
+      if(queueBatchItem())
+	continue;
+      if(poolWaiting) // nothing else goes out before that piece, the driver runs us again when the pool is done
+	return SESSION_WAIT;
+      if(readBlocked)
+	{
+	  if(queueStreamChunk())
+	    continue;
+	  return SESSION_WAIT;
+	}
+
+      // Receive more from the client, only what is already there while streams have chunks to send
+      size_t room;
+      char *space = inputSpace(room);
+      bool streaming = !streams.empty();
+      ssize_t received = recv(sockfd, space, room, streaming ? MSG_DONTWAIT : 0);
+      if(received < 0)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  if(errno == EAGAIN || errno == EWOULDBLOCK)
+	    {
+	      if(streaming) // nothing new, send the next chunk (also works for blocking sockets)
+		{
+		  queueStreamChunk();
+		  continue;
+		}
+	      readBlocked = true;
+	      return SESSION_WAIT;
+	    }
+	  LOG(LOG_ERROR, "Recieving Failed ! : %m");
+	  return SESSION_CLOSE;
+	}
+      if(received == 0) // Client hung up without saying bye
+	{
+	  LOG(LOG_INFO, "Client Closed The Connection.");
+	  return SESSION_CLOSE;
+	}
+      inputReceived(received);
+    }
+}// end run
+/********************************************************************************************************************************
+ * Function name:     inputSpace
+ * Description:       Gives the part of the input buffer the next recv() can fill
+ * Parameters:        size_t &room: Set to the number of bytes that fit
+ * Return Value:      char*: where the received bytes go
+********************************************************************************************************************************/
+char* Session::inputSpace(size_t &room)
+{
+  if(inputStart == inputEnd) // everything was parsed, start over at the beginning
+    inputStart = inputEnd = 0;
+  room = sizeof(input) - inputEnd;
+  return input + inputEnd;
+}// end inputSpace
+/********************************************************************************************************************************
+ * Function name:     inputReceived
+ * Description:       Records that bytes were received into the space given by inputSpace()
+ * Parameters:        size_t length: The number of bytes received
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::inputReceived(size_t length)
+{
+  inputEnd += length;
+}// end inputReceived
+/********************************************************************************************************************************
+ * Function name:     processInput
+ * Description:       Feeds the received bytes to the frame parser until one whole message has been handled
+ * Parameters:        none
+ * Return Value:      true:  if a message was handled (its reply may be queued)
+                      false: if every received byte was used up without completing a message, a download
+                             is waiting for fileOpened(), an mget or download-dir still has files to queue or
+                             a compressed download still has blocks (a sync its delta, a download its
+                             checksums) to queue
+********************************************************************************************************************************/
+bool Session::processInput()
+{
+  // the next message can't be handled before the file is open, or before an mget's (download-dir's) files or a
+  // compressed file's blocks (a sync's delta, a download's checksums) are all queued
+  if(state == STATE_DOWNLOAD_OPEN || state == STATE_DOWNLOAD_LOAD || !mgetNames.empty() || !archiveDirs.empty() || !compressing.blocks.empty()
+     || !syncing.segments.empty() || checksumming.pending)
+    return false;
+
+  while(true)
+    {
+      const char *data = input + inputStart;
+      size_t length = inputEnd - inputStart;
+      FrameEvent event;
+      int kind = parser.next(data, length, event);
+      inputStart = inputEnd - length;
+
+      switch(kind)
+	{
+	case FRAME_NEED_MORE:
+	  return false;
+	case FRAME_BEGIN: // Only messages are expected from a client, and only short ones (but for a stat-batch path list,
+	                  // sync signatures or the chunk hashes of "have")
+	  message.clear();
+	  messageFlags = event.header.flags;
+	  if(state == STATE_STAT_PATHS)
+	    messageTooLong = event.header.type != FRAME_DATA || event.header.length > STAT_BATCH_BYTES;
+	  else if(state == STATE_SYNC_SIGNATURES)
+	    messageTooLong = event.header.type != FRAME_DATA || event.header.length > SYNC_SIGNATURES_MAX;
+	  else if(state == STATE_HAVE_HASHES)
+	    messageTooLong = event.header.type != FRAME_DATA || event.header.length > CHUNK_HAVE_BYTES;
+	  else
+	    messageTooLong = event.header.type != FRAME_MSG || event.header.length > MAX_MSG_SIZE - 1;
+	  break;
+	case FRAME_PAYLOAD:
+	  if(!messageTooLong)
+	    message.append(event.data, event.length);
+	  break;
+	case FRAME_END:
+	  if(messageTooLong)
+	    {
+	      LOG(LOG_WARN, "Invalid Message From The Client.");
+	      closing = true;
+	    }
+	  else if(messageFlags & FRAME_FLAG_STREAM)
+	    handleStreamRequest(message);
+	  else
+	    handleMessage(message);
+	  checkAnswered();
+	  return true;
+	}
+    }
+}// end processInput
+/********************************************************************************************************************************
+ * Function name:     handleMessage
+ * Description:       Handles a message from the client depending on where the client is in the command protocol
+ * Parameters:        const string &message: The message recieved form the client
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::handleMessage(const string &message)
+{
+  if(state != STATE_STAT_PATHS && state != STATE_SYNC_SIGNATURES && state != STATE_HAVE_HASHES) // binary, described once handled
+    LOG(LOG_DEBUG, "Message from The Client : \"%s\"", message.c_str());
+
+  switch(state)
+    {
+    case STATE_COMMAND:
+      startCommand(message);
+      handleCommand(message);
+      break;
+    case STATE_CD_NAME:
+      state = STATE_COMMAND;
+      changeDirectory(message);
+      break;
+    case STATE_DOWNLOAD_NAME:
+      state = STATE_COMMAND;
+      startDownload(message);
+      break;
+    case STATE_DOWNLOAD_REPLY: // receive "Ready" Or " Stop from client
+      state = STATE_COMMAND;
+      LOG(LOG_DEBUG, "Client : %s", message.c_str());
+      if(message == "READY")
+	{
+	  // The whole file goes in one data frame (or in compressed blocks)
+	  queueWholeFile(downloadSize);
+	  state = STATE_DOWNLOAD_ACK; // did client get complete file?
+	}
+      else if(message.compare(0, 6, "RANGE ") == 0) // Only part of the file, e.g. the rest of an interrupted download
+	{
+	  off_t offset, length;
+	  if(parseRange(message.substr(6), downloadSize, offset, length))
+	    {
+	      startChecksums(offset, length);
+	      queueDownload(offset, length);
+	      state = STATE_DOWNLOAD_ACK;
+	    }
+	  else
+	    {
+	      dropDownload();
+	      queueMessage("Download failed: Invalid range " + message.substr(6), true);
+	    }
+	}
+      else
+	{
+	  dropDownload();
+	  if(message == "STOP") // Client Doesn't Want File To Be Downloaded Anymore
+	    queueMessage("Download Canceled.", true);
+	}
+      break;
+    case STATE_DOWNLOAD_ACK: // The client's confirmation is only printed
+      state = STATE_COMMAND;
+      break;
+    case STATE_STAT_PATHS:
+      state = STATE_COMMAND;
+      statBatch(message);
+      break;
+    case STATE_SYNC_SIGNATURES:
+      state = STATE_COMMAND;
+      syncRequest = make_shared<SyncIndex>();
+      if(!syncRequest->parse(message))
+	{
+	  syncRequest.reset();
+	  queueMessage("Sync failed: Invalid signatures", true);
+	  break;
+	}
+      LOG(LOG_DEBUG, "Sync Signatures: %zu blocks of %u bytes", syncRequest->blocks(), syncRequest->size());
+      startDownload(downloadName);
+      break;
+    case STATE_HAVE_HASHES:
+      state = STATE_COMMAND;
+      receiveHashes(message);
+      break;
+    }
+}// end handleMessage
+/********************************************************************************************************************************
+ * Function name:     handleStreamRequest
+ * Description:       Handles a command sent on a stream, its whole answer goes back on the same stream. Only commands that
+                      are answered without further questions can be sent on a stream: "get" (the file is sent in chunks taking
+                      turns with the other streams' files), "dir", "list", "pwd" and "stats".
+ * Parameters:        const string &message: The stream id followed by the command
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::handleStreamRequest(const string &message)
+{
+  if(message.length() < STREAM_ID_SIZE || decodeBigEndian(message.data(), STREAM_ID_SIZE) == 0)
+    {
+      LOG(LOG_WARN, "Invalid Message From The Client.");
+      closing = true;
+      return;
+    }
+  string command = message.substr(STREAM_ID_SIZE);
+  replyStream = decodeBigEndian(message.data(), STREAM_ID_SIZE);
+  LOG(LOG_DEBUG, "Message from The Client on Stream %u : \"%s\"", replyStream, command.c_str());
+  startCommand(command);
+
+  if(state != STATE_COMMAND)
+    queueMessage("Stream failed: A command is still waiting for an answer", true);
+  else if(command.compare(0, 4, "get ") == 0)
+    {
+      if(streams.size() >= MAX_STREAMS)
+	queueMessage("Stream failed: More than " + to_string(MAX_STREAMS) + " downloads in flight", true);
+      else
+	{
+	  downloadAtOnce = true;
+	  startDownload(command.substr(4));
+	}
+    }
+  else if(command == "dir" || command == "pwd" || command == "stats" || command.compare(0, 5, "list ") == 0)
+    handleCommand(command);
+  else
+    queueMessage("Stream failed: \"" + command + "\" can't be sent on a stream", true);
+
+  if(state != STATE_DOWNLOAD_OPEN && state != STATE_DOWNLOAD_LOAD) // otherwise fileOpened() (fileLoaded()) still answers on the stream
+    replyStream = 0;
+}// end handleStreamRequest
+/********************************************************************************************************************************
+ * Function name:     startCommand
+ * Description:       Counts a command and starts timing it, checkAnswered() stops the clock
+ * Parameters:        const string &command: The command
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::startCommand(const string &command)
+{
+  int kind = commandKind(command);
+
+  countMetric(metrics().commands[kind]);
+  answering.push_back(make_pair(kind, metricsClock()));
+}// end startCommand
+/********************************************************************************************************************************
+ * Function name:     checkAnswered
+ * Description:       Records the latency of the commands being answered once the session has nothing left to send for them
+                      and waits for the next command
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::checkAnswered()
+{
+  if(answering.empty() || state != STATE_COMMAND || !output.empty() || !streams.empty() || !mgetNames.empty()
+     || !archiveDirs.empty() || !compressing.blocks.empty() || !syncing.segments.empty() || checksumming.pending)
+    return;
+  for(size_t i = 0; i < answering.size(); i++)
+    recordLatency(answering[i].first, answering[i].second);
+  answering.clear();
+}// end checkAnswered
+/********************************************************************************************************************************
+ * Function name:     handleCommand
+ * Description:       Checks the client reply  (message/command) for the download protocol, and runs commands apprpriately
+ * Parameters:        const string &command: The command recieved form the client
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::handleCommand(const string &command)
+{
+  if(command == "bye")
+    {
+      // Send A Good Bye Message, the connection is closed once it is out
+      queueMessage("Good Bye Client.", true);
+      closing = true;
+    }
+  else if(command == "pwd")
+    {
+      // Send the working Directory to the Client (remembered at cd time, no getcwd() needed)
+      queueMessage(cwd, true);
+    }
+  else if(command == "cd") // Change Directory
+    {
+      // Prompt the client For the directory name(to change to)
+      queueMessage("Enter the New Directory: ", true);
+      state = STATE_CD_NAME;
+    }
+  else if(command == "download")
+    {
+      // Prompt the client for the file name
+      queueMessage("Enter the File Name: ", true);
+      state = STATE_DOWNLOAD_NAME;
+    }
+  else if(command.compare(0, 4, "get ") == 0)
+    {
+      // Pipelined download: the file (or why it can't be sent) is the whole answer, so a client can send
+      // many of these back to back and read the files in order
+      downloadAtOnce = true;
+      startDownload(command.substr(4));
+    }
+  else if(command.compare(0, 5, "sync ") == 0)
+    {
+      // Delta download of a file the client has an older copy of, the signatures of the copy follow at once in a
+      // FRAME_DATA frame (see deltaSync.h)
+      downloadName = command.substr(5);
+      state = STATE_SYNC_SIGNATURES;
+    }
+  else if(command == "have")
+    {
+      // Hashes of chunks the client already holds, in a FRAME_DATA frame that follows at once (see contentChunks.h)
+      state = STATE_HAVE_HASHES;
+    }
+  else if(command.compare(0, 5, "dget ") == 0)
+    {
+      // Deduplicated download: the file's chunks, then the bytes of those the client doesn't hold
+      downloadDedup = true;
+      startDownload(command.substr(5));
+    }
+  else if(command.compare(0, 5, "mget ") == 0)
+    {
+      // Many files in one answer, the patterns are separated by newlines
+      startMget(command.substr(5));
+    }
+  else if(command.compare(0, 13, "download-dir ") == 0)
+    {
+      // The whole tree as one tar archive
+      startArchive(command.substr(13));
+    }
+  else if(command == "dir")
+    {
+      // Send Directory Listing to client
+      sendDirListing();
+    }
+  else if(command.compare(0, 5, "list ") == 0)
+    {
+      // Send one page of the directory listing
+      sendDirPage(command.substr(5));
+    }
+  else if(command.compare(0, 9, "compress ") == 0)
+    {
+      // Pick the codec whole-file downloads are compressed with from then on
+      negotiateCodec(command.substr(9));
+    }
+  else if(command.compare(0, 9, "checksum ") == 0)
+    {
+      // Follow every file and range with the CRC32Cs of its bytes from then on
+      negotiateChecksum(command.substr(9));
+    }
+  else if(command == "stat-batch")
+    {
+      // The paths follow at once in a FRAME_DATA frame, no prompt so the whole batch is one round trip
+      state = STATE_STAT_PATHS;
+    }
+  else if(command == "stats")
+    {
+      // Send the file and directory cache counters
+      queueMessage(fileCache.stats() + "\n" + dirCache.stats() + "\n" + compressStore.stats() + "\n" + chunkIndex.stats()
+		   + "\n" + workerPoolStats() + "\n" + logStats(), true);
+    }
+}// end handleCommand
+/********************************************************************************************************************************
+ * Function name:     startMget
+ * Description:       Answers "mget" with "MGET <count>" and the names of the files the patterns match, one per line, then
+                      sends the files one after the other exactly like "get" would (see queueMgetFile()). A pattern is
+                      matched against the regular files of the directory it names (the client's working directory if it
+                      has no '/'), a name without wildcards is taken as it is.
+ * Parameters:        const string &patterns: What follows "mget " in the command, one pattern per line
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::startMget(const string &patterns)
+{
+  vector<string> names;
+  size_t start = 0;
+
+  while(start <= patterns.length())
+    {
+      size_t end = patterns.find('\n', start);
+      if(end == string::npos)
+	end = patterns.length();
+      string pattern = patterns.substr(start, end - start);
+      start = end + 1;
+      if(pattern.empty())
+	continue;
+      if(!matchPattern(pattern, names))
+	{
+	  queueMessage("Mget failed: " + pattern + ": " + strerror(errno), true);
+	  return;
+	}
+      if(names.size() > MGET_MAX_FILES)
+	{
+	  queueMessage("Mget failed: More than " + to_string(MGET_MAX_FILES) + " files match", true);
+	  return;
+	}
+    }
+
+  string reply = "MGET " + to_string(names.size());
+  for(size_t i = 0; i < names.size(); i++)
+    reply += "\n" + names[i];
+  queueMessage(reply, false);
+  LOG(LOG_DEBUG, "Message Sent: \"MGET %zu\" and the names", names.size());
+  mgetNames.assign(names.begin(), names.end());
+}// end startMget
+/********************************************************************************************************************************
+ * Function name:     matchPattern
+ * Description:       Adds the regular files a pattern matches (in name order) to the names of an mget, a leading '.' is
+                      only matched by a pattern that starts with one
+ * Parameters:        const string &pattern: The pattern, only its last part may have wildcards
+                      vector<string> &names: The names found are added here, with the directory part of the pattern
+ * Return Value:      true:  if the pattern could be matched (it may match nothing)
+                      false: if its directory can't be read, errno tells why
+********************************************************************************************************************************/
+bool Session::matchPattern(const string &pattern, vector<string> &names)
+{
+  size_t slash = pattern.rfind('/');
+  string prefix = slash == string::npos ? "" : pattern.substr(0, slash + 1);
+  string base = pattern.substr(prefix.length());
+
+  if(base.find_first_of("*?[") == string::npos) // a plain name, "get" tells whether it is there
+    {
+      names.push_back(pattern);
+      return true;
+    }
+
+  int listFd = directory();
+  if(!prefix.empty() && (listFd = openat(directory(), prefix.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    return false;
+  DirNames entries;
+  bool wasRead = readDirectory(listFd, entries);
+  int error = errno;
+  if(listFd != directory())
+    close(listFd);
+  errno = error;
+  if(!wasRead)
+    return false;
+
+  for(auto entry = entries.begin(); entry != entries.end(); ++entry)
+    if(entry->second && fnmatch(base.c_str(), entry->first.c_str(), FNM_PERIOD) == 0)
+      names.push_back(prefix + entry->first);
+  return true;
+}// end matchPattern
+/********************************************************************************************************************************
+ * Function name:     startArchive
+ * Description:       Answers "download-dir" with "ARCHIVE <name>", then sends the directory tree as a tar archive (see
+                      tarArchive.h) in FRAME_DATA frames, one per entry, ended by an empty frame. The tree is walked an
+                      entry at a time while the archive goes out (see queueArchiveEntry()), nothing is built up front and
+                      file contents are moved with the selected copy mode like any download. Symbolic links aren't followed.
+ * Parameters:        const string &name: The directory sent by the client
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::startArchive(const string &name)
+{
+  char linkName[64]; // /proc/self/fd/<n>
+  char path[PATH_MAX]; // where the directory is
+
+  int rootFd = openat(directory(), name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(rootFd == -1)
+    {
+      string errorMsg = "Download-dir failed: ";
+      errorMsg += strerror(errno);
+      queueMessage(errorMsg, true);
+      return;
+    }
+
+  // The archive is rooted at the directory's own name, looked up when it is "." or ".."
+  string root = name;
+  while(root.length() > 1 && root[root.length() - 1] == '/')
+    root.erase(root.length() - 1);
+  root = root.substr(root.rfind('/') + 1);
+  snprintf(linkName, sizeof(linkName), "/proc/self/fd/%d", rootFd);
+  ssize_t length;
+  if((root.empty() || root == "." || root == "..") && (length = readlink(linkName, path, sizeof(path) - 1)) > 0)
+    {
+      root.assign(path, length);
+      root = root.substr(root.rfind('/') + 1);
+    }
+  if(root.empty() || root == "." || root == "..")
+    root = "root";
+
+  queueMessage("ARCHIVE " + root, true);
+  archiveRoot = root;
+  archiveFiles = archiveBytes = 0;
+  if(!enterArchiveDirectory(rootFd, root + "/")) // nothing to walk, the archive is only its end
+    {
+      queueFrame(FRAME_DATA, string(TAR_END_SIZE, '\0'));
+      queueFrame(FRAME_DATA, "");
+    }
+}// end startArchive
+/********************************************************************************************************************************
+ * Function name:     enterArchiveDirectory
+ * Description:       Queues the header of a directory of the archive and makes it the one walked next, its entries come
+                      before the rest of the directory it is in
+ * Parameters:        int dirFd: The directory, owned by the walk from here on
+                      const string &path: Its path in the archive, ending with "/"
+ * Return Value:      true:  if the directory was entered
+                      false: if it can't be read (it is left out of the archive and closed)
+********************************************************************************************************************************/
+bool Session::enterArchiveDirectory(int dirFd, const string &path)
+{
+  struct stat info;
+  DirNames names;
+
+  if(fstat(dirFd, &info) == -1 || !readDirectory(dirFd, names))
+    {
+      LOG(LOG_WARN, "Not Archived: %s: %m", path.c_str());
+      close(dirFd);
+      return false;
+    }
+
+  TarEntry entry = { path, TAR_TYPE_DIR, (uint32_t)info.st_mode, 0, (int64_t)info.st_mtim.tv_sec };
+  string header = encodeTarEntry(entry);
+  queueHeader(FRAME_DATA, 0, 0, header.length());
+  output.back().bytes += header;
+
+  archiveDirs.push_back(ArchiveDir());
+  archiveDirs.back().dirFd = dirFd;
+  archiveDirs.back().path = path;
+  for(auto name = names.begin(); name != names.end(); ++name)
+    if(name->first != "." && name->first != "..")
+      archiveDirs.back().names.push_back(name->first);
+  return true;
+}// end enterArchiveDirectory
+/********************************************************************************************************************************
+ * Function name:     changeDirectory
+ * Description:       Changes the working directory of this client only, the server process never calls chdir()
+ * Parameters:        const string &name: The directory sent by the client
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::changeDirectory(const string &name)
+{
+  char linkName[64]; // /proc/self/fd/<n>
+  char newDirectory[PATH_MAX]; // path of the new directory, for pwd
+
+  // The new directory must exist, be a directory and be searchable (same checks as chdir())
+  int newDirFd = openat(directory(), name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(newDirFd == -1 || faccessat(newDirFd, ".", X_OK, 0) == -1)
+    {
+      // An error message from the server to the client, with the error specified by the system call
+      string errorMsg = "Couldn't change to specified directory: ";
+      errorMsg += strerror(errno);
+      LOG(LOG_WARN, "Couldn't Change to New Directory: %m");
+      if(newDirFd != -1)
+	close(newDirFd);
+      queueMessage(errorMsg, true);
+      return;
+    }
+
+  // Ask the kernel where the descriptor points, once per cd instead of a getcwd() per pwd
+  snprintf(linkName, sizeof(linkName), "/proc/self/fd/%d", newDirFd);
+  ssize_t length = readlink(linkName, newDirectory, sizeof(newDirectory) - 1);
+  if(length > 0)
+    cwd.assign(newDirectory, length);
+  else if(!name.empty() && name[0] == '/') // no /proc, keep track of the path by hand
+    cwd = name;
+  else
+    cwd += "/" + name;
+
+  if(dirFd != -1)
+    close(dirFd);
+  dirFd = newDirFd;
+  queueMessage("Directory has Successfully Changed to: " + name, true);
+}// end changeDirectory
+/********************************************************************************************************************************
+ * Function name:     startDownload
+ * Description:       Opens the file asked for and announces its size with "READY <size>", the file stays open until the
+                      client answers READY (send it) or STOP (cancel). A file in the file cache isn't opened at all, the stat()
+                      that shows the cached version is still current is enough. With setAsyncOpen(true) the driver opens the
+                      file instead (see openRequest()).
+ * Parameters:        const string &name: The file name sent by the client
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::startDownload(const string &name)
+{
+  struct stat val;
+
+  downloadName = name;
+  if(fileCache.enabled() && fstatat(directory(), name.c_str(), &val, 0) == 0 && S_ISREG(val.st_mode)
+     && (downloadCached = fileCache.lookup(val)))
+    {
+      downloadInfo = val;
+      announceDownload(val.st_size);
+      return;
+    }
+
+  if(asyncOpen)
+    {
+      state = STATE_DOWNLOAD_OPEN;
+      return;
+    }
+
+  // O_NONBLOCK so a fifo can't hang the server, it makes no difference to regular files
+  int fileFd = openat(directory(), name.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if(fileFd == -1 || fstat(fileFd, &val) == -1)
+    {
+      int error = errno;
+      if(fileFd != -1)
+	close(fileFd);
+      fileOpened(-1, error, NULL);
+      return;
+    }
+  fileOpened(fileFd, 0, &val);
+}// end startDownload
+/********************************************************************************************************************************
+ * Function name:     openRequest
+ * Description:       Tells an asynchronous driver which file a download is waiting for, it must be opened relative to
+                      directory() with O_RDONLY | O_NONBLOCK | O_CLOEXEC and reported with fileOpened()
+ * Parameters:        none
+ * Return Value:      const string*: the file name, NULL if no download is waiting for its file
+********************************************************************************************************************************/
+const string* Session::openRequest() const
+{
+  return state == STATE_DOWNLOAD_OPEN ? &downloadName : NULL;
+}// end openRequest
+/********************************************************************************************************************************
+ * Function name:     fileOpened
+ * Description:       Announces the file of a download once it is open and its size is known, or tells the client why it
+                      couldn't be opened. A file small enough for the file cache is read into it and sent from there. After
+                      setPoolWake() the compress pool reads it and fileLoaded() announces it, the loop thread doesn't wait
+                      for the disk.
+ * Parameters:        int fileFd: The open file (-1 if it couldn't be opened), the session owns it from here on
+                      int error: errno of the failed open/stat, 0 on success
+                      const struct stat *info: stat of the open file (only st_dev, st_ino, st_mode, st_size and st_mtim
+                                               are used), NULL on error
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::fileOpened(int fileFd, int error, const struct stat *info)
+{
+  state = STATE_COMMAND;
+  if(error != 0)
+    {
+      // An error message from the server to the client, with the error specified by the system call
+      string errorMsg = "Download failed: ";
+      errorMsg += strerror(error);
+      if(fileFd != -1)
+	close(fileFd);
+      downloadAtOnce = false;
+      downloadDedup = false;
+      syncRequest.reset();
+      queueMessage(errorMsg, true);
+      replyStream = 0;
+      return;
+    }
+
+  if(!S_ISREG(info->st_mode))
+    {
+      close(fileFd);
+      downloadAtOnce = false;
+      downloadDedup = false;
+      syncRequest.reset();
+      queueMessage("Download Failed: " + downloadName + " is a directory not a file! ", true);
+      replyStream = 0;
+      return;
+    }
+
+  downloadInfo = *info;
+  if(fileCache.enabled() && fileCache.fits(*info) && poolWakeFd != -1)
+    {
+      downloadFd = fileFd;
+      shared_ptr<CachedFilePtr> result = make_shared<CachedFilePtr>();
+      struct stat version = *info;
+      loaded = result;
+      loading = compressPool.run([fileFd, version, result]()
+				 {
+				   *result = fileCache.load(fileFd, version);
+				   return string();
+				 }, poolWakeFd);
+      state = STATE_DOWNLOAD_LOAD;
+      return;
+    }
+  if(fileCache.enabled() && (downloadCached = fileCache.load(fileFd, *info)))
+    close(fileFd); // the next download of it won't need to open it either
+  else
+    downloadFd = fileFd;
+  announceDownload(info->st_size);
+  replyStream = 0;
+}// end fileOpened
+/********************************************************************************************************************************
+ * Function name:     fileLoaded
+ * Description:       Announces the download fileOpened() handed to the compress pool once the pool is done with it, from
+                      the file cache if it was cached and from downloadFd if it wasn't
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::fileLoaded()
+{
+  loading.get();
+  downloadCached = *loaded;
+  loaded.reset();
+  if(downloadCached)
+    {
+      close(downloadFd); // the next download of it won't need to open it either
+      downloadFd = -1;
+    }
+  state = STATE_COMMAND;
+  announceDownload(downloadInfo.st_size);
+  replyStream = 0;
+}// end fileLoaded
+/********************************************************************************************************************************
+ * Function name:     announceDownload
+ * Description:       Tells the client the file is there and how big it is, then waits for READY, RANGE or STOP. For "get"
+                      the file is queued right away instead (or handed to a stream), for "sync" its delta, for "dget" the
+                      chunks the client doesn't hold.
+ * Parameters:        off_t fileSize: Size of the file (downloadFd or downloadCached)
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::announceDownload(off_t fileSize)
+{
+  downloadSize = fileSize;
+  if(syncRequest) // "sync" sent its signatures with the request
+    {
+      startSync(fileSize);
+      state = STATE_COMMAND;
+      return;
+    }
+  if(downloadDedup) // "dget" too, but for the chunks the client holds
+    {
+      downloadDedup = false;
+      queueDeduplicated(fileSize);
+      state = STATE_COMMAND;
+      return;
+    }
+  if(downloadAtOnce) // "get" already asked for all of it
+    {
+      downloadAtOnce = false;
+      if(replyStream != 0)
+	addStream(fileSize);
+      else
+	queueWholeFile(fileSize);
+      state = STATE_COMMAND;
+      return;
+    }
+  // Send Ready message (followed by the file size) For Client
+  queueMessage("READY " + to_string((long long)fileSize), true);
+  state = STATE_DOWNLOAD_REPLY;
+}// end announceDownload
+/********************************************************************************************************************************
+ * Function name:     addStream
+ * Description:       Hands the file of a "get" sent on a stream to the streams taking turns, queueStreamChunk() sends it
+ * Parameters:        off_t fileSize: Size of the file (downloadFd or downloadCached)
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::addStream(off_t fileSize)
+{
+  Stream stream;
+  stream.id = replyStream;
+  stream.fileFd = downloadFd;
+  stream.cached = downloadCached;
+  stream.offset = 0;
+  stream.remaining = fileSize;
+  stream.fileName = downloadName;
+  streams.push_back(stream);
+  downloadFd = -1;
+  downloadCached.reset();
+}// end addStream
+/********************************************************************************************************************************
+ * Function name:     sendDirListing
+ * Description:       Sends the names in the client's working directory, regular files are marked with **. The listing comes
+                      from the directory cache when it is on, the directory is only read here when the cache can't help.
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::sendDirListing()
+{
+  CachedFilePtr listing;
+
+  if(dirCache.enabled())
+    listing = dirCache.lookup(directory());
+  if(!listing)
+    {
+      DirNames names;
+      if(!readDirectory(directory(), names))
+	{
+	  string errorMsg = "Cannot open current directory: ";
+	  errorMsg += strerror(errno);
+	  queueMessage(errorMsg, true);
+	  return;
+	}
+      listing = formatListing(names);
+    }
+
+  // Send the list to client, the frame is shared with every other client listing the same directory. On a
+  // stream only its text is, after a header of its own that names the stream.
+  off_t skip = 0;
+  if(replyStream != 0)
+    {
+      skip = FRAME_HEADER_SIZE;
+      queueHeader(FRAME_MSG, FRAME_FLAG_END, replyStream, listing->size - skip);
+    }
+  addOutput();
+  output.back().cached = listing;
+  output.back().offset = skip;
+  output.back().remaining = listing->size - skip;
+}// end sendDirListing
+/********************************************************************************************************************************
+ * Function name:     sendDirPage
+ * Description:       Sends one page of the names in the client's working directory for "list <page size> [<cursor>]". The
+                      page is read with getdents64() from the cursor on, so only one page is ever held no matter how big the
+                      directory is. The reply starts with "PAGE <next cursor>" ("PAGE END" after the last name) followed by
+                      a line per name, regular files marked with **, and always fits in MAX_MSG_SIZE - 1 bytes.
+ * Parameters:        const string &request: What follows "list " in the command
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::sendDirPage(const string &request)
+{
+  alignas(struct dirent64) char entries[8192]; // getdents64() batch
+  long long pageSize;
+  off_t cursor;
+  struct stat statStr;
+
+  if(!parsePageRequest(request, pageSize, cursor))
+    {
+      queueMessage("List failed: Invalid page request " + request, true);
+      return;
+    }
+
+  // A descriptor of its own, getdents64() moves its offset
+  int listFd = openat(directory(), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(listFd == -1 || lseek(listFd, cursor, SEEK_SET) == -1)
+    {
+      string errorMsg = "List failed: ";
+      errorMsg += strerror(errno);
+      LOG(LOG_WARN, "Cannot list current directory: %m");
+      if(listFd != -1)
+	close(listFd);
+      queueMessage(errorMsg, true);
+      return;
+    }
+
+  string names; // the lines of this page
+  long long count = 0;
+  bool atEnd = false;
+  while(count < pageSize && !atEnd)
+    {
+      ssize_t length = getdents64(listFd, entries, sizeof(entries));
+      if(length == -1)
+	{
+	  string errorMsg = "List failed: ";
+	  errorMsg += strerror(errno);
+	  LOG(LOG_WARN, "Error reading directory entry: %m");
+	  close(listFd);
+	  queueMessage(errorMsg, true);
+	  return;
+	}
+      atEnd = length == 0;
+
+      for(ssize_t at = 0; at < length && count < pageSize; )
+	{
+	  struct dirent64 *entry = (struct dirent64 *)(entries + at);
+	  at += entry->d_reclen;
+
+	  // The type getdents64() reports is enough unless it is a symlink (a file is marked by what it points to)
+	  bool isFile = entry->d_type == DT_REG;
+	  if(entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+	    {
+	      if(fstatat(listFd, entry->d_name, &statStr, 0) == -1)
+		{
+		  cursor = entry->d_off; // skipped like "dir" does, but the page goes on after it
+		  continue;
+		}
+	      isFile = S_ISREG(statStr.st_mode);
+	    }
+
+	  size_t line = strlen(entry->d_name) + (isFile ? 5 : 1);
+	  if(26 + names.length() + line > MAX_MSG_SIZE - 1) // "PAGE " + cursor + "\n" must fit too
+	    {
+	      count = pageSize; // page full, the next one starts at this name
+	      break;
+	    }
+	  names += entry->d_name;
+	  names += isFile ? "  **\n" : "\n";
+	  cursor = entry->d_off;
+	  count++;
+	}
+    }
+  close(listFd);
+
+  if(atEnd)
+    queueMessage("PAGE END\n" + names, false);
+  else
+    queueMessage("PAGE " + to_string((long long)cursor) + "\n" + names, false);
+}// end sendDirPage
+/********************************************************************************************************************************
+ * Function name:     statBatch
+ * Description:       Answers a stat-batch request: every path is looked up with statx() relative to the client's working
+                      directory and described by a StatRecord, all records go back in one FRAME_DATA frame in the order of
+                      the paths
+ * Parameters:        const string &paths: The paths, each ended by a '\0' (the last one may also end with the frame)
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::statBatch(const string &paths)
+{
+  struct statx info;
+  char record[STAT_RECORD_SIZE];
+
+  size_t count = std::count(paths.begin(), paths.end(), '\0');
+  if(!paths.empty() && paths[paths.length() - 1] != '\0') // the last path ends with the frame
+    count++;
+  if(count > STAT_BATCH_MAX)
+    {
+      queueMessage("Stat failed: More than " + to_string(STAT_BATCH_MAX) + " paths", true);
+      return;
+    }
+
+  string records;
+  records.reserve(count * STAT_RECORD_SIZE);
+  const char *path = paths.c_str(); // every path is '\0' terminated, the last one by the string itself
+  for(size_t i = 0; i < count; i++, path += strlen(path) + 1)
+    {
+      StatRecord result;
+      memset(&result, 0, sizeof(result));
+      if(statx(directory(), path, AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO, &info) == -1)
+	result.error = errno < 256 ? errno : EIO;
+      else
+	{
+	  result.type = S_ISREG(info.stx_mode) ? STAT_TYPE_FILE : S_ISDIR(info.stx_mode) ? STAT_TYPE_DIR : STAT_TYPE_OTHER;
+	  result.size = info.stx_size;
+	  result.mtimeSeconds = info.stx_mtime.tv_sec;
+	  result.mtimeNanoseconds = info.stx_mtime.tv_nsec;
+	  result.inode = info.stx_ino;
+	}
+      encodeStatRecord(record, result);
+      records.append(record, sizeof(record));
+    }
+
+  queueFrame(FRAME_DATA, records);
+  LOG(LOG_DEBUG, "Stat Batch Sent: %zu paths", (size_t)count);
+}// end statBatch
+/********************************************************************************************************************************
+ * Function name:     queueFrame
+ * Description:       Queues a whole frame for the client
+ * Parameters:        uint8_t type: FRAME_MSG or FRAME_DATA
+                      const string &payload: The bytes of the frame
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::queueFrame(uint8_t type, const string &payload)
+{
+  queueHeader(type, replyStream ? FRAME_FLAG_END : 0, replyStream, payload.length());
+  output.back().bytes += payload;
+}// end queueFrame
+/********************************************************************************************************************************
+ * Function name:     queueHeader
+ * Description:       Queues a frame header, followed by the stream id when the frame belongs to a stream. The payload is
+                      queued after it by the caller.
+ * Parameters:        uint8_t type: FRAME_MSG or FRAME_DATA
+                      uint8_t flags: FRAME_FLAG_END for the last frame of a stream's answer or of a compressed file,
+                                     FRAME_FLAG_COMPRESSED for a compressed block (FRAME_FLAG_STREAM is added for streams)
+                      uint32_t stream: The stream the frame belongs to, 0 for none
+                      uint64_t length: Bytes of payload that follow (without the stream id)
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::queueHeader(uint8_t type, uint8_t flags, uint32_t stream, uint64_t length)
+{
+  char header[FRAME_HEADER_SIZE + STREAM_ID_SIZE];
+
+  if(stream == 0)
+    encodeFrameHeader(header, type, flags, length);
+  else
+    {
+      encodeFrameHeader(header, type, FRAME_FLAG_STREAM | flags, STREAM_ID_SIZE + length);
+      encodeBigEndian(header + FRAME_HEADER_SIZE, stream, STREAM_ID_SIZE);
+    }
+  addOutput();
+  output.back().bytes.assign(header, FRAME_HEADER_SIZE + (stream ? STREAM_ID_SIZE : 0));
+}// end queueHeader
+/********************************************************************************************************************************
+ * Function name:     queueMessage
+ * Description:       Queues a FRAME_MSG frame for the client
+ * Parameters:        const string &message: A message to be sent to the client
+                      bool printToScreen: also write the message to the screen
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::queueMessage(const string &message, bool printToScreen)
+{
+  queueFrame(FRAME_MSG, message);
+
+  if(printToScreen)
+    LOG(LOG_DEBUG, "Message Sent: \"%s\"", message.c_str());
+}// end queueMessage
+/********************************************************************************************************************************
+ * Function name:     queueDownload
+ * Description:       Queues a range of the announced file as one FRAME_DATA frame, the bytes are only read when the socket
+                      can take them. The file (or its cached contents) now belongs to the output queue.
+ * Parameters:        off_t offset: First byte of the file to send
+                      off_t length: The number of bytes to send (the frame length)
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::queueDownload(off_t offset, off_t length)
+{
+  queueHeader(FRAME_DATA, 0, 0, length);
+
+  addOutput();
+  output.back().fileFd = downloadFd;
+  output.back().cached = downloadCached;
+  output.back().offset = offset;
+  output.back().remaining = length;
+  output.back().mode = copyMode;
+  output.back().fileName = downloadName;
+  downloadFd = -1;
+  downloadCached.reset();
+}// end queueDownload
+/********************************************************************************************************************************
+ * Function name:     queueStreamChunk
+ * Description:       Queues the next chunk of the stream whose turn it is, then moves that stream to the back so the files
+                      on all streams are sent a chunk at a time, taking turns. The last chunk of a file is flagged
+                      FRAME_FLAG_END and closes it once sent.
+ * Parameters:        none
+ * Return Value:      true:  if a chunk was queued
+                      false: if no stream has anything to send
+********************************************************************************************************************************/
+bool Session::queueStreamChunk()
+{
+  if(streams.empty())
+    return false;
+
+  Stream stream = streams.front();
+  streams.pop_front();
+  off_t length = min(stream.remaining, (off_t)STREAM_CHUNK_SIZE);
+  bool last = length == stream.remaining;
+
+  queueHeader(FRAME_DATA, last ? FRAME_FLAG_END : 0, stream.id, length);
+  if(length == 0) // empty file, the END frame is all there is to it
+    {
+      if(stream.fileFd != -1)
+	close(stream.fileFd);
+      LOG(LOG_INFO, "File Sent: \"%s\" (stream %u)", stream.fileName.c_str(), stream.id);
+      return true;
+    }
+  addOutput();
+  output.back().fileFd = stream.fileFd;
+  output.back().ownsFile = last;
+  output.back().cached = stream.cached;
+  output.back().offset = stream.offset;
+  output.back().remaining = length;
+  output.back().mode = copyMode;
+  if(last)
+    output.back().fileName = stream.fileName;
+  else
+    {
+      stream.offset += length;
+      stream.remaining -= length;
+      streams.push_back(stream);
+    }
+  return true;
+}// end queueStreamChunk
+/********************************************************************************************************************************
+ * Function name:     queueBatchItem
+ * Description:       Queues the next piece of a command whose answer is sent a file at a time (mget, download-dir), a
+                      block at a time (a compressed download) or a segment at a time (sync), or the checksums of a
+                      download, once everything before it is sent. A download whose file the compress pool is reading into
+                      the file cache is announced first.
+ * Parameters:        none
+ * Return Value:      true:  if something was queued or started
+                      false: if no such command is under way, its previous file is still being opened or the compress pool
+                             isn't done with the next piece yet (waitingForPool())
+********************************************************************************************************************************/
+bool Session::queueBatchItem()
+{
+  poolWaiting = false;
+  if(state == STATE_DOWNLOAD_LOAD)
+    {
+      if(!jobReady(loading))
+	return false;
+      fileLoaded();
+      return true;
+    }
+  if(!compressing.blocks.empty())
+    {
+      if(!jobReady(compressing.blocks.front()))
+	return false;
+      queueCompressedBlock();
+      return true;
+    }
+  if(!syncing.segments.empty())
+    {
+      if(!jobReady(syncing.segments.front()))
+	return false;
+      queueSyncSegment();
+      return true;
+    }
+  if(checksumming.pending)
+    {
+      for(size_t i = 0; i < checksumming.parts.size(); i++)
+	if(!jobReady(checksumming.parts[i]))
+	  return false;
+      queueChecksums();
+      return true;
+    }
+  if(!archiveDirs.empty())
+    {
+      queueArchiveEntry();
+      return true;
+    }
+  return queueMgetFile();
+}// end queueBatchItem
+/********************************************************************************************************************************
+ * Function name:     queueWholeFile
+ * Description:       Queues the whole announced file. With a codec picked by "compress" a file whose variant is in the
+                      compress store is sent from there with the copy mode, those frames are already compressed. A file
+                      that compresses well (see worthCompressing()) is handed to the compress pool instead and sent as
+                      compressed blocks by queueCompressedBlock(), and counted towards building its variant. Anything
+                      else goes out as it is in one FRAME_DATA frame.
+ * Parameters:        off_t fileSize: Size of the file (downloadFd or downloadCached)
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::queueWholeFile(off_t fileSize)
+{
+  startChecksums(0, fileSize); // of the file itself, however it is sent
+  off_t storedSize;
+  int stored = codec != CODEC_NONE && compressStore.enabled() ? compressStore.lookup(downloadInfo, codec, storedSize) : -1;
+  if(stored != -1) // the variant holds the frames, header and all
+    {
+      addOutput();
+      output.back().fileFd = stored;
+      output.back().remaining = storedSize;
+      output.back().mode = copyMode;
+      output.back().fileName = downloadName;
+      dropDownload();
+      return;
+    }
+  if(codec == CODEC_NONE || !worthCompressing(codec, downloadFd, downloadCached, fileSize))
+    {
+      queueDownload(0, fileSize);
+      return;
+    }
+  if(compressStore.enabled())
+    compressStore.requested(downloadInfo, codec, downloadFd, downloadCached);
+  compressing.fileFd = downloadFd;
+  compressing.cached = downloadCached;
+  compressing.size = fileSize;
+  compressing.next = 0;
+  compressing.fileName = downloadName;
+  compressing.wireBytes = 0;
+  downloadFd = -1;
+  downloadCached.reset();
+  submitBlocks();
+}// end queueWholeFile
+/********************************************************************************************************************************
+ * Function name:     submitBlocks
+ * Description:       Hands blocks of the file being compressed to the compress pool until one per worker is in flight, so
+                      the blocks after the one being sent are compressed on every core meanwhile
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::submitBlocks()
+{
+  while((int)compressing.blocks.size() < compressPool.threads() && compressing.next < compressing.size)
+    {
+      off_t length = min(compressing.size - compressing.next, (off_t)COMPRESS_BLOCK_SIZE);
+      compressing.blocks.push_back(compressPool.submit(codec, compressing.fileFd, compressing.cached, compressing.next, length,
+						       poolWakeFd));
+      compressing.next += length;
+    }
+}// end submitBlocks
+/********************************************************************************************************************************
+ * Function name:     queueCompressedBlock
+ * Description:       Queues the next block of the file being compressed as one FRAME_DATA frame flagged
+                      FRAME_FLAG_COMPRESSED, the last one also flagged FRAME_FLAG_END. Waits for the worker if the block
+                      isn't compressed yet, which only a blocking driver lets happen (see jobReady()). A block that
+                      couldn't be read or compressed ends the connection, the client has no way to skip it.
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::queueCompressedBlock()
+{
+  string payload = compressing.blocks.front().get();
+  compressing.blocks.pop_front();
+  if(payload.empty())
+    {
+      LOG(LOG_ERROR, "Compressing \"%s\" Failed !", compressing.fileName.c_str());
+      closing = true; // the other blocks are waited for when the session is deleted
+      return;
+    }
+  submitBlocks();
+  bool last = compressing.blocks.empty();
+
+  queueHeader(FRAME_DATA, FRAME_FLAG_COMPRESSED | (last ? FRAME_FLAG_END : 0), 0, payload.length());
+  output.back().bytes += payload;
+  compressing.wireBytes += payload.length();
+  if(last)
+    {
+      if(compressing.fileFd != -1)
+	close(compressing.fileFd);
+      compressing.fileFd = -1;
+      compressing.cached.reset();
+      LOG(LOG_INFO, "File Sent: \"%s\" (%s, %lld -> %lld bytes)", compressing.fileName.c_str(), codecName(codec),
+	  (long long)compressing.size, compressing.wireBytes);
+    }
+}// end queueCompressedBlock
+/********************************************************************************************************************************
+ * Function name:     jobReady
+ * Description:       Tells whether the result of a compress pool job can be taken without waiting. A blocking driver (no
+                      setPoolWake()) always takes it, waiting if it has to. Otherwise a job that isn't done sets poolWaiting,
+                      the pool wakes the driver once it is.
+ * Parameters:        future<string> &job: The job
+ * Return Value:      true:  if get() may be called
+                      false: if the session has to wait for the pool
+********************************************************************************************************************************/
+bool Session::jobReady(future<string> &job)
+{
+  if(poolWakeFd == -1 || job.wait_for(chrono::seconds(0)) == future_status::ready)
+    return true;
+  poolWaiting = true;
+  return false;
+}// end jobReady
+/********************************************************************************************************************************
+ * Function name:     negotiateCodec
+ * Description:       Answers "compress <codec>[,<codec>...]" with "COMPRESS <codec>", the first codec of the list this
+                      server was built with. "COMPRESS none" means none was (or the list asked for none), downloads are
+                      sent as they are then.
+ * Parameters:        const string &codecs: What follows "compress ", comma separated in order of preference
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::negotiateCodec(const string &codecs)
+{
+  size_t start = 0;
+
+  codec = CODEC_NONE;
+  while(start <= codecs.length())
+    {
+      size_t comma = codecs.find(',', start);
+      if(comma == string::npos)
+	comma = codecs.length();
+      int found = parseCodec(codecs.substr(start, comma - start));
+      if(found != -1)
+	{
+	  codec = found;
+	  break;
+	}
+      start = comma + 1;
+    }
+  queueMessage("COMPRESS " + string(codecName(codec)), true);
+}// end negotiateCodec
+/********************************************************************************************************************************
+ * Function name:     negotiateChecksum
+ * Description:       Answers "checksum <algorithm>[,<algorithm>...]" with "CHECKSUM crc32c" if crc32c is on the list,
+                      "CHECKSUM none" (no more checksums) otherwise
+ * Parameters:        const string &algorithms: What follows "checksum ", comma separated
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::negotiateChecksum(const string &algorithms)
+{
+  checksums = ("," + algorithms + ",").find(",crc32c,") != string::npos;
+  queueMessage(checksums ? "CHECKSUM crc32c" : "CHECKSUM none", true);
+}// end negotiateChecksum
+/********************************************************************************************************************************
+ * Function name:     startChecksums
+ * Description:       Hands the CRC32Cs of a range of the announced file to the compress pool, each job checksums
+                      CHECKSUM_JOB_CHUNKS chunks, so they are computed on every core while the bytes are being sent.
+                      queueChecksums() sends them once the bytes are out. Does nothing unless checksums were negotiated.
+ * Parameters:        off_t offset: First byte of the range
+                      off_t length: Bytes in the range
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::startChecksums(off_t offset, off_t length)
+{
+  if(!checksums)
+    return;
+  checksumming.pending = true;
+  checksumming.length = length;
+  checksumming.fileFd = downloadFd == -1 ? -1 : fcntl(downloadFd, F_DUPFD_CLOEXEC, 0);
+  if(downloadFd != -1 && checksumming.fileFd == -1)
+    {
+      LOG(LOG_ERROR, "Couldn't Checksum The Download : %m");
+      return; // no parts, queueChecksums() ends the connection
+    }
+  int fileFd = checksumming.fileFd;
+  CachedFilePtr cached = downloadCached;
+  for(off_t done = 0; done < length; done += (off_t)CHECKSUM_CHUNK_SIZE * CHECKSUM_JOB_CHUNKS)
+    {
+      off_t start = offset + done;
+      off_t end = offset + min(length, done + (off_t)CHECKSUM_CHUNK_SIZE * CHECKSUM_JOB_CHUNKS);
+      checksumming.parts.push_back(compressPool.run([fileFd, cached, start, end]()
+						     {
+						       static thread_local vector<char> chunk; // one allocation per worker
+						       string crcs;
+						       for(off_t at = start; at < end; at += CHECKSUM_CHUNK_SIZE)
+							 {
+							   size_t length = min(end - at, (off_t)CHECKSUM_CHUNK_SIZE);
+							   char crc[4];
+							   if(!readBlock(fileFd, cached, at, length, chunk))
+							     return string();
+							   encodeBigEndian(crc, crc32cUpdate(0, chunk.data(), length), 4);
+							   crcs.append(crc, 4);
+							 }
+						       return crcs;
+						     }, poolWakeFd));
+    }
+}// end startChecksums
+/********************************************************************************************************************************
+ * Function name:     queueChecksums
+ * Description:       Queues the FRAME_CHECKSUM frame of the file or range just sent: the chunk CRCs the workers computed
+                      and the CRC of the whole, combined from them. Waits for the workers if they aren't done, which only a
+                      blocking driver lets happen (queueBatchItem() asks jobReady() about every part first). If a piece
+                      couldn't be read the connection is ended, the client would take the missing frame for damage.
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::queueChecksums()
+{
+  string payload(8, '\0');
+  bool complete = checksumming.length == 0 || !checksumming.parts.empty();
+
+  for(size_t i = 0; i < checksumming.parts.size(); i++)
+    {
+      string crcs = checksumming.parts[i].get();
+      complete = complete && !crcs.empty();
+      payload += crcs;
+    }
+  checksumming.parts.clear();
+  checksumming.pending = false;
+  if(checksumming.fileFd != -1)
+    close(checksumming.fileFd);
+  checksumming.fileFd = -1;
+  if(!complete)
+    {
+      LOG(LOG_ERROR, "Checksumming The Download Failed !");
+      closing = true;
+      return;
+    }
+
+  uint32_t whole = 0;
+  off_t left = checksumming.length;
+  for(size_t at = 8; at < payload.length(); at += 4, left -= CHECKSUM_CHUNK_SIZE)
+    whole = crc32cCombine(whole, decodeBigEndian(&payload[at], 4), min(left, (off_t)CHECKSUM_CHUNK_SIZE));
+  encodeBigEndian(&payload[0], CHECKSUM_CHUNK_SIZE, 4);
+  encodeBigEndian(&payload[4], whole, 4);
+  queueFrame(FRAME_CHECKSUM, payload);
+}// end queueChecksums
+/********************************************************************************************************************************
+ * Function name:     startSync
+ * Description:       Answers a "sync" with "SYNC <file size>" and hands the segments of the file to the compress pool to
+                      be matched against the client's signatures, queueSyncSegment() sends their delta. The CRC32Cs of the
+                      whole file follow it if checksums were negotiated, so the client can check what it rebuilt.
+ * Parameters:        off_t fileSize: Size of the file (downloadFd or downloadCached)
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::startSync(off_t fileSize)
+{
+  queueMessage("SYNC " + to_string((long long)fileSize), true);
+  startChecksums(0, fileSize);
+  syncing.index = syncRequest;
+  syncRequest.reset();
+  syncing.fileFd = downloadFd;
+  syncing.cached = downloadCached;
+  syncing.size = fileSize;
+  syncing.next = 0;
+  syncing.fileName = downloadName;
+  syncing.wireBytes = 0;
+  downloadFd = -1;
+  downloadCached.reset();
+  if(fileSize == 0) // nothing to match, an empty last frame says so
+    {
+      queueHeader(FRAME_DATA, FRAME_FLAG_END, 0, 0);
+      if(syncing.fileFd != -1)
+	close(syncing.fileFd);
+      syncing.fileFd = -1;
+      syncing.cached.reset();
+      syncing.index.reset();
+      LOG(LOG_INFO, "File Synced: \"%s\" (0 bytes)", syncing.fileName.c_str());
+      return;
+    }
+  submitSegments();
+}// end startSync
+/********************************************************************************************************************************
+ * Function name:     submitSegments
+ * Description:       Hands segments of the file being synced to the compress pool until one per worker is in flight, each
+                      is read and matched on its own (see SyncIndex::delta())
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::submitSegments()
+{
+  while((int)syncing.segments.size() < compressPool.threads() && syncing.next < syncing.size)
+    {
+      off_t start = syncing.next;
+      size_t length = min(syncing.size - start, (off_t)SYNC_SEGMENT_SIZE);
+      shared_ptr<const SyncIndex> index = syncing.index;
+      int fileFd = syncing.fileFd;
+      CachedFilePtr cached = syncing.cached;
+      syncing.segments.push_back(compressPool.run([index, fileFd, cached, start, length]()
+						   {
+						     static thread_local vector<char> segment; // one allocation per worker
+						     if(!readBlock(fileFd, cached, start, length, segment))
+						       return string(); // never a valid delta, a segment has at least one operation
+						     return index->delta(segment.data(), length, start);
+						   }, poolWakeFd));
+      syncing.next += length;
+    }
+}// end submitSegments
+/********************************************************************************************************************************
+ * Function name:     queueSyncSegment
+ * Description:       Queues the delta of the next segment of the file being synced as one FRAME_DATA frame, the last one
+                      flagged FRAME_FLAG_END. Waits for the worker if the segment isn't matched yet, which only a blocking
+                      driver lets happen (see jobReady()). A segment that couldn't be read ends the connection, the client
+                      can't rebuild the file without it.
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::queueSyncSegment()
+{
+  string delta = syncing.segments.front().get();
+  syncing.segments.pop_front();
+  if(delta.empty())
+    {
+      LOG(LOG_ERROR, "Syncing \"%s\" Failed !", syncing.fileName.c_str());
+      closing = true; // the other segments are waited for when the session is deleted
+      return;
+    }
+  submitSegments();
+  bool last = syncing.segments.empty();
+
+  queueHeader(FRAME_DATA, last ? FRAME_FLAG_END : 0, 0, delta.length());
+  output.back().bytes += delta;
+  syncing.wireBytes += delta.length();
+  if(last)
+    {
+      if(syncing.fileFd != -1)
+	close(syncing.fileFd);
+      syncing.fileFd = -1;
+      syncing.cached.reset();
+      syncing.index.reset();
+      LOG(LOG_INFO, "File Synced: \"%s\" (%lld bytes, %lld sent)", syncing.fileName.c_str(), (long long)syncing.size,
+	  syncing.wireBytes);
+    }
+}// end queueSyncSegment
+/********************************************************************************************************************************
+ * Function name:     receiveHashes
+ * Description:       Answers "have" with "HAVE <chunks held>" after adding the hashes it sent to the chunks the client holds,
+                      the chunks of later dgets with those hashes aren't sent
+ * Parameters:        const string &hashes: 8 byte chunk hashes, big endian
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::receiveHashes(const string &hashes)
+{
+  if(hashes.length() % CHUNK_HASH_SIZE != 0)
+    {
+      queueMessage("Have failed: Invalid chunk hashes", true);
+      return;
+    }
+  for(size_t at = 0; at < hashes.length(); at += CHUNK_HASH_SIZE)
+    chunkHeld(heldChunks, decodeBigEndian(&hashes[at], CHUNK_HASH_SIZE));
+  LOG(LOG_DEBUG, "Chunk Hashes: %zu received, %zu held", hashes.length() / CHUNK_HASH_SIZE, heldChunks.size());
+  queueMessage("HAVE " + to_string((long long)heldChunks.size()), true);
+}// end receiveHashes
+/********************************************************************************************************************************
+ * Function name:     queueDeduplicated
+ * Description:       Answers a "dget" with "CHUNKS <file size> <chunk count>" and the file's recipe from the chunk index, then
+                      queues one FRAME_DATA frame of the chunks the client doesn't hold (see contentChunks.h): neighbouring
+                      chunks are sent as one range of the file with the copy mode, so the bytes never pass through memory
+                      here. A file that isn't indexed yet is sent whole after an empty recipe, and queued to be chunked.
+                      The CRC32Cs of the whole file follow if checksums were negotiated, the client checks what it put
+                      together.
+ * Parameters:        off_t fileSize: Size of the file (downloadFd or downloadCached)
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::queueDeduplicated(off_t fileSize)
+{
+  string recipe;
+  vector<pair<off_t, off_t> > ranges; // offset and length of the bytes to send
+  off_t wireBytes = 0;
+  size_t sentChunks = 0;
+
+  if(chunkIndex.enabled() && !chunkIndex.lookup(downloadInfo, recipe))
+    chunkIndex.requested(downloadInfo, downloadFd, downloadCached);
+  queueMessage("CHUNKS " + to_string((long long)fileSize) + " " + to_string((long long)(recipe.length() / CHUNK_RECORD_SIZE)), true);
+  queueFrame(FRAME_DATA, recipe);
+  startChecksums(0, fileSize);
+  if(recipe.empty())
+    {
+      chunkIndex.sent(fileSize, fileSize);
+      queueDownload(0, fileSize);
+      return;
+    }
+
+  off_t offset = 0;
+  for(size_t at = 0; at < recipe.length(); at += CHUNK_RECORD_SIZE)
+    {
+      off_t length = decodeBigEndian(&recipe[at + CHUNK_HASH_SIZE], 4);
+      if(!chunkHeld(heldChunks, decodeBigEndian(&recipe[at], CHUNK_HASH_SIZE)))
+	{
+	  if(!ranges.empty() && ranges.back().first + ranges.back().second == offset)
+	    ranges.back().second += length;
+	  else
+	    ranges.push_back(make_pair(offset, length));
+	  wireBytes += length;
+	  sentChunks++;
+	}
+      offset += length;
+    }
+  LOG(LOG_INFO, "Deduplicated \"%s\": %zu of %zu chunks to send, %lld of %lld bytes", downloadName.c_str(), sentChunks,
+      recipe.length() / CHUNK_RECORD_SIZE, (long long)wireBytes, (long long)fileSize);
+  chunkIndex.sent(fileSize, wireBytes);
+
+  queueHeader(FRAME_DATA, 0, 0, wireBytes);
+  for(size_t i = 0; i < ranges.size(); i++)
+    {
+      bool last = i + 1 == ranges.size();
+      addOutput();
+      output.back().fileFd = downloadFd;
+      output.back().ownsFile = last;
+      output.back().cached = downloadCached;
+      output.back().offset = ranges[i].first;
+      output.back().remaining = ranges[i].second;
+      output.back().mode = copyMode;
+      if(last)
+	output.back().fileName = downloadName;
+    }
+  if(ranges.empty()) // the client holds all of it
+    dropDownload();
+  downloadFd = -1;
+  downloadCached.reset();
+}// end queueDeduplicated
+/********************************************************************************************************************************
+ * Function name:     queueArchiveEntry
+ * Description:       Queues the next entry of a download-dir archive as one FRAME_DATA frame: its tar header, the file
+                      contents (from the file cache if they are there, nothing is added to it) and the padding. A
+                      directory is entered instead, a finished one is left, and the end of the archive is queued once the
+                      walk is done. Entries that vanished or are neither files nor directories are left out.
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::queueArchiveEntry()
+{
+  ArchiveDir &current = archiveDirs.back();
+  struct stat info;
+
+  if(current.names.empty())
+    {
+      close(current.dirFd);
+      archiveDirs.pop_back();
+      if(archiveDirs.empty()) // the walk is done, two zero blocks and an empty frame end the archive
+	{
+	  queueFrame(FRAME_DATA, string(TAR_END_SIZE, '\0'));
+	  queueFrame(FRAME_DATA, "");
+	  LOG(LOG_INFO, "Archive Sent: \"%s\" (%lld files, %lld bytes)", archiveRoot.c_str(), archiveFiles, archiveBytes);
+	}
+      return;
+    }
+  int dirFd = current.dirFd;
+  string name = current.names.front();
+  string path = current.path + name;
+  current.names.pop_front();
+
+  if(fstatat(dirFd, name.c_str(), &info, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+      LOG(LOG_WARN, "Not Archived: %s: %m", path.c_str());
+      return;
+    }
+  if(S_ISDIR(info.st_mode))
+    {
+      int subdirFd = openat(dirFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if(subdirFd == -1)
+	LOG(LOG_WARN, "Not Archived: %s: %m", path.c_str());
+      else
+	enterArchiveDirectory(subdirFd, path + "/");
+      return;
+    }
+  if(!S_ISREG(info.st_mode))
+    {
+      LOG(LOG_WARN, "Not Archived: \"%s\" is not a file or a directory", path.c_str());
+      return;
+    }
+
+  int fileFd = -1;
+  CachedFilePtr cached;
+  if(!fileCache.enabled() || !(cached = fileCache.lookup(info)))
+    {
+      // O_NONBLOCK so a fifo swapped in since the fstatat() can't hang the server
+      fileFd = openat(dirFd, name.c_str(), O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+      if(fileFd == -1 || fstat(fileFd, &info) == -1 || !S_ISREG(info.st_mode))
+	{
+	  LOG(LOG_WARN, "Not Archived: %s: %m", path.c_str());
+	  if(fileFd != -1)
+	    close(fileFd);
+	  return;
+	}
+    }
+
+  TarEntry entry = { path, TAR_TYPE_FILE, (uint32_t)info.st_mode, (uint64_t)info.st_size, (int64_t)info.st_mtim.tv_sec };
+  string header = encodeTarEntry(entry);
+  size_t padding = tarPadding(info.st_size);
+  queueHeader(FRAME_DATA, 0, 0, header.length() + info.st_size + padding);
+  output.back().bytes += header;
+  if(info.st_size > 0)
+    {
+      addOutput();
+      output.back().fileFd = fileFd;
+      output.back().cached = cached;
+      output.back().remaining = info.st_size;
+      output.back().mode = copyMode;
+      output.back().fileName = path;
+    }
+  else if(fileFd != -1)
+    close(fileFd);
+  if(padding > 0)
+    {
+      addOutput();
+      output.back().bytes.assign(padding, '\0');
+    }
+  archiveFiles++;
+  archiveBytes += info.st_size;
+}// end queueArchiveEntry
+/********************************************************************************************************************************
+ * Function name:     queueMgetFile
+ * Description:       Starts the download of the next file of an mget once everything before it is queued. It is sent just
+                      like "get" sends it (one FRAME_DATA frame, or a message saying why it can't be sent), so the file cache,
+                      the copy modes and a driver's asynchronous open all work for mget too. Files are opened one at a time,
+                      an mget of thousands of files never holds more than one open.
+ * Parameters:        none
+ * Return Value:      true:  if a file was started
+                      false: if no mget has files left, or the previous file is still being opened
+********************************************************************************************************************************/
+bool Session::queueMgetFile()
+{
+  if(mgetNames.empty() || state != STATE_COMMAND)
+    return false;
+
+  string name = mgetNames.front();
+  mgetNames.pop_front();
+  downloadAtOnce = true;
+  startDownload(name);
+  return true;
+}// end queueMgetFile
+/********************************************************************************************************************************
+ * Function name:     dropDownload
+ * Description:       Lets go of the announced file when the client doesn't want it
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::dropDownload()
+{
+  if(downloadFd != -1)
+    close(downloadFd);
+  downloadFd = -1;
+  downloadCached.reset();
+}// end dropDownload
+/********************************************************************************************************************************
+ * Function name:     flush
+ * Description:       Sends queued output in order until the queue is empty or the socket is full
+ * Parameters:        none
+ * Return Value:      FLUSH_DONE, FLUSH_BLOCKED or FLUSH_ERROR
+********************************************************************************************************************************/
+int Session::flush()
+{
+  while(!output.empty())
+    {
+      OutputItem &item = output.front();
+
+      if(item.cached)
+	{
+	  int result = sendCached(item);
+	  if(result != FLUSH_DONE)
+	    return result;
+	}
+      else if(item.fileFd == -1)
+	{
+	  while(item.sent < item.bytes.length())
+	    {
+	      if(writeBlocked)
+		return FLUSH_BLOCKED;
+	      // MSG_MORE while more output is queued, so a frame header goes out in the same segment as the file
+	      // after it instead of waiting for the client's delayed ACK
+	      ssize_t sent = send(sockfd, item.bytes.data() + item.sent, item.bytes.length() - item.sent,
+				  MSG_NOSIGNAL | (moreOutput() ? MSG_MORE : 0));
+	      if(sent < 0)
+		{
+		  if(errno == EINTR)
+		    continue;
+		  if(errno == EAGAIN || errno == EWOULDBLOCK)
+		    {
+		      writeBlocked = true;
+		      return FLUSH_BLOCKED;
+		    }
+		  LOG(LOG_ERROR, "Sending Failed ! : %m");
+		  return FLUSH_ERROR;
+		}
+	      item.sent += sent;
+	      countMetric(metrics().bytesSent, sent);
+	    }
+	}
+      else
+	{
+	  int result = flushFile(item);
+	  if(result != FLUSH_DONE)
+	    return result;
+	}
+      outputSent();
+    }
+  return FLUSH_DONE;
+}// end flush
+/********************************************************************************************************************************
+ * Function name:     outputSent
+ * Description:       Drops the first queued item once all of it was sent, closing its file unless a stream still sends from
+                      it (or letting go of its cached contents)
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::outputSent()
+{
+  OutputItem &item = output.front();
+
+  if(item.fileFd != -1 && item.ownsFile)
+    {
+      close(item.fileFd);
+      LOG(LOG_INFO, "File Sent: \"%s\" (%s)", item.fileName.c_str(), copyModeName(item.mode));
+    }
+  else if(item.cached && !item.fileName.empty()) // not for directory listings
+    LOG(LOG_INFO, "File Sent: \"%s\" (cache)", item.fileName.c_str());
+  output.pop_front();
+  countMetric(metrics().outputDone);
+  checkAnswered();
+}// end outputSent
+/********************************************************************************************************************************
+ * Function name:     flushFile
+ * Description:       Moves a queued file range to the socket with its copy mode. The zero copy modes fall back
+                      (sendfile -> splice -> buffered) when the kernel refuses them for this file, so a download never fails
+                      just because of the copy mode.
+ * Parameters:        OutputItem &item: The file range, offset/remaining are advanced past the bytes sent
+ * Return Value:      FLUSH_DONE, FLUSH_BLOCKED or FLUSH_ERROR
+********************************************************************************************************************************/
+int Session::flushFile(OutputItem &item)
+{
+  while(true)
+    {
+      int result;
+      if(item.mode == COPY_SENDFILE)
+	result = sendFileSendfile(item);
+      else if(item.mode == COPY_SPLICE)
+	result = sendFileSplice(item);
+      else
+	result = sendFileBuffered(item);
+
+      if(result != FLUSH_UNSUPPORTED)
+	return result;
+      item.mode = item.mode == COPY_SENDFILE ? COPY_SPLICE : COPY_BUFFERED;
+    }
+}// end flushFile
+/********************************************************************************************************************************
+ * Function name:     sendCached
+ * Description:       Sends a range of a file's cached contents, straight from the memory every connection shares
+ * Parameters:        OutputItem &item: The range, offset/remaining are advanced past the bytes sent
+ * Return Value:      FLUSH_DONE, FLUSH_BLOCKED or FLUSH_ERROR
+********************************************************************************************************************************/
+int Session::sendCached(OutputItem &item)
+{
+  while(item.remaining > 0)
+    {
+      if(writeBlocked)
+	return FLUSH_BLOCKED;
+      ssize_t sent = send(sockfd, item.cached->data.data() + item.offset, item.remaining, MSG_NOSIGNAL);
+      if(sent < 0)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  if(errno == EAGAIN || errno == EWOULDBLOCK)
+	    {
+	      writeBlocked = true;
+	      return FLUSH_BLOCKED;
+	    }
+	  LOG(LOG_ERROR, "Sending Failed ! : %m");
+	  return FLUSH_ERROR;
+	}
+      item.offset += sent;
+      item.remaining -= sent;
+      countMetric(metrics().bytesSent, sent);
+    }
+  return FLUSH_DONE;
+}// end sendCached
+/********************************************************************************************************************************
+ * Function name:     sendFileBuffered
+ * Description:       Copies a file range to the client CHUNK_SIZE bytes at a time through a user space buffer, the
+                      buffer only exists while a buffered download is in progress
+ * Parameters:        OutputItem &item: The file range
+ * Return Value:      FLUSH_DONE, FLUSH_BLOCKED or FLUSH_ERROR
+********************************************************************************************************************************/
+int Session::sendFileBuffered(OutputItem &item)
+{
+  if(chunk.empty())
+    chunk.resize(CHUNK_SIZE);
+
+  while(item.remaining > 0 || chunkStart < chunkEnd)
+    {
+      if(chunkStart == chunkEnd) // Everything read so far was sent, read the next piece
+	{
+	  size_t toRead = item.remaining < CHUNK_SIZE ? (size_t)item.remaining : CHUNK_SIZE;
+	  ssize_t bytesRead = pread(item.fileFd, &chunk[0], toRead, item.offset);
+	  if(bytesRead < 0)
+	    {
+	      if(errno == EINTR)
+		continue;
+	      LOG(LOG_ERROR, "Reading File Failed ! : %m");
+	      return FLUSH_ERROR;
+	    }
+	  if(bytesRead == 0) // The file shrank after stat(), the client is still owed bytes
+	    {
+	      LOG(LOG_ERROR, "File shrank during download");
+	      return FLUSH_ERROR;
+	    }
+	  chunkStart = 0;
+	  chunkEnd = bytesRead;
+	  item.offset += bytesRead;
+	  item.remaining -= bytesRead;
+	}
+
+      if(writeBlocked)
+	return FLUSH_BLOCKED;
+      ssize_t sent = send(sockfd, &chunk[chunkStart], chunkEnd - chunkStart, MSG_NOSIGNAL);
+      if(sent < 0)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  if(errno == EAGAIN || errno == EWOULDBLOCK)
+	    {
+	      writeBlocked = true;
+	      return FLUSH_BLOCKED;
+	    }
+	  LOG(LOG_ERROR, "Sending Failed ! : %m");
+	  return FLUSH_ERROR;
+	}
+      chunkStart += sent;
+      countMetric(metrics().bytesSent, sent);
+    }
+
+  vector<char>().swap(chunk); // give the buffer back until the next buffered download
+  chunkStart = chunkEnd = 0;
+  return FLUSH_DONE;
+}// end sendFileBuffered
+/********************************************************************************************************************************
+ * Function name:     sendFileSendfile
+ * Description:       Moves a file range to the client with sendfile(), the bytes go from the page cache to the socket
+                      without ever being copied into this process
+ * Parameters:        OutputItem &item: The file range
+ * Return Value:      FLUSH_DONE, FLUSH_BLOCKED, FLUSH_ERROR or FLUSH_UNSUPPORTED
+********************************************************************************************************************************/
+int Session::sendFileSendfile(OutputItem &item)
+{
+  while(item.remaining > 0)
+    {
+      if(writeBlocked)
+	return FLUSH_BLOCKED;
+      ssize_t sent = sendfile(sockfd, item.fileFd, &item.offset, item.remaining); // advances offset itself
+      if(sent < 0)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  if(errno == EAGAIN || errno == EWOULDBLOCK)
+	    {
+	      writeBlocked = true;
+	      return FLUSH_BLOCKED;
+	    }
+	  if(errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+	    return FLUSH_UNSUPPORTED;
+	  LOG(LOG_ERROR, "sendfile Failed ! : %m");
+	  return FLUSH_ERROR;
+	}
+      if(sent == 0) // The file shrank after stat(), the client is still owed bytes
+	{
+	  LOG(LOG_ERROR, "File shrank during download");
+	  return FLUSH_ERROR;
+	}
+      item.remaining -= sent;
+      countMetric(metrics().bytesSent, sent);
+    }
+  return FLUSH_DONE;
+}// end sendFileSendfile
+/********************************************************************************************************************************
+ * Function name:     sendFileSplice
+ * Description:       Moves a file range to the client with splice(), first from the file into a pipe and then from the
+                      pipe into the socket, both moves happen inside the kernel. Bytes left in the pipe when the socket
+                      fills up are sent first the next time.
+ * Parameters:        OutputItem &item: The file range
+ * Return Value:      FLUSH_DONE, FLUSH_BLOCKED, FLUSH_ERROR or FLUSH_UNSUPPORTED
+********************************************************************************************************************************/
+int Session::sendFileSplice(OutputItem &item)
+{
+  if(pipeFds[0] == -1)
+    {
+      if(pipe2(pipeFds, O_NONBLOCK | O_CLOEXEC) == -1)
+	{
+	  LOG(LOG_ERROR, "Couldn't Create Pipe For splice: %m");
+	  pipeFds[0] = pipeFds[1] = -1;
+	  return FLUSH_UNSUPPORTED;
+	}
+      fcntl(pipeFds[1], F_SETPIPE_SZ, SPLICE_SIZE); // Bigger pipe, fewer trips (best effort)
+    }
+
+  while(item.remaining > 0 || pipeFill > 0)
+    {
+      if(pipeFill == 0) // File -> pipe
+	{
+	  size_t toMove = item.remaining < SPLICE_SIZE ? (size_t)item.remaining : SPLICE_SIZE;
+	  ssize_t moved = splice(item.fileFd, &item.offset, pipeFds[1], NULL, toMove,
+				 SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+	  if(moved < 0)
+	    {
+	      if(errno == EINTR)
+		continue;
+	      if(errno == EINVAL || errno == ENOSYS)
+		{
+		  closePipe(); // nothing is in the pipe, safe to fall back
+		  return FLUSH_UNSUPPORTED;
+		}
+	      LOG(LOG_ERROR, "splice Failed ! : %m");
+	      return FLUSH_ERROR;
+	    }
+	  if(moved == 0) // The file shrank after stat(), the client is still owed bytes
+	    {
+	      LOG(LOG_ERROR, "File shrank during download");
+	      return FLUSH_ERROR;
+	    }
+	  pipeFill = moved;
+	  item.remaining -= moved;
+	}
+
+      // Pipe -> socket, the pipe has to be drained before the next file read
+      if(writeBlocked)
+	return FLUSH_BLOCKED;
+      // The last piece goes without SPLICE_F_MORE, so it isn't held back waiting for more
+      ssize_t sent = splice(pipeFds[0], NULL, sockfd, NULL, pipeFill,
+			    SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (item.remaining > 0 ? SPLICE_F_MORE : 0));
+      if(sent < 0)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  if(errno == EAGAIN || errno == EWOULDBLOCK)
+	    {
+	      writeBlocked = true;
+	      return FLUSH_BLOCKED;
+	    }
+	  LOG(LOG_ERROR, "splice Failed ! : %m");
+	  return FLUSH_ERROR;
+	}
+      pipeFill -= sent;
+      countMetric(metrics().bytesSent, sent);
+    }
+
+  closePipe(); // idle sessions don't hold on to pipes
+  return FLUSH_DONE;
+}// end sendFileSplice
+/********************************************************************************************************************************
+ * Function name:     closePipe
+ * Description:       Closes the splice() pipe, if there is one
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void Session::closePipe()
+{
+  if(pipeFds[0] != -1)
+    {
+      close(pipeFds[0]);
+      close(pipeFds[1]);
+      pipeFds[0] = pipeFds[1] = -1;
+    }
+  pipeFill = 0;
+}// end closePipe
+/********************************************************************************************************************************
+ * Function name:     initSessions
+ * Description:       Opens the directory the server was started in, once, so every new session can start there without
+                      a syscall of its own. Must be called before the first session is created.
+ * Parameters:        none
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void initSessions()
+{
+  char directory[PATH_MAX]; // the server's working directory
+
+  if((startDirFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+    {
+      perror("Couldn't Open Current Working Directory");
+      exit(EXIT_FAILURE);
+    }
+  if(getcwd(directory, sizeof(directory)) == NULL)
+    {
+      perror("Couldn't Get Current Working Directory");
+      strcpy(directory, ".");
+    }
+  startDir = directory;
+}// end initSessions
+/********************************************************************************************************************************
+ * Function name:     parseCopyMode
+ * Description:       Sets the copy mode used by downloads from its command line name
+ * Parameters:        const char *name: "sendfile", "splice" or "buffered"
+ * Return Value:      true:  if the name is a known copy mode
+                      false: otherwise (copy mode left unchanged)
+********************************************************************************************************************************/
+bool parseCopyMode(const char *name)
+{
+  string strName = name;
+
+  if(strName == "sendfile")
+    copyMode = COPY_SENDFILE;
+  else if(strName == "splice")
+    copyMode = COPY_SPLICE;
+  else if(strName == "buffered")
+    copyMode = COPY_BUFFERED;
+  else
+    return false;
+
+  return true;
+}// end parseCopyMode
+/********************************************************************************************************************************
+ * Function name:     parseRange
+ * Description:       Parses the "<offset> [<length>]" of a RANGE answer. A missing length, or one that runs past the end of
+                      the file, means up to the end of the file. An offset equal to the file size is a valid empty range
+                      (a client whose copy is complete but was never renamed).
+ * Parameters:        const string &range: The text after "RANGE "
+                      off_t fileSize: Size of the file announced with READY
+                      off_t &offset: Set to the first byte of the range
+                      off_t &length: Set to the number of bytes in the range
+ * Return Value:      true:  if the range is valid
+                      false: if it isn't numeric or starts past the end of the file
+********************************************************************************************************************************/
+bool parseRange(const string &range, off_t fileSize, off_t &offset, off_t &length)
+{
+  const char *text = range.c_str();
+  char *end;
+
+  if(!isdigit((unsigned char)*text))
+    return false;
+  errno = 0;
+  offset = strtoll(text, &end, 10);
+  if(errno != 0 || offset > fileSize)
+    return false;
+
+  length = fileSize - offset;
+  if(*end == '\0')
+    return true;
+  if(*end != ' ' || !isdigit((unsigned char)end[1]))
+    return false;
+  long long requested = strtoll(end + 1, &end, 10);
+  if(errno != 0 || *end != '\0')
+    return false;
+  if(requested < length)
+    length = requested;
+  return true;
+}// end parseRange
+/********************************************************************************************************************************
+ * Function name:     parsePageRequest
+ * Description:       Reads the "<page size> [<cursor>]" of a "list" command, the page size is capped at LIST_PAGE_MAX
+ * Parameters:        const string &request: The text after "list "
+                      long long &pageSize: Set to the most names to send
+                      off_t &cursor: Set to where in the directory to start (0, the beginning, if not given)
+ * Return Value:      true:  if the request is valid
+                      false: otherwise
+********************************************************************************************************************************/
+bool parsePageRequest(const string &request, long long &pageSize, off_t &cursor)
+{
+  const char *text = request.c_str();
+  char *end;
+
+  if(!isdigit((unsigned char)*text))
+    return false;
+  errno = 0;
+  pageSize = strtoll(text, &end, 10);
+  if(errno != 0 || pageSize < 1)
+    return false;
+  if(pageSize > LIST_PAGE_MAX)
+    pageSize = LIST_PAGE_MAX;
+
+  cursor = 0;
+  if(*end == '\0')
+    return true;
+  if(*end != ' ' || !isdigit((unsigned char)end[1]))
+    return false;
+  cursor = strtoll(end + 1, &end, 10);
+  return errno == 0 && *end == '\0';
+}// end parsePageRequest
+/********************************************************************************************************************************
+ * Function name:     copyModeName
+ * Description:       Gives the command line name of a copy mode (for output)
+ * Parameters:        int mode: one of the COPY_ constants
+ * Return Value:      const char*: the name of the mode
+********************************************************************************************************************************/
+const char* copyModeName(int mode)
+{
+  switch(mode)
+    {
+    case COPY_SENDFILE:
+      return "sendfile";
+    case COPY_SPLICE:
+      return "splice";
+    default:
+      return "buffered";
+    }
+}// end copyModeName
+/*************************************************************************************************************************************
+ * Function name:     getIpAddress
+ * Description:       Converts the IPv4 and IPv6 addresses from binary to text form
+ * Parameters:        struct sockaddr_in &address: A sockaddr_in structure used to store the addresses for the internet address family
+ * Return Value:      string: the address in text form
+
+ ************************************************************************************************************************************/
+
+string getIpAddress(sockaddr_in &address)
+{
+
+  // To store the IP address of the client
+  char ipAddress[50];
+
+  ///  Get the ip Address of the Client
+  if(inet_ntop(AF_INET,&(&address)->sin_addr, ipAddress, sizeof ipAddress ) == NULL )
+    {
+      LOG(LOG_WARN, "Couldnt Get Clients IP Address ! : %m");
+      strcpy(ipAddress, "unknown");
+    }
+  // Output The Ip address the server is connected to (Clients ip)
+  LOG(LOG_INFO, "Connected To: %s", ipAddress);
+
+  // Convert the Ip Address to a string
+  string strIpAddress = ipAddress;
+
+  return strIpAddress;
+
+}
@@ -0,0 +1,310 @@
+/********************************************************************************************************
+ * Filename: session.h
+ * Purpose: Per-connection state machine of the download server. A Session owns one connected socket,
+ *          parses the frames the client sends and queues the replies, it never decides how the socket
+ *          is waited on. The fork() model drives it with a blocking socket, the event loop
+ *          (eventLoop.cpp) drives it with a non-blocking one, the io_uring loop (uringLoop.cpp) does
+ *          the socket and file I/O itself and only uses the session to parse and queue.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <future>
+#include <unordered_set>
+#include "protocol.h"
+#include "fileCache.h"
+#include "tarArchive.h"
+#include "deltaSync.h"
+#include "metrics.h"
+
+#define SESSION_INPUT_SIZE 4096 // Receive buffer per connection, commands are small
+
+// Ways the download path can move file bytes to the socket
+#define COPY_BUFFERED 0 // read() into a user space buffer then send()
+#define COPY_SENDFILE 1 // sendfile(): page cache straight to the socket
+#define COPY_SPLICE   2 // splice() through a pipe: page cache -> pipe -> socket
+
+#define SPLICE_SIZE (CHUNK_SIZE * 16) // Bytes moved through the pipe per splice()
+
+#define CHECKSUM_JOB_CHUNKS 16 // Chunk CRCs one compress pool job computes
+
+#define STREAM_CHUNK_SIZE (CHUNK_SIZE * 4) // File bytes a stream sends before the next stream gets a turn
+
+// What Session::run() tells the driver
+#define SESSION_CLOSE 0 // The connection is finished, close the socket and delete the session
+#define SESSION_WAIT  1 // Blocked, call run() again once the socket is readable/writable
+
+extern int copyMode; // Selected with -c, shared by every session
+extern int startDirFd; // Directory the server started in, every session starts out there
+
+/*************************************************************************************************
+ * Struct name:       OutputItem
+ * Description:       One piece of queued output, either bytes in memory, a range of an open
+                      file that is moved to the socket with the selected copy mode, or a range
+                      of shared read-only bytes (a file's cached contents, a cached directory listing)
+ *************************************************************************************************/
+struct OutputItem
+{
+  std::string bytes; // bytes to send when fileFd is -1
+  size_t sent; // how many of bytes already went out
+  int fileFd; // open file to send from, closed once the range is sent if ownsFile (-1 for none)
+  bool ownsFile; // false for all but the last chunk of a stream, the stream keeps the file open
+  off_t offset; // next byte of the file to send
+  off_t remaining; // bytes of the file still to send
+  int mode; // copy mode used for the file, downgraded when the kernel refuses one
+  std::string fileName; // for output once the file is sent
+  CachedFilePtr cached; // cached file contents (or a whole listing frame) to send instead of fileFd (offset/remaining give the range)
+
+  OutputItem() : sent(0), fileFd(-1), ownsFile(true), offset(0), remaining(0), mode(COPY_SENDFILE) {}
+};
+
+/*************************************************************************************************
+ * Class name:        Session
+ * Description:       State of one client connection: where it is in the command protocol,
+                      its working directory, the bytes received but not parsed yet and the
+                      replies queued but not sent yet. Paths from the client are always
+                      resolved relative to the session's own directory descriptor (openat and
+                      friends), the process working directory is never used or changed.
+ *************************************************************************************************/
+class Session
+{
+public:
+  Session(int sockfd, const std::string &ipAddress);
+  ~Session();
+
+  // Runs the session until it has to wait for the socket or the connection is finished
+  int run();
+
+  // Tells the session the socket became readable/writable again (non-blocking sockets)
+  void setReadable() { readBlocked = false; }
+  void setWritable() { writeBlocked = false; }
+
+  // Pieces run() is made of, for drivers that do the socket I/O themselves
+  char* inputSpace(size_t &room);
+  void inputReceived(size_t length);
+  bool processInput();
+  bool hasOutput() const { return !output.empty(); }
+  bool isClosing() const { return closing; }
+  OutputItem& nextOutput() { return output.front(); }
+  bool moreOutput() const { return output.size() > 1; } // more queued after nextOutput()
+  void outputSent();
+  bool queueStreamChunk();
+  bool queueBatchItem();
+
+  // Drivers with asynchronous file I/O open download files themselves: after setAsyncOpen(true)
+  // a download stops at openRequest() until the driver reports the result with fileOpened()
+  void setAsyncOpen(bool async) { asyncOpen = async; }
+  const std::string* openRequest() const;
+  void fileOpened(int fileFd, int error, const struct stat *info);
+  int directory() const { return dirFd != -1 ? dirFd : startDirFd; }
+
+  // Event loops never wait for the compress pool: after setPoolWake(fd) a job that isn't done stops the
+  // session with waitingForPool() set, the pool writes to fd once a job is, and the driver runs it again
+  void setPoolWake(int wakeFd) { poolWakeFd = wakeFd; }
+  bool waitingForPool() const { return poolWaiting; }
+
+  int socket() const { return sockfd; }
+  const std::string& address() const { return ipAddress; }
+
+private:
+  enum
+  {
+    STATE_COMMAND, // waiting for a command
+    STATE_CD_NAME, // "cd" prompted for the new directory
+    STATE_DOWNLOAD_NAME, // "download" prompted for the file name
+    STATE_DOWNLOAD_OPEN, // the driver is opening the file (setAsyncOpen() only)
+    STATE_DOWNLOAD_LOAD, // the compress pool is reading the file into the file cache (setPoolWake() only)
+    STATE_DOWNLOAD_REPLY, // "READY <size>" sent, waiting for READY, RANGE or STOP
+    STATE_DOWNLOAD_ACK, // file sent, waiting for the client to confirm it
+    STATE_STAT_PATHS, // "stat-batch" received, its FRAME_DATA path list comes next
+    STATE_SYNC_SIGNATURES, // "sync" received, its FRAME_DATA signatures come next
+    STATE_HAVE_HASHES // "have" received, its FRAME_DATA chunk hashes come next
+  };
+
+  void handleMessage(const std::string &message);
+  void handleStreamRequest(const std::string &message);
+  void handleCommand(const std::string &command);
+  void changeDirectory(const std::string &name);
+  void startDownload(const std::string &name);
+  void fileLoaded();
+  void sendDirListing();
+  void sendDirPage(const std::string &request);
+  void statBatch(const std::string &paths);
+  void startMget(const std::string &patterns);
+  bool matchPattern(const std::string &pattern, std::vector<std::string> &names);
+  void startArchive(const std::string &name);
+  bool enterArchiveDirectory(int dirFd, const std::string &path);
+  bool queueMgetFile();
+  void queueArchiveEntry();
+  void negotiateCodec(const std::string &codecs);
+  void queueWholeFile(off_t fileSize);
+  void submitBlocks();
+  void queueCompressedBlock();
+  bool jobReady(std::future<std::string> &job);
+  void negotiateChecksum(const std::string &algorithms);
+  void startChecksums(off_t offset, off_t length);
+  void queueChecksums();
+  void startSync(off_t fileSize);
+  void submitSegments();
+  void queueSyncSegment();
+  void receiveHashes(const std::string &hashes);
+  void queueDeduplicated(off_t fileSize);
+
+  void startCommand(const std::string &command);
+  void checkAnswered();
+  void addOutput() { countMetric(metrics().outputQueued); output.push_back(OutputItem()); } // counted for the queue depth
+
+  void queueFrame(uint8_t type, const std::string &payload);
+  void queueHeader(uint8_t type, uint8_t flags, uint32_t stream, uint64_t length);
+  void queueMessage(const std::string &message, bool printToScreen);
+  void announceDownload(off_t fileSize);
+  void addStream(off_t fileSize);
+  void queueDownload(off_t offset, off_t length);
+  void dropDownload();
+  int flush();
+  int flushFile(OutputItem &item);
+  int sendCached(OutputItem &item);
+  int sendFileBuffered(OutputItem &item);
+  int sendFileSendfile(OutputItem &item);
+  int sendFileSplice(OutputItem &item);
+  void closePipe();
+
+  int sockfd; // connected socket (The Client Socket)
+  std::string ipAddress; // for output
+  int state; // where the client is in the command protocol
+  bool closing; // "bye" received, close once the goodbye is sent
+  bool readBlocked; // recv() said EAGAIN, wait for setReadable()
+  bool writeBlocked; // send() said EAGAIN, wait for setWritable()
+  bool asyncOpen; // the driver opens download files, see openRequest()
+  int poolWakeFd; // eventfd the compress pool wakes the driver with, -1 to wait for jobs instead (blocking socket)
+  bool poolWaiting; // stopped because the compress pool isn't done with the next piece of the answer
+  int dirFd; // working directory of this client, -1 while it is still the directory the server started in
+  std::string cwd; // path of the working directory, for pwd
+  int downloadFd; // file announced with READY, waiting for the client's answer
+  CachedFilePtr downloadCached; // or its cached contents, instead of downloadFd
+  std::future<std::string> loading; // the compress pool filling the file cache with downloadFd (STATE_DOWNLOAD_LOAD)
+  std::shared_ptr<CachedFilePtr> loaded; // what it cached, empty if the file couldn't be
+  off_t downloadSize; // size announced with READY
+  struct stat downloadInfo; // stat of the announced file, names its version in the compress store
+  bool downloadAtOnce; // "get": the file follows its lookup right away, no READY exchange and no ack
+  bool downloadDedup; // "dget": like "get", but only the chunks the client doesn't hold are sent
+  std::string downloadName; // for output
+  uint32_t replyStream; // stream the request being handled came on, its replies go there (0 for none)
+
+  /*************************************************************************************************
+   * Struct name:       Stream
+   * Description:       A download in flight on a stream, sent STREAM_CHUNK_SIZE bytes per turn
+   *************************************************************************************************/
+  struct Stream
+  {
+    uint32_t id;
+    int fileFd; // the file, or -1 with cached
+    CachedFilePtr cached;
+    off_t offset; // next byte to send
+    off_t remaining; // bytes still to send
+    std::string fileName; // for output
+  };
+  std::deque<Stream> streams; // downloads taking turns, the front one sends the next chunk
+  std::deque<std::string> mgetNames; // files of an mget not queued yet, no command is looked at until it is empty
+
+  /*************************************************************************************************
+   * Struct name:       ArchiveDir
+   * Description:       A directory of a download-dir archive that is being walked
+   *************************************************************************************************/
+  struct ArchiveDir
+  {
+    int dirFd; // the directory, its entries are opened relative to it
+    std::string path; // its path in the archive, ends with "/"
+    std::deque<std::string> names; // entries not archived yet, in name order
+  };
+  std::vector<ArchiveDir> archiveDirs; // directories of a download-dir being walked, innermost last (empty if none)
+  std::string archiveRoot; // for output
+  long long archiveFiles; // files archived so far, for output
+  long long archiveBytes; // bytes of them
+
+  int codec; // CODEC_* whole files are compressed with, picked by "compress" (CODEC_NONE until then)
+
+  /*************************************************************************************************
+   * Struct name:       Compression
+   * Description:       A whole-file download being compressed a block at a time by the compress pool
+   *************************************************************************************************/
+  struct Compression
+  {
+    int fileFd; // the file, or -1 with cached
+    CachedFilePtr cached;
+    off_t size; // bytes of the file
+    off_t next; // first byte not submitted to the pool yet
+    std::deque<std::future<std::string> > blocks; // submitted and not queued yet, in file order (empty if no download)
+    std::string fileName; // for output
+    long long wireBytes; // compressed bytes queued so far, for output
+  };
+  Compression compressing;
+
+  bool checksums; // "checksum crc32c" was negotiated, files and ranges (not on streams or in archives) get a FRAME_CHECKSUM frame
+
+  /*************************************************************************************************
+   * Struct name:       Checksums
+   * Description:       CRC32Cs of a file or range being computed by the compress pool while it is sent
+   *************************************************************************************************/
+  struct Checksums
+  {
+    bool pending; // a FRAME_CHECKSUM frame is still to be queued
+    int fileFd; // a descriptor of the file's own (the sent one is closed once sent), -1 with cached
+    off_t length; // bytes checksummed
+    std::deque<std::future<std::string> > parts; // chunk CRCs of consecutive pieces, in file order
+  };
+  Checksums checksumming;
+
+  std::shared_ptr<SyncIndex> syncRequest; // signatures of a "sync" whose file is being looked up, NULL for other downloads
+
+  /*************************************************************************************************
+   * Struct name:       Syncing
+   * Description:       A "sync" whose delta is being matched a segment at a time by the compress pool
+   *************************************************************************************************/
+  struct Syncing
+  {
+    std::shared_ptr<const SyncIndex> index; // the client's signatures
+    int fileFd; // the file, or -1 with cached
+    CachedFilePtr cached;
+    off_t size; // bytes of the file
+    off_t next; // first byte not submitted to the pool yet
+    std::deque<std::future<std::string> > segments; // submitted and not queued yet, in file order (empty if no sync)
+    std::string fileName; // for output
+    long long wireBytes; // delta bytes queued so far, for output
+  };
+  Syncing syncing;
+
+  std::unordered_set<uint64_t> heldChunks; // hashes of the chunks the client holds, from "have" and earlier dgets
+
+  std::vector<std::pair<int, uint64_t> > answering; // COMMAND_* and metricsClock() of the commands not fully answered yet
+
+  char input[SESSION_INPUT_SIZE]; // bytes received from the client
+  size_t inputStart; // first byte not handed to the parser yet
+  size_t inputEnd; // end of the received bytes
+  FrameParser parser; // splits the input into frames
+  std::string message; // text of the message being received
+  uint8_t messageFlags; // frame flags of the message being received
+  bool messageTooLong; // the message being received does not fit in MAX_MSG_SIZE
+
+  std::deque<OutputItem> output; // replies not fully sent yet
+  std::vector<char> chunk; // COPY_BUFFERED only: file bytes read but not sent yet
+  size_t chunkStart, chunkEnd; // unsent part of chunk
+  int pipeFds[2]; // COPY_SPLICE only: pipe between the file and the socket
+  size_t pipeFill; // bytes sitting in the pipe
+};
+
+void initSessions();
+std::string getIpAddress(sockaddr_in &address);
+bool parseCopyMode(const char *name);
+bool parseRange(const std::string &range, off_t fileSize, off_t &offset, off_t &length);
+bool parsePageRequest(const std::string &request, long long &pageSize, off_t &cursor);
+const char* copyModeName(int mode);
+
+#endif // SESSION_H
@@ -0,0 +1,237 @@
+/********************************************************************************************************
+ * Filename: tarArchive.h
+ * Purpose: The tar (POSIX ustar) format "download-dir" streams a directory tree in, shared by the
+ *          server that writes it and the client that unpacks it as it arrives
+ * Programming Language Used: C++
+ * Format: -> Every entry is a TAR_BLOCK_SIZE byte header followed by the contents of a regular file,
+ *            padded with zeros to a whole block. Directories have no contents.
+ *         -> A path too long for the ustar name and prefix fields, or a size too big for its
+ *            field, comes in a pax extended header (type 'x') right before the entry's own header.
+ *         -> Two blocks of zeros end the archive, so the bytes received can also be saved as a
+ *            .tar file and read by any tar program.
+ *********************************************************************************************************/
+#ifndef TAR_ARCHIVE_H
+#define TAR_ARCHIVE_H
+
+#include <stdint.h>
+#include <stdio.h> // snprintf
+#include <stdlib.h> // strtoull
+#include <string.h>
+#include <string>
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_END_SIZE (2 * TAR_BLOCK_SIZE) // zero blocks after the last entry
+
+// Entry types (typeflag)
+#define TAR_TYPE_FILE '0'
+#define TAR_TYPE_DIR  '5'
+#define TAR_TYPE_PAX  'x' // pax extended header: "<length> <key>=<value>\n" records for the next entry
+
+#define TAR_SIZE_MAX 077777777777ULL // Biggest size the 12 byte octal field holds
+
+/*************************************************************************************************
+ * Struct name:       TarEntry
+ * Description:       What an archive says about one file or directory
+ *************************************************************************************************/
+struct TarEntry
+{
+  std::string path; // relative, "/" separated, directories end with "/"
+  char type; // TAR_TYPE_FILE or TAR_TYPE_DIR
+  uint32_t mode; // permission bits
+  uint64_t size; // bytes of contents, 0 for directories
+  int64_t mtime; // seconds since the epoch
+};
+
+/*************************************************************************************************
+ * Function name:     tarPadding
+ * Description:       Zeros that follow contents of a given size to fill its last block
+ * Parameters:        uint64_t size: Bytes of contents
+ * Return Value:      size_t: number of padding bytes
+ *************************************************************************************************/
+inline size_t tarPadding(uint64_t size)
+{
+  return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}// end tarPadding
+
+/*************************************************************************************************
+ * Function name:     writeTarOctal
+ * Description:       Writes a number as zero padded octal digits followed by a NUL
+ * Parameters:        char field[]: The header field
+                      size_t length: Size of the field, NUL included
+                      uint64_t value: The number, must fit
+ * Return Value:      void(none)
+ *************************************************************************************************/
+inline void writeTarOctal(char field[], size_t length, uint64_t value)
+{
+  field[length - 1] = '\0';
+  for(size_t i = length - 1; i-- > 0; value >>= 3)
+    field[i] = '0' + (value & 7);
+}// end writeTarOctal
+
+/*************************************************************************************************
+ * Function name:     readTarOctal
+ * Description:       Reads an octal header field, leading spaces and a NUL or space end allowed
+ * Parameters:        const char field[]: The header field
+                      size_t length: Size of the field
+ * Return Value:      uint64_t: the number
+ *************************************************************************************************/
+inline uint64_t readTarOctal(const char field[], size_t length)
+{
+  uint64_t value = 0;
+  size_t i = 0;
+  while(i < length && field[i] == ' ')
+    i++;
+  for(; i < length && field[i] >= '0' && field[i] <= '7'; i++)
+    value = (value << 3) | (field[i] - '0');
+  return value;
+}// end readTarOctal
+
+/*************************************************************************************************
+ * Function name:     tarChecksum
+ * Description:       Sum of the bytes of a header with the checksum field counted as spaces
+ * Parameters:        const char block[]: TAR_BLOCK_SIZE header bytes
+ * Return Value:      unsigned: the checksum
+ *************************************************************************************************/
+inline unsigned tarChecksum(const char block[])
+{
+  unsigned sum = 0;
+  for(int i = 0; i < TAR_BLOCK_SIZE; i++)
+    sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)block[i];
+  return sum;
+}// end tarChecksum
+
+/*************************************************************************************************
+ * Function name:     encodeTarBlock
+ * Description:       Fills in one ustar header block
+ * Parameters:        char block[]: TAR_BLOCK_SIZE bytes to fill
+                      const std::string &name, const std::string &prefix: Path split to fit the fields
+                      char type, uint32_t mode, uint64_t size, int64_t mtime: The header fields
+ * Return Value:      void(none)
+ *************************************************************************************************/
+inline void encodeTarBlock(char block[], const std::string &name, const std::string &prefix, char type,
+			   uint32_t mode, uint64_t size, int64_t mtime)
+{
+  memset(block, 0, TAR_BLOCK_SIZE);
+  memcpy(block, name.data(), name.length() < 100 ? name.length() : 100);
+  writeTarOctal(block + 100, 8, mode & 07777);
+  writeTarOctal(block + 108, 8, 0); // uid
+  writeTarOctal(block + 116, 8, 0); // gid
+  writeTarOctal(block + 124, 12, size <= TAR_SIZE_MAX ? size : 0);
+  writeTarOctal(block + 136, 12, mtime > 0 && (uint64_t)mtime <= TAR_SIZE_MAX ? mtime : 0);
+  block[156] = type;
+  memcpy(block + 257, "ustar", 6);
+  memcpy(block + 263, "00", 2);
+  memcpy(block + 345, prefix.data(), prefix.length() < 155 ? prefix.length() : 155);
+  snprintf(block + 148, 8, "%06o", tarChecksum(block));
+  block[155] = ' ';
+}// end encodeTarBlock
+
+/*************************************************************************************************
+ * Function name:     paxRecord
+ * Description:       Formats one pax extended header record, its length counts itself
+ * Parameters:        const std::string &key, const std::string &value: The record
+ * Return Value:      std::string: "<length> <key>=<value>\n"
+ *************************************************************************************************/
+inline std::string paxRecord(const std::string &key, const std::string &value)
+{
+  size_t length = key.length() + value.length() + 3; // ' ', '=' and '\n'
+  size_t digits = 1;
+  while(std::to_string(length + digits).length() > digits)
+    digits++;
+  return std::to_string(length + digits) + " " + key + "=" + value + "\n";
+}// end paxRecord
+
+/*************************************************************************************************
+ * Function name:     encodeTarEntry
+ * Description:       Writes the header of an entry, preceded by a pax extended header when its path
+                      or size don't fit the ustar fields
+ * Parameters:        const TarEntry &entry: The entry
+ * Return Value:      std::string: the header blocks (a multiple of TAR_BLOCK_SIZE bytes)
+ *************************************************************************************************/
+inline std::string encodeTarEntry(const TarEntry &entry)
+{
+  char block[TAR_BLOCK_SIZE];
+  std::string name = entry.path, prefix, records;
+
+  if(name.length() > 100) // split at a '/' so the prefix and the name both fit
+    {
+      size_t slash = name.find('/', name.length() - 101);
+      if(slash != std::string::npos && slash > 0 && slash <= 155 && name.length() - slash - 1 > 0)
+	{
+	  prefix = name.substr(0, slash);
+	  name = name.substr(slash + 1);
+	}
+      else
+	records += paxRecord("path", entry.path);
+    }
+  if(entry.size > TAR_SIZE_MAX)
+    records += paxRecord("size", std::to_string((unsigned long long)entry.size));
+
+  std::string header;
+  if(!records.empty())
+    {
+      encodeTarBlock(block, "PaxHeader", "", TAR_TYPE_PAX, 0644, records.length(), entry.mtime);
+      header.append(block, TAR_BLOCK_SIZE);
+      header += records;
+      header.append(tarPadding(records.length()), '\0');
+    }
+  encodeTarBlock(block, name, prefix, entry.type, entry.mode, entry.size, entry.mtime);
+  header.append(block, TAR_BLOCK_SIZE);
+  return header;
+}// end encodeTarEntry
+
+/*************************************************************************************************
+ * Function name:     decodeTarHeader
+ * Description:       Reads a header block. A pax extended header is reported as an entry of type
+                      TAR_TYPE_PAX whose contents are handed to applyPaxRecords() for the next entry.
+ * Parameters:        const char block[]: TAR_BLOCK_SIZE bytes received
+                      TarEntry &entry: Filled in with the header fields
+ * Return Value:      true:  if the block is a header with a valid checksum
+                      false: otherwise (the zero blocks at the end included)
+ *************************************************************************************************/
+inline bool decodeTarHeader(const char block[], TarEntry &entry)
+{
+  if(readTarOctal(block + 148, 8) != tarChecksum(block))
+    return false;
+
+  std::string name(block, strnlen(block, 100));
+  std::string prefix(block + 345, strnlen(block + 345, 155));
+  entry.path = prefix.empty() ? name : prefix + "/" + name;
+  entry.type = block[156] == '\0' ? TAR_TYPE_FILE : block[156];
+  entry.mode = readTarOctal(block + 100, 8);
+  entry.size = readTarOctal(block + 124, 12);
+  entry.mtime = readTarOctal(block + 136, 12);
+  return true;
+}// end decodeTarHeader
+
+/*************************************************************************************************
+ * Function name:     applyPaxRecords
+ * Description:       Applies the path and size records of a pax extended header to the entry
+                      that follows it, other records are ignored
+ * Parameters:        const std::string &records: Contents of the pax extended header
+                      TarEntry &entry: The decoded header of the next entry
+ * Return Value:      void(none)
+ *************************************************************************************************/
+inline void applyPaxRecords(const std::string &records, TarEntry &entry)
+{
+  size_t at = 0;
+  while(at < records.length())
+    {
+      size_t space = records.find(' ', at);
+      size_t length = strtoull(records.c_str() + at, NULL, 10);
+      if(space == std::string::npos || length == 0 || at + length > records.length())
+	return;
+      std::string record = records.substr(space + 1, at + length - space - 2); // without the '\n'
+      size_t equals = record.find('=');
+      if(equals != std::string::npos)
+	{
+	  if(record.compare(0, equals, "path") == 0)
+	    entry.path = record.substr(equals + 1);
+	  else if(record.compare(0, equals, "size") == 0)
+	    entry.size = strtoull(record.c_str() + equals + 1, NULL, 10);
+	}
+      at += length;
+    }
+}// end applyPaxRecords
+
+#endif // TAR_ARCHIVE_H
@@ -0,0 +1,878 @@
+/********************************************************************************************************
+ * Filename: uringLoop.cpp
+ * Purpose: io_uring server model (see uringLoop.h). Each thread owns one ring and the connections it
+ *          accepts. Nothing is done with a syscall of its own: the thread queues accept, recv, send,
+ *          openat, statx and read/splice submissions while it handles completions, and hands the
+ *          whole batch to the kernel with the same io_uring_enter() that waits for the next
+ *          completions. Sessions (session.h) only parse messages and queue replies here. A session
+ *          waiting for the compress pool is run again when a read of the loop's eventfd completes,
+ *          the pool writes to it whenever a job is done.
+ *          The ring is set up with the raw syscalls, no library is needed.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h> // uintptr_t
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h> // statx
+#include <sys/sysmacros.h> // makedev
+#include <sys/mman.h> // mmap
+#include <sys/syscall.h> // __NR_io_uring_*
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <stdio.h> // perror
+#include <errno.h>
+#include <unistd.h>
+#include <iostream>
+#include <string.h> // strerror
+#include <string>
+#include <thread>
+#include <vector>
+#include <unordered_set>
+#include "session.h"
+#include "logger.h"
+#include "eventLoop.h" // raiseFileLimit
+#include "uringLoop.h"
+using namespace std;
+
+// What a completion belongs to
+#define OP_ACCEPT     0 // new connection
+#define OP_RECV       1 // bytes from the client
+#define OP_SEND       2 // queued bytes, or file bytes read by OP_READ
+#define OP_READ       3 // COPY_BUFFERED: file -> buffer
+#define OP_SPLICE_IN  4 // file -> pipe, linked to the OP_SPLICE_OUT that drains it
+#define OP_SPLICE_OUT 5 // pipe -> socket
+#define OP_OPEN       6 // download file opened
+#define OP_STATX      7 // size of the opened download file
+#define OP_CANCEL     8 // the recv of a closed connection was cancelled
+#define OP_WAKE       9 // the compress pool finished jobs
+
+struct UringConnection;
+
+/*************************************************************************************************
+ * Struct name:       UringOp
+ * Description:       What a submission was for, its address is the user_data of the completion
+ *************************************************************************************************/
+struct UringOp
+{
+  int type; // one of the OP_ constants
+  UringConnection *conn; // NULL for OP_ACCEPT and OP_WAKE
+};
+
+/*************************************************************************************************
+ * Struct name:       UringConnection
+ * Description:       A session and the I/O the ring is doing for it. At most one recv, one
+                      output step (a send, a read, or a splice pair) and one open/statx are in
+                      flight at a time, the buffers they use belong to the connection, so it is
+                      only deleted once every submission came back.
+ *************************************************************************************************/
+struct UringConnection
+{
+  Session *session;
+  UringOp recvOp, sendOp, readOp, spliceInOp, spliceOutOp, openOp, statxOp, cancelOp;
+  int inFlight; // submissions not completed yet
+  bool receiving; // a recv is in flight
+  int sending; // output submissions in flight (2 for a splice pair)
+  bool opening; // the download file is being opened/stat'ed
+  bool closed; // finished, deleted once inFlight is 0
+  bool splicedFile; // the splice in flight started at the file, not at bytes left in the pipe
+  int spliceIn, spliceOut; // results of the splice pair in flight
+  int pipeFds[2]; // COPY_SPLICE only: pipe between the file and the socket
+  size_t pipeFill; // bytes sitting in the pipe
+  vector<char> chunk; // COPY_BUFFERED only: file bytes read but not sent yet
+  size_t chunkStart, chunkEnd; // unsent part of chunk
+  int openFd; // download file opened, waiting for its statx
+  struct statx fileStat; // filled by OP_STATX
+
+  UringConnection(Session *session);
+};
+
+/*************************************************************************************************
+ * Struct name:       Ring
+ * Description:       The parts of an io_uring shared with the kernel
+ *************************************************************************************************/
+struct Ring
+{
+  int fd; // from io_uring_setup()
+  unsigned *sqHead, *sqTail, *sqArray; // submission queue
+  unsigned sqMask, sqEntries;
+  struct io_uring_sqe *sqes;
+  unsigned *cqHead, *cqTail; // completion queue
+  unsigned cqMask;
+  struct io_uring_cqe *cqes;
+  unsigned toSubmit; // submissions queued since the last io_uring_enter()
+};
+
+struct UringLoop
+{
+  int id; // number of the thread running the loop
+  Ring ring;
+  int listeningSock; // shared by all loops, every loop keeps one accept in flight on it
+  UringOp acceptOp;
+  struct sockaddr_in acceptAddress; // filled by the accept in flight
+  socklen_t acceptLength;
+  long connections; // connections currently owned by this loop
+  int wakeFd; // eventfd the compress pool writes to when a job of one of the loop's sessions is done
+  UringOp wakeOp; // the read of wakeFd, always in flight
+  uint64_t jobsDone; // filled by that read
+  unordered_set<UringConnection*> poolWaiters; // connections stopped until the compress pool is done with a job of theirs
+};
+
+bool initRing(Ring &ring);
+bool supportsOps(int ringFd);
+struct io_uring_sqe* getSqe(Ring &ring);
+void makeRoom(Ring &ring, unsigned needed);
+void submitRing(Ring &ring, unsigned minComplete);
+void uringLoopThread(UringLoop *loop);
+void submitAccept(UringLoop &loop);
+void acceptCompleted(UringLoop &loop, int result);
+void submitWake(UringLoop &loop);
+void wakeCompleted(UringLoop &loop, int result);
+void handleCompletion(UringLoop &loop, UringOp *op, int result);
+bool outputCompleted(UringConnection *conn, int type, int result);
+bool openCompleted(UringLoop &loop, UringConnection *conn, int type, int result);
+void advance(UringLoop &loop, UringConnection *conn);
+struct io_uring_sqe* queueOp(UringLoop &loop, UringOp &op, int opcode, int fd);
+bool submitOutput(UringLoop &loop, UringConnection *conn);
+void closeConnection(UringLoop &loop, UringConnection *conn);
+void closeUringPipe(UringConnection *conn);
+
+/********************************************************************************************************************************
+ * Function name:     runUringLoops
+ * Description:       Serves clients with numThreads io_uring loops, the calling thread runs the first one. Returns only if
+                      io_uring can't be used (too old a kernel, or disabled), so the caller can serve with epoll instead.
+ * Parameters:        int listeningSock: The (blocking) listening socket from connectToClient()
+                      int numThreads: How many loops (threads) to run
+ * Return Value:      false: io_uring is not available, nothing was started
+********************************************************************************************************************************/
+bool runUringLoops(int listeningSock, int numThreads)
+{
+  vector<UringLoop> loops(numThreads);
+  for(int i = 0; i < numThreads; i++)
+    {
+      if(!initRing(loops[i].ring))
+	{
+	  for(int j = 0; j < i; j++)
+	    close(loops[j].ring.fd);
+	  return false;
+	}
+      loops[i].id = i;
+      loops[i].listeningSock = listeningSock;
+      loops[i].acceptOp.type = OP_ACCEPT;
+      loops[i].acceptOp.conn = NULL;
+      loops[i].connections = 0;
+      loops[i].wakeOp.type = OP_WAKE;
+      loops[i].wakeOp.conn = NULL;
+      // Blocking, so its read waits in the ring instead of failing with EAGAIN
+      if((loops[i].wakeFd = eventfd(0, EFD_CLOEXEC)) == -1)
+	{
+	  perror("eventfd");
+	  exit(EXIT_FAILURE);
+	}
+    }
+  raiseFileLimit();
+
+  cout << "Serving With " << numThreads << " io_uring Thread(s)" << endl;
+  vector<thread> threads;
+  for(int i = 1; i < numThreads; i++)
+    threads.push_back(thread(uringLoopThread, &loops[i]));
+  uringLoopThread(&loops[0]);
+  return true;
+}// end runUringLoops
+/********************************************************************************************************************************
+ * Function name:     initRing
+ * Description:       Creates an io_uring and maps its queues, the kernel has to support every operation the loop uses and
+                      must never drop a completion
+ * Parameters:        Ring &ring: The ring to set up
+ * Return Value:      true:  if the ring is ready
+                      false: if io_uring can't be used (reason printed)
+********************************************************************************************************************************/
+bool initRing(Ring &ring)
+{
+  struct io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE; // every connection can have a few completions waiting at once
+  params.cq_entries = URING_ENTRIES * 4;
+  if((ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) == -1)
+    {
+      perror("io_uring_setup");
+      return false;
+    }
+  if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) || !supportsOps(ring.fd))
+    {
+      cerr << "io_uring Is Missing Features This Server Needs" << endl;
+      close(ring.fd);
+      return false;
+    }
+
+  // Both queues live in one mapping, the submission entries in another
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  char *queues = (char *)mmap(NULL, sqSize > cqSize ? sqSize : cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			      ring.fd, IORING_OFF_SQ_RING);
+  void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ring.fd, IORING_OFF_SQES);
+  if(queues == MAP_FAILED || sqes == MAP_FAILED)
+    {
+      perror("Couldn't Map io_uring");
+      close(ring.fd);
+      return false;
+    }
+
+  ring.sqHead = (unsigned *)(queues + params.sq_off.head);
+  ring.sqTail = (unsigned *)(queues + params.sq_off.tail);
+  ring.sqArray = (unsigned *)(queues + params.sq_off.array);
+  ring.sqMask = *(unsigned *)(queues + params.sq_off.ring_mask);
+  ring.sqEntries = *(unsigned *)(queues + params.sq_off.ring_entries);
+  ring.sqes = (struct io_uring_sqe *)sqes;
+  ring.cqHead = (unsigned *)(queues + params.cq_off.head);
+  ring.cqTail = (unsigned *)(queues + params.cq_off.tail);
+  ring.cqMask = *(unsigned *)(queues + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(queues + params.cq_off.cqes);
+  ring.toSubmit = 0;
+  return true;
+}// end initRing
+/********************************************************************************************************************************
+ * Function name:     supportsOps
+ * Description:       Asks the kernel whether it knows every operation the loop submits (splice and openat/statx came
+                      later than accept/recv/send)
+ * Parameters:        int ringFd: The new ring
+ * Return Value:      true:  if all of them are supported
+                      false: otherwise
+********************************************************************************************************************************/
+bool supportsOps(int ringFd)
+{
+  static const int needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_SPLICE,
+				IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_ASYNC_CANCEL };
+  vector<char> buffer(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op), 0);
+  struct io_uring_probe *probe = (struct io_uring_probe *)&buffer[0];
+
+  if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, 256) == -1)
+    return false;
+  for(size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++)
+    if(needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+      return false;
+  return true;
+}// end supportsOps
+/********************************************************************************************************************************
+ * Function name:     getSqe
+ * Description:       Takes the next free submission queue entry, cleared. It is published right away, which is safe because
+                      the kernel only looks at the queue during io_uring_enter() (no SQPOLL) and that is only called once the
+                      entry is filled in. A full queue is submitted first.
+ * Parameters:        Ring &ring: The ring to submit to
+ * Return Value:      struct io_uring_sqe*: the entry to fill in
+********************************************************************************************************************************/
+struct io_uring_sqe* getSqe(Ring &ring)
+{
+  makeRoom(ring, 1);
+
+  unsigned tail = *ring.sqTail;
+  unsigned index = tail & ring.sqMask;
+  struct io_uring_sqe *sqe = &ring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring.sqArray[index] = index;
+  __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+  ring.toSubmit++;
+  return sqe;
+}// end getSqe
+/********************************************************************************************************************************
+ * Function name:     makeRoom
+ * Description:       Makes sure the submission queue has room for a number of entries, submitting what is queued if not.
+                      Linked entries must be submitted together, so they make room for the whole link first.
+ * Parameters:        Ring &ring: The ring to submit to
+                      unsigned needed: How many entries will be taken
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void makeRoom(Ring &ring, unsigned needed)
+{
+  while(*ring.sqTail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) + needed > ring.sqEntries)
+    submitRing(ring, 0);
+}// end makeRoom
+/********************************************************************************************************************************
+ * Function name:     submitRing
+ * Description:       Hands every queued submission to the kernel and, if asked to, waits for completions in the same call
+ * Parameters:        Ring &ring: The ring
+                      unsigned minComplete: Completions to wait for (0: don't wait)
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void submitRing(Ring &ring, unsigned minComplete)
+{
+  while(true)
+    {
+      int submitted = syscall(__NR_io_uring_enter, ring.fd, ring.toSubmit, minComplete,
+			      minComplete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if(submitted == -1)
+	{
+	  if(errno == EINTR)
+	    continue;
+	  if(errno == EAGAIN || errno == EBUSY) // completions have to be reaped before more can be submitted
+	    return;
+	  perror("io_uring_enter");
+	  exit(EXIT_FAILURE);
+	}
+      ring.toSubmit -= submitted;
+      return;
+    }
+}// end submitRing
+/********************************************************************************************************************************
+ * Function name:     uringLoopThread
+ * Description:       Submits what the last completions asked for, waits for the next ones and handles them, forever
+ * Parameters:        UringLoop *loop: The loop to run
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void uringLoopThread(UringLoop *loop)
+{
+  Ring &ring = loop->ring;
+
+  submitAccept(*loop);
+  submitWake(*loop);
+  while(true)
+    {
+      submitRing(ring, 1);
+
+      // Handle every completion there is, whatever they submit goes out with the next io_uring_enter()
+      unsigned head = *ring.cqHead;
+      while(head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+	{
+	  struct io_uring_cqe *cqe = &ring.cqes[head & ring.cqMask];
+	  UringOp *op = (UringOp *)(uintptr_t)cqe->user_data;
+	  int result = cqe->res;
+	  __atomic_store_n(ring.cqHead, ++head, __ATOMIC_RELEASE);
+	  handleCompletion(*loop, op, result);
+	}
+    }
+}// end uringLoopThread
+/********************************************************************************************************************************
+ * Function name:     submitAccept
+ * Description:       Queues the accept of the next connection, every loop keeps exactly one in flight
+ * Parameters:        UringLoop &loop: The loop that will own the connection
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void submitAccept(UringLoop &loop)
+{
+  loop.acceptLength = sizeof(loop.acceptAddress);
+
+  struct io_uring_sqe *sqe = getSqe(loop.ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = loop.listeningSock;
+  sqe->addr = (uintptr_t)&loop.acceptAddress;
+  sqe->addr2 = (uintptr_t)&loop.acceptLength;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = (uintptr_t)&loop.acceptOp;
+}// end submitAccept
+/********************************************************************************************************************************
+ * Function name:     acceptCompleted
+ * Description:       Starts a session for a new connection and queues the next accept
+ * Parameters:        UringLoop &loop: The loop that owns the connection
+                      int result: The connected socket, or -errno
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void acceptCompleted(UringLoop &loop, int result)
+{
+  if(result >= 0)
+    {
+      Session *session = new Session(result, getIpAddress(loop.acceptAddress));
+      session->setAsyncOpen(true); // download files are opened through the ring too
+      session->setPoolWake(loop.wakeFd);
+      loop.connections++;
+      advance(loop, new UringConnection(session)); // Send the hello message right away
+    }
+  else if(result != -EINTR && result != -ECONNABORTED) // Out of descriptors, the connection stays in the backlog
+    LOG(LOG_ERROR, "accept: %s", strerror(-result));
+
+  submitAccept(loop);
+}// end acceptCompleted
+/********************************************************************************************************************************
+ * Function name:     submitWake
+ * Description:       Queues the read of the loop's eventfd, every loop keeps exactly one in flight
+ * Parameters:        UringLoop &loop: The loop
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void submitWake(UringLoop &loop)
+{
+  struct io_uring_sqe *sqe = getSqe(loop.ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = loop.wakeFd;
+  sqe->addr = (uintptr_t)&loop.jobsDone;
+  sqe->len = sizeof(loop.jobsDone);
+  sqe->off = (uint64_t)-1; // no file position on an eventfd
+  sqe->user_data = (uintptr_t)&loop.wakeOp;
+}// end submitWake
+/********************************************************************************************************************************
+ * Function name:     wakeCompleted
+ * Description:       Moves on every connection that was waiting for the compress pool (those whose job is still not done
+                      wait again) and queues the next read of the eventfd
+ * Parameters:        UringLoop &loop: The loop woken by the pool
+                      int result: Bytes read, or -errno
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void wakeCompleted(UringLoop &loop, int result)
+{
+  if(result < 0 && result != -EINTR)
+    LOG(LOG_ERROR, "Reading The Compress Pool eventfd Failed ! : %s", strerror(-result));
+
+  unordered_set<UringConnection*> waiters;
+  waiters.swap(loop.poolWaiters);
+  for(UringConnection *conn : waiters)
+    advance(loop, conn);
+  submitWake(loop);
+}// end wakeCompleted
+/********************************************************************************************************************************
+ * Function name:     UringConnection
+ * Description:       Wraps a new session, nothing is in flight yet
+ * Parameters:        Session *session: The session, deleted with the connection
+ * Return Value:      none
+********************************************************************************************************************************/
+UringConnection::UringConnection(Session *session)
+  : session(session), inFlight(0), receiving(false), sending(0), opening(false), closed(false), splicedFile(false),
+    spliceIn(0), spliceOut(0), pipeFill(0), chunkStart(0), chunkEnd(0), openFd(-1)
+{
+  UringOp *ops[] = { &recvOp, &sendOp, &readOp, &spliceInOp, &spliceOutOp, &openOp, &statxOp, &cancelOp };
+  int types[] = { OP_RECV, OP_SEND, OP_READ, OP_SPLICE_IN, OP_SPLICE_OUT, OP_OPEN, OP_STATX, OP_CANCEL };
+  for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+      ops[i]->type = types[i];
+      ops[i]->conn = this;
+    }
+  pipeFds[0] = pipeFds[1] = -1;
+}
+/********************************************************************************************************************************
+ * Function name:     handleCompletion
+ * Description:       Applies the result of a finished submission to its connection and moves the connection on
+ * Parameters:        UringLoop &loop: The loop that owns the connection
+                      UringOp *op: What the submission was for
+                      int result: Its result, -errno on failure
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void handleCompletion(UringLoop &loop, UringOp *op, int result)
+{
+  if(op->type == OP_ACCEPT)
+    {
+      acceptCompleted(loop, result);
+      return;
+    }
+  if(op->type == OP_WAKE)
+    {
+      wakeCompleted(loop, result);
+      return;
+    }
+
+  UringConnection *conn = op->conn;
+  conn->inFlight--;
+  if(conn->closed) // only waiting for its submissions to come back
+    {
+      if(op->type == OP_OPEN && result >= 0)
+	conn->openFd = result; // closed with the connection
+    }
+  else
+    {
+      bool healthy = true;
+      switch(op->type)
+	{
+	case OP_RECV:
+	  conn->receiving = false;
+	  if(result <= 0)
+	    {
+	      if(result == 0) // Client hung up without saying bye
+		LOG(LOG_INFO, "Client Closed The Connection.");
+	      else
+		LOG(LOG_ERROR, "Recieving Failed ! : %s", strerror(-result));
+	      healthy = false;
+	    }
+	  else
+	    conn->session->inputReceived(result);
+	  break;
+	case OP_OPEN:
+	case OP_STATX:
+	  healthy = openCompleted(loop, conn, op->type, result);
+	  break;
+	default:
+	  healthy = outputCompleted(conn, op->type, result);
+	  break;
+	}
+      if(!healthy)
+	closeConnection(loop, conn);
+    }
+
+  advance(loop, conn);
+}// end handleCompletion
+/********************************************************************************************************************************
+ * Function name:     outputCompleted
+ * Description:       Advances the front output item past the bytes a send, read or splice moved
+ * Parameters:        UringConnection *conn: The connection
+                      int type: OP_SEND, OP_READ, OP_SPLICE_IN or OP_SPLICE_OUT
+                      int result: Bytes moved, -errno on failure
+ * Return Value:      true:  if the download can go on
+                      false: if the connection is broken
+********************************************************************************************************************************/
+bool outputCompleted(UringConnection *conn, int type, int result)
+{
+  OutputItem &item = conn->session->nextOutput();
+
+  if(type == OP_SPLICE_IN || type == OP_SPLICE_OUT)
+    {
+      if(type == OP_SPLICE_IN)
+	conn->spliceIn = result;
+      else
+	conn->spliceOut = result;
+      if(--conn->sending > 0) // the other half of the pair is still in flight
+	return true;
+
+      if(conn->splicedFile)
+	{
+	  if(conn->spliceIn < 0) // the pipe -> socket half was cancelled with it
+	    {
+	      if(conn->spliceIn == -EINVAL || conn->spliceIn == -EOPNOTSUPP)
+		{
+		  closeUringPipe(conn); // nothing is in the pipe, safe to fall back
+		  item.mode = COPY_BUFFERED;
+		  return true;
+		}
+	      LOG(LOG_ERROR, "splice Failed ! : %s", strerror(-conn->spliceIn));
+	      return false;
+	    }
+	  if(conn->spliceIn == 0) // The file shrank after stat(), the client is still owed bytes
+	    {
+	      LOG(LOG_ERROR, "File shrank during download");
+	      return false;
+	    }
+	  item.offset += conn->spliceIn;
+	  item.remaining -= conn->spliceIn;
+	  conn->pipeFill += conn->spliceIn;
+	}
+      if(conn->spliceOut == -ECANCELED) // the file half came up short, the pipe is drained on its own next
+	return true;
+      if(conn->spliceOut <= 0)
+	{
+	  LOG(LOG_ERROR, "splice Failed ! : %s", strerror(conn->spliceOut < 0 ? -conn->spliceOut : EPIPE));
+	  return false;
+	}
+      conn->pipeFill -= conn->spliceOut;
+      countMetric(metrics().bytesSent, conn->spliceOut);
+      return true;
+    }
+
+  conn->sending = 0;
+  if(result < 0)
+    {
+      LOG(LOG_ERROR, "%s : %s", type == OP_READ ? "Reading File Failed !" : "Sending Failed !", strerror(-result));
+      return false;
+    }
+  if(type != OP_READ)
+    countMetric(metrics().bytesSent, result);
+  if(type == OP_READ)
+    {
+      if(result == 0) // The file shrank after stat(), the client is still owed bytes
+	{
+	  LOG(LOG_ERROR, "File shrank during download");
+	  return false;
+	}
+      conn->chunkStart = 0;
+      conn->chunkEnd = result;
+      item.offset += result;
+      item.remaining -= result;
+    }
+  else if(item.cached)
+    {
+      item.offset += result;
+      item.remaining -= result;
+      if(item.remaining == 0)
+	conn->session->outputSent();
+    }
+  else if(item.fileFd == -1)
+    {
+      item.sent += result;
+      if(item.sent == item.bytes.length())
+	conn->session->outputSent();
+    }
+  else
+    conn->chunkStart += result;
+  return true;
+}// end outputCompleted
+/********************************************************************************************************************************
+ * Function name:     openCompleted
+ * Description:       Continues opening a download file: an opened file is stat'ed through the descriptor (so the size is
+                      the size of the file that was opened), once both are done the session gets the result
+ * Parameters:        UringLoop &loop: The loop that owns the connection
+                      UringConnection *conn: The connection
+                      int type: OP_OPEN or OP_STATX
+                      int result: The file descriptor (OP_OPEN), 0 (OP_STATX), or -errno
+ * Return Value:      true (a failed open is reported to the client, not a broken connection)
+********************************************************************************************************************************/
+bool openCompleted(UringLoop &loop, UringConnection *conn, int type, int result)
+{
+  if(type == OP_OPEN && result >= 0)
+    {
+      conn->openFd = result;
+      struct io_uring_sqe *sqe = queueOp(loop, conn->statxOp, IORING_OP_STATX, result);
+      sqe->addr = (uintptr_t)""; // AT_EMPTY_PATH: the descriptor itself
+      sqe->statx_flags = AT_EMPTY_PATH;
+      sqe->len = STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME; // what the file cache tells versions apart by
+      sqe->off = (uintptr_t)&conn->fileStat;
+      return true;
+    }
+
+  conn->opening = false;
+  if(result < 0)
+    conn->session->fileOpened(conn->openFd, -result, NULL);
+  else
+    {
+      struct stat info; // the parts of statx the session looks at
+      memset(&info, 0, sizeof(info));
+      info.st_dev = makedev(conn->fileStat.stx_dev_major, conn->fileStat.stx_dev_minor);
+      info.st_ino = conn->fileStat.stx_ino;
+      info.st_mode = conn->fileStat.stx_mode;
+      info.st_size = conn->fileStat.stx_size;
+      info.st_mtim.tv_sec = conn->fileStat.stx_mtime.tv_sec;
+      info.st_mtim.tv_nsec = conn->fileStat.stx_mtime.tv_nsec;
+      conn->session->fileOpened(conn->openFd, 0, &info);
+    }
+  conn->openFd = -1; // the session owns it now
+  return true;
+}// end openCompleted
+/********************************************************************************************************************************
+ * Function name:     advance
+ * Description:       Moves a connection on as far as it goes without waiting: sends queued output before the next command
+                      is looked at (same order as Session::run()), sends batch files and stream chunks while no command
+                      waits, starts the open of a requested download and keeps a recv in flight while there is room for
+                      input. A closed connection is deleted once nothing is in flight.
+ * Parameters:        UringLoop &loop: The loop that owns the connection
+                      UringConnection *conn: The connection
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void advance(UringLoop &loop, UringConnection *conn)
+{
+  Session *session = conn->session;
+
+  while(!conn->closed && conn->sending == 0 && !conn->opening)
+    {
+      if(session->hasOutput())
+	{
+	  if(submitOutput(loop, conn))
+	    break;
+	  continue; // an item finished without any I/O
+	}
+      if(session->isClosing())
+	{
+	  closeConnection(loop, conn);
+	  break;
+	}
+      // A new command first, else the next file of an mget or download-dir, else the next stream's turn, unless the
+      // compress pool holds up the answer being sent (wakeCompleted() moves the connection on once it is done)
+      if(!session->processInput() && !session->queueBatchItem())
+	{
+	  if(session->waitingForPool())
+	    {
+	      loop.poolWaiters.insert(conn);
+	      break;
+	    }
+	  if(!session->queueStreamChunk())
+	    break;
+	}
+
+      const string *fileName = session->openRequest();
+      if(fileName != NULL)
+	{
+	  // O_NONBLOCK so a fifo can't hang the server, it makes no difference to regular files
+	  struct io_uring_sqe *sqe = queueOp(loop, conn->openOp, IORING_OP_OPENAT, session->directory());
+	  sqe->addr = (uintptr_t)fileName->c_str(); // kept by the session until fileOpened()
+	  sqe->open_flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;
+	  conn->opening = true;
+	}
+    }
+
+  if(!conn->closed && !conn->receiving)
+    {
+      size_t room;
+      char *space = session->inputSpace(room);
+      if(room > 0) // a full buffer is only drained by processInput(), which waits for the output
+	{
+	  struct io_uring_sqe *sqe = queueOp(loop, conn->recvOp, IORING_OP_RECV, session->socket());
+	  sqe->addr = (uintptr_t)space;
+	  sqe->len = room;
+	  conn->receiving = true;
+	}
+    }
+
+  if(conn->closed && conn->inFlight == 0)
+    {
+      closeUringPipe(conn);
+      if(conn->openFd != -1)
+	close(conn->openFd);
+      loop.poolWaiters.erase(conn);
+      delete session; // closes the socket
+      delete conn;
+      loop.connections--;
+    }
+}// end advance
+/********************************************************************************************************************************
+ * Function name:     queueOp
+ * Description:       Queues a submission for a connection, the completion comes back to handleCompletion() with op
+ * Parameters:        UringLoop &loop: The loop that owns the connection
+                      UringOp &op: One of the connection's operations
+                      int opcode: IORING_OP_ of the submission
+                      int fd: The descriptor it works on
+ * Return Value:      struct io_uring_sqe*: the entry, for the opcode's own fields
+********************************************************************************************************************************/
+struct io_uring_sqe* queueOp(UringLoop &loop, UringOp &op, int opcode, int fd)
+{
+  struct io_uring_sqe *sqe = getSqe(loop.ring);
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = (uintptr_t)&op;
+  op.conn->inFlight++;
+  return sqe;
+}// end queueOp
+/********************************************************************************************************************************
+ * Function name:     submitOutput
+ * Description:       Queues the next step of the front output item: a send of queued bytes or cached contents, a splice
+                      pair (file -> pipe linked to pipe -> socket, so one submission moves a piece of the file all the way)
+                      or a read of the file into the buffer followed by a send. io_uring has no sendfile, so COPY_SENDFILE
+                      downloads use the splice pair, which copies as little. Items that are already finished are dropped
+                      instead.
+ * Parameters:        UringLoop &loop: The loop that owns the connection
+                      UringConnection *conn: The connection
+ * Return Value:      true:  if a submission was queued
+                      false: if the front item was finished and dropped
+********************************************************************************************************************************/
+bool submitOutput(UringLoop &loop, UringConnection *conn)
+{
+  OutputItem &item = conn->session->nextOutput();
+  int sockfd = conn->session->socket();
+  struct io_uring_sqe *sqe;
+
+  if(item.cached) // straight from the file cache
+    {
+      if(item.remaining == 0)
+	{
+	  conn->session->outputSent();
+	  return false;
+	}
+      sqe = queueOp(loop, conn->sendOp, IORING_OP_SEND, sockfd);
+      sqe->addr = (uintptr_t)(item.cached->data.data() + item.offset);
+      sqe->len = item.remaining;
+      sqe->msg_flags = MSG_NOSIGNAL;
+      conn->sending = 1;
+      return true;
+    }
+  if(item.fileFd == -1)
+    {
+      sqe = queueOp(loop, conn->sendOp, IORING_OP_SEND, sockfd);
+      sqe->addr = (uintptr_t)(item.bytes.data() + item.sent);
+      sqe->len = item.bytes.length() - item.sent;
+      sqe->msg_flags = MSG_NOSIGNAL | (conn->session->moreOutput() ? MSG_MORE : 0); // a header waits for its file
+      conn->sending = 1;
+      return true;
+    }
+
+  if(item.mode == COPY_SENDFILE)
+    item.mode = COPY_SPLICE;
+  if(item.mode == COPY_SPLICE && conn->pipeFds[0] == -1)
+    {
+      if(pipe2(conn->pipeFds, O_CLOEXEC) == -1)
+	{
+	  LOG(LOG_ERROR, "Couldn't Create Pipe For splice: %m");
+	  conn->pipeFds[0] = conn->pipeFds[1] = -1;
+	  item.mode = COPY_BUFFERED;
+	}
+      else
+	fcntl(conn->pipeFds[1], F_SETPIPE_SZ, SPLICE_SIZE); // Bigger pipe, fewer trips (best effort)
+    }
+
+  if(item.mode == COPY_SPLICE)
+    {
+      if(item.remaining == 0 && conn->pipeFill == 0)
+	{
+	  closeUringPipe(conn); // idle connections don't hold on to pipes
+	  conn->session->outputSent();
+	  return false;
+	}
+
+      size_t toMove = conn->pipeFill;
+      conn->splicedFile = conn->pipeFill == 0; // the pipe has to be drained before the next file read
+      conn->sending = conn->splicedFile ? 2 : 1;
+      if(conn->splicedFile)
+	{
+	  toMove = item.remaining < SPLICE_SIZE ? (size_t)item.remaining : SPLICE_SIZE;
+	  makeRoom(loop.ring, 2); // a link only holds within one submission
+	  sqe = queueOp(loop, conn->spliceInOp, IORING_OP_SPLICE, conn->pipeFds[1]);
+	  sqe->splice_fd_in = item.fileFd;
+	  sqe->splice_off_in = item.offset;
+	  sqe->off = (uint64_t)-1; // no offset on the pipe
+	  sqe->len = toMove;
+	  sqe->splice_flags = SPLICE_F_MOVE;
+	  sqe->flags = IOSQE_IO_LINK; // a short or failed file splice cancels the socket half
+	}
+      sqe = queueOp(loop, conn->spliceOutOp, IORING_OP_SPLICE, sockfd);
+      sqe->splice_fd_in = conn->pipeFds[0];
+      sqe->splice_off_in = (uint64_t)-1;
+      sqe->off = (uint64_t)-1;
+      sqe->len = toMove;
+      sqe->splice_flags = SPLICE_F_MOVE;
+      return true;
+    }
+
+  // COPY_BUFFERED, the buffer only exists while a buffered download is in progress
+  if(conn->chunkStart < conn->chunkEnd)
+    {
+      sqe = queueOp(loop, conn->sendOp, IORING_OP_SEND, sockfd);
+      sqe->addr = (uintptr_t)&conn->chunk[conn->chunkStart];
+      sqe->len = conn->chunkEnd - conn->chunkStart;
+      sqe->msg_flags = MSG_NOSIGNAL;
+    }
+  else if(item.remaining > 0)
+    {
+      if(conn->chunk.empty())
+	conn->chunk.resize(CHUNK_SIZE);
+      sqe = queueOp(loop, conn->readOp, IORING_OP_READ, item.fileFd);
+      sqe->addr = (uintptr_t)&conn->chunk[0];
+      sqe->len = item.remaining < CHUNK_SIZE ? (size_t)item.remaining : CHUNK_SIZE;
+      sqe->off = item.offset;
+    }
+  else
+    {
+      vector<char>().swap(conn->chunk);
+      conn->chunkStart = conn->chunkEnd = 0;
+      conn->session->outputSent();
+      return false;
+    }
+  conn->sending = 1;
+  return true;
+}// end submitOutput
+/********************************************************************************************************************************
+ * Function name:     closeConnection
+ * Description:       Marks a connection finished and cancels its recv, advance() deletes it once nothing is in flight. An
+                      output step or open in flight finishes on its own.
+ * Parameters:        UringLoop &loop: The loop that owns the connection
+                      UringConnection *conn: The finished connection
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void closeConnection(UringLoop &loop, UringConnection *conn)
+{
+  conn->closed = true;
+  if(conn->receiving)
+    {
+      struct io_uring_sqe *sqe = queueOp(loop, conn->cancelOp, IORING_OP_ASYNC_CANCEL, -1);
+      sqe->addr = (uintptr_t)&conn->recvOp;
+    }
+}// end closeConnection
+/********************************************************************************************************************************
+ * Function name:     closeUringPipe
+ * Description:       Closes the splice pipe of a connection, if there is one
+ * Parameters:        UringConnection *conn: The connection
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void closeUringPipe(UringConnection *conn)
+{
+  if(conn->pipeFds[0] != -1)
+    {
+      close(conn->pipeFds[0]);
+      close(conn->pipeFds[1]);
+      conn->pipeFds[0] = conn->pipeFds[1] = -1;
+    }
+  conn->pipeFill = 0;
+}// end closeUringPipe
@@ -0,0 +1,15 @@
+/********************************************************************************************************
+ * Filename: uringLoop.h
+ * Purpose: io_uring server model: accepts, receives, sends, download opens/stats and file reads or
+ *          splices are all submitted to one io_uring per thread, so a busy loop pays one
+ *          io_uring_enter() for a whole batch of operations instead of a syscall for each
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#define URING_ENTRIES 1024 // submission queue entries per ring, the completion queue gets four times as many
+
+bool runUringLoops(int listeningSock, int numThreads);
+
+#endif // URING_LOOP_H
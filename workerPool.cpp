@@ -0,0 +1,282 @@
+/********************************************************************************************************
+ * Filename: workerPool.cpp
+ * Purpose: The fork server model (see workerPool.h). The supervisor forks every worker up front and
+ *          then only sleeps in sigtimedwait() until SIGCHLD says a worker is gone, reaps it and forks
+ *          its replacement into the same slot. The workers block in accept() on the listening socket
+ *          they inherited, the kernel hands each new connection to one of them. Slot i counts in metrics
+ *          shard i (see metrics.h), whichever worker it has.
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h> // shared slots
+#include <sys/wait.h>
+#include <sys/prctl.h> // PR_SET_PDEATHSIG
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h> // perror
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <iostream>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "session.h"
+#include "metrics.h"
+#include "workerPool.h"
+using namespace std;
+
+/*************************************************************************************************
+ * Struct name:       WorkerSlot
+ * Description:       One worker's place in the memory shared by the supervisor and every worker.
+                      The supervisor only writes pid and respawns, the worker in the slot busy.
+ *************************************************************************************************/
+struct WorkerSlot
+{
+  std::atomic<int> pid; // worker in the slot, 0 while there is none
+  std::atomic<int> busy; // the worker is serving a client
+  std::atomic<unsigned long long> respawns; // workers forked into the slot after the first one
+};
+
+static WorkerSlot *slots = NULL; // shared, NULL unless this is the fork model
+static int numSlots = 0;
+
+void spawnWorker(int listeningSock, int slot, vector<time_t> &started);
+void reapWorkers(vector<time_t> &started, vector<time_t> &retryAt);
+void workerProcess(int listeningSock, int slot, pid_t supervisor);
+void onWorkerExit(int);
+
+/********************************************************************************************************************************
+ * Function name:     runWorkerPool
+ * Description:       Forks numWorkers workers that serve clients accepted on the listening socket, then keeps the pool full
+                      until SIGTERM or SIGINT, which is passed on to every worker. initMetrics() must have mapped a shard
+                      per worker. Never returns.
+ * Parameters:        int listeningSock: The listening socket from connectToClient()
+                      int numWorkers: How many worker processes to run
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void runWorkerPool(int listeningSock, int numWorkers)
+{
+  void *shared = mmap(NULL, sizeof(WorkerSlot) * numWorkers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(shared == MAP_FAILED)
+    {
+      perror("Couldn't Map The Worker Slots");
+      exit(EXIT_FAILURE);
+    }
+  slots = (WorkerSlot*)shared; // zero filled: no worker, nothing counted
+  numSlots = numWorkers;
+
+  // The signals only ever wait for sigtimedwait(), so a worker that exits between two waits isn't missed. SIGCHLD still
+  // gets a handler: with the default action it isn't raised at all on some systems.
+  struct sigaction childAction;
+  memset(&childAction, 0, sizeof(childAction));
+  childAction.sa_handler = onWorkerExit;
+  sigemptyset(&childAction.sa_mask);
+  sigaction(SIGCHLD, &childAction, NULL);
+  sigset_t supervised;
+  sigemptyset(&supervised);
+  sigaddset(&supervised, SIGCHLD);
+  sigaddset(&supervised, SIGTERM);
+  sigaddset(&supervised, SIGINT);
+  sigprocmask(SIG_BLOCK, &supervised, NULL);
+
+  vector<time_t> started(numWorkers, 0); // when the slot's worker was forked, 0 before the first
+  vector<time_t> retryAt(numWorkers, 0); // a slot whose worker failed right away stays empty until then
+  for(int i = 0; i < numWorkers; i++)
+    spawnWorker(listeningSock, i, started);
+  cout << "Serving With " << numWorkers << " Pre-Forked Worker Process(es)" << endl;
+
+  while(true)
+    {
+      bool emptySlots = false; // a worker couldn't be forked or may not be yet, check again in a second
+      time_t now = time(NULL);
+      for(int i = 0; i < numWorkers; i++)
+	if(slots[i].pid == 0)
+	  {
+	    if(now >= retryAt[i])
+	      spawnWorker(listeningSock, i, started);
+	    if(slots[i].pid == 0)
+	      emptySlots = true;
+	  }
+
+      struct timespec oneSecond = { 1, 0 };
+      int signalNumber = sigtimedwait(&supervised, NULL, emptySlots ? &oneSecond : NULL);
+      if(signalNumber == SIGTERM || signalNumber == SIGINT)
+	break;
+      reapWorkers(started, retryAt);
+    }
+
+  cout << "Stopping The Workers" << endl;
+  for(int i = 0; i < numWorkers; i++)
+    if(slots[i].pid != 0)
+      kill(slots[i].pid, SIGTERM);
+  while(wait(NULL) > 0 || errno == EINTR)
+    ;
+  exit(0);
+}// end runWorkerPool
+/********************************************************************************************************************************
+ * Function name:     spawnWorker
+ * Description:       Forks the worker of an empty slot. A failed fork() leaves the slot empty, runWorkerPool() tries again.
+ * Parameters:        int listeningSock: The listening socket
+                      int slot: The slot
+                      vector<time_t> &started: Set to when the slot's worker was forked
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void spawnWorker(int listeningSock, int slot, vector<time_t> &started)
+{
+  pid_t supervisor = getpid();
+  pid_t pid = fork();
+
+  switch(pid)
+    {
+    case -1: // fork() error
+      perror("Fork() Failed !");
+      return;
+    case 0: // Worker
+      workerProcess(listeningSock, slot, supervisor); // never returns
+      _exit(EXIT_FAILURE); // and if it did, the worker must not go on as a supervisor
+    default: // Supervisor
+      if(started[slot] != 0)
+	slots[slot].respawns++;
+      slots[slot].pid = pid;
+      started[slot] = time(NULL);
+    }
+}// end spawnWorker
+/********************************************************************************************************************************
+ * Function name:     reapWorkers
+ * Description:       Collects every worker that has finished, without waiting for the ones still running, and empties its
+                      slot. A worker that failed within WORKER_RESPAWN_DELAY seconds of being forked is replaced only after
+                      that long, so a worker that can't start doesn't have the supervisor forking all the time.
+ * Parameters:        vector<time_t> &started: When the slots' workers were forked
+                      vector<time_t> &retryAt: Set for the slots that have to wait
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void reapWorkers(vector<time_t> &started, vector<time_t> &retryAt)
+{
+  int stat;
+  pid_t workerPid; // process id of a finished worker
+
+  while((workerPid = waitpid(-1, &stat, WNOHANG)) > 0)
+    {
+      int slot = 0;
+      while(slot < numSlots && slots[slot].pid != workerPid)
+	slot++;
+      if(slot == numSlots) // not a worker
+	continue;
+
+      WorkerSlot &worker = slots[slot];
+      bool failed = !WIFEXITED(stat) || WEXITSTATUS(stat) != 0;
+      if(WIFEXITED(stat))
+	cout << "Worker " << slot << ": " << workerPid << " is terminated: Return Status: " << WEXITSTATUS(stat);
+      else if(WIFSIGNALED(stat))
+	cout << "Worker " << slot << ": " << workerPid << " is terminated by signal " << WTERMSIG(stat);
+      else
+	cout << "Worker " << slot << ": " << workerPid << " is terminated, return status is unknown.";
+      MetricsShard &counted = metricsShardAt(slot);
+      cout << " (slot totals: " << counted.connections << " connections, " << shardCommands(counted)
+	   << " commands, " << counted.bytesSent << " bytes sent)" << endl;
+
+      worker.pid = 0;
+      worker.busy = 0;
+      if(failed && time(NULL) - started[slot] < WORKER_RESPAWN_DELAY)
+	retryAt[slot] = time(NULL) + WORKER_RESPAWN_DELAY;
+    }
+}// end reapWorkers
+/********************************************************************************************************************************
+ * Function name:     workerProcess
+ * Description:       Body of a worker: serves the clients it accepts one after the other, each with a session over a
+                      blocking socket, and exits after WORKER_MAX_CONNECTIONS of them. Never returns.
+ * Parameters:        int listeningSock: The listening socket, shared with the other workers
+                      int slot: The worker's slot
+                      pid_t supervisor: The process that forked it
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void workerProcess(int listeningSock, int slot, pid_t supervisor)
+{
+  WorkerSlot &worker = slots[slot];
+  struct sockaddr_in address;
+  int addrlen;
+
+  // Undo what the supervisor set up for itself, and go away with it
+  signal(SIGCHLD, SIG_DFL);
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL);
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if(getppid() != supervisor) // it was gone before prctl()
+    exit(0);
+  bindMetricsShard(slot);
+
+  for(int served = 0; served < WORKER_MAX_CONNECTIONS; served++)
+    {
+      int client_socket;
+      addrlen = sizeof(address);
+      // Accept incoming connections form client
+      if((client_socket = accept(listeningSock, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0)
+	{
+	  if(errno == EINTR || errno == ECONNABORTED) // The client gave up
+	    {
+	      served--;
+	      continue;
+	    }
+	  perror("accept");
+	  exit(EXIT_FAILURE);
+	}
+      worker.busy = 1;
+      Session *session = new Session(client_socket, getIpAddress(address));
+      session->run(); // Blocking socket: only returns once the connection is finished
+      delete session;
+      worker.busy = 0;
+    }
+  exit(0);
+}// end workerProcess
+/********************************************************************************************************************************
+ * Function name:     onWorkerExit
+ * Description:       SIGCHLD handler, never called: the signal is blocked and taken by sigtimedwait() in runWorkerPool().
+                      It is there so SIGCHLD isn't ignored, SIG_IGN would reap the workers before waitpid() could report them.
+ * Parameters:        int: SIGCHLD
+ * Return Value:      void(none)
+********************************************************************************************************************************/
+void onWorkerExit(int)
+{
+}// end onWorkerExit
+/********************************************************************************************************************************
+ * Function name:     workerPoolStats
+ * Description:       Describes the pool for "stats": totals over every slot, then the first WORKER_STATS_LINES workers one
+                      by one. Any worker can tell, the slots are shared.
+ * Parameters:        none
+ * Return Value:      string: the description, "Worker Pool: off" outside the fork model
+********************************************************************************************************************************/
+string workerPoolStats()
+{
+  char text[256];
+  unsigned long long connections = 0, commands = 0, bytesSent = 0, respawns = 0;
+  int busy = 0;
+
+  if(slots == NULL)
+    return "Worker Pool: off";
+  for(int i = 0; i < numSlots; i++)
+    {
+      MetricsShard &counted = metricsShardAt(i);
+      connections += counted.connections;
+      commands += shardCommands(counted);
+      bytesSent += counted.bytesSent;
+      respawns += slots[i].respawns;
+      busy += slots[i].busy;
+    }
+  snprintf(text, sizeof(text), "Worker Pool: %d workers, %d busy, %llu respawned, %llu connections, %llu commands, %llu bytes sent",
+	   numSlots, busy, respawns, connections, commands, bytesSent);
+  string description = text;
+  for(int i = 0; i < numSlots && i < WORKER_STATS_LINES; i++)
+    {
+      MetricsShard &counted = metricsShardAt(i);
+      snprintf(text, sizeof(text), "\n  Worker %d: pid %d%s, %llu connections, %llu commands, %llu bytes sent", i,
+	       slots[i].pid.load(), slots[i].busy ? " (busy)" : "", counted.connections.load(), shardCommands(counted),
+	       counted.bytesSent.load());
+      description += text;
+    }
+  return description;
+}// end workerPoolStats
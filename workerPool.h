@@ -0,0 +1,26 @@
+/********************************************************************************************************
+ * Filename: workerPool.h
+ * Purpose: The fork server model: a fixed pool of worker processes forked once at startup, each
+ *          accepting clients on the shared listening socket and serving them one at a time with a
+ *          blocking Session (session.h), so no fork() (and no page table copy) is paid per
+ *          connection. The parent only supervises: it reaps workers as SIGCHLD reports them and
+ *          forks their replacements. Every worker counts what it does in its own metrics shard
+ *          (see metrics.h), in memory shared with the other workers, so any of them can tell the
+ *          numbers of all of them for "stats".
+ * Programming Language Used: C++
+ *********************************************************************************************************/
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <string>
+
+#define DEFAULT_WORKERS 16 // worker processes unless -w says otherwise, also the clients served at once
+#define MAX_WORKERS 1024
+#define WORKER_MAX_CONNECTIONS 10000 // clients a worker serves before it is replaced, so whatever it leaks is given back
+#define WORKER_RESPAWN_DELAY 1 // Seconds a slot stays empty after its worker failed this soon after it started
+#define WORKER_STATS_LINES 16 // workers listed one by one in "stats", the rest only count towards the totals
+
+void runWorkerPool(int listeningSock, int numWorkers);
+std::string workerPoolStats();
+
+#endif // WORKER_POOL_H